@@ -23,6 +23,7 @@ import json
 import logging
 import os
 import secrets
+import struct
 import time
 import uuid
 from datetime import datetime
@@ -40,7 +41,7 @@ from fastapi.security import HTTPBasic, HTTPBasicCredentials
 from PIL import Image
 from pydantic import BaseModel
 from sqlalchemy import (JSON, Boolean, Column, DateTime, Float, ForeignKey,
-                        String, create_engine)
+                        Integer, String, create_engine)
 from sqlalchemy.ext.declarative import declarative_base
 from sqlalchemy.orm import Session, relationship, sessionmaker
 from sqlalchemy.sql import func
@@ -218,6 +219,21 @@ class CameraFamilyMember(Base):
     family_member = relationship("FamilyMember", back_populates="cameras")
 
 
+# Local automation rules, run by the hub itself (see "smart home hub/PROTOCOL.md")
+class HubRuleSet(Base):
+    __tablename__ = "hub_rule_sets"
+
+    hub_id = Column(String(255), ForeignKey("hubs.id"), primary_key=True)
+    version = Column(Integer, default=0)
+    rules = Column(JSON, default=list)
+    updated_at = Column(DateTime, default=datetime.utcnow)
+
+    def __init__(self, hub_id):
+        self.hub_id = hub_id
+        self.version = 0
+        self.rules = []
+
+
 # Create tables
 Base.metadata.create_all(bind=engine)
 
@@ -337,6 +353,262 @@ class ConnectionManager:
 manager = ConnectionManager()
 
 
+# Versioned hub_status sync (see "smart home hub/PROTOCOL.md")
+class HubStatusMirror:
+    """The server's copy of one hub's device list, kept in step by hub_status deltas."""
+
+    def __init__(self):
+        self.epoch = None
+        self.seq = None
+        self.devices: Dict[str, Dict] = {}
+        self.pending: Optional[Dict[str, Dict]] = None
+
+    def digest(self) -> int:
+        # XOR of FNV-1a("id|type|status") per device, as DeviceRegistry::digest() on the hub
+        result = 0
+        for device_id, device in self.devices.items():
+            result ^= fnv1a(f"{device_id}|{device['type']}|{device['status']}")
+        return result
+
+
+hub_mirrors: Dict[str, HubStatusMirror] = {}
+
+# Latest per-device-type command latency (n, timeouts, p50/p95/p99 in ms) reported by each hub
+hub_latency: Dict[str, Dict[str, Dict]] = {}
+
+# Last rules_ack from each hub
+hub_rules_ack: Dict[str, Dict] = {}
+
+# Hub limits for one rule set (rule_engine.h); a frame to the hub is at most 512 bytes
+RULE_EVENTS = ("alert", "status", "offline")
+RULES_MAX = 32
+RULE_ACTIONS_MAX = 64
+RULE_STRING_MAX = 23
+RULE_POOL_BYTES = 1024
+RULES_PAGE_BYTES = 480
+
+
+def validate_rules(rules: list) -> Optional[str]:
+    """Return why the hub would reject these rules, or None if they fit."""
+    if not isinstance(rules, list):
+        return "rules must be a list"
+    if len(rules) > RULES_MAX:
+        return f"at most {RULES_MAX} rules"
+    actions = 0
+    strings = {""}
+    for index, rule in enumerate(rules):
+        if not isinstance(rule, dict):
+            return f"rule {index}: not an object"
+        if len(json.dumps(rule, separators=(",", ":"))) > RULES_PAGE_BYTES - 64:
+            return f"rule {index}: too long for one frame"
+        if rule.get("on") not in RULE_EVENTS:
+            return f"rule {index}: 'on' must be one of {', '.join(RULE_EVENTS)}"
+        if ("device" in rule) == ("deviceType" in rule):
+            return f"rule {index}: give exactly one of 'device' and 'deviceType'"
+        names = [rule.get("device") or rule.get("deviceType"), rule.get("match", "")]
+        steps = rule.get("do")
+        if not isinstance(steps, list) or not steps:
+            return f"rule {index}: 'do' must be a non-empty list"
+        for step in steps:
+            if not isinstance(step, dict):
+                return f"rule {index}: actions must be objects"
+            if "alarm" in step:
+                if not isinstance(step["alarm"], bool):
+                    return f"rule {index}: 'alarm' must be true or false"
+            elif step.get("deviceId") and step.get("command"):
+                names += [step["deviceId"], step["command"]]
+            else:
+                return f"rule {index}: an action needs 'alarm', or 'deviceId' and 'command'"
+        actions += len(steps)
+        for name in names:
+            if not isinstance(name, str) or len(name.encode()) > RULE_STRING_MAX:
+                return f"rule {index}: names are strings of at most {RULE_STRING_MAX} bytes"
+        strings.update(names[1:])
+    if actions > RULE_ACTIONS_MAX:
+        return f"at most {RULE_ACTIONS_MAX} actions"
+    # The hub stores each distinct match value, device ID and command once
+    if sum(len(text.encode()) + 1 for text in strings) > RULE_POOL_BYTES:
+        return f"rule strings exceed {RULE_POOL_BYTES} bytes"
+    return None
+
+
+def rule_pages(version: int, rules: list) -> List[str]:
+    """Split a rule set into rules frames that each fit the hub's frame buffer."""
+    pages: List[list] = [[]]
+    size = 0
+    for rule in rules:
+        rule_size = len(json.dumps(rule, separators=(",", ":"))) + 1
+        if pages[-1] and size + rule_size > RULES_PAGE_BYTES:
+            pages.append([])
+            size = 0
+        pages[-1].append(rule)
+        size += rule_size
+    return [
+        json.dumps(
+            {"type": "rules", "version": version, "page": page, "pages": len(pages), "rules": chunk},
+            separators=(",", ":"),
+        )
+        for page, chunk in enumerate(pages)
+    ]
+
+
+async def push_rules(hub_id: str, rule_set: "HubRuleSet") -> bool:
+    for frame in rule_pages(rule_set.version, rule_set.rules or []):
+        if not await manager.send_message(hub_id, frame):
+            return False
+    logger.info(f"Sent rules version {rule_set.version} to hub {hub_id}")
+    return True
+
+
+def fnv1a(text: str) -> int:
+    value = 2166136261
+    for byte in text.encode():
+        value = ((value ^ byte) * 16777619) & 0xFFFFFFFF
+    return value
+
+
+# Binary uplink frames (see "smart home hub/PROTOCOL.md" and uplink_codec.h)
+UPLINK_ENCODING = "msgpack-dict/1"
+UPLINK_EXT_REF = 1
+UPLINK_EXT_DEF = 2
+
+
+class UplinkDecoder:
+    """Decodes one hub connection's binary frames; the dictionary lives as long as the connection."""
+
+    def __init__(self):
+        self.strings: List[str] = []
+
+    def decode(self, frame: bytes):
+        self.data = frame
+        self.pos = 0
+        start = len(self.strings)
+        try:
+            value = self.read_value()
+            if self.pos != len(frame):
+                raise ValueError("trailing bytes")
+            if not isinstance(value, dict):
+                raise ValueError("frame is not a map")
+        except (IndexError, ValueError, struct.error, UnicodeDecodeError):
+            # Forget anything the broken frame defined, as the hub does for unsent frames
+            del self.strings[start:]
+            raise ValueError("malformed uplink frame")
+        return value
+
+    def take(self, count: int) -> bytes:
+        if self.pos + count > len(self.data):
+            raise IndexError("frame truncated")
+        chunk = self.data[self.pos : self.pos + count]
+        self.pos += count
+        return chunk
+
+    def read_uint(self, size: int) -> int:
+        return int.from_bytes(self.take(size), "big")
+
+    def read_ext(self, size: int):
+        ext_type = self.take(1)[0]
+        payload = self.take(size)
+        if ext_type == UPLINK_EXT_REF and size in (1, 2):
+            return self.strings[int.from_bytes(payload, "big")]
+        if ext_type == UPLINK_EXT_DEF:
+            text = payload.decode()
+            self.strings.append(text)
+            return text
+        raise ValueError(f"unknown ext type {ext_type}")
+
+    def read_value(self, key: bool = False):
+        tag = self.take(1)[0]
+        if tag < 0x80 or 0xCC <= tag <= 0xCF:
+            value = tag if tag < 0x80 else self.read_uint(1 << (tag - 0xCC))
+            # Integer map keys refer to the dictionary
+            return self.strings[value] if key else value
+        if 0xA0 <= tag <= 0xBF or 0xD9 <= tag <= 0xDB:
+            size = tag & 0x1F if tag <= 0xBF else self.read_uint(1 << (tag - 0xD9))
+            return self.take(size).decode()
+        if 0xD4 <= tag <= 0xD8:
+            return self.read_ext(1 << (tag - 0xD4))
+        if 0xC7 <= tag <= 0xC9:
+            return self.read_ext(self.read_uint(1 << (tag - 0xC7)))
+        if key:
+            raise ValueError("map key is not a string")
+        if tag >= 0xE0:
+            return tag - 0x100
+        if 0xD0 <= tag <= 0xD3:
+            size = 1 << (tag - 0xD0)
+            return int.from_bytes(self.take(size), "big", signed=True)
+        if 0x80 <= tag <= 0x8F or tag in (0xDE, 0xDF):
+            count = tag & 0x0F if tag <= 0x8F else self.read_uint(2 if tag == 0xDE else 4)
+            result = {}
+            for _ in range(count):
+                name = self.read_value(key=True)
+                result[name] = self.read_value()
+            return result
+        if 0x90 <= tag <= 0x9F or tag in (0xDC, 0xDD):
+            count = tag & 0x0F if tag <= 0x9F else self.read_uint(2 if tag == 0xDC else 4)
+            return [self.read_value() for _ in range(count)]
+        if tag == 0xC0:
+            return None
+        if tag in (0xC2, 0xC3):
+            return tag == 0xC3
+        if tag == 0xCA:
+            return struct.unpack(">f", self.take(4))[0]
+        if tag == 0xCB:
+            return struct.unpack(">d", self.take(8))[0]
+        raise ValueError(f"unsupported tag 0x{tag:02x}")
+
+
+def apply_hub_status(hub_id: str, message: dict) -> Optional[bool]:
+    """Apply one hub_status page to the mirror.
+
+    Returns None while more pages are expected, True once the hub's digest
+    matches the mirror, and False if the mirror cannot or did not converge.
+    """
+    epoch = message.get("epoch")
+    if epoch is None:
+        # Hub without versioned status; nothing to check
+        return None
+
+    mirror = hub_mirrors.setdefault(hub_id, HubStatusMirror())
+    full = message.get("full", True)
+    page = message.get("page", 0)
+
+    if page == 0:
+        if full:
+            mirror.pending = {}
+        elif mirror.epoch != epoch or mirror.seq is None or message.get("sinceSeq", 0) > mirror.seq:
+            # Delta starts after what we have: changes in between are missing
+            mirror.pending = None
+            return False
+        else:
+            mirror.pending = dict(mirror.devices)
+    elif mirror.pending is None:
+        # Missed the first page
+        return False
+
+    for device in message.get("devices", []):
+        device_id = device.get("id")
+        if device_id:
+            mirror.pending[device_id] = {
+                "type": device.get("type", "unknown"),
+                "status": device.get("status", "Unknown"),
+            }
+
+    if not message.get("last", True):
+        return None
+
+    mirror.devices = mirror.pending
+    mirror.pending = None
+    mirror.epoch = epoch
+    mirror.seq = message.get("seq")
+    if mirror.digest() != message.get("digest") or len(mirror.devices) != message.get(
+        "connectedDevices", len(mirror.devices)
+    ):
+        mirror.epoch = None
+        mirror.seq = None
+        return False
+    return True
+
+
 # WebSocket endpoint for hubs
 @app.websocket("/ws/hub/{hub_id}")
 async def websocket_endpoint(
@@ -350,8 +622,26 @@ async def websocket_endpoint(
             hub.online = True
             db.commit()
 
+        # Binary frames share one dictionary for the life of this connection
+        decoder = UplinkDecoder()
         while True:
-            data = await websocket.receive_text()
+            frame = await websocket.receive()
+            if frame["type"] == "websocket.disconnect":
+                raise WebSocketDisconnect(frame.get("code", 1000))
+            if frame.get("bytes") is not None:
+                try:
+                    message = decoder.decode(frame["bytes"])
+                except ValueError:
+                    # The dictionaries may no longer match; a reconnect starts both afresh
+                    logger.error(f"Invalid binary frame from hub {hub_id}: {frame['bytes'].hex()}")
+                    await websocket.close(code=1007)
+                    raise WebSocketDisconnect(1007)
+                # Binary frames leave out hubId; the path already names the hub
+                message.setdefault("hubId", hub_id)
+                await process_hub_message(hub_id, message, websocket, db)
+                continue
+
+            data = frame.get("text", "")
             try:
                 message = json.loads(data)
                 await process_hub_message(hub_id, message, websocket, db)
@@ -384,6 +674,14 @@ async def process_hub_message(
                 "success": True,
                 "message": "Authentication successful",
             }
+            # Accept binary uplink frames if the hub offers them
+            if UPLINK_ENCODING in message.get("encodings", []):
+                response["encoding"] = UPLINK_ENCODING
+            # Tell the hub which status we already have so it only sends the changes
+            mirror = hub_mirrors.get(hub_id)
+            if mirror and mirror.epoch is not None:
+                response["epoch"] = mirror.epoch
+                response["seq"] = mirror.seq
             logger.info(f"Hub {hub_id} authenticated successfully")
         else:
             response = {
@@ -395,6 +693,12 @@ async def process_hub_message(
 
         await websocket.send_text(json.dumps(response))
 
+        # The hub keeps running the rules it has; send ours if they differ
+        if auth_success:
+            rule_set = db.query(HubRuleSet).filter(HubRuleSet.hub_id == hub_id).first()
+            if rule_set and rule_set.version != message.get("rulesVersion"):
+                await push_rules(hub_id, rule_set)
+
     elif msg_type == "heartbeat":
         # Update last heartbeat time
         hub = db.query(Hub).filter(Hub.id == hub_id).first()
@@ -407,8 +711,10 @@ async def process_hub_message(
         # Update hub status
         hub = db.query(Hub).filter(Hub.id == hub_id).first()
         if hub:
-            hub.temperature = message.get("temperature")
-            hub.humidity = message.get("humidity")
+            # A stale reading is the hub's last known value, not the current climate
+            stale = message.get("climateStale", False)
+            hub.temperature = None if stale else message.get("temperature")
+            hub.humidity = None if stale else message.get("humidity")
             hub.alarm_state = message.get("alarmState", False)
             db.commit()
 
@@ -434,6 +740,19 @@ async def process_hub_message(
             db.commit()
             logger.info(f"Updated status for hub {hub_id}")
 
+        latency = message.get("latency")
+        if isinstance(latency, dict):
+            hub_latency[hub_id] = latency
+            logger.debug(f"Command latency on hub {hub_id}: {latency}")
+
+        converged = apply_hub_status(hub_id, message)
+        if converged is False:
+            # Mirror is out of step with the hub: ask for a full snapshot
+            logger.warning(f"Status of hub {hub_id} did not converge, requesting snapshot")
+            await websocket.send_text(json.dumps({"type": "status_request"}))
+        elif converged:
+            logger.debug(f"Status of hub {hub_id} converged at seq {message.get('seq')}")
+
     elif msg_type == "device_added":
         # Register new device
         device_id = message.get("deviceId")
@@ -454,11 +773,19 @@ async def process_hub_message(
                 db.commit()
                 logger.info(f"New device {device_id} added to hub {hub_id}")
 
+        mirror = hub_mirrors.get(hub_id)
+        if mirror and device_id and device_id not in mirror.devices:
+            mirror.devices[device_id] = {"type": device_type or "unknown", "status": "Unknown"}
+
     elif msg_type == "device_status":
         # Update device status
         device_id = message.get("deviceId")
         status = message.get("status")
 
+        mirror = hub_mirrors.get(hub_id)
+        if mirror and device_id in mirror.devices:
+            mirror.devices[device_id]["status"] = status
+
         device = (
             db.query(Device)
             .filter(Device.id == device_id, Device.hub_id == hub_id)
@@ -472,6 +799,25 @@ async def process_hub_message(
                 f"Updated status for device {device_id} on hub {hub_id}: {status}"
             )
 
+    elif msg_type == "device_offline":
+        # Device missed its liveness deadline on the hub; the hub now reports it as "offline"
+        device_id = message.get("deviceId")
+
+        mirror = hub_mirrors.get(hub_id)
+        if mirror and device_id in mirror.devices:
+            mirror.devices[device_id]["status"] = "offline"
+
+        device = (
+            db.query(Device)
+            .filter(Device.id == device_id, Device.hub_id == hub_id)
+            .first()
+        )
+        if device:
+            device.status = "offline"
+            device.last_updated = datetime.utcnow()
+            db.commit()
+        logger.warning(f"Device {device_id} on hub {hub_id} went offline")
+
     elif msg_type == "alert":
         # Handle device alerts (e.g., smoke detector)
         device_id = message.get("deviceId")
@@ -481,6 +827,29 @@ async def process_hub_message(
 
         # In a real system, you might trigger notifications to users here
 
+    elif msg_type == "batch":
+        # Coalesced uplink frame: each event has the same shape as its standalone message
+        events = message.get("events", [])
+        for event in events:
+            if isinstance(event, dict) and event.get("type") != "batch":
+                await process_hub_message(hub_id, event, websocket, db)
+        logger.debug(f"Processed batch of {len(events)} events from hub {hub_id}")
+
+    elif msg_type == "rules_ack":
+        hub_rules_ack[hub_id] = {
+            "version": message.get("version"),
+            "success": message.get("success", False),
+            "rules": message.get("rules"),
+            "error": message.get("error"),
+        }
+        if not message.get("success", False):
+            logger.warning(
+                f"Hub {hub_id} rejected rules version {message.get('version')}: {message.get('error')}"
+            )
+
+    elif msg_type in ("camera_added", "camera_status"):
+        await process_camera_message(hub_id, message, websocket, db)
+
 
 # API Endpoints - Simplified for user interaction
 @app.get("/api/user/hubs", response_model=List[Dict])
@@ -527,6 +896,7 @@ async def get_user_hub(
         "humidity": hub.humidity,
         "alarm_state": hub.alarm_state,
         "online": hub.online,
+        "command_latency": hub_latency.get(hub_id, {}),
         "devices": [
             {
                 "device_id": device.id,
@@ -563,19 +933,59 @@ async def control_device(
     if not device:
         raise HTTPException(status_code=404, detail="Device not found")
 
-    # Send control command to hub
-    message = {"type": "control", "deviceId": device_id, "command": command}
+    # Send control command to hub; the device's reply echoes corrId so the hub can time it
+    corr_id = secrets.randbits(31) or 1
+    message = {
+        "type": "control",
+        "deviceId": device_id,
+        "command": command,
+        "corrId": corr_id,
+    }
 
     success = await manager.send_message(hub_id, json.dumps(message))
     if success:
         return {
             "status": "success",
             "message": f"Command {command} sent to device {device_id}",
+            "corr_id": corr_id,
         }
     else:
         raise HTTPException(status_code=500, detail="Failed to send command to hub")
 
 
+@app.delete("/api/user/hubs/{hub_id}/devices/{device_id}")
+async def remove_device(
+    hub_id: str,
+    device_id: str,
+    current_user: User = Depends(get_current_user),
+    db: Session = Depends(get_db),
+):
+    hub = db.query(Hub).filter(Hub.id == hub_id, Hub.user_id == current_user.id).first()
+    if not hub:
+        raise HTTPException(status_code=404, detail="Hub not found")
+
+    # The hub keeps its device list across reboots, so it has to forget the device too
+    if not hub.online:
+        raise HTTPException(status_code=503, detail="Hub is offline")
+
+    device = (
+        db.query(Device).filter(Device.id == device_id, Device.hub_id == hub_id).first()
+    )
+    if not device:
+        raise HTTPException(status_code=404, detail="Device not found")
+
+    message = {"type": "remove_device", "deviceId": device_id}
+    if not await manager.send_message(hub_id, json.dumps(message)):
+        raise HTTPException(status_code=500, detail="Failed to send removal to hub")
+
+    db.delete(device)
+    db.commit()
+    mirror = hub_mirrors.get(hub_id)
+    if mirror:
+        mirror.devices.pop(device_id, None)
+    return {"status": "success", "message": f"Device {device_id} removed"}
+
+
 @app.post("/api/user/hubs/{hub_id}/alarm")
 async def control_alarm(
     hub_id: str,
@@ -608,6 +1018,57 @@ async def control_alarm(
         )
 
 
+@app.get("/api/user/hubs/{hub_id}/rules")
+async def get_hub_rules(
+    hub_id: str,
+    current_user: User = Depends(get_current_user),
+    db: Session = Depends(get_db),
+):
+    hub = db.query(Hub).filter(Hub.id == hub_id, Hub.user_id == current_user.id).first()
+    if not hub:
+        raise HTTPException(status_code=404, detail="Hub not found")
+
+    rule_set = db.query(HubRuleSet).filter(HubRuleSet.hub_id == hub_id).first()
+    return {
+        "version": rule_set.version if rule_set else 0,
+        "rules": rule_set.rules if rule_set else [],
+        "hub_ack": hub_rules_ack.get(hub_id),
+    }
+
+
+@app.put("/api/user/hubs/{hub_id}/rules")
+async def set_hub_rules(
+    hub_id: str,
+    rules: List[Dict],
+    current_user: User = Depends(get_current_user),
+    db: Session = Depends(get_db),
+):
+    hub = db.query(Hub).filter(Hub.id == hub_id, Hub.user_id == current_user.id).first()
+    if not hub:
+        raise HTTPException(status_code=404, detail="Hub not found")
+
+    error = validate_rules(rules)
+    if error:
+        raise HTTPException(status_code=400, detail=error)
+
+    rule_set = db.query(HubRuleSet).filter(HubRuleSet.hub_id == hub_id).first()
+    if not rule_set:
+        rule_set = HubRuleSet(hub_id)
+        db.add(rule_set)
+    rule_set.version = (rule_set.version or 0) + 1
+    rule_set.rules = rules
+    rule_set.updated_at = datetime.utcnow()
+    db.commit()
+
+    # An offline hub gets the new version when it next authenticates
+    sent = hub.online and await push_rules(hub_id, rule_set)
+    return {
+        "status": "success",
+        "version": rule_set.version,
+        "sent": bool(sent),
+    }
+
+
 # Simple dashboard HTML - Updated for user interaction
 @app.get("/", response_class=HTMLResponse)
 async def get_dashboard(current_user: User = Depends(get_current_user)):
@@ -1227,13 +1688,12 @@ async def check_camera_status():
         await asyncio.sleep(60)  # Check every minute
 
 
-# Extend process_hub_message to handle camera-related messages
-async def process_hub_message(
+# Camera-related hub messages (dispatched from process_hub_message)
+async def process_camera_message(
     hub_id: str, message: dict, websocket: WebSocket, db: Session
 ):
     msg_type = message.get("type")
 
-    # Add camera handling to the existing message processing
     if msg_type == "camera_added":
         # Register new camera from hub
         camera_id = message.get("cameraId")
@@ -1289,11 +1749,6 @@ async def process_hub_message(
                 f"Updated status for camera {camera_id} on hub {hub_id}: {'online' if is_online else 'offline'}"
             )
 
-    # Process other message types (from the existing code)
-    else:
-        # Existing message handling code goes here
-        pass  # This should be replaced with the original code
-
 
 # Update the startup event to include camera status check
 @app.on_event("startup")
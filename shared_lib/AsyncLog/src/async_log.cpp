@@ -0,0 +1,185 @@
+#include "async_log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+
+static const char LEVEL_TAGS[] = "-EWID";   // Indexed by LOG_LEVEL_*
+
+AsyncLog asyncLog;
+
+AsyncLog::AsyncLog() : tail_(0), head_(0), dropped_(0) {
+  for (uint32_t i = 0; i < LOG_SLOTS; i++) {
+    slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+  truncated_ = 0;
+  reportedDrops_ = 0;
+  written_ = 0;
+  peakDepth_ = 0;
+  out_ = nullptr;
+  taskRunning_ = false;
+  pendingLength_ = 0;
+  pendingOffset_ = 0;
+}
+
+void AsyncLog::begin(HardwareSerial& out) {
+  out_ = &out;
+}
+
+bool AsyncLog::claim(uint32_t& position) {
+#ifdef ESP8266
+  // One core, so only an interrupt can get in between the check and the claim
+  uint32_t saved = xt_rsil(15);
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  bool free = slots_[tail & (LOG_SLOTS - 1)].seq.load(std::memory_order_acquire) == tail;
+  if (free) {
+    tail_.store(tail + 1, std::memory_order_relaxed);
+  } else {
+    dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+  xt_wsr_ps(saved);
+  position = tail;
+  return free;
+#else
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  for (;;) {
+    // Acquire pairs with the consumer's release: it has finished reading the slot
+    uint32_t seq = slots_[tail & (LOG_SLOTS - 1)].seq.load(std::memory_order_acquire);
+    int32_t lag = (int32_t)(seq - tail);
+    if (lag == 0) {
+      // Free; take it unless another producer got there first (tail is then reloaded)
+      if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+        position = tail;
+        return true;
+      }
+    } else if (lag < 0) {
+      // Still holds a line from the previous lap: the ring is full
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      tail = tail_.load(std::memory_order_relaxed);
+    }
+  }
+#endif
+}
+
+void AsyncLog::write(uint8_t level, const char* format, ...) {
+  uint32_t position;
+  if (!claim(position)) {
+    return;
+  }
+
+  Slot& slot = slots_[position & (LOG_SLOTS - 1)];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(slot.text, sizeof(slot.text), format, args);
+  va_end(args);
+  if (length < 0) {
+    slot.text[0] = '\0';
+  }
+  slot.cut = length >= (int)sizeof(slot.text);
+  slot.ms = millis();
+  slot.level = level;
+  // Release publishes the line before the consumer can see the slot as full
+  slot.seq.store(position + 1, std::memory_order_release);
+}
+
+// Move the next finished line into pending_; false if there is none yet
+bool AsyncLog::takeLine() {
+  uint32_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped != reportedDrops_) {
+    // Say where the gap is, in the order it happened
+    unsigned long now = millis();
+    pendingLength_ = snprintf(pending_, sizeof(pending_), "%lu.%03lu W (%u log lines dropped)\n",
+                              now / 1000, now % 1000, dropped - reportedDrops_);
+    pendingOffset_ = 0;
+    reportedDrops_ = dropped;
+    return true;
+  }
+
+  uint32_t head = head_.load(std::memory_order_relaxed);
+  Slot& slot = slots_[head & (LOG_SLOTS - 1)];
+  if (slot.seq.load(std::memory_order_acquire) != head + 1) {
+    // Empty, or the next line is still being formatted
+    return false;
+  }
+
+  uint32_t depth = tail_.load(std::memory_order_relaxed) - head;
+  if (depth > peakDepth_) {
+    peakDepth_ = depth;
+  }
+  char tag = slot.level < sizeof(LEVEL_TAGS) - 1 ? LEVEL_TAGS[slot.level] : '?';
+  int length = snprintf(pending_, sizeof(pending_), "%lu.%03lu %c %s%s\n", (unsigned long)slot.ms / 1000,
+                        (unsigned long)slot.ms % 1000, tag, slot.text, slot.cut ? "..." : "");
+  pendingLength_ = length < (int)sizeof(pending_) ? length : sizeof(pending_) - 1;
+  pendingOffset_ = 0;
+  if (slot.cut) {
+    truncated_++;
+  }
+
+  // Copied out; hand the slot to the producer one lap ahead
+  slot.seq.store(head + LOG_SLOTS, std::memory_order_release);
+  head_.store(head + 1, std::memory_order_relaxed);
+  written_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool AsyncLog::service() {
+  if (out_ == nullptr) {
+    return !idle();
+  }
+  for (;;) {
+    if (pendingOffset_ == pendingLength_ && !takeLine()) {
+      return false;
+    }
+    int room = out_->availableForWrite();
+    if (room <= 0) {
+      return true;
+    }
+    size_t chunk = pendingLength_ - pendingOffset_;
+    if ((size_t)room < chunk) {
+      chunk = room;
+    }
+    out_->write((const uint8_t*)pending_ + pendingOffset_, chunk);
+    pendingOffset_ += chunk;
+  }
+}
+
+bool AsyncLog::idle() const {
+  return pendingOffset_ == pendingLength_ &&
+         head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed) &&
+         dropped_.load(std::memory_order_relaxed) == reportedDrops_;
+}
+
+void AsyncLog::flush() {
+  if (out_ == nullptr) {
+    return;
+  }
+  // With a drain task it stays the only consumer; wait for it (bounded, lines may keep coming)
+  uint32_t start = millis();
+  while (!idle() && millis() - start < 1000) {
+    if (taskRunning_) {
+      delay(LOG_DRAIN_INTERVAL_MS);
+    } else {
+      service();
+      yield();
+    }
+  }
+  out_->flush();
+}
+
+#ifndef ESP8266
+void AsyncLog::startTask(UBaseType_t priority, BaseType_t core) {
+  if (!taskRunning_) {
+    taskRunning_ = true;
+    xTaskCreatePinnedToCore(drainTask, "log", 2048, this, priority, nullptr, core);
+  }
+}
+
+void AsyncLog::drainTask(void* parameter) {
+  AsyncLog* log = (AsyncLog*)parameter;
+  for (;;) {
+    log->service();
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL_MS));
+  }
+}
+#endif
@@ -0,0 +1,152 @@
+/*
+ * Async Log - ring-buffered serial logging with compile-time levels
+ *
+ * At 115200 baud every byte written to Serial costs about 87 us, and
+ * Serial.print blocks once the 128-byte UART FIFO is full, so a 200-byte
+ * line logged from a message handler stalled it for some 17 ms. The
+ * LOG_* macros instead format the line into a slot of a fixed ring of
+ * LOG_SLOTS records and return; service() copies finished records to the
+ * UART only as far as its FIFO has room, so the writer never waits either.
+ * On the ESP32 a low-priority task calls service() (startTask()); on the
+ * ESP8266, which has no tasks, loop() does.
+ *
+ * The ring takes several producers (the hub logs from the loop task, the
+ * net task and AsyncTCP) and one consumer. Each slot carries a sequence
+ * number in the style of Vyukov's bounded queue: a producer claims the
+ * next slot with a compare-and-swap on the tail, formats in place and
+ * publishes by storing the slot's sequence, so no producer waits for
+ * another or for the consumer. The single-core ESP8266 has no CAS
+ * instruction and claims the slot with interrupts masked for those few
+ * instructions instead. When the ring is full the line is dropped and
+ * counted (dropped()), and the next line written out says how many went.
+ *
+ * Levels are resolved by the preprocessor: a LOG_* macro above LOG_LEVEL
+ * expands to nothing, so it adds no code and its arguments are never
+ * evaluated. Set the level per firmware with -DLOG_LEVEL=LOG_LEVEL_DEBUG
+ * (or _WARN, ...) in build_flags.
+ */
+
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <atomic>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4   // Also every frame received; too much for normal use
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_SLOTS
+#ifdef ESP8266
+#define LOG_SLOTS 16        // Power of two
+#else
+#define LOG_SLOTS 32
+#endif
+#endif
+
+#ifndef LOG_LINE_SIZE
+#ifdef ESP8266
+#define LOG_LINE_SIZE 96    // Longer lines are cut short and counted in truncated()
+#else
+#define LOG_LINE_SIZE 128
+#endif
+#endif
+
+#define LOG_DRAIN_INTERVAL_MS 5   // Drain task period; the FIFO holds ~11 ms of output
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) asyncLog.write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) asyncLog.write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) asyncLog.write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) asyncLog.write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+class AsyncLog {
+ public:
+  AsyncLog();
+
+  // Set the output; lines logged before this wait in the ring
+  void begin(HardwareSerial& out);
+#ifndef ESP8266
+  // Drain from a FreeRTOS task every LOG_DRAIN_INTERVAL_MS instead of from loop()
+  void startTask(UBaseType_t priority, BaseType_t core);
+#endif
+
+  // Format one line (no trailing newline) into the ring; use the LOG_* macros
+  void write(uint8_t level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+  // Move finished lines to the UART as far as its FIFO has room; never blocks.
+  // Returns true while lines are still waiting.
+  bool service();
+  // Write out everything now, waiting on the UART (before a restart)
+  void flush();
+
+  // Lines lost because the ring was full
+  uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+  // Lines cut to LOG_LINE_SIZE (counted as they are written out)
+  uint32_t truncated() const { return truncated_; }
+  // Lines written out
+  uint32_t written() const { return written_.load(std::memory_order_relaxed); }
+  // Most slots ever waiting at once (as seen by the consumer)
+  uint32_t peakDepth() const { return peakDepth_; }
+
+ private:
+  struct Slot {
+    std::atomic<uint32_t> seq;  // == position: free; == position + 1: holds a line
+    uint32_t ms;
+    uint8_t level;
+    bool cut;                   // Formatted line was longer than text
+    char text[LOG_LINE_SIZE];
+  };
+
+  bool claim(uint32_t& position);
+  bool takeLine();
+  bool idle() const;
+#ifndef ESP8266
+  static void drainTask(void* parameter);
+#endif
+
+  Slot slots_[LOG_SLOTS];
+  std::atomic<uint32_t> tail_;    // Next slot to claim; producers
+  std::atomic<uint32_t> head_;    // Next slot to write out; the consumer
+  std::atomic<uint32_t> dropped_;
+  uint32_t truncated_;
+  uint32_t reportedDrops_;        // dropped() already announced in the output
+  std::atomic<uint32_t> written_; // Read by other tasks for reports
+  uint32_t peakDepth_;
+  HardwareSerial* out_;
+  bool taskRunning_;
+
+  // The line being written out; it left the ring when it was taken
+  char pending_[LOG_LINE_SIZE + 24];
+  uint16_t pendingLength_;
+  uint16_t pendingOffset_;
+};
+
+extern AsyncLog asyncLog;
+
+#endif
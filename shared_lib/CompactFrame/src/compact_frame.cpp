@@ -0,0 +1,377 @@
+#include "compact_frame.h"
+
+#include <string.h>
+
+int32_t CompactValue::asInt() const {
+  if (kind == COMPACT_INT) {
+    return (int32_t)integer;
+  }
+  if (kind == COMPACT_FLOAT) {
+    return (int32_t)number;
+  }
+  if (kind == COMPACT_BOOL) {
+    return boolean ? 1 : 0;
+  }
+  return 0;
+}
+
+float CompactValue::asFloat() const {
+  if (kind == COMPACT_FLOAT) {
+    return number;
+  }
+  if (kind == COMPACT_INT) {
+    return (float)integer;
+  }
+  return 0;
+}
+
+size_t CompactValue::copyTo(char* out, size_t size) const {
+  if (size == 0) {
+    return 0;
+  }
+  size_t len = 0;
+  if (kind == COMPACT_STRING) {
+    len = length < size - 1 ? length : size - 1;
+    memcpy(out, str, len);
+  }
+  out[len] = '\0';
+  return len;
+}
+
+CompactWriter::CompactWriter(uint8_t* buffer, size_t size) {
+  buffer_ = buffer;
+  size_ = size;
+  length_ = 0;
+  fields_ = 0;
+  overflow_ = false;
+}
+
+void CompactWriter::writeByte(uint8_t value) {
+  if (length_ < size_) {
+    buffer_[length_++] = value;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void CompactWriter::writeBytes(const void* data, size_t length) {
+  if (length_ + length <= size_) {
+    memcpy(buffer_ + length_, data, length);
+    length_ += length;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void CompactWriter::writeBigEndian(uint32_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    writeByte((uint8_t)(value >> (i * 8)));
+  }
+}
+
+void CompactWriter::begin(FrameType type) {
+  length_ = 0;
+  fields_ = 0;
+  overflow_ = false;
+  writeByte(0x80);  // fixmap; the field count is filled in by finish()
+  putInt(KEY_TYPE, type);
+}
+
+void CompactWriter::putKey(FrameKey key) {
+  if (fields_ >= COMPACT_MAX_FIELDS) {
+    overflow_ = true;
+    return;
+  }
+  fields_++;
+  writeByte(key);  // positive fixint
+}
+
+void CompactWriter::putInt(FrameKey key, int32_t value) {
+  putKey(key);
+  if (value >= 0 && value < 128) {
+    writeByte((uint8_t)value);  // positive fixint
+  } else if (value < 0 && value >= -32) {
+    writeByte((uint8_t)(int8_t)value);  // negative fixint
+  } else if (value >= 0 && value <= 0xFF) {
+    writeByte(0xcc);
+    writeByte((uint8_t)value);
+  } else if (value >= 0 && value <= 0xFFFF) {
+    writeByte(0xcd);
+    writeBigEndian((uint32_t)value, 2);
+  } else if (value >= 0) {
+    writeByte(0xce);
+    writeBigEndian((uint32_t)value, 4);
+  } else if (value >= -128) {
+    writeByte(0xd0);
+    writeByte((uint8_t)(int8_t)value);
+  } else if (value >= -32768) {
+    writeByte(0xd1);
+    writeBigEndian((uint16_t)(int16_t)value, 2);
+  } else {
+    writeByte(0xd2);
+    writeBigEndian((uint32_t)value, 4);
+  }
+}
+
+void CompactWriter::putBool(FrameKey key, bool value) {
+  putKey(key);
+  writeByte(value ? 0xc3 : 0xc2);
+}
+
+void CompactWriter::putFloat(FrameKey key, float value) {
+  putKey(key);
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  writeByte(0xca);
+  writeBigEndian(bits, 4);
+}
+
+void CompactWriter::putString(FrameKey key, const char* value) {
+  putKey(key);
+  size_t length = value ? strlen(value) : 0;
+  if (length < 32) {
+    writeByte(0xa0 | (uint8_t)length);  // fixstr
+  } else if (length <= 0xFF) {
+    writeByte(0xd9);
+    writeByte((uint8_t)length);
+  } else {
+    overflow_ = true;
+    return;
+  }
+  writeBytes(value, length);
+}
+
+size_t CompactWriter::finish() {
+  if (overflow_ || length_ == 0) {
+    return 0;
+  }
+  buffer_[0] = 0x80 | fields_;
+  return length_;
+}
+
+CompactReader::CompactReader(const uint8_t* data, size_t length) {
+  data_ = data;
+  length_ = length;
+  pos_ = 0;
+  remaining_ = -1;
+
+  if (length == 0) {
+    return;
+  }
+  uint8_t header = data[0];
+  if ((header & 0xf0) == 0x80) {
+    remaining_ = header & 0x0f;
+    pos_ = 1;
+  } else if (header == 0xde && length >= 3) {
+    remaining_ = (data[1] << 8) | data[2];
+    pos_ = 3;
+  }
+  fieldsStart_ = pos_;
+}
+
+FrameType CompactReader::type() const {
+  CompactReader scan = *this;
+  scan.pos_ = fieldsStart_;
+  uint8_t key;
+  CompactValue value;
+  while (scan.next(key, value)) {
+    if (key == KEY_TYPE) {
+      return value.kind == COMPACT_INT ? (FrameType)value.integer : FRAME_UNKNOWN;
+    }
+  }
+  return FRAME_UNKNOWN;
+}
+
+bool CompactReader::readBigEndian(int bytes, uint32_t& value) {
+  // Lengths are checked against what is left, never as pos_ + n, which can wrap
+  if ((size_t)bytes > length_ - pos_) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | data_[pos_++];
+  }
+  return true;
+}
+
+bool CompactReader::next(uint8_t& key, CompactValue& value) {
+  while (remaining_ > 0) {
+    remaining_--;
+    CompactValue keyValue;
+    if (!readValue(keyValue) || !readValue(value)) {
+      remaining_ = 0;
+      return false;
+    }
+    // Keys that are not small integers belong to some other encoding; skip them
+    if (keyValue.kind == COMPACT_INT && keyValue.integer >= 0 && keyValue.integer < 256) {
+      key = (uint8_t)keyValue.integer;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CompactReader::readValue(CompactValue& value) {
+  if (pos_ >= length_) {
+    return false;
+  }
+  value.kind = COMPACT_OTHER;
+  value.boolean = false;
+  value.integer = 0;
+  value.number = 0;
+  value.str = nullptr;
+  value.length = 0;
+
+  uint8_t tag = data_[pos_++];
+  uint32_t raw;
+
+  if (tag < 0x80 || tag >= 0xe0) {
+    value.kind = COMPACT_INT;
+    value.integer = (int8_t)tag;
+    if (tag < 0x80) {
+      value.integer = tag;
+    }
+    return true;
+  }
+  if ((tag & 0xe0) == 0xa0 || tag == 0xd9 || tag == 0xda) {
+    size_t length = tag & 0x1f;
+    if (tag == 0xd9) {
+      if (!readBigEndian(1, raw)) return false;
+      length = raw;
+    } else if (tag == 0xda) {
+      if (!readBigEndian(2, raw)) return false;
+      length = raw;
+    }
+    if (length > length_ - pos_) {
+      return false;
+    }
+    value.kind = COMPACT_STRING;
+    value.str = (const char*)data_ + pos_;
+    value.length = length;
+    pos_ += length;
+    return true;
+  }
+
+  switch (tag) {
+    case 0xc0:
+      value.kind = COMPACT_NIL;
+      return true;
+    case 0xc2:
+    case 0xc3:
+      value.kind = COMPACT_BOOL;
+      value.boolean = tag == 0xc3;
+      return true;
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+      if (!readBigEndian(1 << (tag - 0xcc), raw)) return false;
+      value.kind = COMPACT_INT;
+      value.integer = raw;
+      return true;
+    case 0xd0:
+      if (!readBigEndian(1, raw)) return false;
+      value.kind = COMPACT_INT;
+      value.integer = (int8_t)raw;
+      return true;
+    case 0xd1:
+      if (!readBigEndian(2, raw)) return false;
+      value.kind = COMPACT_INT;
+      value.integer = (int16_t)raw;
+      return true;
+    case 0xd2:
+      if (!readBigEndian(4, raw)) return false;
+      value.kind = COMPACT_INT;
+      value.integer = (int32_t)raw;
+      return true;
+    case 0xca: {
+      if (!readBigEndian(4, raw)) return false;
+      value.kind = COMPACT_FLOAT;
+      memcpy(&value.number, &raw, sizeof(raw));
+      return true;
+    }
+    case 0xcb: {
+      // float64 from other encoders; narrowed to float
+      uint32_t high, low;
+      if (!readBigEndian(4, high) || !readBigEndian(4, low)) return false;
+      uint64_t bits = ((uint64_t)high << 32) | low;
+      double wide;
+      memcpy(&wide, &bits, sizeof(bits));
+      value.kind = COMPACT_FLOAT;
+      value.number = (float)wide;
+      return true;
+    }
+    default:
+      // Anything else (arrays, maps, binary, 64-bit ints) is skipped whole
+      pos_--;
+      return skipValue(0);
+  }
+}
+
+bool CompactReader::skipValue(int depth) {
+  if (pos_ >= length_) {
+    return false;
+  }
+  uint8_t tag = data_[pos_++];
+  uint32_t raw;
+  uint32_t count = 0;   // Nested values to skip
+
+  if ((tag & 0xf0) == 0x90) {
+    count = tag & 0x0f;
+  } else if ((tag & 0xf0) == 0x80) {
+    count = (tag & 0x0f) * 2;
+  } else {
+    switch (tag) {
+      case 0xc4: case 0xc5: case 0xc6: {
+        // bin 8/16/32
+        if (!readBigEndian(1 << (tag - 0xc4), raw) || raw > length_ - pos_) return false;
+        pos_ += raw;
+        return true;
+      }
+      case 0xcf: case 0xd3: case 0xcb:
+        if (8 > length_ - pos_) return false;
+        pos_ += 8;
+        return true;
+      case 0xdb:
+        if (!readBigEndian(4, raw) || raw > length_ - pos_) return false;
+        pos_ += raw;
+        return true;
+      case 0xdc: case 0xdd:
+        if (!readBigEndian(tag == 0xdc ? 2 : 4, count)) return false;
+        break;
+      case 0xde: case 0xdf:
+        if (!readBigEndian(tag == 0xde ? 2 : 4, count) || count > (length_ - pos_) / 2) return false;
+        count *= 2;
+        break;
+      case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+        // fixext: type byte plus 1..16 data bytes
+        raw = 1 + (1 << (tag - 0xd4));
+        if (raw > length_ - pos_) return false;
+        pos_ += raw;
+        return true;
+      case 0xc7: case 0xc8: case 0xc9:
+        // ext 8/16/32: length, type byte, data
+        if (!readBigEndian(1 << (tag - 0xc7), raw) || raw >= length_ - pos_) return false;
+        pos_ += 1 + raw;
+        return true;
+      case 0xc1:
+        // Never used by MessagePack
+        return false;
+      default:
+        // Every other tag is a scalar that readValue decodes (and we discard)
+        pos_--;
+        CompactValue ignored;
+        return readValue(ignored);
+    }
+  }
+
+  // Every nested value takes at least a byte, and nesting is bounded so the stack is
+  if (count > length_ - pos_ || depth >= COMPACT_MAX_DEPTH) {
+    return false;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    if (!skipValue(depth + 1)) {
+      return false;
+    }
+  }
+  return true;
+}
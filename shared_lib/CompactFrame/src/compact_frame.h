@@ -0,0 +1,135 @@
+/*
+ * Compact Frame - binary encoding for hub <-> sub-device WebSocket messages
+ *
+ * A compact frame is a single MessagePack map whose keys are the small
+ * integers in FrameKey instead of strings, and whose "type" is a FrameType
+ * code instead of a string. Field values keep their natural MessagePack
+ * type (uint, int, bool, float32, str). Any MessagePack decoder can read
+ * a frame, but the firmwares use the writer/reader below, which need no
+ * JsonDocument and no heap.
+ *
+ * Devices offer the encoding with "encodings": ["msgpack"] in their JSON
+ * registration; the hub accepts it with "encoding": "msgpack" in its JSON
+ * registration_confirm. From then on both sides send binary WebSocket
+ * frames on that connection. Devices that never offer it keep using JSON.
+ *
+ * The reader takes frames straight off the network, so it trusts nothing
+ * in them: every length is checked against the bytes left, and values it
+ * skips may nest containers only COMPACT_MAX_DEPTH deep.
+ */
+
+#ifndef COMPACT_FRAME_H
+#define COMPACT_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define COMPACT_ENCODING_NAME "msgpack"
+#define COMPACT_MAX_FIELDS 15           // Fits the one-byte fixmap header
+#define COMPACT_MAX_DEPTH 8             // Arrays/maps nested in a skipped value; deeper is malformed
+
+// Map keys; never renumber, only append
+enum FrameKey : uint8_t {
+  KEY_TYPE = 0,
+  KEY_DEVICE_ID = 1,
+  KEY_DEVICE_TYPE = 2,
+  KEY_STATUS = 3,
+  KEY_ALERT_TYPE = 4,
+  KEY_VALUE = 5,
+  KEY_COMMAND = 6,
+  KEY_POSITION = 7,
+  KEY_SUCCESS = 8,
+  KEY_CORR_ID = 9        // Correlation ID of a command, echoed in its reply
+};
+
+// Values of KEY_TYPE; never renumber, only append
+enum FrameType : uint8_t {
+  FRAME_UNKNOWN = 0,
+  FRAME_REGISTRATION = 1,
+  FRAME_REGISTRATION_CONFIRM = 2,
+  FRAME_STATUS = 3,
+  FRAME_ALERT = 4,
+  FRAME_HEARTBEAT = 5,
+  FRAME_COMMAND = 6,
+  FRAME_POSITION_UPDATE = 7,
+  FRAME_SET_POSITION = 8,
+  FRAME_CALIBRATE = 9,
+  FRAME_ACK = 10         // Reply to a command that produces no status
+};
+
+enum CompactKind : uint8_t {
+  COMPACT_NIL,
+  COMPACT_BOOL,
+  COMPACT_INT,
+  COMPACT_FLOAT,
+  COMPACT_STRING,
+  COMPACT_OTHER   // Valid MessagePack the firmwares have no use for (skipped)
+};
+
+// One decoded field value; strings point into the frame and are not NUL-terminated
+struct CompactValue {
+  CompactKind kind;
+  bool boolean;
+  int64_t integer;
+  float number;
+  const char* str;
+  size_t length;
+
+  int32_t asInt() const;
+  float asFloat() const;
+  // Copy a string value into a NUL-terminated buffer (truncating); returns its length
+  size_t copyTo(char* out, size_t size) const;
+};
+
+// Builds one frame into a caller-provided buffer
+class CompactWriter {
+ public:
+  CompactWriter(uint8_t* buffer, size_t size);
+
+  // Start a frame of the given type; must be called first
+  void begin(FrameType type);
+  void putInt(FrameKey key, int32_t value);
+  void putBool(FrameKey key, bool value);
+  void putFloat(FrameKey key, float value);
+  void putString(FrameKey key, const char* value);
+  // Returns the frame length, or 0 if it did not fit
+  size_t finish();
+
+ private:
+  void putKey(FrameKey key);
+  void writeByte(uint8_t value);
+  void writeBytes(const void* data, size_t length);
+  void writeBigEndian(uint32_t value, int bytes);
+
+  uint8_t* buffer_;
+  size_t size_;
+  size_t length_;
+  uint8_t fields_;
+  bool overflow_;
+};
+
+// Walks the fields of one frame without copying it
+class CompactReader {
+ public:
+  CompactReader(const uint8_t* data, size_t length);
+
+  // False if the data does not start with a MessagePack map
+  bool valid() const { return remaining_ >= 0; }
+  // Frame type, read by scanning for KEY_TYPE (FRAME_UNKNOWN if absent)
+  FrameType type() const;
+  // Read the next field; returns false at the end or on malformed data
+  bool next(uint8_t& key, CompactValue& value);
+
+ private:
+  bool readValue(CompactValue& value);
+  bool skipValue(int depth);
+  bool readBigEndian(int bytes, uint32_t& value);
+
+  const uint8_t* data_;
+  size_t length_;
+  size_t pos_;
+  size_t fieldsStart_;
+  int remaining_;
+};
+
+#endif
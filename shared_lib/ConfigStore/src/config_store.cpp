@@ -0,0 +1,209 @@
+#include "config_store.h"
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <string.h>
+#ifdef CONFIG_STORE_FILE
+#include <LittleFS.h>
+#endif
+
+#define CONFIG_MAGIC 0x31474643u   // "CFG1"
+#define FILE_SLOT 2                // active_ when the config came from the file
+
+static uint32_t crcAppend(uint32_t crc, const uint8_t* data, size_t length) {
+  // CRC-32 (IEEE, reflected), bit by bit; a config is a few hundred bytes
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+  }
+  return crc;
+}
+
+static uint32_t slotCrc(const ConfigHeader& header, const uint8_t* config) {
+  uint32_t crc = crcAppend(0xFFFFFFFFu, (const uint8_t*)&header, offsetof(ConfigHeader, crc));
+  return ~crcAppend(crc, config, header.length);
+}
+
+// The RAM image EEPROM.begin() read from flash
+static const uint8_t* eepromImage() {
+#ifdef ESP8266
+  return EEPROM.getConstDataPtr();
+#else
+  return EEPROM.getDataPtr();
+#endif
+}
+
+ConfigStore::ConfigStore() {
+  address_ = 0;
+  size_ = 0;
+  version_ = 0;
+  active_ = -1;
+#ifdef CONFIG_STORE_FILE
+  fileReady_ = false;
+#endif
+  sequence_ = 0;
+  loadedVersion_ = 0;
+  loadUs_ = 0;
+  saves_ = 0;
+}
+
+void ConfigStore::begin(int address, size_t size, uint16_t version) {
+  address_ = address;
+  size_ = size;
+  version_ = version;
+#ifdef CONFIG_STORE_FILE
+  fileImage_.reset(new uint8_t[sizeof(ConfigHeader) + size]);
+  fileReady_ = LittleFS.begin();
+#endif
+}
+
+int ConfigStore::slotAddress(int slot) const {
+  return address_ + slot * (sizeof(ConfigHeader) + size_);
+}
+
+const uint8_t* ConfigStore::slotImage(int slot) const {
+#ifdef CONFIG_STORE_FILE
+  if (slot == FILE_SLOT) {
+    return fileImage_.get();
+  }
+#endif
+  return eepromImage() + slotAddress(slot);
+}
+
+bool ConfigStore::slotValid(const uint8_t* slot, ConfigHeader& header) const {
+  memcpy(&header, slot, sizeof(header));
+  return header.magic == CONFIG_MAGIC && header.length <= size_ &&
+         header.crc == slotCrc(header, slot + sizeof(header));
+}
+
+#ifdef CONFIG_STORE_FILE
+// Read the file into fileImage_; false if there is none or its length is not the header's
+bool ConfigStore::readFile() {
+  File file = LittleFS.open(CONFIG_STORE_FILE, "r");
+  if (!file) {
+    return false;
+  }
+  size_t length = file.read(fileImage_.get(), sizeof(ConfigHeader) + size_);
+  file.close();
+  ConfigHeader header;
+  memcpy(&header, fileImage_.get(), sizeof(header));
+  return length >= sizeof(header) && length == sizeof(header) + header.length;
+}
+
+// Write a new file and rename it over the old one, which stays whole until the rename
+bool ConfigStore::writeFile(const ConfigHeader& header, const void* config) {
+  static const char TEMP_PATH[] = CONFIG_STORE_FILE ".new";
+  File file = LittleFS.open(TEMP_PATH, "w");
+  if (!file) {
+    return false;
+  }
+  bool written = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+                 file.write((const uint8_t*)config, size_) == size_;
+  file.close();
+  if (!written || !LittleFS.rename(TEMP_PATH, CONFIG_STORE_FILE)) {
+    LittleFS.remove(TEMP_PATH);
+    return false;
+  }
+  memcpy(fileImage_.get(), &header, sizeof(header));
+  memcpy(fileImage_.get() + sizeof(header), config, size_);
+  return true;
+}
+#endif
+
+bool ConfigStore::load(void* config) {
+  uint32_t start = micros();
+  ConfigHeader headers[FILE_SLOT + 1];
+  active_ = -1;
+#ifdef CONFIG_STORE_FILE
+  // A valid file is always the newest; the slots are only a store from before it
+  if (fileReady_ && readFile() && slotValid(fileImage_.get(), headers[FILE_SLOT])) {
+    active_ = FILE_SLOT;
+  }
+#endif
+
+  if (active_ < 0) {
+    bool valid[2];
+    for (int slot = 0; slot < 2; slot++) {
+      valid[slot] = slotValid(slotImage(slot), headers[slot]);
+    }
+    // Sequence numbers are compared by their difference, so they may wrap
+    if (valid[0] && valid[1]) {
+      active_ = (int32_t)(headers[1].sequence - headers[0].sequence) > 0 ? 1 : 0;
+    } else if (valid[0] || valid[1]) {
+      active_ = valid[0] ? 0 : 1;
+    }
+  }
+
+  if (active_ >= 0) {
+    const ConfigHeader& header = headers[active_];
+    // A slot written by an older, shorter layout leaves the new fields zero
+    memcpy(config, slotImage(active_) + sizeof(ConfigHeader), header.length);
+    memset((uint8_t*)config + header.length, 0, size_ - header.length);
+    sequence_ = header.sequence;
+    loadedVersion_ = header.version;
+  }
+  loadUs_ = micros() - start;
+  return active_ >= 0;
+}
+
+bool ConfigStore::writeSlot(int slot, const ConfigHeader& header, const void* config) {
+#ifdef CONFIG_STORE_FILE
+  if (slot == FILE_SLOT) {
+    return writeFile(header, config);
+  }
+#endif
+  // Both pieces go into the RAM image; flash is written once, by commit()
+  uint8_t* image = EEPROM.getDataPtr();
+  memcpy(image + slotAddress(slot), &header, sizeof(header));
+  memcpy(image + slotAddress(slot) + sizeof(header), config, size_);
+  return EEPROM.commit();
+}
+
+bool ConfigStore::save(const void* config) {
+  if (active_ >= 0) {
+    const uint8_t* current = slotImage(active_);
+    ConfigHeader header;
+    memcpy(&header, current, sizeof(header));
+    if (header.version == version_ && header.length == size_ &&
+        memcmp(current + sizeof(header), config, size_) == 0) {
+      return true;
+    }
+  }
+
+  ConfigHeader header;
+  header.magic = CONFIG_MAGIC;
+  header.version = version_;
+  header.length = size_;
+  header.sequence = sequence_ + 1;
+  header.crc = slotCrc(header, (const uint8_t*)config);
+
+  int slot = active_ == 0 ? 1 : 0;
+#ifdef CONFIG_STORE_FILE
+  if (fileReady_) {
+    slot = FILE_SLOT;
+  }
+#endif
+  if (!writeSlot(slot, header, config)) {
+    return false;
+  }
+  active_ = slot;
+  sequence_ = header.sequence;
+  loadedVersion_ = version_;
+  saves_++;
+  return true;
+}
+
+void ConfigStore::erase() {
+  uint8_t* image = EEPROM.getDataPtr();
+  memset(image + address_, 0, CONFIG_STORE_SIZE(size_));
+  EEPROM.commit();
+#ifdef CONFIG_STORE_FILE
+  if (fileReady_) {
+    LittleFS.remove(CONFIG_STORE_FILE);
+  }
+#endif
+  active_ = -1;
+  sequence_ = 0;
+}
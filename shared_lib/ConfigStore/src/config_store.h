@@ -0,0 +1,112 @@
+/*
+ * Config Store - versioned, CRC-checked firmware configuration in flash
+ *
+ * Each firmware keeps its settings in one packed struct. The store holds
+ * two copies of it in EEPROM, each slot a ConfigHeader followed by the
+ * struct. The header carries the struct's layout version, its length, a
+ * sequence number and a CRC32 over both, so a slot is either provably
+ * intact or ignored.
+ *
+ * load() checks both slots in the RAM image that EEPROM.begin() read from
+ * flash in one block, picks the valid slot with the highest sequence
+ * number and copies the struct out with one memcpy. save()
+ * writes the other slot with the next sequence number and commits once;
+ * the slot that was loaded is not touched until the save after that. A
+ * save that changes nothing writes nothing.
+ *
+ * On the ESP32 the EEPROM image lives in NVS, which writes the new blob
+ * before it drops the old one, so a power loss during commit leaves the
+ * previous image whole. The ESP8266 rewrites its single EEPROM sector in
+ * place, and a power loss between the sector erase and the write loses
+ * both slots, so there the store keeps the struct in a LittleFS file
+ * instead (CONFIG_STORE_FILE). save() writes a new file beside it and
+ * renames it over the old one; LittleFS makes the rename atomic, so the
+ * old file is whole until the new one is. The EEPROM slots are then only
+ * read, by load(), when there is no valid file: a store written before
+ * the file existed, which the next save() moves into the file. If
+ * LittleFS cannot be mounted (a board layout with no filesystem) the
+ * store uses the EEPROM slots as before.
+ *
+ * Fields appended to a struct read as zero from an older, shorter slot;
+ * anything else about a layout change is the firmware's business, using
+ * loadedVersion(). Firmwares that predate the store read their old layout
+ * once when no slot is valid, and save() it into the store.
+ */
+
+#ifndef CONFIG_STORE_H
+#define CONFIG_STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <memory>
+
+// The ESP8266 keeps the store in a file; a build may choose the path itself
+#if defined(ESP8266) && !defined(CONFIG_STORE_FILE)
+#define CONFIG_STORE_FILE "/config.bin"
+#endif
+
+struct __attribute__((packed)) ConfigHeader {
+  uint32_t magic;
+  uint16_t version;     // Layout version of the firmware's struct
+  uint16_t length;      // Struct bytes that follow
+  uint32_t sequence;    // Incremented on every save; the higher valid slot wins
+  uint32_t crc;         // CRC32 of the fields above and the struct
+};
+
+// EEPROM bytes taken by a store of configSize-byte structs
+#define CONFIG_STORE_SIZE(configSize) (2 * (sizeof(ConfigHeader) + (configSize)))
+
+class ConfigStore {
+ public:
+  ConfigStore();
+
+  // The store takes CONFIG_STORE_SIZE(size) bytes of EEPROM at address;
+  // the caller has already run EEPROM.begin(). version is the layout
+  // version written with every save. With CONFIG_STORE_FILE this also
+  // mounts LittleFS.
+  void begin(int address, size_t size, uint16_t version);
+
+  // Copy the newest valid slot into config (size bytes, as passed to
+  // begin()). Returns false, leaving config untouched, if neither is valid.
+  bool load(void* config);
+  // Write config to the older slot (or the file) and commit. Returns
+  // false if the commit failed, leaving the previous config in place.
+  bool save(const void* config);
+  // Invalidate both slots and remove the file (factory reset)
+  void erase();
+
+  template <typename T> bool load(T& config) { return load((void*)&config); }
+  template <typename T> bool save(const T& config) { return save((const void*)&config); }
+
+  // Layout version of the slot load() found
+  uint16_t loadedVersion() const { return loadedVersion_; }
+  uint32_t sequence() const { return sequence_; }
+  // Time the last load() took, in us
+  uint32_t loadUs() const { return loadUs_; }
+  uint32_t saves() const { return saves_; }
+
+ private:
+  int slotAddress(int slot) const;
+  const uint8_t* slotImage(int slot) const;
+  bool slotValid(const uint8_t* slot, ConfigHeader& header) const;
+  bool writeSlot(int slot, const ConfigHeader& header, const void* config);
+#ifdef CONFIG_STORE_FILE
+  bool readFile();
+  bool writeFile(const ConfigHeader& header, const void* config);
+#endif
+
+  int address_;
+  size_t size_;
+  uint16_t version_;
+  int active_;              // Slot that holds the newest config; -1 if none
+#ifdef CONFIG_STORE_FILE
+  bool fileReady_;          // LittleFS mounted; saves go to the file
+  std::unique_ptr<uint8_t[]> fileImage_;   // The file's header and struct, as last read or written
+#endif
+  uint32_t sequence_;
+  uint16_t loadedVersion_;
+  uint32_t loadUs_;
+  uint32_t saves_;
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "wifi_connector.h"
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <async_log.h>
+#include <string.h>
+#ifdef ESP8266
+#include <ESP8266WiFi.h>
+#else
+#include <WiFi.h>
+#endif
+
+#define WIFI_CACHE_MAGIC 0x57434331u   // "WCC1"; change when WifiCache changes
+
+static uint32_t fnvAppend(uint32_t hash, const uint8_t* data, size_t length) {
+  // 32-bit FNV-1a
+  for (size_t i = 0; i < length; i++) {
+    hash ^= data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t cacheChecksum(const WifiCache& cache) {
+  return fnvAppend(2166136261u, (const uint8_t*)&cache, offsetof(WifiCache, checksum));
+}
+
+static uint32_t randomWord() {
+#ifdef ESP8266
+  return RANDOM_REG32;
+#else
+  return esp_random();
+#endif
+}
+
+// Copy a string into a fixed-size buffer, always NUL-terminated
+static void copyField(char* dest, const char* src, size_t size) {
+  size_t len = strnlen(src, size - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+WifiConnector::WifiConnector() {
+  memset(networks_, 0, sizeof(networks_));
+  networkCount_ = 0;
+  current_ = 0;
+  cacheAddress_ = -1;
+  memset(&cache_, 0, sizeof(cache_));
+  cacheValid_ = false;
+  state_ = CONNECTOR_IDLE;
+  stateSince_ = 0;
+  stateTimeout_ = 0;
+  attemptsSince_ = 0;
+  failures_ = 0;
+  connectMs_ = 0;
+  bootConnectMs_ = 0;
+  fastPath_ = false;
+  bootFastPath_ = false;
+  handler_ = nullptr;
+}
+
+void WifiConnector::setNetwork(Network& network, const char* ssid, const char* password) {
+  copyField(network.ssid, ssid, sizeof(network.ssid));
+  copyField(network.password, password, sizeof(network.password));
+  // The separator keeps ("ab", "c") and ("a", "bc") apart
+  uint32_t hash = fnvAppend(2166136261u, (const uint8_t*)network.ssid, strlen(network.ssid) + 1);
+  network.credentials = fnvAppend(hash, (const uint8_t*)network.password, strlen(network.password));
+}
+
+void WifiConnector::setFallback(const char* ssid, const char* password) {
+  setNetwork(networks_[1], ssid, password);
+  networkCount_ = 2;
+}
+
+void WifiConnector::begin(const char* ssid, const char* password, int cacheAddress) {
+  setNetwork(networks_[0], ssid, password);
+  if (networkCount_ < 1) {
+    networkCount_ = 1;
+  }
+  current_ = 0;
+  cacheAddress_ = cacheAddress;
+  loadCache();
+
+  // The connector decides when to reconnect, and the SDK need not
+  // rewrite its own copy of the credentials on every attempt
+  WiFi.persistent(false);
+  WiFi.setAutoReconnect(false);
+
+  failures_ = 0;
+  attemptsSince_ = millis();
+  LOG_INFO("WiFi: connecting to %s (%s)", networks_[current_].ssid, cacheValid_ ? "fast path" : "scan");
+  if (cacheValid_) {
+    startFast();
+  } else {
+    startScan();
+  }
+}
+
+void WifiConnector::stop() {
+  if (state_ != CONNECTOR_IDLE) {
+    WiFi.disconnect();
+    state_ = CONNECTOR_IDLE;
+  }
+}
+
+void WifiConnector::startFast() {
+  WiFi.config(IPAddress(cache_.ip), IPAddress(cache_.gateway), IPAddress(cache_.subnet), IPAddress(cache_.dns));
+  WiFi.begin(networks_[current_].ssid, networks_[current_].password, cache_.channel, cache_.bssid);
+  state_ = CONNECTOR_FAST;
+  stateSince_ = millis();
+  stateTimeout_ = WIFI_FAST_TIMEOUT_MS;
+}
+
+void WifiConnector::startScan() {
+  // An all-zero address switches the station back to DHCP
+  WiFi.config(IPAddress((uint32_t)0), IPAddress((uint32_t)0), IPAddress((uint32_t)0));
+  WiFi.begin(networks_[current_].ssid, networks_[current_].password);
+  state_ = CONNECTOR_SCAN;
+  stateSince_ = millis();
+  stateTimeout_ = WIFI_SCAN_TIMEOUT_MS;
+}
+
+void WifiConnector::service() {
+  switch (state_) {
+    case CONNECTOR_FAST:
+    case CONNECTOR_SCAN: {
+      int status = WiFi.status();
+      if (status == WL_CONNECTED) {
+        connectedNow();
+      } else if (state_ == CONNECTOR_FAST &&
+                 (status == WL_NO_SSID_AVAIL || millis() - stateSince_ >= stateTimeout_)) {
+        // The access point moved, changed channel or forgot the lease
+        LOG_WARN("WiFi: fast path failed, scanning");
+        cacheValid_ = false;
+        startScan();
+      } else if (millis() - stateSince_ >= stateTimeout_) {
+        attemptFailed();
+      }
+      break;
+    }
+
+    case CONNECTOR_BACKOFF:
+      if (millis() - stateSince_ >= stateTimeout_) {
+        startScan();
+      }
+      break;
+
+    case CONNECTOR_ONLINE:
+      if (WiFi.status() != WL_CONNECTED) {
+        LOG_WARN("WiFi: connection lost");
+        attemptsSince_ = millis();
+        if (cacheValid_) {
+          startFast();
+        } else {
+          startScan();
+        }
+        emit(CONNECTOR_LOST);
+      }
+      break;
+
+    case CONNECTOR_IDLE:
+      break;
+  }
+}
+
+uint32_t WifiConnector::backoffMs() const {
+  // Exponential in the failures so far, then "equal jitter": half fixed, half random
+  uint32_t base = WIFI_BACKOFF_MAX_MS;
+  if (failures_ <= 6) {
+    base = (uint32_t)WIFI_BACKOFF_MIN_MS << (failures_ - 1);
+    if (base > WIFI_BACKOFF_MAX_MS) {
+      base = WIFI_BACKOFF_MAX_MS;
+    }
+  }
+  return base / 2 + randomWord() % (base / 2 + 1);
+}
+
+void WifiConnector::attemptFailed() {
+  if (failures_ < UINT16_MAX) {
+    failures_++;
+  }
+  WiFi.disconnect();
+  // With a fallback, the next scan tries the other network
+  current_ = (current_ + 1) % networkCount_;
+  state_ = CONNECTOR_BACKOFF;
+  stateSince_ = millis();
+  stateTimeout_ = backoffMs();
+  LOG_WARN("WiFi: connect failed (%u in a row), retrying in %u ms", failures_, stateTimeout_);
+  emit(CONNECTOR_FAILED);
+}
+
+void WifiConnector::connectedNow() {
+  uint32_t now = millis();
+  connectMs_ = now - attemptsSince_;
+  fastPath_ = state_ == CONNECTOR_FAST;
+  failures_ = 0;
+  state_ = CONNECTOR_ONLINE;
+  saveCache();
+
+  LOG_INFO("WiFi: connected in %u ms (%s), IP %s", connectMs_,
+           fastPath_ ? "fast path" : "scan", WiFi.localIP().toString().c_str());
+  if (bootConnectMs_ == 0) {
+    bootConnectMs_ = now > 0 ? now : 1;
+    bootFastPath_ = fastPath_;
+    LOG_INFO("WiFi: first connection %u ms after boot", bootConnectMs_);
+  }
+  emit(CONNECTOR_CONNECTED);
+}
+
+void WifiConnector::emit(ConnectorEvent event) {
+  if (handler_) {
+    handler_(event);
+  }
+}
+
+void WifiConnector::loadCache() {
+  cacheValid_ = false;
+  if (cacheAddress_ < 0) {
+    return;
+  }
+  EEPROM.get(cacheAddress_, cache_);
+  if (cache_.magic != WIFI_CACHE_MAGIC || cache_.checksum != cacheChecksum(cache_) ||
+      cache_.ip == 0 || cache_.channel < 1 || cache_.channel > 14) {
+    return;
+  }
+  // Start with whichever network the cache belongs to
+  for (uint8_t i = 0; i < networkCount_; i++) {
+    if (cache_.credentials == networks_[i].credentials) {
+      current_ = i;
+      cacheValid_ = true;
+    }
+  }
+}
+
+void WifiConnector::saveCache() {
+  WifiCache fresh;
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.magic = WIFI_CACHE_MAGIC;
+  fresh.credentials = networks_[current_].credentials;
+  const uint8_t* bssid = WiFi.BSSID();
+  if (bssid) {
+    memcpy(fresh.bssid, bssid, sizeof(fresh.bssid));
+  }
+  fresh.channel = WiFi.channel();
+  fresh.ip = (uint32_t)WiFi.localIP();
+  fresh.gateway = (uint32_t)WiFi.gatewayIP();
+  fresh.subnet = (uint32_t)WiFi.subnetMask();
+  fresh.dns = (uint32_t)WiFi.dnsIP(0);
+  fresh.checksum = cacheChecksum(fresh);
+
+  // Reconnects to the same access point with the same lease write nothing
+  if (memcmp(&fresh, &cache_, sizeof(fresh)) != 0) {
+    cache_ = fresh;
+    if (cacheAddress_ >= 0) {
+      EEPROM.put(cacheAddress_, cache_);
+      EEPROM.commit();
+    }
+  }
+  cacheValid_ = bssid != nullptr && fresh.ip != 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * WiFi Connector - non-blocking station connection manager
+ *
+ * Replaces the `while (WiFi.status() != WL_CONNECTED) delay(500)` loops of
+ * the firmwares with a state machine that service() advances from loop().
+ * The firmware reacts to its events instead of waiting on it.
+ *
+ * After every successful connection the connector saves the access point's
+ * BSSID and channel and the DHCP lease (address, gateway, mask, DNS) in a
+ * small EEPROM record, keyed by a hash of the credentials. The next
+ * connection starts on the fast path: WiFi.config() with the saved lease
+ * and WiFi.begin() pinned to the saved BSSID and channel, which skips both
+ * the channel scan and the DHCP exchange. If the fast path has not
+ * connected within WIFI_FAST_TIMEOUT_MS, the connector falls back to a
+ * normal scan and DHCP; failed scans are retried after an exponential
+ * backoff with random jitter, so devices that lose the same access point
+ * do not all come back at once. A firmware that knows a second network
+ * (the smart switch: home WiFi, then the hub's hotspot) sets it as the
+ * fallback, and scan attempts alternate between the two.
+ *
+ * The saved lease is reused without asking the DHCP server, so it is only
+ * trusted for the credentials it came from, and is set aside as soon as
+ * the fast path fails, until a scan connects and refreshes it.
+ *
+ * Time-to-connected is kept for every connection (connectMs()) and for the
+ * first one since boot (bootConnectMs()), together with whether it came
+ * through the fast path, and logged (see async_log.h).
+ */
+
+#ifndef WIFI_CONNECTOR_H
+#define WIFI_CONNECTOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIFI_FAST_TIMEOUT_MS 4000      // Fast path (cached BSSID, channel and lease)
+#define WIFI_SCAN_TIMEOUT_MS 10000     // Scan and DHCP; what the old 20 x 500 ms loops allowed
+#define WIFI_BACKOFF_MIN_MS 1000       // First retry after a failed scan
+#define WIFI_BACKOFF_MAX_MS 60000      // Backoff ceiling
+#define WIFI_SSID_LEN 33
+#define WIFI_PASSWORD_LEN 65
+
+enum ConnectorState : uint8_t {
+  CONNECTOR_IDLE,       // begin() not called, or stop()ped
+  CONNECTOR_FAST,       // Connecting to the cached BSSID with the cached lease
+  CONNECTOR_SCAN,       // Connecting with a scan and DHCP
+  CONNECTOR_BACKOFF,    // Waiting to retry after a failed scan
+  CONNECTOR_ONLINE
+};
+
+enum ConnectorEvent : uint8_t {
+  CONNECTOR_CONNECTED,  // Station is up; connectMs() and fastPath() describe how
+  CONNECTOR_LOST,       // Connection dropped; reconnecting already started
+  CONNECTOR_FAILED      // A scan attempt failed; failures() counts them
+};
+
+typedef void (*ConnectorHandler)(ConnectorEvent event);
+
+// Persistent record of the last good connection; WIFI_CACHE_SIZE bytes of EEPROM
+struct WifiCache {
+  uint32_t magic;
+  uint32_t credentials;   // FNV-1a of ssid and password
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint8_t reserved;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+  uint32_t checksum;      // FNV-1a of the fields above
+};
+
+#define WIFI_CACHE_SIZE sizeof(WifiCache)
+
+class WifiConnector {
+ public:
+  WifiConnector();
+
+  // Start connecting. cacheAddress is the EEPROM offset of WIFI_CACHE_SIZE
+  // bytes reserved for the connection cache; the caller has already run
+  // EEPROM.begin(). Calling begin() again switches networks.
+  void begin(const char* ssid, const char* password, int cacheAddress);
+  // Second network to alternate with when a scan fails; call before begin()
+  void setFallback(const char* ssid, const char* password);
+  // Drop the station connection and stop retrying
+  void stop();
+  // Advance the state machine; call from loop() (or a scheduler task)
+  void service();
+  void onEvent(ConnectorHandler handler) { handler_ = handler; }
+
+  ConnectorState state() const { return state_; }
+  bool connected() const { return state_ == CONNECTOR_ONLINE; }
+  // Connected at least once since boot
+  bool everConnected() const { return bootConnectMs_ != 0; }
+  // Failed scan attempts since the last connection
+  uint16_t failures() const { return failures_; }
+
+  // From the first attempt to the last connection, in ms
+  uint32_t connectMs() const { return connectMs_; }
+  // millis() when the first connection since boot came up; 0 until then
+  uint32_t bootConnectMs() const { return bootConnectMs_; }
+  // The last connection came through the fast path
+  bool fastPath() const { return fastPath_; }
+  // The first connection since boot came through the fast path
+  bool bootFastPath() const { return bootFastPath_; }
+
+ private:
+  void startFast();
+  void startScan();
+  void attemptFailed();
+  void connectedNow();
+  void emit(ConnectorEvent event);
+  void loadCache();
+  void saveCache();
+  uint32_t backoffMs() const;
+
+  struct Network {
+    char ssid[WIFI_SSID_LEN];
+    char password[WIFI_PASSWORD_LEN];
+    uint32_t credentials;   // FNV-1a of ssid and password, as in WifiCache
+  };
+
+  static void setNetwork(Network& network, const char* ssid, const char* password);
+
+  Network networks_[2];     // Primary, then the optional fallback
+  uint8_t networkCount_;
+  uint8_t current_;         // Network of the current attempt
+  int cacheAddress_;
+  WifiCache cache_;
+  bool cacheValid_;         // cache_ belongs to one of networks_ and may be used
+
+  ConnectorState state_;
+  uint32_t stateSince_;
+  uint32_t stateTimeout_;
+  uint32_t attemptsSince_;  // millis() when the current run of attempts began
+  uint16_t failures_;
+  uint32_t connectMs_;
+  uint32_t bootConnectMs_;
+  bool fastPath_;
+  bool bootFastPath_;
+  ConnectorHandler handler_;
+};
+
+#endif
@@ -4,6 +4,9 @@
 #include <ArduinoJson.h>
 #include <EEPROM.h>
 #include <ESPAsyncWebServer.h>
+#include <wifi_connector.h>
+#include <async_log.h>
+#include <config_store.h>
 
 // Camera pins for AI Thinker ESP32-CAM
 #define PWDN_GPIO_NUM     32
@@ -28,9 +31,24 @@
 
 // EEPROM size and addresses
 #define EEPROM_SIZE       512
+#define CONFIG_STORE_ADDR 0    // Two CamConfig slots (see config_store.h)
+#define CONFIG_VERSION    1    // Layout version of CamConfig
+#define WIFI_CACHE_ADDR   (EEPROM_SIZE - WIFI_CACHE_SIZE)  // Last good connection (see wifi_connector.h)
+
+// Fields of the layout before the config store, read once to migrate
 #define WIFI_SSID_ADDR    0
 #define WIFI_PASS_ADDR    32
 #define DEVICE_ID_ADDR    64
+#define LEGACY_FIELD_SIZE 32
+
+// Settings that survive a reboot, stored as one block; strings are NUL-terminated
+struct __attribute__((packed)) CamConfig {
+  char ssid[33];
+  char password[65];
+  char deviceId[33];
+};
+static_assert(CONFIG_STORE_ADDR + CONFIG_STORE_SIZE(sizeof(CamConfig)) <= WIFI_CACHE_ADDR,
+              "config store overlaps the WiFi cache");
 
 // Server details
 const char* SERVER_URL = "https://well-scallop-cybergenii-075601d4.koyeb.app";
@@ -39,7 +57,10 @@ const char* UPLOAD_ENDPOINT = "/api/camera/upload";
 // Global variables
 String deviceId;
 bool isConfigured = false;
+bool setupAPStarted = false;
 AsyncWebServer server(80);
+WifiConnector wifi;
+ConfigStore configStore;
 
 // Camera configuration
 camera_config_t config;
@@ -47,7 +68,9 @@ camera_config_t config;
 
 void setupCamera();
 void loadConfig();
+bool loadLegacyConfig(CamConfig &saved);
 void setupAP();
+void onWifiEvent(ConnectorEvent event);
 bool captureAndSendImage();
 
 void setupCamera() {
@@ -79,54 +102,72 @@ void setupCamera() {
 
   esp_err_t err = esp_camera_init(&config);
   if (err != ESP_OK) {
-    Serial.printf("Camera init failed with error 0x%x", err);
+    LOG_ERROR("Camera init failed with error 0x%x", err);
     return;
   }
 }
 
+// Read one NUL-terminated field of the pre-store layout (at most LEGACY_FIELD_SIZE bytes)
+void readLegacyField(int addr, char *dest) {
+  int i = 0;
+  for (; i < LEGACY_FIELD_SIZE; i++) {
+    char c = EEPROM.read(addr + i);
+    if (c == 0) break;
+    dest[i] = c;
+  }
+  dest[i] = '\0';
+}
+
+// The layout before the config store; false if it holds no credentials
+bool loadLegacyConfig(CamConfig &saved) {
+  memset(&saved, 0, sizeof(saved));
+  readLegacyField(WIFI_SSID_ADDR, saved.ssid);
+  readLegacyField(WIFI_PASS_ADDR, saved.password);
+  readLegacyField(DEVICE_ID_ADDR, saved.deviceId);
+  return saved.ssid[0] != '\0' && saved.password[0] != '\0';
+}
+
 void loadConfig() {
   EEPROM.begin(EEPROM_SIZE);
-  String ssid = "";
-  String pass = "";
-  deviceId = "";
+  configStore.begin(CONFIG_STORE_ADDR, sizeof(CamConfig), CONFIG_VERSION);
 
-  // Read SSID
-  for (int i = 0; i < 32; i++) {
-    char c = EEPROM.read(WIFI_SSID_ADDR + i);
-    if (c == 0) break;
-    ssid += c;
-  }
+  CamConfig saved;
+  bool loaded = configStore.load(saved);
 
-  // Read password
-  for (int i = 0; i < 32; i++) {
-    char c = EEPROM.read(WIFI_PASS_ADDR + i);
-    if (c == 0) break;
-    pass += c;
+  // First boot after the update: the settings are still in the old layout
+  if (!loaded && loadLegacyConfig(saved)) {
+    loaded = true;
+    if (configStore.save(saved)) {
+      LOG_INFO("Configuration migrated from the old EEPROM layout");
+    } else {
+      LOG_ERROR("Configuration save failed");
+    }
+  }
+  if (!loaded) {
+    return;
   }
+  deviceId = saved.deviceId;
+  LOG_INFO("Configuration loaded in %u us (seq %u)", configStore.loadUs(), configStore.sequence());
 
-  // Read device ID
-  for (int i = 0; i < 32; i++) {
-    char c = EEPROM.read(DEVICE_ID_ADDR + i);
-    if (c == 0) break;
-    deviceId += c;
+  // The connector retries on its own from loop(); isConfigured follows its events
+  if (saved.ssid[0] != '\0' && saved.password[0] != '\0') {
+    wifi.onEvent(onWifiEvent);
+    wifi.begin(saved.ssid, saved.password, WIFI_CACHE_ADDR);
   }
+}
 
-  if (ssid.length() > 0 && pass.length() > 0) {
-    WiFi.begin(ssid.c_str(), pass.c_str());
-    int attempts = 0;
-    while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-      delay(500);
-      Serial.print(".");
-      attempts++;
-    }
-    if (WiFi.status() == WL_CONNECTED) {
-      isConfigured = true;
-      Serial.println("\nConnected to WiFi");
-    }
+void onWifiEvent(ConnectorEvent event) {
+  if (event == CONNECTOR_CONNECTED) {
+    isConfigured = true;
+    LOG_INFO("Connected to WiFi");
+  } else if (event == CONNECTOR_FAILED && !wifi.everConnected() && !setupAPStarted) {
+    // Saved network unreachable since boot; offer setup while still retrying
+    setupAP();
   }
 }
 
 void setupAP() {
+  setupAPStarted = true;
   String apName = "SmartCam-" + String((uint32_t)ESP.getEfuseMac(), HEX);
   WiFi.softAP(apName.c_str());
   
@@ -148,28 +189,14 @@ void setupAP() {
     // Generate device ID
     deviceId = "CAM-" + String((uint32_t)ESP.getEfuseMac(), HEX);
     
-    // Save to EEPROM
-    EEPROM.begin(EEPROM_SIZE);
-    
-    // Write SSID
-    for (int i = 0; i < ssid.length(); i++) {
-      EEPROM.write(WIFI_SSID_ADDR + i, ssid[i]);
-    }
-    EEPROM.write(WIFI_SSID_ADDR + ssid.length(), 0);
-    
-    // Write password
-    for (int i = 0; i < pass.length(); i++) {
-      EEPROM.write(WIFI_PASS_ADDR + i, pass[i]);
-    }
-    EEPROM.write(WIFI_PASS_ADDR + pass.length(), 0);
-    
-    // Write device ID
-    for (int i = 0; i < deviceId.length(); i++) {
-      EEPROM.write(DEVICE_ID_ADDR + i, deviceId[i]);
+    CamConfig saved;
+    memset(&saved, 0, sizeof(saved));
+    strlcpy(saved.ssid, ssid.c_str(), sizeof(saved.ssid));
+    strlcpy(saved.password, pass.c_str(), sizeof(saved.password));
+    strlcpy(saved.deviceId, deviceId.c_str(), sizeof(saved.deviceId));
+    if (!configStore.save(saved)) {
+      LOG_ERROR("Configuration save failed");
     }
-    EEPROM.write(DEVICE_ID_ADDR + deviceId.length(), 0);
-    
-    EEPROM.commit();
     
     request->send(200, "text/plain", "Settings saved. Device will restart.");
     delay(2000);
@@ -182,7 +209,7 @@ void setupAP() {
 bool captureAndSendImage() {
   camera_fb_t* fb = esp_camera_fb_get();
   if (!fb) {
-    Serial.println("Camera capture failed");
+    LOG_WARN("Camera capture failed");
     return false;
   }
 
@@ -196,16 +223,19 @@ bool captureAndSendImage() {
 
   if (httpResponseCode > 0) {
     String response = http.getString();
-    Serial.println("Image uploaded successfully");
+    LOG_INFO("Image uploaded successfully");
     return true;
   } else {
-    Serial.println("Image upload failed");
+    LOG_WARN("Image upload failed");
     return false;
   }
 }
 
 void setup() {
+  // Lines are written out by a low-priority task on the other core (see async_log.h)
   Serial.begin(115200);
+  asyncLog.begin(Serial);
+  asyncLog.startTask(1, 0);
   
   // Initialize PIR sensor
   pinMode(PIR_PIN, INPUT);
@@ -216,30 +246,30 @@ void setup() {
   // Load saved configuration
   loadConfig();
   
-  // If not configured, start AP mode
-  if (!isConfigured) {
+  // Without saved credentials, start AP mode
+  if (wifi.state() == CONNECTOR_IDLE) {
     setupAP();
   }
 }
 
 void loop() {
+  wifi.service();
+  
   if (!isConfigured) {
     // In setup mode, handle web server
     delay(100);
     return;
   }
 
-  // Check WiFi connection
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("WiFi connection lost. Attempting to reconnect...");
-    loadConfig();
-    delay(5000);
+  // Wait for the connector to bring WiFi back
+  if (!wifi.connected()) {
+    delay(100);
     return;
   }
 
   // Check PIR sensor
   if (digitalRead(PIR_PIN) == HIGH) {
-    Serial.println("Motion detected!");
+    LOG_INFO("Motion detected!");
     if (captureAndSendImage()) {
       // Wait a bit before checking for motion again
       delay(5000);
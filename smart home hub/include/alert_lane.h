@@ -0,0 +1,64 @@
+/*
+ * Alert Lane - the path an alert frame takes past every other message
+ *
+ * An alert from a sub-device is the one message whose latency matters to
+ * a person. On the ordinary path it waited behind whatever else was in
+ * deviceInbox, was parsed, logged and drawn on the LCD before the siren
+ * came on, and then queued behind every older uplink frame.
+ *
+ * On the lane, the AsyncTCP callback recognises an alert as it arrives
+ * (isAlertFrame), drives the siren itself and hands the frame to the loop
+ * through alertInbox, which the loop drains before any other link. The
+ * loop sends the server notification as JSON text through alertOutbox,
+ * which the net task empties before cloudOutbox. Text keeps the binary
+ * uplink dictionary (see uplink_codec.h) in order however far ahead of
+ * other frames the alert goes.
+ *
+ * While the server link is down, alerts wait in an AlertBacklog instead
+ * of the uplink queue and go out first once the hub is authenticated
+ * again, ahead of everything queued before them. Only when the backlog is
+ * full does an alert fall back to the uplink queue at high priority.
+ */
+
+#ifndef ALERT_LANE_H
+#define ALERT_LANE_H
+
+#include <Arduino.h>
+#include "uplink_queue.h"
+
+#define ALERT_FRAME_SIZE 192         // Largest alert notification for the server
+#define ALERT_BACKLOG_SLOTS 8        // Alerts held while the server link is down
+
+// True if a sub-device frame is an alert. Text frames count only if they
+// open with the type (ArduinoJson keeps the firmwares' key order), so a
+// string that merely contains the words can never sound the siren.
+bool isAlertFrame(const uint8_t* data, size_t length, bool binary);
+
+// Alert notifications waiting for the server, oldest first; loop task only
+class AlertBacklog {
+ public:
+  AlertBacklog();
+
+  // Keep a copy of the frame; false if every slot is taken or it is too long
+  bool push(const char* frame, size_t length);
+  // The oldest frame, or nullptr if there is none; valid until pop()
+  const char* peek(size_t& length) const;
+  void pop();
+
+  bool empty() const { return count_ == 0; }
+  uint32_t depth() const { return count_; }
+  uint32_t held() const { return held_; }     // Alerts ever held for a later send
+
+ private:
+  char frames_[ALERT_BACKLOG_SLOTS][ALERT_FRAME_SIZE];
+  uint16_t lengths_[ALERT_BACKLOG_SLOTS];
+  uint8_t head_;
+  uint8_t count_;
+  uint32_t held_;
+};
+
+// Hold an alert for the next session: in the backlog, or once that is full
+// in the uplink queue at high priority. False if neither had room.
+bool holdAlert(AlertBacklog& backlog, UplinkQueue& queue, const char* frame, size_t length);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ * Battery Monitor - calibrated, oversampled battery voltage and charge
+ *
+ * The battery is read through a resistor divider on an ADC1 pin (ADC2
+ * cannot be read while WiFi is on). A single raw reading is both noisy
+ * and off by up to ~10% on an uncalibrated ESP32, so a measurement here
+ * is BATTERY_OVERSAMPLE readings, each converted to millivolts with the
+ * chip's own calibration from eFuse (two-point values if the chip has
+ * them, else its measured Vref), then averaged. The readings are spread
+ * over several scheduler runs, BATTERY_SAMPLES_PER_RUN at a time, so no
+ * run costs more than a few tens of microseconds.
+ *
+ * Each finished measurement feeds an exponential moving average of the
+ * battery voltage, and the charge comes from that voltage through a
+ * single-cell LiPo discharge table rather than a straight line: a LiPo
+ * spends most of its charge between 3.7 and 3.9 V.
+ */
+
+#ifndef BATTERY_MONITOR_H
+#define BATTERY_MONITOR_H
+
+#include <Arduino.h>
+#include <esp_adc_cal.h>
+
+#define BATTERY_OVERSAMPLE 64          // Readings per measurement
+#define BATTERY_SAMPLES_PER_RUN 8      // Readings per service() call
+#define BATTERY_EMA_ALPHA 0.2f         // Weight of a new measurement in the average
+
+class BatteryMonitor {
+ public:
+  // pin must be an ADC1 pin; dividerRatio is battery volts per volt at the pin
+  BatteryMonitor(uint8_t pin, float dividerRatio);
+
+  // Set up the pin and load the calibration; call once
+  void begin();
+  // Take the next few readings; true when a measurement has completed
+  bool service();
+
+  bool ready() const { return measurements_ > 0; }
+  float voltage() const { return voltage_; }       // Averaged battery voltage
+  float percent() const { return percent_; }       // Charge estimate, 0-100
+  uint32_t measurements() const { return measurements_; }
+  // Where the ADC calibration came from, for the boot log
+  const char* calibration() const;
+
+  // Charge of a single LiPo cell at rest, from its voltage
+  static float lipoPercent(float volts);
+
+ private:
+  uint8_t pin_;
+  float dividerRatio_;
+  esp_adc_cal_characteristics_t adcChars_;
+  esp_adc_cal_value_t calibration_;
+  uint32_t sumMv_;              // Millivolts at the pin, summed over this measurement
+  int samples_;
+  float voltage_;
+  float percent_;
+  uint32_t measurements_;
+};
+
+#endif
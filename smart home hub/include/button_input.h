@@ -0,0 +1,143 @@
+/*
+ * Button Input - GPIO edge queue and gesture recognizer for the hub buttons
+ *
+ * The buttons are not polled. A CHANGE interrupt on each button pin pushes
+ * the pin's level and the time into a ButtonEdgeQueue; the loop task pops
+ * the edges from the scheduler and feeds them to a GestureRecognizer,
+ * which turns them into events:
+ *
+ *   BUTTON_CLICK         pressed and released before the long-press time
+ *   BUTTON_LONG_PRESS    held for the long-press time (once, while held)
+ *   BUTTON_CHORD_START   all buttons down together
+ *   BUTTON_CHORD_HOLD    all buttons held for the chord time (once)
+ *   BUTTON_CHORD_CANCEL  a button released before that
+ *
+ * Debouncing is done on timestamps, not by waiting: a level counts once
+ * it has lasted the debounce time with no further edge. Every edge first
+ * brings the recognizer's timers up to the edge's own time, so a backlog
+ * of edges (a busy loop iteration) gives the same events as edges fed one
+ * by one. Clicks are reported on release, so a button that becomes part
+ * of a chord or a long press never also clicks.
+ *
+ * The queue has one producer: the GPIO interrupt, which on the ESP32 is
+ * one handler for every pin, so button interrupts never nest. The
+ * recognizer has no hardware dependency and can be driven from a host
+ * test with a synthetic edge trace.
+ */
+
+#ifndef BUTTON_INPUT_H
+#define BUTTON_INPUT_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define BUTTON_COUNT 3
+#define BUTTON_EDGE_SLOTS 32       // Power of two; edges waiting for the loop task
+#define BUTTON_EVENT_SLOTS 8       // Events waiting to be handled
+#define BUTTON_CHORD 0xFF          // ButtonEvent::button of chord events
+
+struct ButtonEdge {
+  uint32_t ms;              // millis() at the interrupt
+  uint8_t button;           // Index, 0 .. BUTTON_COUNT - 1
+  uint8_t pressed;          // Level read in the interrupt
+};
+
+class ButtonEdgeQueue {
+ public:
+  ButtonEdgeQueue() : head_(0), tail_(0), dropped_(0) {}
+
+  // Producer (the GPIO interrupt). Inline, so it runs from IRAM with the handler.
+  bool push(uint8_t button, bool pressed, uint32_t ms) {
+    uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) >= BUTTON_EDGE_SLOTS) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    ButtonEdge& edge = slots_[tail & (BUTTON_EDGE_SLOTS - 1)];
+    edge.ms = ms;
+    edge.button = button;
+    edge.pressed = pressed ? 1 : 0;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer (the loop task). Returns false if empty.
+  bool pop(ButtonEdge& edge) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    edge = slots_[head & (BUTTON_EDGE_SLOTS - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint32_t pushed() const { return tail_.load(std::memory_order_relaxed); }
+  uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  ButtonEdge slots_[BUTTON_EDGE_SLOTS];
+  std::atomic<uint32_t> head_;
+  std::atomic<uint32_t> tail_;
+  std::atomic<uint32_t> dropped_;
+};
+
+enum ButtonEventKind : uint8_t {
+  BUTTON_CLICK,
+  BUTTON_LONG_PRESS,
+  BUTTON_CHORD_START,
+  BUTTON_CHORD_HOLD,
+  BUTTON_CHORD_CANCEL
+};
+
+struct ButtonEvent {
+  uint8_t kind;             // ButtonEventKind
+  uint8_t button;           // Index, or BUTTON_CHORD
+  uint32_t ms;              // When the gesture was recognized
+};
+
+class GestureRecognizer {
+ public:
+  GestureRecognizer(uint32_t debounceMs, uint32_t longPressMs, uint32_t chordHoldMs);
+
+  // Feed one edge; edges must come in time order
+  void edge(uint8_t button, bool pressed, uint32_t ms);
+  void edge(const ButtonEdge& edge) { this->edge(edge.button, edge.pressed != 0, edge.ms); }
+  // Run the debounce and hold timers up to now
+  void advance(uint32_t now);
+  // Take the oldest event; false if there is none
+  bool nextEvent(ButtonEvent& event);
+
+  // Debounced state
+  bool pressed(int button) const { return buttons_[button].stable; }
+  bool chordActive() const { return chordActive_; }
+  uint32_t chordHeldMs(uint32_t now) const { return chordActive_ ? now - chordStart_ : 0; }
+  uint32_t droppedEvents() const { return droppedEvents_; }
+
+ private:
+  struct ButtonState {
+    bool raw;               // Level of the last edge
+    bool stable;            // Debounced level
+    bool longFired;
+    bool suppressed;        // Part of a chord; no click or long press until released
+    uint32_t rawSince;      // Time of the last edge
+    uint32_t downAt;        // Time the debounced press began
+  };
+
+  void settle(int button, uint32_t ms);
+  void emit(uint8_t kind, uint8_t button, uint32_t ms);
+
+  ButtonState buttons_[BUTTON_COUNT];
+  uint32_t debounceMs_;
+  uint32_t longPressMs_;
+  uint32_t chordHoldMs_;
+  bool chordActive_;
+  bool chordFired_;
+  uint32_t chordStart_;
+  ButtonEvent events_[BUTTON_EVENT_SLOTS];
+  uint8_t eventHead_;
+  uint8_t eventCount_;
+  uint32_t droppedEvents_;
+};
+
+#endif
@@ -0,0 +1,69 @@
+/*
+ * Climate Sensor - DHT11 sampling on its own task, read as a snapshot
+ *
+ * A DHT11 transaction holds the line low to wake the sensor, then reads
+ * 40 bits with interrupts disabled. Done inline, the loop sat in both.
+ * Here a task of its own runs exactly one transaction every
+ * CLIMATE_INTERVAL_MS, and the wake-up is a vTaskDelay rather than a busy
+ * wait, so the loop shares its core with the bit read only. The library
+ * does both parts in one call, so hub_sensor_read_duration_seconds is the
+ * wall time of the whole transaction, wake-up included: an upper bound on
+ * what a read can cost the loop. The cost itself shows in
+ * hub_loop_duration_seconds and the heartbeat's loopMaxUs.
+ *
+ * Each good reading goes into a window of the last CLIMATE_WINDOW
+ * readings, and the published values are the window's medians, so a
+ * single wild reading never shows. A reading that fails (timeout,
+ * checksum, or a value the DHT11 cannot produce) only counts as a
+ * failure. Once no good reading has arrived for CLIMATE_STALE_MS the
+ * snapshot is marked stale, keeping the last values.
+ *
+ * The loop task never touches the sensor: snapshot() copies the latest
+ * values under a spinlock, which the sensor task takes only to publish.
+ */
+
+#ifndef CLIMATE_SENSOR_H
+#define CLIMATE_SENSOR_H
+
+#include <Arduino.h>
+#include <DHT.h>
+
+#define CLIMATE_INTERVAL_MS 2000      // One transaction per cycle; the DHT11 needs 1 s between reads
+#define CLIMATE_WINDOW 5              // Readings the median is taken over
+#define CLIMATE_STALE_MS 30000        // No good reading for this long marks the snapshot stale
+#define CLIMATE_TASK_STACK 2048
+
+struct ClimateSnapshot {
+  float temperature;        // Median of the window, degrees C
+  float humidity;           // Median of the window, %RH
+  bool valid;               // At least one good reading since boot
+  bool stale;               // No good reading for CLIMATE_STALE_MS (set by snapshot())
+  uint32_t readings;        // Transactions attempted
+  uint32_t failures;        // Transactions that gave no usable reading
+  uint32_t lastReadUs;      // Wall time of the last transaction, wake-up included
+  uint32_t lastGoodMs;      // millis() of the last good reading
+};
+
+class ClimateSensor {
+ public:
+  explicit ClimateSensor(DHT& dht);
+
+  // Start the sensor and its sampling task
+  void begin(UBaseType_t priority, BaseType_t core);
+  // Latest values; safe from any task
+  ClimateSnapshot snapshot() const;
+
+ private:
+  static void task(void* parameter);
+  void sample();
+
+  DHT& dht_;
+  ClimateSnapshot published_;
+  // Sensor task only
+  float temperatures_[CLIMATE_WINDOW];
+  float humidities_[CLIMATE_WINDOW];
+  int windowCount_;
+  int windowNext_;
+};
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Command Latency - time from a cloud control message to the device's reply
+ *
+ * The server tags each control message with a correlation ID (corrId). The
+ * hub passes it on with the command and starts a clock; the sub-device
+ * echoes it in the status, position_update or ack that answers the command,
+ * which stops the clock. Latencies go into one histogram per device type
+ * (the registry's interned type index), reported as p50/p95/p99 in
+ * hub_status.
+ *
+ * Histogram buckets are logarithmic with four sub-buckets per power of two,
+ * so a percentile is read back within about 25% (as the bucket's upper
+ * bound). Counts are kept since boot. Only the loop task records and
+ * reads them (see core_link.h), so nothing here takes a lock.
+ */
+
+#ifndef COMMAND_LATENCY_H
+#define COMMAND_LATENCY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_registry.h"
+
+#define LATENCY_PENDING 16          // Commands awaiting a reply at once
+#define LATENCY_TIMEOUT_MS 30000    // A command unanswered this long counts as a timeout
+#define LATENCY_BUCKETS 60          // Covers 0 ms to 65 s; slower replies share the last bucket
+#define NO_CORRELATION 0u           // corrId of commands nobody is timing
+
+struct LatencyStats {
+  uint32_t samples;
+  uint32_t timeouts;
+  uint32_t p50Ms;
+  uint32_t p95Ms;
+  uint32_t p99Ms;
+};
+
+class CommandLatency {
+ public:
+  CommandLatency();
+
+  // A command with this corrId was sent to a device; replaces the oldest
+  // pending command (as a timeout) if LATENCY_PENDING are already waiting
+  void start(uint32_t corrId, uint32_t deviceHash, uint8_t typeIndex, uint32_t now);
+  // The device answered; returns false if the corrId was not pending for it
+  bool complete(uint32_t corrId, uint32_t deviceHash, uint32_t now);
+  // Count commands waiting longer than LATENCY_TIMEOUT_MS as timeouts
+  void expire(uint32_t now);
+
+  // Samples, timeouts and percentiles for one device type
+  LatencyStats stats(uint8_t typeIndex) const;
+  bool hasData(uint8_t typeIndex) const { return samples_[typeIndex] > 0 || timeouts_[typeIndex] > 0; }
+
+ private:
+  struct Pending {
+    uint32_t corrId;        // NO_CORRELATION when the slot is free
+    uint32_t deviceHash;    // DeviceRegistry::hashId of the device the command went to
+    uint32_t startedAt;
+    uint8_t typeIndex;
+  };
+
+  static int bucketOf(uint32_t ms);
+  static uint32_t bucketUpperMs(int bucket);
+  uint32_t percentile(uint8_t typeIndex, uint32_t percent) const;
+
+  Pending pending_[LATENCY_PENDING];
+  uint32_t buckets_[MAX_DEVICE_TYPES][LATENCY_BUCKETS];
+  uint32_t samples_[MAX_DEVICE_TYPES];
+  uint32_t timeouts_[MAX_DEVICE_TYPES];
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Core Link - lock-free single-producer single-consumer message ring
+ *
+ * The hub splits its work between the two ESP32 cores. Core 0 runs
+ * network I/O: the cloud WebSocket client in the net task, and the
+ * AsyncTCP task behind the sub-device WebSocket server. Core 1 runs the
+ * Arduino loop task: registry, uplink, sensors, LCD, buttons and liveness.
+ * The two sides share no mutable state; every message between them goes
+ * through a CoreLink, each with exactly one task pushing and one popping.
+ * The loop task's modules (registry, JSON pool, uplink batcher and queue,
+ * timer wheel, latency tracking, rules, journal) and the settings are
+ * touched by no other task and take no locks. /metrics, served on
+ * AsyncTCP, reads snapshots the loop and net tasks publish (see
+ * hub_metrics.h). The one thing both network-core tasks touch is the
+ * sub-device server's client list, under wsClientsLock (see ws_fanout.h).
+ *
+ *   deviceInbox   AsyncTCP  -> loop   frames and disconnects from sub-devices, setup form
+ *   deviceOutbox  loop      -> net    frames for sub-devices, binding checks
+ *   cloudInbox    net       -> loop   server frames and link events, clients found gone
+ *   cloudOutbox   loop      -> net    uplink frames and connect requests
+ *   alertInbox    AsyncTCP  -> loop   alert frames, drained before the others
+ *   alertOutbox   loop      -> net    alert notifications, sent before cloudOutbox
+ *
+ * Messages are variable-length records (a LinkMessage header followed by
+ * the payload) in a byte ring whose capacity is a power of two. Head and
+ * tail are free-running counters published with release stores and read
+ * with acquire loads, so neither side ever waits for the other; a full
+ * ring makes send() return false instead.
+ */
+
+#ifndef CORE_LINK_H
+#define CORE_LINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+enum LinkKind : uint8_t {
+  LINK_CLOUD_OPEN,          // loop -> net: connect to the server; payload = path
+  LINK_CLOUD_TEXT,          // Text frame to or from the server
+  LINK_CLOUD_BINARY,        // loop -> net: binary uplink frame
+  LINK_CLOUD_CONNECTED,     // net -> loop: server link up
+  LINK_CLOUD_DISCONNECTED,  // net -> loop: server link down
+  LINK_DEVICE_TEXT,         // Text frame to or from a sub-device
+  LINK_DEVICE_BINARY,       // Compact frame to or from a sub-device
+  LINK_DEVICE_DISCONNECTED, // AsyncTCP -> loop: sub-device client gone
+  LINK_ALERT_TEXT,          // AsyncTCP -> loop: text alert frame (see alert_lane.h)
+  LINK_ALERT_BINARY,        // AsyncTCP -> loop: compact alert frame
+  LINK_DEVICE_FANOUT_TEXT,  // loop -> net: one text frame for many clients (see ws_fanout.h);
+                            // clientId = client count, payload = their IDs, then the frame
+  LINK_DEVICE_FANOUT_BINARY,// loop -> net: the same for a compact frame
+  LINK_SETUP,               // AsyncTCP -> loop: settings from the setup page; payload = HubConfig
+  LINK_DEVICE_CHECK,        // loop -> net: which of these bound clients are gone? (after a lost disconnect);
+                            // clientId = client count, payload = their IDs
+  LINK_DEVICE_GONE          // net -> loop: clients no longer connected; clientId = count, payload = IDs
+};
+
+struct LinkMessage {
+  uint8_t kind;             // LinkKind
+  uint16_t length;          // Payload bytes
+  uint32_t clientId;        // Sub-device client; NO_CLIENT on the cloud links
+  uint32_t ip;              // Sub-device address on inbound device messages, else 0;
+                            // on the alert links, micros() when the alert reached the hub (0: untimed)
+};
+
+class CoreLink {
+ public:
+  // buffer: capacity bytes, a power of two, owned by the caller
+  CoreLink(uint8_t* buffer, uint32_t capacity);
+
+  // Producer side. Returns false (and counts a drop) if the message does not fit.
+  bool send(LinkKind kind, uint32_t clientId, uint32_t ip, const void* data, size_t length);
+
+  // Consumer side. Returns false if empty. The payload is copied into data;
+  // message.length is the full length, which exceeds size if it was truncated.
+  bool receive(LinkMessage& message, uint8_t* data, size_t size);
+
+  bool empty() const;
+  uint32_t used() const;
+  uint32_t capacity() const { return capacity_; }
+  // Messages the producer could not fit (written only by the producer)
+  uint32_t dropped() const { return dropped_; }
+  // Most bytes ever waiting at once (written only by the producer)
+  uint32_t peakUsed() const { return peakUsed_; }
+
+ private:
+  void write(uint32_t position, const void* data, size_t length);
+  void read(uint32_t position, void* data, size_t length) const;
+
+  uint8_t* buffer_;
+  uint32_t capacity_;
+  std::atomic<uint32_t> head_;   // Next byte to read; advanced by the consumer
+  std::atomic<uint32_t> tail_;   // Next byte to write; advanced by the producer
+  uint32_t dropped_;
+  uint32_t peakUsed_;
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Device Journal - the device registry, persisted to LittleFS
+ *
+ * The registry itself is RAM only. The journal keeps a copy of it in an
+ * append-only file of device records, each the device's ID, type and
+ * status behind a small header with a CRC, so the hub knows its devices
+ * again straight after a reboot. A removed device gets a tombstone, a
+ * record with its ID alone. load() replays the file into the registry at
+ * boot, later records for an ID replacing earlier ones and tombstones
+ * removing them, and stops at the first record that does not check out
+ * (a write cut short by a reset).
+ *
+ * Nothing is written on the message paths. service() runs from the
+ * scheduler and uses the registry's own version numbers: every device
+ * whose version is above the last one journaled gets one record, however
+ * often its status changed in between. Versions cannot describe a
+ * removal (see DeviceRegistry::canDelta), so the caller reports each one
+ * through removed(), and service() writes its tombstone ahead of the
+ * changed devices. A removal that was not reported starts a compaction.
+ *
+ * Compaction only reclaims space, once the file has grown past
+ * JOURNAL_COMPACT_BYTES. It writes every live device to a new file a few
+ * records per service() call, walking the registry from the top index
+ * down: remove() only ever moves the last record into a lower hole, so a
+ * walk downward sees every device at least once. Changes and tombstones
+ * made meanwhile go to both files. The new file then replaces the old one
+ * with a rename, which LittleFS does atomically, so a reset at any point
+ * leaves one complete journal.
+ */
+
+#ifndef DEVICE_JOURNAL_H
+#define DEVICE_JOURNAL_H
+
+#include <Arduino.h>
+#include "device_registry.h"
+
+#define JOURNAL_PATH "/devices.log"
+#define JOURNAL_COMPACT_PATH "/devices.new"
+#define JOURNAL_FLUSH_INTERVAL 2000     // ms between service() calls; status changes in between coalesce
+#define JOURNAL_COMPACT_BYTES 8192      // File size that starts a compaction
+#define JOURNAL_COMPACT_BURST 16        // Records written to the new file per service() call
+#define JOURNAL_REMOVED_SLOTS 8         // Removals held for service(); more are written at once
+
+class DeviceJournal {
+ public:
+  DeviceJournal();
+
+  // Mount LittleFS and replay the journal into registry (which should be
+  // empty). Returns the number of devices restored.
+  int load(DeviceRegistry& registry);
+  // Append what changed since the last call, and advance a compaction
+  void service();
+  // deviceId has just been removed from the registry; its tombstone goes
+  // out with the next service() call
+  void removed(const char* deviceId);
+  // Delete the journal and stop writing it (factory reset; a restart follows)
+  void erase();
+
+  bool available() const { return fsReady_; }
+  bool compacting() const { return compacting_; }
+  // Time load() took, and what it found
+  uint32_t loadUs() const { return loadUs_; }
+  uint32_t loadedRecords() const { return loadedRecords_; }
+  int restoredDevices() const { return restoredDevices_; }
+  uint32_t fileBytes() const { return fileSize_; }
+  uint32_t recordsWritten() const { return recordsWritten_; }
+  uint32_t compactions() const { return compactions_; }
+
+ private:
+  struct RecordHeader {
+    uint8_t magic;      // JOURNAL_MAGIC for a device, JOURNAL_REMOVED_MAGIC for a tombstone
+    uint8_t length;     // Payload bytes: ID, type and status, each NUL-terminated
+    uint16_t crc;       // CRC-16 of the payload
+  };
+
+  // Encode the device at index into out; returns the record length
+  size_t encode(int index, uint8_t* out) const;
+  // Encode a tombstone for deviceId into out; returns the record length
+  size_t encodeRemoved(const char* deviceId, uint8_t* out) const;
+  // Append the pending tombstones, then the devices changed since
+  // journaledSeq_, to the file at path
+  bool appendChanges(const char* path, uint32_t* fileSize);
+  // Write what appendChanges() covers to the journal, and the new file if compacting
+  void flush();
+  // A removal since sinceSeq that removed() was not told about
+  bool unreportedRemoval(uint32_t sinceSeq) const;
+  void startCompaction();
+  void continueCompaction();
+
+  DeviceRegistry* registry_;
+  bool fsReady_;
+  uint32_t journaledSeq_;     // Registry sequence number the file is up to date with
+  uint32_t fileSize_;
+  bool compacting_;
+  bool compactPending_;       // The file has a torn record; rewrite it before appending
+  int compactNext_;           // Next registry index to copy, walking down
+  uint32_t compactSeq_;       // Registry sequence number when the compaction started
+  uint32_t compactSize_;
+  char removedIds_[JOURNAL_REMOVED_SLOTS][DEVICE_ID_LEN];
+  int removedCount_;          // Tombstones not written yet
+  uint32_t removedSeq_;       // Registry sequence number just after the last reported removal
+
+  uint32_t loadUs_;
+  uint32_t loadedRecords_;
+  int restoredDevices_;
+  uint32_t recordsWritten_;
+  uint32_t compactions_;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Device Registry - fixed-capacity table of registered sub-devices
+ *
+ * Records live in a dense array (so screens and status reports can walk
+ * them in order) and are indexed by two open-addressing hash tables:
+ * one keyed by the device ID string, one keyed by the WebSocket client ID
+ * the device is currently bound to. Device type strings are interned so
+ * each record only stores a one-byte type index.
+ *
+ * Every change to a device's reported fields (ID, type, status) takes the
+ * next value of a registry-wide sequence number and stores it as that
+ * device's version, so the devices changed since sequence N are the ones
+ * whose version is above N. Removals are not tracked individually; they
+ * raise the delta floor, and a delta from below the floor needs a full
+ * snapshot instead.
+ */
+
+#ifndef DEVICE_REGISTRY_H
+#define DEVICE_REGISTRY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define REGISTRY_CAPACITY 128   // Maximum number of registered sub-devices
+#define REGISTRY_SLOTS 256      // Hash slots per index (power of two, load <= 50%)
+#define DEVICE_ID_LEN 24        // Including terminating NUL
+#define DEVICE_STATUS_LEN 24    // Including terminating NUL
+#define DEVICE_TYPE_LEN 16      // Including terminating NUL
+#define MAX_DEVICE_TYPES 16     // Distinct interned device type strings
+#define NO_CLIENT 0             // AsyncWebSocket client IDs start at 1
+#define NO_DEVICE -1
+#define ENCODING_JSON 0         // Text frames
+#define ENCODING_COMPACT 1      // Binary compact frames (see compact_frame.h)
+
+struct DeviceRecord {
+  char id[DEVICE_ID_LEN];
+  char status[DEVICE_STATUS_LEN];
+  uint32_t idHash;      // FNV-1a hash of id, compared before strcmp
+  uint32_t ip;          // IPv4 address as stored by IPAddress
+  uint32_t clientId;    // Bound WebSocket client, NO_CLIENT if none
+  uint8_t typeIndex;    // Index into the interned type table
+  uint32_t version;     // Registry sequence number of the last reported change
+  uint8_t encoding;     // Frame encoding negotiated with the bound client
+  uint32_t lastSeen;    // millis() of the last frame from the device
+  bool online;          // Heard from within the liveness timeout
+};
+
+class DeviceRegistry {
+ public:
+  DeviceRegistry();
+
+  // Look up a device by ID; returns its index or NO_DEVICE
+  int find(const char* deviceId) const;
+  // Look up the device bound to a WebSocket client; returns its index or NO_DEVICE
+  int findByClient(uint32_t clientId) const;
+
+  // Add a device, or return the existing index if already registered,
+  // taking deviceType if it differs from the stored one.
+  // Returns NO_DEVICE when the registry is full or the ID is invalid.
+  int add(const char* deviceId, const char* deviceType, bool* isNew = nullptr);
+  // Remove a device. The last record is moved into the freed index.
+  bool remove(const char* deviceId);
+  void clear();
+
+  void setStatus(int index, const char* status);
+  void setIP(int index, uint32_t ip);
+  void setEncoding(int index, uint8_t encoding) { records_[index].encoding = encoding; }
+  // Bind a device to a client (replacing any previous binding on either side)
+  void bindClient(int index, uint32_t clientId);
+  // Drop the binding for a client ID; returns the device index it was bound to
+  int unbindClient(uint32_t clientId);
+
+  DeviceRecord& at(int index) { return records_[index]; }
+  const DeviceRecord& at(int index) const { return records_[index]; }
+  const char* typeName(int index) const { return types_[records_[index].typeIndex]; }
+  // Interned types by type index; indexes stay valid for the life of the registry
+  int typeCount() const { return numTypes_; }
+  const char* typeNameAt(uint8_t typeIndex) const { return types_[typeIndex]; }
+  // Sequence number of the most recent change
+  uint32_t seq() const { return seq_; }
+  // True if the devices with version > sinceSeq describe every change since sinceSeq
+  bool canDelta(uint32_t sinceSeq) const { return sinceSeq >= deltaFloor_ && sinceSeq <= seq_; }
+  // Order-independent hash of every device's ID, type and status
+  uint32_t digest() const;
+  int count() const { return count_; }
+  bool isFull() const { return count_ >= REGISTRY_CAPACITY; }
+
+  static uint32_t hashId(const char* deviceId);
+  // Continue an FNV-1a hash over another string
+  static uint32_t hashAppend(uint32_t hash, const char* text);
+
+ private:
+  static const int16_t SLOT_EMPTY = -1;
+  static const int16_t SLOT_DELETED = -2;
+
+  int idSlotOf(const char* deviceId, uint32_t hash) const;
+  int clientSlotOf(uint32_t clientId) const;
+  void insertIdSlot(uint32_t hash, int16_t index);
+  void insertClientSlot(uint32_t clientId, int16_t index);
+  void clearClientSlot(uint32_t clientId);
+  void rebuildIndexes();
+  uint8_t internType(const char* deviceType);
+
+  DeviceRecord records_[REGISTRY_CAPACITY];
+  int16_t idSlots_[REGISTRY_SLOTS];
+  int16_t clientSlots_[REGISTRY_SLOTS];
+  char types_[MAX_DEVICE_TYPES][DEVICE_TYPE_LEN];
+  uint8_t numTypes_;
+  int count_;
+  int deletedSlots_;
+  uint32_t seq_;
+  uint32_t deltaFloor_;   // Oldest sequence number a delta can start from
+};
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Hub Metrics - performance counters served at /metrics (Prometheus text format)
+ *
+ * Hot paths bump plain integer fields; nothing is formatted until a
+ * scrape. Counters are 32-bit and wrap, which Prometheus reads as a
+ * counter reset. Each task has its own set and is its only writer:
+ * `metrics` belongs to the loop task, `netMetrics` to the net task and
+ * `asyncTcpMetrics` to AsyncTCP (see core_link.h).
+ *
+ * The scrape runs on the AsyncTCP task and never reads another task's
+ * state. Once a second the loop and net tasks each copy what /metrics
+ * shows of theirs into a SeqLockSnapshot, and the scrape formats the last
+ * published copies (see handleMetrics in main.cpp).
+ *
+ * DurationHistogram keeps per-bucket counts for fixed upper bounds in
+ * microseconds and is exposed as a Prometheus histogram in seconds.
+ * MetricsWriter prints the text format straight to a Print (the request's
+ * AsyncResponseStream), so a scrape builds no String.
+ */
+
+#ifndef HUB_METRICS_H
+#define HUB_METRICS_H
+
+#include <Arduino.h>
+#include <atomic>
+#include <string.h>
+#include <type_traits>
+
+#define METRICS_MAX_BUCKETS 12     // Upper bounds per histogram, +Inf not included
+
+class DurationHistogram {
+ public:
+  // bounds: ascending upper bounds in microseconds; must outlive the histogram
+  DurationHistogram(const uint32_t* bounds, int count);
+
+  void observe(uint32_t us);
+
+  int bucketCount() const { return count_; }
+  uint32_t bound(int bucket) const { return bounds_[bucket]; }
+  // Observations in bucket i alone (not cumulative); bucketCount() is the +Inf bucket
+  uint32_t countIn(int bucket) const { return counts_[bucket]; }
+  uint32_t observations() const { return observations_; }
+  uint64_t sumUs() const { return sumUs_; }
+
+ private:
+  const uint32_t* bounds_;
+  int count_;
+  uint32_t counts_[METRICS_MAX_BUCKETS + 1];
+  uint32_t observations_;
+  uint64_t sumUs_;
+};
+
+struct TrafficCounters {
+  uint32_t messages;
+  uint32_t bytes;
+};
+
+struct HubMetrics {
+  TrafficCounters cloudRx;        // Server -> hub
+  TrafficCounters cloudTx;        // Hub -> server, as sent on the wire
+  uint32_t cloudTxJsonBytes;      // What cloudTx would have cost as JSON text
+  TrafficCounters localRx;        // Sub-devices -> hub
+  TrafficCounters localTx;        // Hub -> sub-devices
+  uint32_t jsonParseFailures;
+  uint32_t cloudConnects;         // Server WebSocket connections established
+  uint32_t wifiConnects;          // Internet WiFi connections established
+  uint32_t devicesOffline;        // Devices that missed their liveness deadline
+  uint32_t deviceFastBoots;       // Device boots that connected through the WiFi fast path
+  uint32_t heapMinLargestBlock;   // Low watermark of the largest free heap block
+  uint32_t firstForwardMs;        // millis() at the first command forwarded to a device; 0 until then
+  DurationHistogram loopUs;       // Loop task (core 1)
+  DurationHistogram sensorReadUs;
+  DurationHistogram deviceBootConnectUs;  // Boot to WiFi connected, from device registrations
+  DurationHistogram ruleActionUs; // Device frame taken from the inbox to its rule actions queued
+
+  HubMetrics();
+  // Update the heap watermarks; cheap enough to call every second
+  void sampleHeap();
+};
+
+struct NetMetrics {
+  DurationHistogram netLoopUs;    // Net task (core 0)
+  DurationHistogram alertCloudUs; // Alert frame received to its notification sent to the server
+
+  NetMetrics();
+};
+
+struct AsyncTcpMetrics {
+  DurationHistogram alertGpioUs;  // Alert frame received to ALARM_PIN driven (see alert_lane.h)
+
+  AsyncTcpMetrics();
+};
+
+extern HubMetrics metrics;          // Loop task
+extern NetMetrics netMetrics;       // Net task
+extern AsyncTcpMetrics asyncTcpMetrics;  // AsyncTCP task
+
+// The last copy of a T published by one task, readable from any other.
+// publish() never waits. read() retries while a publish is under way; a
+// reader on the writer's core that preempted it sleeps a tick so the
+// writer can finish.
+template <typename T>
+class SeqLockSnapshot {
+  static_assert(std::is_trivially_copyable<T>::value, "snapshots are copied with memcpy");
+
+ public:
+  SeqLockSnapshot() : sequence_(0) {}
+
+  void publish(const T& value) {
+    uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(&value_, &value, sizeof(T));
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Returns false until the first publish()
+  bool read(T& value) const {
+    for (;;) {
+      uint32_t before = sequence_.load(std::memory_order_acquire);
+      if ((before & 1) == 0) {
+        memcpy(&value, &value_, sizeof(T));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) == before) {
+          return before != 0;
+        }
+      }
+      vTaskDelay(1);
+    }
+  }
+
+ private:
+  std::atomic<uint32_t> sequence_;   // Odd while a publish is under way
+  T value_;
+};
+
+// Writes metrics in the Prometheus text exposition format
+class MetricsWriter {
+ public:
+  explicit MetricsWriter(Print& out) : out_(out) {}
+
+  // HELP and TYPE lines; once per metric name, before its samples
+  void header(const char* name, const char* type, const char* help);
+  // One sample; labels is the text between the braces (e.g. link="cloud"), or nullptr
+  void sample(const char* name, const char* labels, uint32_t value);
+  void sample(const char* name, const char* labels, float value);
+
+  // header() plus a single unlabelled sample
+  void counter(const char* name, const char* help, uint32_t value);
+  void gauge(const char* name, const char* help, uint32_t value);
+  // Histogram in seconds: cumulative buckets, +Inf, sum and count
+  void histogram(const char* name, const char* help, const DurationHistogram& histogram);
+
+ private:
+  Print& out_;
+};
+
+#endif
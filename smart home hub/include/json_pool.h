@@ -0,0 +1,87 @@
+/*
+ * JSON Document Pool - preallocated ArduinoJson documents for message handling
+ *
+ * Each pooled document draws its memory from its own fixed arena instead of
+ * the heap. Leasing a document resets the arena, so parsing a frame and
+ * building a reply never touch malloc. Strings read from a leased document
+ * (doc["deviceId"] | "") point into the arena and stay valid until the
+ * lease ends, so handlers pass them around as plain const char* views.
+ */
+
+#ifndef JSON_POOL_H
+#define JSON_POOL_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define JSON_ARENA_SIZE 4096   // Bytes per pooled document
+#define JSON_POOL_SIZE 4       // Leases held at once: a parse and the replies built while handling it
+
+// Bump allocator over a fixed buffer; reset() frees everything at once
+class ArenaAllocator : public ArduinoJson::Allocator {
+ public:
+  ArenaAllocator();
+
+  void* allocate(size_t size) override;
+  void deallocate(void* ptr) override;
+  void* reallocate(void* ptr, size_t newSize) override;
+  void reset();
+
+  size_t used() const { return used_; }
+  size_t peak() const { return peak_; }
+  uint32_t failures() const { return failures_; }
+
+ private:
+  alignas(8) uint8_t buffer_[JSON_ARENA_SIZE];
+  size_t used_;
+  size_t last_;       // Offset of the most recent block (can grow/shrink in place)
+  size_t peak_;
+  uint32_t failures_;
+};
+
+class JsonDocPool {
+ public:
+  JsonDocPool();
+
+  // Returns a cleared document, or nullptr if all are leased
+  JsonDocument* acquire();
+  void release(JsonDocument* doc);
+
+  // Largest arena use seen by any document, and allocations that did not fit
+  size_t peakBytes() const;
+  uint32_t allocFailures() const;
+  uint32_t exhausted() const { return exhausted_; }
+
+ private:
+  struct Slot {
+    Slot() : doc(&arena), inUse(false) {}
+    ArenaAllocator arena;  // Declared first: doc keeps a pointer to it
+    JsonDocument doc;
+    bool inUse;
+  };
+
+  Slot slots_[JSON_POOL_SIZE];
+  uint32_t exhausted_;
+};
+
+// Scoped lease on a pooled document
+class JsonDocLease {
+ public:
+  explicit JsonDocLease(JsonDocPool &pool) : pool_(pool), doc_(pool.acquire()) {}
+  ~JsonDocLease() { if (doc_) pool_.release(doc_); }
+
+  explicit operator bool() const { return doc_ != nullptr; }
+  JsonDocument& operator*() { return *doc_; }
+  JsonDocument* operator->() { return doc_; }
+
+ private:
+  JsonDocLease(const JsonDocLease&) = delete;
+  JsonDocLease& operator=(const JsonDocLease&) = delete;
+
+  JsonDocPool &pool_;
+  JsonDocument *doc_;
+};
+
+extern JsonDocPool jsonPool;
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * LCD Frame Buffer - shadow copy of the 4x16 character LCD
+ *
+ * Screens print into the shadow buffer exactly as they would print to the
+ * LCD (it is a Print, so print/printf work unchanged). refresh() compares the
+ * shadow buffer with what the LCD is known to show and sends only the cells
+ * that changed. There is no lcd.clear(), so nothing flickers and an unchanged
+ * screen costs no I2C traffic at all. The hub calls refresh() from a scheduler
+ * task every LCD_REFRESH_MS, which sets the refresh rate.
+ */
+
+#ifndef LCD_FRAMEBUFFER_H
+#define LCD_FRAMEBUFFER_H
+
+#include <Arduino.h>
+#include <LiquidCrystal_I2C.h>
+
+#define LCD_FB_COLS 16
+#define LCD_FB_ROWS 4
+#ifndef LCD_REFRESH_MS
+#define LCD_REFRESH_MS 200          // Time between refreshes (override with -D)
+#endif
+#define LCD_I2C_BYTES_PER_WRITE 6   // PCF8574 backpack: 2 nibbles x (data, EN high, EN low)
+
+class LcdFrameBuffer : public Print {
+ public:
+  explicit LcdFrameBuffer(LiquidCrystal_I2C &lcd);
+
+  // Drawing into the shadow buffer (no I2C traffic)
+  void clear();
+  void setCursor(uint8_t col, uint8_t row);
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  // Send the cells that differ from what the LCD shows
+  void refresh();
+  // Forget what the LCD shows so the next refresh redraws every cell
+  void invalidate();
+
+  // I2C bytes actually sent, and bytes a full clear-and-redraw would have added
+  uint32_t i2cBytesSent() const { return i2cBytesSent_; }
+  uint32_t i2cBytesSaved() const { return i2cBytesSaved_; }
+
+ private:
+  LiquidCrystal_I2C &lcd_;
+  char shadow_[LCD_FB_ROWS][LCD_FB_COLS];  // What the screens want shown
+  char front_[LCD_FB_ROWS][LCD_FB_COLS];   // What the LCD currently shows
+  uint8_t cursorCol_;
+  uint8_t cursorRow_;
+  uint32_t i2cBytesSent_;
+  uint32_t i2cBytesSaved_;
+};
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Message Types - the "type" values of the hub protocol, hashed at compile time
+ *
+ * Every message type the hub understands is listed once below as a
+ * constexpr FNV-1a hash of its string. The cloud and sub-device handlers
+ * hash the incoming "type" field once and switch on the result, so a
+ * message reaches its handler through a single jump instead of a chain of
+ * string compares. Because the values are used as case labels, two types
+ * that hash alike fail to compile ("duplicate case value").
+ */
+
+#ifndef MESSAGE_TYPES_H
+#define MESSAGE_TYPES_H
+
+#include <stdint.h>
+
+// 32-bit FNV-1a (same function as DeviceRegistry::hashId), usable at compile time
+constexpr uint32_t msgTypeHash(const char* type, uint32_t hash = 2166136261u) {
+  return *type ? msgTypeHash(type + 1, (hash ^ (uint8_t)*type) * 16777619u) : hash;
+}
+
+// Cloud server -> hub
+constexpr uint32_t MSG_CONTROL = msgTypeHash("control");
+constexpr uint32_t MSG_STATUS_REQUEST = msgTypeHash("status_request");
+constexpr uint32_t MSG_ALARM = msgTypeHash("alarm");
+constexpr uint32_t MSG_AUTH_RESPONSE = msgTypeHash("auth_response");
+constexpr uint32_t MSG_RULES = msgTypeHash("rules");
+constexpr uint32_t MSG_REMOVE_DEVICE = msgTypeHash("remove_device");
+
+// Sub-device -> hub
+constexpr uint32_t MSG_REGISTRATION = msgTypeHash("registration");
+constexpr uint32_t MSG_STATUS = msgTypeHash("status");
+constexpr uint32_t MSG_ALERT = msgTypeHash("alert");
+constexpr uint32_t MSG_HEARTBEAT = msgTypeHash("heartbeat");
+constexpr uint32_t MSG_POSITION_UPDATE = msgTypeHash("position_update");
+constexpr uint32_t MSG_ACK = msgTypeHash("ack");
+
+// Local rule events (see rule_engine.h); "alert" and "status" reuse the message types
+constexpr uint32_t RULE_EVENT_OFFLINE = msgTypeHash("offline");
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Rule Engine - local automation rules, evaluated on the hub
+ *
+ * A rule says: on event E (alert, status change, offline) from one device,
+ * or from any device of one type, optionally only when the event's value
+ * (alert type, new status) equals a given string, run a list of actions
+ * (send a command to a device, set the hub alarm). The hub runs them as
+ * soon as it has handled the event, without waiting for the cloud.
+ *
+ * Rules arrive from the server as JSON and are compiled into a RuleTable:
+ * fixed arrays of rules and actions, every string in one pool addressed
+ * by offset, and an open-addressing index from (source hash, event hash)
+ * to the first rule of a chain sharing that key. The table holds no
+ * pointers, so it is stored in flash as it is, behind a header with a
+ * CRC, and read back at boot in one piece.
+ *
+ * evaluate() looks up the device's own chain and its type's chain, so the
+ * cost of an event is the rules that could match it, not the rule count.
+ *
+ * An update is built in a second table (beginUpdate(), addRule(),
+ * addAction()) and replaces the active one only when commitUpdate() has
+ * written it to flash, so a failed or partial update leaves the old rules
+ * running. Everything runs on the loop task.
+ */
+
+#ifndef RULE_ENGINE_H
+#define RULE_ENGINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RULE_CAPACITY 32          // Rules per table
+#define RULE_ACTION_CAPACITY 64   // Actions per table, over all rules
+#define RULE_POOL_SIZE 1024       // String bytes per table
+#define RULE_INDEX_SLOTS 64       // Power of two, at least twice RULE_CAPACITY
+#define RULES_PATH "/rules.bin"
+#define RULES_UPDATE_PATH "/rules.new"
+#define NO_RULE -1
+#define RULE_ANY_VALUE 0xFFFF     // Rule::match of a rule that matches any value
+
+enum RuleSource : uint8_t {
+  RULE_SOURCE_DEVICE,     // Source is a device ID
+  RULE_SOURCE_TYPE        // Source is a device type
+};
+
+enum RuleActionKind : uint8_t {
+  RULE_ACTION_COMMAND,    // Send command to deviceId
+  RULE_ACTION_ALARM       // Set the hub alarm to state
+};
+
+struct RuleAction {
+  uint8_t kind;           // RuleActionKind
+  uint8_t state;
+  uint16_t deviceId;      // Pool offsets
+  uint16_t command;
+};
+
+struct Rule {
+  uint32_t sourceHash;    // FNV-1a of the device ID or type
+  uint32_t eventHash;     // msgTypeHash() of the event name
+  uint16_t match;         // Pool offset of the required value; RULE_ANY_VALUE if none
+  uint8_t source;         // RuleSource
+  uint8_t firstAction;
+  uint8_t actionCount;
+  int8_t next;            // Next rule with the same source and event; NO_RULE ends the chain
+};
+
+struct RuleTable {
+  uint32_t version;       // Set by the server; 0 means no rules were ever received
+  uint16_t ruleCount;
+  uint16_t actionCount;
+  uint16_t poolUsed;
+  int8_t index[RULE_INDEX_SLOTS];   // First rule of each chain, NO_RULE if empty
+  Rule rules[RULE_CAPACITY];
+  RuleAction actions[RULE_ACTION_CAPACITY];
+  char pool[RULE_POOL_SIZE];
+};
+
+// Called once per action of every matching rule
+typedef void (*RuleActionCallback)(uint8_t kind, const char* deviceId, const char* command, bool state);
+
+class RuleEngine {
+ public:
+  RuleEngine();
+
+  // Load the stored table; LittleFS must already be mounted
+  void begin();
+
+  // Run the actions of every rule matching the event; returns the number of rules that fired
+  int evaluate(uint32_t eventHash, const char* deviceId, const char* deviceType, const char* value,
+               RuleActionCallback callback);
+
+  // Start building a new table
+  void beginUpdate(uint32_t version);
+  // Append a rule; nullptr match matches any value. Returns false (and fails the update) if it does not fit
+  bool addRule(const char* event, RuleSource source, const char* sourceName, const char* match);
+  // Append an action to the rule added last
+  bool addAction(RuleActionKind kind, const char* deviceId, const char* command, bool state);
+  // Index and store the new table, then make it the active one; false if anything failed
+  bool commitUpdate();
+  // Drop the table being built
+  void abortUpdate() { updating_ = false; }
+  bool updating() const { return updating_; }
+  uint32_t updateVersion() const { return updating_ ? tables_[1 - active_].version : 0; }
+  // Why the update failed, for the reply to the server
+  const char* error() const { return error_; }
+
+  uint32_t version() const { return tables_[active_].version; }
+  int ruleCount() const { return tables_[active_].ruleCount; }
+  uint32_t evaluations() const { return evaluations_; }
+  uint32_t fired() const { return fired_; }
+
+ private:
+  int chainOf(const RuleTable& table, uint32_t sourceHash, uint32_t eventHash, uint8_t source) const;
+  void buildIndex(RuleTable& table);
+  bool store(const RuleTable& table);
+  uint16_t intern(RuleTable& table, const char* text);
+  bool fail(const char* error);
+
+  RuleTable tables_[2];
+  int active_;
+  bool updating_;
+  const char* error_;
+  uint32_t evaluations_;
+  uint32_t fired_;
+};
+
+#endif
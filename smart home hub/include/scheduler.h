@@ -0,0 +1,58 @@
+/*
+ * Scheduler - cooperative millis()-based task runner for the hub loop
+ *
+ * Every periodic job in the hub is registered here and called from loop()
+ * once its interval has elapsed. Tasks must return quickly: anything that
+ * used to wait (WiFi connect, debounce, timed LCD screens) is written as a
+ * small state machine that checks a millis() deadline and returns.
+ *
+ * The scheduler also times each loop iteration so the worst case can be
+ * reported (it should stay well under 10 ms).
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define MAX_SCHEDULER_TASKS 16
+#define NO_TASK -1
+
+typedef void (*TaskCallback)();
+
+struct SchedulerTask {
+  const char* name;
+  TaskCallback callback;
+  uint32_t intervalMs;  // 0 = run on every loop iteration
+  uint32_t lastRunMs;
+  uint32_t maxRunUs;    // Longest single run, to spot the task stalling the loop
+};
+
+class Scheduler {
+ public:
+  Scheduler();
+
+  // Register a task; returns its ID or NO_TASK if the table is full
+  int addTask(const char* name, TaskCallback callback, uint32_t intervalMs);
+
+  // Run every due task once; call this from loop()
+  void run();
+
+  uint32_t lastLoopUs() const { return lastLoopUs_; }
+  uint32_t maxLoopUs() const { return maxLoopUs_; }
+  uint32_t loopCount() const { return loopCount_; }
+  // Start a new worst-case window (e.g. after it has been reported)
+  void resetLoopStats();
+
+  const SchedulerTask& task(int taskId) const { return tasks_[taskId]; }
+  int taskCount() const { return numTasks_; }
+
+ private:
+  SchedulerTask tasks_[MAX_SCHEDULER_TASKS];
+  int numTasks_;
+  uint32_t lastLoopUs_;
+  uint32_t maxLoopUs_;
+  uint32_t loopCount_;
+};
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Timer Wheel - hashed timing wheel for per-device deadlines
+ *
+ * Timers are identified by a small integer (the registry index of the
+ * device) and kept in intrusive doubly linked lists, one per wheel slot,
+ * so arming, re-arming and disarming are O(1). Each tick visits a single
+ * slot; with TIMER_WHEEL_SLOTS ticks spanning more than any deadline in
+ * use, every timer in that slot is due, so the cost of a tick is the
+ * number of timers firing, not the number armed. A deadline further out
+ * than one turn of the wheel stays in its slot until its turn comes.
+ *
+ * The wheel keeps its own tick count from elapsed millis(), so it is not
+ * disturbed by the 49-day wrap.
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_registry.h"
+
+#define TIMER_WHEEL_SLOTS 128          // Power of two; slots * tick is one turn of the wheel
+#define TIMER_WHEEL_TICK_MS 1000       // Deadline resolution
+#define TIMER_WHEEL_TIMERS REGISTRY_CAPACITY
+
+class TimerWheel {
+ public:
+  TimerWheel();
+
+  // Start counting ticks from now; call once before arming timers
+  void begin(uint32_t now);
+  // Fire timer id once delayMs has passed (rounded up to a whole tick),
+  // replacing any deadline it already had
+  void arm(int id, uint32_t delayMs);
+  void disarm(int id);
+  bool armed(int id) const { return timers_[id].armed; }
+  int armedCount() const { return armedCount_; }
+
+  // Run the ticks that have elapsed by now and collect up to max fired
+  // timer IDs in fired; returns how many. Fired timers are disarmed.
+  // Ticks left over when fired fills up run on the next call.
+  int advance(uint32_t now, int16_t* fired, int max);
+
+ private:
+  static const int16_t NO_TIMER = -1;
+
+  struct Timer {
+    int16_t next;
+    int16_t prev;
+    uint32_t deadlineTick;
+    bool armed;
+  };
+
+  void link(int id);
+  void unlink(int id);
+
+  Timer timers_[TIMER_WHEEL_TIMERS];
+  int16_t slots_[TIMER_WHEEL_SLOTS];   // Head of each slot's list
+  uint32_t currentTick_;               // Last tick that has run
+  uint32_t tickStartMs_;               // millis() at which currentTick_ began
+  int armedCount_;
+};
+
+#endif
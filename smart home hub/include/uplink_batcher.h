@@ -0,0 +1,83 @@
+/*
+ * Uplink Batcher - coalesces non-urgent hub-to-cloud events into one frame
+ *
+ * Status changes, device additions, offline notices and heartbeats are
+ * queued here instead of each being sent as its own frame. A batch is
+ * flushed once its oldest event has waited UPLINK_BATCH_WINDOW_MS or
+ * UPLINK_BATCH_MAX_EVENTS events are pending. Only the latest status of each device is kept, so a chatty
+ * device costs one entry per window; the kept entry moves to the back of
+ * the batch, so events still reach the cloud in the order they happened.
+ * Alerts never go through the batcher.
+ */
+
+#ifndef UPLINK_BATCHER_H
+#define UPLINK_BATCHER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "device_registry.h"
+
+#ifndef UPLINK_BATCH_WINDOW_MS
+#define UPLINK_BATCH_WINDOW_MS 100   // Longest an event waits for company
+#endif
+#ifndef UPLINK_BATCH_MAX_EVENTS
+#define UPLINK_BATCH_MAX_EVENTS 8    // Flush early once this many are pending
+#endif
+#define UPLINK_BATCH_CAPACITY 16     // Pending events held at most
+
+enum UplinkKind : uint8_t {
+  UPLINK_DEVICE_STATUS,  // value = status; coalesced per device
+  UPLINK_DEVICE_ADDED,   // value = device type
+  UPLINK_HEARTBEAT,      // no payload; built when the batch is sent
+  UPLINK_DEVICE_OFFLINE  // no payload; the device missed its liveness deadline
+};
+
+struct UplinkEvent {
+  UplinkKind kind;
+  char deviceId[DEVICE_ID_LEN];
+  char value[DEVICE_STATUS_LEN];
+  uint32_t queuedAt;     // millis() when the entry was first queued
+};
+
+class UplinkBatcher {
+ public:
+  UplinkBatcher(uint32_t windowMs = UPLINK_BATCH_WINDOW_MS, int maxEvents = UPLINK_BATCH_MAX_EVENTS);
+
+  // Queue an event at the back, dropping a pending one of the same kind and device.
+  // Returns true when the batch is full and should be flushed now.
+  bool add(UplinkKind kind, const char* deviceId, const char* value, uint32_t now);
+  // True once the oldest pending event has waited the full window
+  bool due(uint32_t now) const;
+  // Move up to max pending events into out and record their latency
+  int take(UplinkEvent* out, int max, uint32_t now);
+  // Record one frame sent for a batch taken with take()
+  void frameSent() { framesSent_++; }
+
+  int pending() const { return count_; }
+  uint32_t windowMs() const { return windowMs_; }
+
+  uint32_t eventsQueued() const { return eventsQueued_; }
+  uint32_t eventsCoalesced() const { return eventsCoalesced_; }
+  uint32_t eventsDropped() const { return eventsDropped_; }
+  uint32_t framesSent() const { return framesSent_; }
+  // Frames avoided compared with sending one frame per event
+  uint32_t framesSaved() const { return eventsSent_ + eventsCoalesced_ - framesSent_; }
+  uint32_t avgLatencyMs() const { return eventsSent_ ? latencyTotalMs_ / eventsSent_ : 0; }
+  uint32_t maxLatencyMs() const { return maxLatencyMs_; }
+
+ private:
+  UplinkEvent events_[UPLINK_BATCH_CAPACITY];
+  int count_;
+  uint32_t windowMs_;
+  int maxEvents_;
+
+  uint32_t eventsQueued_;
+  uint32_t eventsCoalesced_;
+  uint32_t eventsDropped_;
+  uint32_t eventsSent_;
+  uint32_t framesSent_;
+  uint32_t latencyTotalMs_;
+  uint32_t maxLatencyMs_;
+};
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * Uplink Codec - binary encoding for hub -> server frames
+ *
+ * When the server accepts it at authentication, the hub sends its uplink
+ * messages as binary WebSocket frames instead of JSON text. A binary frame
+ * is the same message as a MessagePack map, minus "hubId" (the server
+ * knows it from the /ws/hub/<hubId> path), with repeated strings replaced
+ * by references into a dictionary that both ends build up during the
+ * session:
+ *
+ *   ext type 2 (ext 8)        defines a string: the payload is the text,
+ *                             which becomes the next dictionary entry and
+ *                             also stands for that string where it appears
+ *   ext type 1 (fixext 1/2)   refers to entry N (big-endian index)
+ *   positive int as map key   also refers to entry N (JSON keys are never ints)
+ *
+ * The hub puts every map key and the values of identifier fields (type,
+ * deviceId, deviceType, id, alertType) in the dictionary, so a device ID
+ * crosses the link once per session and costs three bytes after that.
+ * Numbers keep their MessagePack type; non-integers are sent as float32.
+ *
+ * The dictionary starts empty on every connection. Entries added by a frame
+ * that could not be sent are rolled back, so both ends stay in step as long
+ * as every frame the encoder commits reaches the server in order.
+ *
+ * UplinkDecoder is the reference decoder: it turns a binary frame back into
+ * the JSON text the hub would have sent (still without "hubId").
+ */
+
+#ifndef UPLINK_CODEC_H
+#define UPLINK_CODEC_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#define UPLINK_ENCODING_NAME "msgpack-dict/1"
+#define UPLINK_DICT_ENTRIES 128          // Entries per session; later strings are sent as text
+#define UPLINK_DICT_STRING_MAX 23        // Longer strings never enter the dictionary
+#define UPLINK_CODEC_MAX_DEPTH 8         // Nesting limit for maps and arrays
+
+#define UPLINK_EXT_REF 1
+#define UPLINK_EXT_DEF 2
+
+class UplinkEncoder {
+ public:
+  UplinkEncoder();
+
+  // Start a new session with an empty dictionary
+  void reset();
+
+  // Encode one message, leaving out its top-level omitKey (may be nullptr).
+  // Returns the frame length, or 0 if it did not fit; new dictionary entries
+  // stay pending until commit() or rollback()
+  size_t encode(JsonVariantConst message, const char* omitKey, uint8_t* out, size_t size);
+  // The last encoded frame was sent: its new entries are now known to the server
+  void commit();
+  // The last encoded frame was not sent: forget its new entries
+  void rollback();
+
+  int entries() const { return committed_; }
+
+ private:
+  void writeValue(JsonVariantConst value, bool identifier, int depth);
+  void writeMap(JsonObjectConst object, const char* omitKey, int depth);
+  void writeString(const char* text, bool dictionary, bool key);
+  void writeRawString(const char* text, size_t length);
+  void writeInt(int64_t value);
+  void writeHeader(uint8_t fixBase, uint8_t tag16, uint8_t tag32, size_t count);
+  int lookup(const char* text, size_t length, uint32_t hash) const;
+  void writeByte(uint8_t value);
+  void writeBytes(const void* data, size_t length);
+  void writeBigEndian(uint32_t value, int bytes);
+
+  char strings_[UPLINK_DICT_ENTRIES][UPLINK_DICT_STRING_MAX + 1];
+  uint32_t hashes_[UPLINK_DICT_ENTRIES];
+  int committed_;   // Entries the server has seen
+  int count_;       // Entries including those pending in the last frame
+
+  uint8_t* out_;
+  size_t size_;
+  size_t length_;
+  bool overflow_;
+};
+
+class UplinkDecoder {
+ public:
+  UplinkDecoder();
+
+  // Start a new session with an empty dictionary
+  void reset();
+
+  // Decode one binary frame into NUL-terminated JSON text. Returns the text
+  // length, or 0 if the frame is malformed or the text does not fit
+  size_t decode(const uint8_t* frame, size_t length, char* json, size_t size);
+
+  int entries() const { return count_; }
+
+ private:
+  bool readValue(bool key, int depth);
+  bool readString(size_t length);
+  bool readExt(uint8_t type, size_t length);
+  bool readBigEndian(int bytes, uint64_t& value);
+  bool emitEntry(uint32_t index);
+  void emitText(const char* text, size_t length);
+  void emit(const char* text);
+  void emitChar(char c);
+
+  char strings_[UPLINK_DICT_ENTRIES][UPLINK_DICT_STRING_MAX + 1];
+  int count_;
+
+  const uint8_t* in_;
+  size_t inLength_;
+  size_t pos_;
+  char* out_;
+  size_t size_;
+  size_t length_;
+  bool overflow_;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Uplink Queue - store-and-forward buffer for frames bound for the cloud
+ *
+ * Frames that cannot be sent right away (server link down, not yet
+ * authenticated, or older frames still waiting) are queued here and
+ * drained in order once the hub is authenticated again.
+ *
+ * New frames go into a RAM ring. When the ring is full its oldest records
+ * are spilled to an append-only segment file on LittleFS, so the file
+ * always holds older frames than the ring and draining reads the file
+ * first, then the ring. The segment is deleted once fully drained. If a
+ * spill write fails partway (flash full), the torn record is left past the
+ * last good one and spilling pauses until the segment has drained.
+ *
+ * Priority decides what survives when space runs out: a spilled record is
+ * dropped once the segment reaches UPLINK_SPILL_MAX_BYTES unless it is
+ * UPLINK_PRIORITY_HIGH, which may use an extra UPLINK_SPILL_HIGH_RESERVE.
+ * Without a filesystem, a full ring drops its oldest record unless that
+ * record outranks the new one, in which case the new frame is dropped.
+ */
+
+#ifndef UPLINK_QUEUE_H
+#define UPLINK_QUEUE_H
+
+#include <Arduino.h>
+
+#define UPLINK_QUEUE_RAM_BYTES 8192      // RAM ring size, record headers included
+#define UPLINK_SPILL_PATH "/uplink.seg"
+#define UPLINK_SPILL_MAX_BYTES 49152     // Segment size at which normal records are dropped
+#define UPLINK_SPILL_HIGH_RESERVE 16384  // Extra segment space only high priority may use
+
+enum UplinkPriority : uint8_t {
+  UPLINK_PRIORITY_LOW,     // Status updates, heartbeats: superseded by later ones
+  UPLINK_PRIORITY_NORMAL,  // Device additions, status snapshots
+  UPLINK_PRIORITY_HIGH     // Alerts
+};
+
+class UplinkQueue {
+ public:
+  UplinkQueue();
+
+  // Mount LittleFS; a segment left from before a reboot is discarded
+  void begin();
+
+  // Queue a frame; returns false if it (or nothing at all) could be kept
+  bool push(const char* data, size_t length, UplinkPriority priority);
+  // Copy the oldest frame into out; returns its length, or 0 if the queue is empty
+  size_t peek(char* out, size_t size);
+  // Remove the frame returned by the last peek() after it was sent
+  void pop();
+
+  bool empty();
+  uint32_t depth() const { return ramCount_ + fileCount_; }
+  uint32_t spilledDepth() const { return fileCount_; }
+  bool spillAvailable() const { return fsReady_ && !spillBlocked_; }
+
+  uint32_t dropped() const { return dropped_; }
+  uint32_t spilled() const { return spilled_; }
+  uint32_t drainedFrames() const { return drainedFrames_; }
+  uint32_t drainedBytes() const { return drainedBytes_; }
+
+ private:
+  struct RecordHeader {
+    uint16_t length;
+    uint8_t priority;
+    uint8_t reserved;
+  };
+
+  size_t ramFree() const { return UPLINK_QUEUE_RAM_BYTES - ramUsed_; }
+  void ringWrite(size_t offset, const void* data, size_t length);
+  void ringRead(size_t offset, void* data, size_t length) const;
+  void dropRamHead();
+  // Make room by spilling or dropping the oldest RAM record; false if the new frame must go instead
+  bool evictRamHead(UplinkPriority incoming);
+  bool appendToSpill(const RecordHeader& header, size_t ringOffset);
+  void resetSegment();
+
+  uint8_t ring_[UPLINK_QUEUE_RAM_BYTES];
+  size_t ramHead_;
+  size_t ramUsed_;
+  uint32_t ramCount_;
+
+  bool fsReady_;
+  bool spillBlocked_;        // A torn record ends the segment; no appends until it drains
+  uint32_t fileSize_;        // Bytes appended to the segment
+  uint32_t fileReadOffset_;  // Start of the oldest undrained record
+  uint32_t fileCount_;
+  size_t peekedLength_;      // Record size (header included) of the last peek, 0 if none
+  bool peekedFromFile_;
+
+  uint32_t dropped_;
+  uint32_t spilled_;
+  uint32_t drainedFrames_;
+  uint32_t drainedBytes_;
+
+};
+
+#endif
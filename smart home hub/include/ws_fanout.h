@@ -0,0 +1,71 @@
+/*
+ * WebSocket Fan-out - one frame to many sub-devices from a single shared copy
+ *
+ * Sending a frame with client->text(data, length) gives every client its
+ * own copy of the payload, so a frame for N devices held N copies on the
+ * heap until the slowest of them had taken it. Here the frame is copied
+ * once into a reference-counted buffer, the std::shared_ptr inside an
+ * AsyncWebSocketMessageBuffer, and each client queues only a small
+ * message that points at it. The buffer is freed when the last of those
+ * messages has been sent or discarded.
+ *
+ * (ws.makeBuffer() hands out that buffer wrapped, but client->text() on
+ * the wrapper takes it over and deletes it, so it cannot be queued on a
+ * second client; the fan-out keeps the shared_ptr itself instead.)
+ *
+ * A client that is not keeping up never holds the sender back. One with
+ * FANOUT_SKIP_QUEUE or more messages already waiting is skipped for this
+ * frame. One whose queue is full (WS_MAX_QUEUED_MESSAGES in the library)
+ * has stopped reading altogether and is closed; the device reconnects
+ * and registers again.
+ *
+ * The loop task names the clients (see sendToDevices in main.cpp), since
+ * it knows which devices are bound to which connections. The fan-out
+ * itself runs on the net task, which owns all sends to sub-devices (see
+ * core_link.h). lastHeapBytes() is the drop in free heap across the last
+ * fan-out, so the real cost of a frame sent to many devices can be read
+ * from /metrics.
+ *
+ * The server's client list belongs to AsyncTCP: it adds a client before
+ * raising WS_EVT_CONNECT, and unlinks one and raises WS_EVT_DISCONNECT
+ * before freeing it. The hub's event handler holds wsClientsLock (in
+ * main.cpp) for every event, and the net task holds it while it looks
+ * clients up and queues frames on them, so a client found under the lock
+ * stays valid until the lock is let go.
+ */
+
+#ifndef WS_FANOUT_H
+#define WS_FANOUT_H
+
+#include <Arduino.h>
+#include <AsyncWebSocket.h>
+
+#define FANOUT_MAX_CLIENTS 64        // Clients named in one fan-out message on deviceOutbox
+#define FANOUT_SKIP_QUEUE 8          // Messages waiting at which a client misses a fan-out
+
+class WsFanout {
+ public:
+  explicit WsFanout(AsyncWebSocket& ws);
+
+  // Queue one frame on each of the given clients; returns how many it was queued on.
+  // Call with wsClientsLock held.
+  uint32_t send(const uint32_t* clientIds, int count, const uint8_t* data, size_t length, bool binary);
+
+  uint32_t fanouts() const { return fanouts_; }       // Frames fanned out
+  uint32_t queued() const { return queued_; }         // Client sends queued from them
+  uint32_t skipped() const { return skipped_; }       // Client sends skipped: queue too long
+  uint32_t closed() const { return closed_; }         // Clients closed: queue full
+  uint32_t lastClients() const { return lastClients_; }
+  int32_t lastHeapBytes() const { return lastHeapBytes_; }
+
+ private:
+  AsyncWebSocket& ws_;
+  uint32_t fanouts_;
+  uint32_t queued_;
+  uint32_t skipped_;
+  uint32_t closed_;
+  uint32_t lastClients_;
+  int32_t lastHeapBytes_;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include "alert_lane.h"
+
+#include <string.h>
+#include <compact_frame.h>
+
+static const char ALERT_TEXT_PREFIX[] = "{\"type\":\"alert\"";
+
+bool isAlertFrame(const uint8_t* data, size_t length, bool binary) {
+  if (binary) {
+    return CompactReader(data, length).type() == FRAME_ALERT;
+  }
+  const size_t prefixLength = sizeof(ALERT_TEXT_PREFIX) - 1;
+  return length > prefixLength && memcmp(data, ALERT_TEXT_PREFIX, prefixLength) == 0 &&
+         (data[prefixLength] == ',' || data[prefixLength] == '}');
+}
+
+AlertBacklog::AlertBacklog() {
+  head_ = 0;
+  count_ = 0;
+  held_ = 0;
+}
+
+bool AlertBacklog::push(const char* frame, size_t length) {
+  if (count_ >= ALERT_BACKLOG_SLOTS || length > ALERT_FRAME_SIZE) {
+    return false;
+  }
+  int slot = (head_ + count_) % ALERT_BACKLOG_SLOTS;
+  memcpy(frames_[slot], frame, length);
+  lengths_[slot] = length;
+  count_++;
+  held_++;
+  return true;
+}
+
+const char* AlertBacklog::peek(size_t& length) const {
+  if (count_ == 0) {
+    return nullptr;
+  }
+  length = lengths_[head_];
+  return frames_[head_];
+}
+
+void AlertBacklog::pop() {
+  if (count_ == 0) {
+    return;
+  }
+  head_ = (head_ + 1) % ALERT_BACKLOG_SLOTS;
+  count_--;
+}
+
+bool holdAlert(AlertBacklog& backlog, UplinkQueue& queue, const char* frame, size_t length) {
+  // Only a full backlog puts the alert behind older frames
+  return backlog.push(frame, length) || queue.push(frame, length, UPLINK_PRIORITY_HIGH);
+}
@@ -0,0 +1,78 @@
+#include "battery_monitor.h"
+
+#define DEFAULT_VREF_MV 1100    // Used only on chips with no calibration in eFuse
+
+// Resting voltage of one LiPo cell against its remaining charge, highest first
+static const struct {
+  float volts;
+  float percent;
+} LIPO_CURVE[] = {
+  {4.20f, 100}, {4.15f, 95}, {4.11f, 90}, {4.08f, 85}, {4.02f, 80}, {3.98f, 75},
+  {3.95f, 70}, {3.91f, 65}, {3.87f, 60}, {3.85f, 55}, {3.84f, 50}, {3.82f, 45},
+  {3.80f, 40}, {3.79f, 35}, {3.77f, 30}, {3.75f, 25}, {3.73f, 20}, {3.71f, 15},
+  {3.69f, 10}, {3.61f, 5}, {3.27f, 0}
+};
+
+BatteryMonitor::BatteryMonitor(uint8_t pin, float dividerRatio) {
+  pin_ = pin;
+  dividerRatio_ = dividerRatio;
+  calibration_ = ESP_ADC_CAL_VAL_DEFAULT_VREF;
+  sumMv_ = 0;
+  samples_ = 0;
+  voltage_ = 0;
+  percent_ = 0;
+  measurements_ = 0;
+}
+
+void BatteryMonitor::begin() {
+  // 11 dB attenuation reads up to ~3.1 V at the pin: a full cell through a 1:1 divider
+  analogReadResolution(12);
+  analogSetPinAttenuation(pin_, ADC_11db);
+  calibration_ = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12,
+                                          DEFAULT_VREF_MV, &adcChars_);
+}
+
+const char* BatteryMonitor::calibration() const {
+  switch (calibration_) {
+    case ESP_ADC_CAL_VAL_EFUSE_TP:
+      return "eFuse two-point";
+    case ESP_ADC_CAL_VAL_EFUSE_VREF:
+      return "eFuse Vref";
+    default:
+      return "default Vref";
+  }
+}
+
+bool BatteryMonitor::service() {
+  for (int i = 0; i < BATTERY_SAMPLES_PER_RUN && samples_ < BATTERY_OVERSAMPLE; i++) {
+    sumMv_ += esp_adc_cal_raw_to_voltage(analogRead(pin_), &adcChars_);
+    samples_++;
+  }
+  if (samples_ < BATTERY_OVERSAMPLE) {
+    return false;
+  }
+
+  float volts = (float)sumMv_ / samples_ / 1000.0f * dividerRatio_;
+  sumMv_ = 0;
+  samples_ = 0;
+  voltage_ = measurements_ == 0 ? volts : voltage_ + BATTERY_EMA_ALPHA * (volts - voltage_);
+  percent_ = lipoPercent(voltage_);
+  measurements_++;
+  return true;
+}
+
+float BatteryMonitor::lipoPercent(float volts) {
+  const int points = sizeof(LIPO_CURVE) / sizeof(LIPO_CURVE[0]);
+  if (volts >= LIPO_CURVE[0].volts) {
+    return 100;
+  }
+  for (int i = 1; i < points; i++) {
+    if (volts >= LIPO_CURVE[i].volts) {
+      // Straight line between the two neighbouring points
+      float span = LIPO_CURVE[i - 1].volts - LIPO_CURVE[i].volts;
+      float fraction = (volts - LIPO_CURVE[i].volts) / span;
+      return LIPO_CURVE[i].percent + fraction * (LIPO_CURVE[i - 1].percent - LIPO_CURVE[i].percent);
+    }
+  }
+  return 0;
+}
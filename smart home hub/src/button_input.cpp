@@ -0,0 +1,125 @@
+#include "button_input.h"
+
+#include <string.h>
+
+// True once at least span has passed from since to now (wrap-safe)
+static bool elapsed(uint32_t now, uint32_t since, uint32_t span) {
+  return (int32_t)(now - since) >= 0 && now - since >= span;
+}
+
+GestureRecognizer::GestureRecognizer(uint32_t debounceMs, uint32_t longPressMs, uint32_t chordHoldMs) {
+  memset(buttons_, 0, sizeof(buttons_));
+  debounceMs_ = debounceMs;
+  longPressMs_ = longPressMs;
+  chordHoldMs_ = chordHoldMs;
+  chordActive_ = false;
+  chordFired_ = false;
+  chordStart_ = 0;
+  eventHead_ = 0;
+  eventCount_ = 0;
+  droppedEvents_ = 0;
+}
+
+void GestureRecognizer::emit(uint8_t kind, uint8_t button, uint32_t ms) {
+  if (eventCount_ >= BUTTON_EVENT_SLOTS) {
+    droppedEvents_++;
+    return;
+  }
+  ButtonEvent& event = events_[(eventHead_ + eventCount_) % BUTTON_EVENT_SLOTS];
+  event.kind = kind;
+  event.button = button;
+  event.ms = ms;
+  eventCount_++;
+}
+
+bool GestureRecognizer::nextEvent(ButtonEvent& event) {
+  if (eventCount_ == 0) {
+    return false;
+  }
+  event = events_[eventHead_];
+  eventHead_ = (eventHead_ + 1) % BUTTON_EVENT_SLOTS;
+  eventCount_--;
+  return true;
+}
+
+// Apply a level that has held for the debounce time; ms is when it became stable
+void GestureRecognizer::settle(int button, uint32_t ms) {
+  ButtonState& state = buttons_[button];
+  state.stable = state.raw;
+
+  if (state.stable) {
+    state.downAt = ms;
+    state.longFired = false;
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+      if (!buttons_[i].stable) {
+        return;
+      }
+    }
+    // The last button of the chord went down; none of them may click or long-press now
+    chordActive_ = true;
+    chordFired_ = false;
+    chordStart_ = ms;
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+      buttons_[i].suppressed = true;
+    }
+    emit(BUTTON_CHORD_START, BUTTON_CHORD, ms);
+    return;
+  }
+
+  if (chordActive_) {
+    chordActive_ = false;
+    if (!chordFired_) {
+      emit(BUTTON_CHORD_CANCEL, BUTTON_CHORD, ms);
+    }
+  }
+  if (!state.suppressed && !state.longFired) {
+    emit(BUTTON_CLICK, button, ms);
+  }
+  state.suppressed = false;
+}
+
+void GestureRecognizer::advance(uint32_t now) {
+  // Levels that have stopped bouncing, in the order they became stable
+  for (;;) {
+    int next = -1;
+    uint32_t nextAt = 0;
+    for (int i = 0; i < BUTTON_COUNT; i++) {
+      const ButtonState& state = buttons_[i];
+      uint32_t at = state.rawSince + debounceMs_;
+      if (state.raw != state.stable && elapsed(now, state.rawSince, debounceMs_) &&
+          (next < 0 || (int32_t)(at - nextAt) < 0)) {
+        next = i;
+        nextAt = at;
+      }
+    }
+    if (next < 0) {
+      break;
+    }
+    settle(next, nextAt);
+  }
+
+  for (int i = 0; i < BUTTON_COUNT; i++) {
+    ButtonState& state = buttons_[i];
+    if (state.stable && !state.suppressed && !state.longFired && elapsed(now, state.downAt, longPressMs_)) {
+      state.longFired = true;
+      emit(BUTTON_LONG_PRESS, i, state.downAt + longPressMs_);
+    }
+  }
+  if (chordActive_ && !chordFired_ && elapsed(now, chordStart_, chordHoldMs_)) {
+    chordFired_ = true;
+    emit(BUTTON_CHORD_HOLD, BUTTON_CHORD, chordStart_ + chordHoldMs_);
+  }
+}
+
+void GestureRecognizer::edge(uint8_t button, bool pressed, uint32_t ms) {
+  if (button >= BUTTON_COUNT) {
+    return;
+  }
+  // Whatever settled before this edge happened first
+  advance(ms);
+  ButtonState& state = buttons_[button];
+  if (state.raw != pressed) {
+    state.raw = pressed;
+    state.rawSince = ms;
+  }
+}
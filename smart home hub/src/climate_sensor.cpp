@@ -0,0 +1,85 @@
+#include "climate_sensor.h"
+
+#include <string.h>
+
+static portMUX_TYPE climateMux = portMUX_INITIALIZER_UNLOCKED;
+
+// Median of count values (count <= CLIMATE_WINDOW); sorts a copy
+static float median(const float* values, int count) {
+  float sorted[CLIMATE_WINDOW];
+  for (int i = 0; i < count; i++) {
+    float value = values[i];
+    int j = i;
+    for (; j > 0 && sorted[j - 1] > value; j--) {
+      sorted[j] = sorted[j - 1];
+    }
+    sorted[j] = value;
+  }
+  return count % 2 ? sorted[count / 2] : (sorted[count / 2 - 1] + sorted[count / 2]) / 2;
+}
+
+ClimateSensor::ClimateSensor(DHT& dht) : dht_(dht) {
+  memset(&published_, 0, sizeof(published_));
+  windowCount_ = 0;
+  windowNext_ = 0;
+}
+
+void ClimateSensor::begin(UBaseType_t priority, BaseType_t core) {
+  dht_.begin();
+  xTaskCreatePinnedToCore(task, "climate", CLIMATE_TASK_STACK, this, priority, nullptr, core);
+}
+
+ClimateSnapshot ClimateSensor::snapshot() const {
+  portENTER_CRITICAL(&climateMux);
+  ClimateSnapshot snapshot = published_;
+  portEXIT_CRITICAL(&climateMux);
+  // Counted from boot until the first good reading
+  snapshot.stale = millis() - (snapshot.valid ? snapshot.lastGoodMs : 0) >= CLIMATE_STALE_MS;
+  return snapshot;
+}
+
+void ClimateSensor::task(void* parameter) {
+  ClimateSensor* sensor = (ClimateSensor*)parameter;
+  TickType_t wake = xTaskGetTickCount();
+  for (;;) {
+    sensor->sample();
+    vTaskDelayUntil(&wake, pdMS_TO_TICKS(CLIMATE_INTERVAL_MS));
+  }
+}
+
+void ClimateSensor::sample() {
+  // One transaction; both values then come from the library's copy of it.
+  // The library sleeps through the wake-up inside read(), so this times the sleep as well
+  uint32_t start = micros();
+  bool ok = dht_.read(true);
+  uint32_t readUs = micros() - start;
+  float temperature = dht_.readTemperature();
+  float humidity = dht_.readHumidity();
+  // Outside what a DHT11 can report: a corrupted frame that passed the checksum
+  ok = ok && !isnan(temperature) && !isnan(humidity) &&
+       temperature >= -20 && temperature <= 60 && humidity >= 0 && humidity <= 100;
+
+  if (ok) {
+    temperatures_[windowNext_] = temperature;
+    humidities_[windowNext_] = humidity;
+    windowNext_ = (windowNext_ + 1) % CLIMATE_WINDOW;
+    if (windowCount_ < CLIMATE_WINDOW) {
+      windowCount_++;
+    }
+    temperature = median(temperatures_, windowCount_);
+    humidity = median(humidities_, windowCount_);
+  }
+
+  portENTER_CRITICAL(&climateMux);
+  published_.readings++;
+  published_.lastReadUs = readUs;
+  if (ok) {
+    published_.temperature = temperature;
+    published_.humidity = humidity;
+    published_.valid = true;
+    published_.lastGoodMs = millis();
+  } else {
+    published_.failures++;
+  }
+  portEXIT_CRITICAL(&climateMux);
+}
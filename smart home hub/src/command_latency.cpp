@@ -0,0 +1,117 @@
+#include "command_latency.h"
+
+#include <string.h>
+
+CommandLatency::CommandLatency() {
+  memset(pending_, 0, sizeof(pending_));
+  memset(buckets_, 0, sizeof(buckets_));
+  memset(samples_, 0, sizeof(samples_));
+  memset(timeouts_, 0, sizeof(timeouts_));
+}
+
+// 0-3 ms get a bucket each; above that, four buckets per power of two
+int CommandLatency::bucketOf(uint32_t ms) {
+  if (ms < 4) {
+    return ms;
+  }
+  int exponent = 31 - __builtin_clz(ms);
+  int bucket = 4 * (exponent - 1) + ((ms >> (exponent - 2)) & 3);
+  return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+uint32_t CommandLatency::bucketUpperMs(int bucket) {
+  if (bucket < 4) {
+    return bucket;
+  }
+  int exponent = bucket / 4 + 1;
+  uint32_t width = 1u << (exponent - 2);
+  return (4 + bucket % 4) * width + width - 1;
+}
+
+void CommandLatency::start(uint32_t corrId, uint32_t deviceHash, uint8_t typeIndex, uint32_t now) {
+  if (corrId == NO_CORRELATION || typeIndex >= MAX_DEVICE_TYPES) {
+    return;
+  }
+
+  // Prefer a free slot; otherwise give up on the command that has waited longest
+  int slot = 0;
+  for (int i = 0; i < LATENCY_PENDING; i++) {
+    if (pending_[i].corrId == NO_CORRELATION) {
+      slot = i;
+      break;
+    }
+    if (now - pending_[i].startedAt > now - pending_[slot].startedAt) {
+      slot = i;
+    }
+  }
+  if (pending_[slot].corrId != NO_CORRELATION) {
+    timeouts_[pending_[slot].typeIndex]++;
+  }
+  pending_[slot].corrId = corrId;
+  pending_[slot].deviceHash = deviceHash;
+  pending_[slot].startedAt = now;
+  pending_[slot].typeIndex = typeIndex;
+}
+
+bool CommandLatency::complete(uint32_t corrId, uint32_t deviceHash, uint32_t now) {
+  if (corrId == NO_CORRELATION) {
+    return false;
+  }
+
+  for (int i = 0; i < LATENCY_PENDING; i++) {
+    Pending &entry = pending_[i];
+    if (entry.corrId == corrId && entry.deviceHash == deviceHash) {
+      uint32_t elapsed = now - entry.startedAt;
+      if (elapsed > LATENCY_TIMEOUT_MS) {
+        // Too late to count, whether or not expire() got to it first
+        timeouts_[entry.typeIndex]++;
+      } else {
+        buckets_[entry.typeIndex][bucketOf(elapsed)]++;
+        samples_[entry.typeIndex]++;
+      }
+      entry.corrId = NO_CORRELATION;
+      return true;
+    }
+  }
+  return false;
+}
+
+void CommandLatency::expire(uint32_t now) {
+  for (int i = 0; i < LATENCY_PENDING; i++) {
+    Pending &entry = pending_[i];
+    if (entry.corrId != NO_CORRELATION && now - entry.startedAt > LATENCY_TIMEOUT_MS) {
+      timeouts_[entry.typeIndex]++;
+      entry.corrId = NO_CORRELATION;
+    }
+  }
+}
+
+uint32_t CommandLatency::percentile(uint8_t typeIndex, uint32_t percent) const {
+  uint32_t total = samples_[typeIndex];
+  if (total == 0) {
+    return 0;
+  }
+  // Smallest bucket holding at least percent% of the samples
+  uint32_t rank = (total * percent + 99) / 100;
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    seen += buckets_[typeIndex][bucket];
+    if (seen >= rank) {
+      return bucketUpperMs(bucket);
+    }
+  }
+  return bucketUpperMs(LATENCY_BUCKETS - 1);
+}
+
+LatencyStats CommandLatency::stats(uint8_t typeIndex) const {
+  LatencyStats result = {0, 0, 0, 0, 0};
+  if (typeIndex >= MAX_DEVICE_TYPES) {
+    return result;
+  }
+  result.samples = samples_[typeIndex];
+  result.timeouts = timeouts_[typeIndex];
+  result.p50Ms = percentile(typeIndex, 50);
+  result.p95Ms = percentile(typeIndex, 95);
+  result.p99Ms = percentile(typeIndex, 99);
+  return result;
+}
@@ -0,0 +1,73 @@
+#include "core_link.h"
+
+#include <string.h>
+
+CoreLink::CoreLink(uint8_t* buffer, uint32_t capacity)
+    : buffer_(buffer), capacity_(capacity), head_(0), tail_(0), dropped_(0), peakUsed_(0) {
+}
+
+void CoreLink::write(uint32_t position, const void* data, size_t length) {
+  uint32_t offset = position & (capacity_ - 1);
+  size_t first = capacity_ - offset < length ? capacity_ - offset : length;
+  memcpy(buffer_ + offset, data, first);
+  memcpy(buffer_, (const uint8_t*)data + first, length - first);
+}
+
+void CoreLink::read(uint32_t position, void* data, size_t length) const {
+  uint32_t offset = position & (capacity_ - 1);
+  size_t first = capacity_ - offset < length ? capacity_ - offset : length;
+  memcpy(data, buffer_ + offset, first);
+  memcpy((uint8_t*)data + first, buffer_, length - first);
+}
+
+bool CoreLink::send(LinkKind kind, uint32_t clientId, uint32_t ip, const void* data, size_t length) {
+  uint32_t tail = tail_.load(std::memory_order_relaxed);
+  // Acquire pairs with the consumer's release: the bytes it freed are no longer being read
+  uint32_t head = head_.load(std::memory_order_acquire);
+  size_t needed = sizeof(LinkMessage) + length;
+  if (length > UINT16_MAX || needed > capacity_ - (tail - head)) {
+    dropped_++;
+    return false;
+  }
+
+  LinkMessage message;
+  memset(&message, 0, sizeof(message));
+  message.kind = kind;
+  message.length = length;
+  message.clientId = clientId;
+  message.ip = ip;
+  write(tail, &message, sizeof(message));
+  if (length > 0) {
+    write(tail + sizeof(message), data, length);
+  }
+  // Release publishes the record before the consumer can see the new tail
+  tail_.store(tail + needed, std::memory_order_release);
+
+  uint32_t used = tail + needed - head;
+  if (used > peakUsed_) {
+    peakUsed_ = used;
+  }
+  return true;
+}
+
+bool CoreLink::receive(LinkMessage& message, uint8_t* data, size_t size) {
+  uint32_t head = head_.load(std::memory_order_relaxed);
+  uint32_t tail = tail_.load(std::memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+
+  read(head, &message, sizeof(message));
+  read(head + sizeof(message), data, message.length < size ? message.length : size);
+  // Copied out; the producer may now reuse the space
+  head_.store(head + sizeof(message) + message.length, std::memory_order_release);
+  return true;
+}
+
+bool CoreLink::empty() const {
+  return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+}
+
+uint32_t CoreLink::used() const {
+  return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+}
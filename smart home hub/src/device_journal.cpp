@@ -0,0 +1,290 @@
+#include "device_journal.h"
+
+#include <LittleFS.h>
+#include <async_log.h>
+#include <string.h>
+
+#define JOURNAL_MAGIC 0xD5
+#define JOURNAL_REMOVED_MAGIC 0xD6
+#define HEADER_SIZE sizeof(RecordHeader)
+#define RECORD_MAX (HEADER_SIZE + DEVICE_ID_LEN + DEVICE_TYPE_LEN + DEVICE_STATUS_LEN)
+
+static uint16_t crc16(const uint8_t* data, size_t length) {
+  // CRC-16/CCITT-FALSE, bit by bit; records are at most 64 bytes
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// Copy a NUL-terminated string into out; returns the bytes used, terminator included
+static size_t putString(uint8_t* out, const char* text) {
+  size_t length = strlen(text) + 1;
+  memcpy(out, text, length);
+  return length;
+}
+
+DeviceJournal::DeviceJournal() {
+  registry_ = nullptr;
+  fsReady_ = false;
+  journaledSeq_ = 0;
+  fileSize_ = 0;
+  compacting_ = false;
+  compactPending_ = false;
+  compactNext_ = 0;
+  compactSeq_ = 0;
+  compactSize_ = 0;
+  removedCount_ = 0;
+  removedSeq_ = 0;
+  loadUs_ = 0;
+  loadedRecords_ = 0;
+  restoredDevices_ = 0;
+  recordsWritten_ = 0;
+  compactions_ = 0;
+}
+
+int DeviceJournal::load(DeviceRegistry& registry) {
+  uint32_t start = micros();
+  registry_ = &registry;
+  fsReady_ = LittleFS.begin(true);
+  if (!fsReady_) {
+    LOG_WARN("LittleFS mount failed, device registry is RAM only");
+    return 0;
+  }
+  // A compaction cut short by a reset; the old journal is still whole
+  if (LittleFS.exists(JOURNAL_COMPACT_PATH)) {
+    LittleFS.remove(JOURNAL_COMPACT_PATH);
+  }
+
+  uint32_t goodBytes = 0;
+  File file = LittleFS.open(JOURNAL_PATH, FILE_READ);
+  if (file) {
+    fileSize_ = file.size();
+    RecordHeader header;
+    uint8_t payload[255];
+    while (file.read((uint8_t*)&header, HEADER_SIZE) == HEADER_SIZE) {
+      if ((header.magic != JOURNAL_MAGIC && header.magic != JOURNAL_REMOVED_MAGIC) ||
+          file.read(payload, header.length) != header.length || crc16(payload, header.length) != header.crc) {
+        break;
+      }
+      goodBytes += HEADER_SIZE + header.length;
+      loadedRecords_++;
+
+      if (header.magic == JOURNAL_REMOVED_MAGIC) {
+        // A tombstone: the ID alone; a device added again later has a record after it
+        if (memchr(payload, 0, header.length) != nullptr) {
+          registry.remove((const char*)payload);
+        }
+        continue;
+      }
+
+      // ID, type and status, each terminated inside the payload
+      const char* fields[3];
+      size_t offset = 0;
+      int count = 0;
+      while (count < 3 && offset < header.length) {
+        fields[count++] = (const char*)payload + offset;
+        const uint8_t* end = (const uint8_t*)memchr(payload + offset, 0, header.length - offset);
+        if (end == nullptr) {
+          count = 0;
+          break;
+        }
+        offset = end - payload + 1;
+      }
+      if (count < 3) {
+        continue;
+      }
+      // A later record for the same ID replaces the status of the earlier one
+      int index = registry.add(fields[0], fields[1]);
+      if (index != NO_DEVICE) {
+        registry.setStatus(index, fields[2]);
+      }
+    }
+    file.close();
+  }
+
+  if (goodBytes < fileSize_) {
+    // Records appended after a torn one would never be read back; rewrite the file first
+    LOG_WARN("Device journal: %u bytes after the last good record ignored", fileSize_ - goodBytes);
+    compactPending_ = true;
+  }
+  restoredDevices_ = registry.count();
+  journaledSeq_ = registry.seq();
+  loadUs_ = micros() - start;
+  return restoredDevices_;
+}
+
+size_t DeviceJournal::encode(int index, uint8_t* out) const {
+  const DeviceRecord& record = registry_->at(index);
+  uint8_t* payload = out + HEADER_SIZE;
+  size_t length = putString(payload, record.id);
+  length += putString(payload + length, registry_->typeName(index));
+  length += putString(payload + length, record.status);
+
+  RecordHeader header = {JOURNAL_MAGIC, (uint8_t)length, crc16(payload, length)};
+  memcpy(out, &header, HEADER_SIZE);
+  return HEADER_SIZE + length;
+}
+
+size_t DeviceJournal::encodeRemoved(const char* deviceId, uint8_t* out) const {
+  uint8_t* payload = out + HEADER_SIZE;
+  size_t length = putString(payload, deviceId);
+
+  RecordHeader header = {JOURNAL_REMOVED_MAGIC, (uint8_t)length, crc16(payload, length)};
+  memcpy(out, &header, HEADER_SIZE);
+  return HEADER_SIZE + length;
+}
+
+bool DeviceJournal::appendChanges(const char* path, uint32_t* fileSize) {
+  File file = LittleFS.open(path, FILE_APPEND);
+  if (!file) {
+    return false;
+  }
+  uint8_t record[RECORD_MAX];
+  bool ok = true;
+  // Tombstones first: a device removed and added again since the last call is written after its own
+  for (int i = 0; i < removedCount_ && ok; i++) {
+    size_t length = encodeRemoved(removedIds_[i], record);
+    ok = file.write(record, length) == length;
+    *fileSize += length;
+    recordsWritten_++;
+  }
+  for (int i = 0; i < registry_->count() && ok; i++) {
+    if (registry_->at(i).version <= journaledSeq_) {
+      continue;
+    }
+    size_t length = encode(i, record);
+    ok = file.write(record, length) == length;
+    *fileSize += length;
+    recordsWritten_++;
+  }
+  file.close();
+  return ok;
+}
+
+void DeviceJournal::startCompaction() {
+  File file = LittleFS.open(JOURNAL_COMPACT_PATH, FILE_WRITE);
+  if (!file) {
+    fsReady_ = false;
+    LOG_WARN("Device journal compaction failed, registry is RAM only");
+    return;
+  }
+  file.close();
+  compacting_ = true;
+  compactPending_ = false;
+  compactNext_ = registry_->count() - 1;
+  compactSeq_ = registry_->seq();
+  compactSize_ = 0;
+}
+
+void DeviceJournal::continueCompaction() {
+  File file = LittleFS.open(JOURNAL_COMPACT_PATH, FILE_APPEND);
+  bool ok = (bool)file;
+  uint8_t record[RECORD_MAX];
+  // Records removed meanwhile shrank the registry; the ones that moved down are visited again
+  if (compactNext_ >= registry_->count()) {
+    compactNext_ = registry_->count() - 1;
+  }
+  for (int written = 0; ok && written < JOURNAL_COMPACT_BURST && compactNext_ >= 0; written++) {
+    size_t length = encode(compactNext_--, record);
+    ok = file.write(record, length) == length;
+    compactSize_ += length;
+    recordsWritten_++;
+  }
+  if (file) {
+    file.close();
+  }
+
+  if (ok && compactNext_ < 0) {
+    // The new file has every device; swap it in
+    ok = LittleFS.rename(JOURNAL_COMPACT_PATH, JOURNAL_PATH);
+    if (ok) {
+      LOG_INFO("Device journal compacted from %u to %u bytes", fileSize_, compactSize_);
+      fileSize_ = compactSize_;
+      compacting_ = false;
+      compactions_++;
+    }
+  }
+  if (!ok) {
+    compacting_ = false;
+    fsReady_ = false;
+    LittleFS.remove(JOURNAL_COMPACT_PATH);
+    LOG_WARN("Device journal compaction failed, registry is RAM only");
+  }
+}
+
+bool DeviceJournal::unreportedRemoval(uint32_t sinceSeq) const {
+  // A reported removal moves the delta floor to removedSeq_; any later one moves it past
+  return !registry_->canDelta(sinceSeq) && !registry_->canDelta(removedSeq_);
+}
+
+void DeviceJournal::flush() {
+  uint32_t seq = registry_->seq();
+  if (seq == journaledSeq_ && removedCount_ == 0) {
+    return;
+  }
+  // The old file stays current until the new one replaces it
+  bool ok = appendChanges(JOURNAL_PATH, &fileSize_);
+  if (ok && compacting_) {
+    ok = appendChanges(JOURNAL_COMPACT_PATH, &compactSize_);
+  }
+  removedCount_ = 0;
+  if (!ok) {
+    fsReady_ = false;
+    LOG_WARN("Device journal write failed, registry is RAM only");
+    return;
+  }
+  journaledSeq_ = seq;
+}
+
+void DeviceJournal::removed(const char* deviceId) {
+  if (!fsReady_) {
+    return;
+  }
+  if (removedCount_ == JOURNAL_REMOVED_SLOTS) {
+    flush();
+    if (!fsReady_) {
+      return;
+    }
+  }
+  strncpy(removedIds_[removedCount_], deviceId, DEVICE_ID_LEN - 1);
+  removedIds_[removedCount_][DEVICE_ID_LEN - 1] = '\0';
+  removedCount_++;
+  removedSeq_ = registry_->seq();
+}
+
+void DeviceJournal::service() {
+  if (!fsReady_) {
+    return;
+  }
+
+  if (compacting_) {
+    // A device removed unreported since the walk began may already be in the new file; start over
+    if (unreportedRemoval(compactSeq_)) {
+      startCompaction();
+    }
+  } else if (compactPending_ || unreportedRemoval(journaledSeq_) || fileSize_ >= JOURNAL_COMPACT_BYTES) {
+    startCompaction();
+  }
+  if (!fsReady_) {
+    return;
+  }
+
+  flush();
+  if (fsReady_ && compacting_) {
+    continueCompaction();
+  }
+}
+
+void DeviceJournal::erase() {
+  LittleFS.remove(JOURNAL_PATH);
+  LittleFS.remove(JOURNAL_COMPACT_PATH);
+  // Nothing more is written until the restart that follows a reset
+  fsReady_ = false;
+  compacting_ = false;
+  removedCount_ = 0;
+}
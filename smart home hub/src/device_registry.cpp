@@ -0,0 +1,285 @@
+#include "device_registry.h"
+
+#include <string.h>
+
+#define SLOT_MASK (REGISTRY_SLOTS - 1)
+
+// Copy a string into a fixed-size field, always NUL-terminated
+static void copyField(char* dest, const char* src, size_t size) {
+  size_t len = strnlen(src, size - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+DeviceRegistry::DeviceRegistry() {
+  // Type 0 doubles as the fallback once the type table is full
+  copyField(types_[0], "unknown", DEVICE_TYPE_LEN);
+  numTypes_ = 1;
+  seq_ = 0;
+  clear();
+}
+
+void DeviceRegistry::clear() {
+  count_ = 0;
+  deletedSlots_ = 0;
+  deltaFloor_ = ++seq_;
+  for (int i = 0; i < REGISTRY_SLOTS; i++) {
+    idSlots_[i] = SLOT_EMPTY;
+    clientSlots_[i] = SLOT_EMPTY;
+  }
+}
+
+uint32_t DeviceRegistry::hashId(const char* deviceId) {
+  // 32-bit FNV-1a
+  return hashAppend(2166136261u, deviceId);
+}
+
+uint32_t DeviceRegistry::hashAppend(uint32_t hash, const char* text) {
+  while (*text) {
+    hash ^= (uint8_t)*text++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t DeviceRegistry::digest() const {
+  // XOR of FNV-1a("id|type|status") per device; the cloud computes the same over its copy
+  uint32_t result = 0;
+  for (int i = 0; i < count_; i++) {
+    uint32_t hash = hashAppend(records_[i].idHash, "|");
+    hash = hashAppend(hash, typeName(i));
+    hash = hashAppend(hash, "|");
+    result ^= hashAppend(hash, records_[i].status);
+  }
+  return result;
+}
+
+int DeviceRegistry::idSlotOf(const char* deviceId, uint32_t hash) const {
+  // Linear probing; stops at the first never-used slot
+  uint32_t slot = hash & SLOT_MASK;
+  for (int probes = 0; probes < REGISTRY_SLOTS; probes++) {
+    int16_t index = idSlots_[slot];
+    if (index == SLOT_EMPTY) {
+      return -1;
+    }
+    if (index >= 0 && records_[index].idHash == hash &&
+        strcmp(records_[index].id, deviceId) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & SLOT_MASK;
+  }
+  return -1;
+}
+
+int DeviceRegistry::clientSlotOf(uint32_t clientId) const {
+  uint32_t slot = (clientId * 2654435761u) & SLOT_MASK;
+  for (int probes = 0; probes < REGISTRY_SLOTS; probes++) {
+    int16_t index = clientSlots_[slot];
+    if (index == SLOT_EMPTY) {
+      return -1;
+    }
+    if (index >= 0 && records_[index].clientId == clientId) {
+      return slot;
+    }
+    slot = (slot + 1) & SLOT_MASK;
+  }
+  return -1;
+}
+
+void DeviceRegistry::insertIdSlot(uint32_t hash, int16_t index) {
+  uint32_t slot = hash & SLOT_MASK;
+  while (idSlots_[slot] >= 0) {
+    slot = (slot + 1) & SLOT_MASK;
+  }
+  if (idSlots_[slot] == SLOT_DELETED) {
+    deletedSlots_--;
+  }
+  idSlots_[slot] = index;
+}
+
+void DeviceRegistry::insertClientSlot(uint32_t clientId, int16_t index) {
+  uint32_t slot = (clientId * 2654435761u) & SLOT_MASK;
+  while (clientSlots_[slot] >= 0) {
+    slot = (slot + 1) & SLOT_MASK;
+  }
+  if (clientSlots_[slot] == SLOT_DELETED) {
+    deletedSlots_--;
+  }
+  clientSlots_[slot] = index;
+}
+
+void DeviceRegistry::clearClientSlot(uint32_t clientId) {
+  int slot = clientSlotOf(clientId);
+  if (slot >= 0) {
+    clientSlots_[slot] = SLOT_DELETED;
+    deletedSlots_++;
+  }
+}
+
+void DeviceRegistry::rebuildIndexes() {
+  // Drop accumulated tombstones so probe sequences stay short
+  deletedSlots_ = 0;
+  for (int i = 0; i < REGISTRY_SLOTS; i++) {
+    idSlots_[i] = SLOT_EMPTY;
+    clientSlots_[i] = SLOT_EMPTY;
+  }
+  for (int i = 0; i < count_; i++) {
+    insertIdSlot(records_[i].idHash, i);
+    if (records_[i].clientId != NO_CLIENT) {
+      insertClientSlot(records_[i].clientId, i);
+    }
+  }
+}
+
+uint8_t DeviceRegistry::internType(const char* deviceType) {
+  for (uint8_t i = 0; i < numTypes_; i++) {
+    if (strncmp(types_[i], deviceType, DEVICE_TYPE_LEN - 1) == 0) {
+      return i;
+    }
+  }
+  if (numTypes_ < MAX_DEVICE_TYPES) {
+    copyField(types_[numTypes_], deviceType, DEVICE_TYPE_LEN);
+    return numTypes_++;
+  }
+  return 0;
+}
+
+int DeviceRegistry::find(const char* deviceId) const {
+  int slot = idSlotOf(deviceId, hashId(deviceId));
+  return slot >= 0 ? idSlots_[slot] : NO_DEVICE;
+}
+
+int DeviceRegistry::findByClient(uint32_t clientId) const {
+  if (clientId == NO_CLIENT) {
+    return NO_DEVICE;
+  }
+  int slot = clientSlotOf(clientId);
+  return slot >= 0 ? clientSlots_[slot] : NO_DEVICE;
+}
+
+int DeviceRegistry::add(const char* deviceId, const char* deviceType, bool* isNew) {
+  if (isNew) {
+    *isNew = false;
+  }
+  if (deviceId == nullptr || deviceId[0] == '\0' || strlen(deviceId) >= DEVICE_ID_LEN) {
+    return NO_DEVICE;
+  }
+
+  uint32_t hash = hashId(deviceId);
+  int slot = idSlotOf(deviceId, hash);
+  if (slot >= 0) {
+    // Registered again, perhaps after being flashed as another type: the new type is a change
+    int index = idSlots_[slot];
+    uint8_t typeIndex = internType(deviceType ? deviceType : "unknown");
+    if (records_[index].typeIndex != typeIndex) {
+      records_[index].typeIndex = typeIndex;
+      records_[index].version = ++seq_;
+    }
+    return index;
+  }
+  if (isFull()) {
+    return NO_DEVICE;
+  }
+
+  int index = count_++;
+  DeviceRecord& record = records_[index];
+  copyField(record.id, deviceId, DEVICE_ID_LEN);
+  copyField(record.status, "Unknown", DEVICE_STATUS_LEN);
+  record.idHash = hash;
+  record.ip = 0;
+  record.clientId = NO_CLIENT;
+  record.encoding = ENCODING_JSON;
+  record.lastSeen = 0;
+  record.online = false;
+  record.typeIndex = internType(deviceType ? deviceType : "unknown");
+  record.version = ++seq_;
+  insertIdSlot(hash, index);
+
+  if (isNew) {
+    *isNew = true;
+  }
+  return index;
+}
+
+bool DeviceRegistry::remove(const char* deviceId) {
+  int slot = idSlotOf(deviceId, hashId(deviceId));
+  if (slot < 0) {
+    return false;
+  }
+
+  int index = idSlots_[slot];
+  if (records_[index].clientId != NO_CLIENT) {
+    clearClientSlot(records_[index].clientId);
+  }
+  idSlots_[slot] = SLOT_DELETED;
+  deletedSlots_++;
+  // Deltas cannot describe a removal, so older sequence numbers need a snapshot
+  deltaFloor_ = ++seq_;
+
+  // Keep the record array dense by moving the last record into the hole
+  int last = --count_;
+  if (index != last) {
+    records_[index] = records_[last];
+    idSlots_[idSlotOf(records_[index].id, records_[index].idHash)] = index;
+    if (records_[index].clientId != NO_CLIENT) {
+      clientSlots_[clientSlotOf(records_[index].clientId)] = index;
+    }
+  }
+
+  if (deletedSlots_ > REGISTRY_SLOTS / 4) {
+    rebuildIndexes();
+  }
+  return true;
+}
+
+void DeviceRegistry::setStatus(int index, const char* status) {
+  char updated[DEVICE_STATUS_LEN];
+  copyField(updated, status, DEVICE_STATUS_LEN);
+  if (strcmp(records_[index].status, updated) != 0) {
+    memcpy(records_[index].status, updated, DEVICE_STATUS_LEN);
+    records_[index].version = ++seq_;
+  }
+}
+
+void DeviceRegistry::setIP(int index, uint32_t ip) {
+  records_[index].ip = ip;
+}
+
+void DeviceRegistry::bindClient(int index, uint32_t clientId) {
+  DeviceRecord& record = records_[index];
+  if (record.clientId == clientId) {
+    return;
+  }
+  if (record.clientId != NO_CLIENT) {
+    clearClientSlot(record.clientId);
+  }
+  // A client can only carry one device; steal the binding from any other record
+  int previous = findByClient(clientId);
+  if (previous != NO_DEVICE) {
+    clearClientSlot(clientId);
+    records_[previous].clientId = NO_CLIENT;
+  }
+
+  // A new connection starts in JSON until it negotiates otherwise
+  record.clientId = clientId;
+  record.encoding = ENCODING_JSON;
+  if (clientId != NO_CLIENT) {
+    insertClientSlot(clientId, index);
+  }
+
+  if (deletedSlots_ > REGISTRY_SLOTS / 4) {
+    rebuildIndexes();
+  }
+}
+
+int DeviceRegistry::unbindClient(uint32_t clientId) {
+  int index = findByClient(clientId);
+  if (index != NO_DEVICE) {
+    clearClientSlot(clientId);
+    records_[index].clientId = NO_CLIENT;
+    if (deletedSlots_ > REGISTRY_SLOTS / 4) {
+      rebuildIndexes();
+    }
+  }
+  return index;
+}
@@ -0,0 +1,114 @@
+#include "hub_metrics.h"
+
+#include <string.h>
+
+// One loop iteration should stay well under 10 ms (see scheduler.h)
+static const uint32_t LOOP_BOUNDS_US[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+// Wall time of a DHT11 transaction, the wake-up sleep included (see climate_sensor.h)
+static const uint32_t SENSOR_BOUNDS_US[] = {100, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000};
+// A cached WiFi fast path connects in well under a second; a scan and DHCP take several
+static const uint32_t CONNECT_BOUNDS_US[] = {250000, 500000, 1000000, 2000000, 3000000, 5000000, 8000000, 12000000, 20000000, 30000000, 60000000};
+
+// Recognising an alert and setting a pin takes a few microseconds (see alert_lane.h)
+static const uint32_t ALERT_GPIO_BOUNDS_US[] = {2, 5, 10, 20, 50, 100, 250, 500, 1000, 5000};
+
+HubMetrics metrics;
+NetMetrics netMetrics;
+AsyncTcpMetrics asyncTcpMetrics;
+
+DurationHistogram::DurationHistogram(const uint32_t* bounds, int count) {
+  bounds_ = bounds;
+  count_ = count < METRICS_MAX_BUCKETS ? count : METRICS_MAX_BUCKETS;
+  memset(counts_, 0, sizeof(counts_));
+  observations_ = 0;
+  sumUs_ = 0;
+}
+
+void DurationHistogram::observe(uint32_t us) {
+  int bucket = 0;
+  while (bucket < count_ && us > bounds_[bucket]) {
+    bucket++;
+  }
+  counts_[bucket]++;
+  observations_++;
+  sumUs_ += us;
+}
+
+HubMetrics::HubMetrics()
+    : loopUs(LOOP_BOUNDS_US, sizeof(LOOP_BOUNDS_US) / sizeof(LOOP_BOUNDS_US[0])),
+      sensorReadUs(SENSOR_BOUNDS_US, sizeof(SENSOR_BOUNDS_US) / sizeof(SENSOR_BOUNDS_US[0])),
+      deviceBootConnectUs(CONNECT_BOUNDS_US, sizeof(CONNECT_BOUNDS_US) / sizeof(CONNECT_BOUNDS_US[0])),
+      ruleActionUs(LOOP_BOUNDS_US, sizeof(LOOP_BOUNDS_US) / sizeof(LOOP_BOUNDS_US[0])) {
+  memset(&cloudRx, 0, sizeof(cloudRx));
+  memset(&cloudTx, 0, sizeof(cloudTx));
+  memset(&localRx, 0, sizeof(localRx));
+  memset(&localTx, 0, sizeof(localTx));
+  cloudTxJsonBytes = 0;
+  jsonParseFailures = 0;
+  cloudConnects = 0;
+  wifiConnects = 0;
+  devicesOffline = 0;
+  deviceFastBoots = 0;
+  heapMinLargestBlock = UINT32_MAX;
+  firstForwardMs = 0;
+}
+
+NetMetrics::NetMetrics()
+    : netLoopUs(LOOP_BOUNDS_US, sizeof(LOOP_BOUNDS_US) / sizeof(LOOP_BOUNDS_US[0])),
+      alertCloudUs(LOOP_BOUNDS_US, sizeof(LOOP_BOUNDS_US) / sizeof(LOOP_BOUNDS_US[0])) {
+}
+
+AsyncTcpMetrics::AsyncTcpMetrics()
+    : alertGpioUs(ALERT_GPIO_BOUNDS_US, sizeof(ALERT_GPIO_BOUNDS_US) / sizeof(ALERT_GPIO_BOUNDS_US[0])) {
+}
+
+void HubMetrics::sampleHeap() {
+  // The free-heap low watermark is tracked by the allocator itself (ESP.getMinFreeHeap)
+  uint32_t largest = ESP.getMaxAllocHeap();
+  if (largest < heapMinLargestBlock) {
+    heapMinLargestBlock = largest;
+  }
+}
+
+void MetricsWriter::header(const char* name, const char* type, const char* help) {
+  out_.printf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void MetricsWriter::sample(const char* name, const char* labels, uint32_t value) {
+  if (labels != nullptr) {
+    out_.printf("%s{%s} %u\n", name, labels, value);
+  } else {
+    out_.printf("%s %u\n", name, value);
+  }
+}
+
+void MetricsWriter::sample(const char* name, const char* labels, float value) {
+  if (labels != nullptr) {
+    out_.printf("%s{%s} %g\n", name, labels, value);
+  } else {
+    out_.printf("%s %g\n", name, value);
+  }
+}
+
+void MetricsWriter::counter(const char* name, const char* help, uint32_t value) {
+  header(name, "counter", help);
+  sample(name, nullptr, value);
+}
+
+void MetricsWriter::gauge(const char* name, const char* help, uint32_t value) {
+  header(name, "gauge", help);
+  sample(name, nullptr, value);
+}
+
+void MetricsWriter::histogram(const char* name, const char* help, const DurationHistogram& histogram) {
+  header(name, "histogram", help);
+  uint32_t cumulative = 0;
+  for (int i = 0; i < histogram.bucketCount(); i++) {
+    cumulative += histogram.countIn(i);
+    out_.printf("%s_bucket{le=\"%g\"} %u\n", name, histogram.bound(i) / 1e6, cumulative);
+  }
+  cumulative += histogram.countIn(histogram.bucketCount());
+  out_.printf("%s_bucket{le=\"+Inf\"} %u\n", name, cumulative);
+  out_.printf("%s_sum %.6f\n", name, histogram.sumUs() / 1e6);
+  out_.printf("%s_count %u\n", name, histogram.observations());
+}
@@ -0,0 +1,126 @@
+#include "json_pool.h"
+
+#include <string.h>
+
+// Every block carries its size in front so reallocate() can copy it
+#define BLOCK_HEADER 8
+#define ALIGN_UP(n) (((n) + 7) & ~(size_t)7)
+
+JsonDocPool jsonPool;
+
+ArenaAllocator::ArenaAllocator() {
+  peak_ = 0;
+  failures_ = 0;
+  reset();
+}
+
+void ArenaAllocator::reset() {
+  used_ = 0;
+  last_ = JSON_ARENA_SIZE;  // No block yet
+}
+
+void* ArenaAllocator::allocate(size_t size) {
+  size_t total = BLOCK_HEADER + ALIGN_UP(size);
+  if (used_ + total > JSON_ARENA_SIZE) {
+    failures_++;
+    return nullptr;
+  }
+  uint8_t* block = buffer_ + used_;
+  *(size_t*)block = size;
+  last_ = used_;
+  used_ += total;
+  if (used_ > peak_) {
+    peak_ = used_;
+  }
+  return block + BLOCK_HEADER;
+}
+
+void ArenaAllocator::deallocate(void* ptr) {
+  // Only the most recent block can be handed back; the rest goes on reset()
+  if (ptr != nullptr && (uint8_t*)ptr - BLOCK_HEADER == buffer_ + last_) {
+    used_ = last_;
+    last_ = JSON_ARENA_SIZE;
+  }
+}
+
+void* ArenaAllocator::reallocate(void* ptr, size_t newSize) {
+  if (ptr == nullptr) {
+    return allocate(newSize);
+  }
+  uint8_t* block = (uint8_t*)ptr - BLOCK_HEADER;
+  size_t oldSize = *(size_t*)block;
+
+  // The last block grows or shrinks in place (string building, shrinkToFit)
+  if (block == buffer_ + last_) {
+    size_t total = BLOCK_HEADER + ALIGN_UP(newSize);
+    if (last_ + total > JSON_ARENA_SIZE) {
+      failures_++;
+      return nullptr;
+    }
+    *(size_t*)block = newSize;
+    used_ = last_ + total;
+    if (used_ > peak_) {
+      peak_ = used_;
+    }
+    return ptr;
+  }
+
+  if (newSize <= oldSize) {
+    return ptr;
+  }
+  void* moved = allocate(newSize);
+  if (moved != nullptr) {
+    memcpy(moved, ptr, oldSize);
+  }
+  return moved;
+}
+
+JsonDocPool::JsonDocPool() {
+  exhausted_ = 0;
+}
+
+JsonDocument* JsonDocPool::acquire() {
+  Slot* slot = nullptr;
+  for (int i = 0; i < JSON_POOL_SIZE; i++) {
+    if (!slots_[i].inUse) {
+      slots_[i].inUse = true;
+      slot = &slots_[i];
+      break;
+    }
+  }
+  if (slot == nullptr) {
+    exhausted_++;
+    return nullptr;
+  }
+  // Release whatever the previous lease left behind, then rewind the arena
+  slot->doc.clear();
+  slot->arena.reset();
+  return &slot->doc;
+}
+
+void JsonDocPool::release(JsonDocument* doc) {
+  for (int i = 0; i < JSON_POOL_SIZE; i++) {
+    if (&slots_[i].doc == doc) {
+      slots_[i].inUse = false;
+      break;
+    }
+  }
+}
+
+size_t JsonDocPool::peakBytes() const {
+  size_t peak = 0;
+  for (int i = 0; i < JSON_POOL_SIZE; i++) {
+    if (slots_[i].arena.peak() > peak) {
+      peak = slots_[i].arena.peak();
+    }
+  }
+  return peak;
+}
+
+uint32_t JsonDocPool::allocFailures() const {
+  uint32_t failures = 0;
+  for (int i = 0; i < JSON_POOL_SIZE; i++) {
+    failures += slots_[i].arena.failures();
+  }
+  return failures;
+}
@@ -0,0 +1,66 @@
+#include "lcd_framebuffer.h"
+
+#include <string.h>
+
+// LCD transfers for the old full redraw: clear + one setCursor per row + every cell
+#define FULL_REDRAW_WRITES (1 + LCD_FB_ROWS + LCD_FB_ROWS * LCD_FB_COLS)
+
+LcdFrameBuffer::LcdFrameBuffer(LiquidCrystal_I2C &lcd) : lcd_(lcd) {
+  i2cBytesSent_ = 0;
+  i2cBytesSaved_ = 0;
+  clear();
+  invalidate();
+}
+
+void LcdFrameBuffer::clear() {
+  memset(shadow_, ' ', sizeof(shadow_));
+  cursorCol_ = 0;
+  cursorRow_ = 0;
+}
+
+void LcdFrameBuffer::setCursor(uint8_t col, uint8_t row) {
+  cursorCol_ = col;
+  cursorRow_ = row;
+}
+
+size_t LcdFrameBuffer::write(uint8_t c) {
+  // Text running past the end of a row is clipped rather than wrapped
+  if (cursorRow_ >= LCD_FB_ROWS || cursorCol_ >= LCD_FB_COLS || c == '\n' || c == '\r') {
+    return 1;
+  }
+  shadow_[cursorRow_][cursorCol_++] = (char)c;
+  return 1;
+}
+
+void LcdFrameBuffer::invalidate() {
+  // No printable character is 0, so every cell compares as changed
+  memset(front_, 0, sizeof(front_));
+}
+
+void LcdFrameBuffer::refresh() {
+  uint32_t writes = 0;
+
+  for (uint8_t row = 0; row < LCD_FB_ROWS; row++) {
+    int lcdCol = -1;  // Where the LCD's own cursor is on this row, -1 if unknown
+    for (uint8_t col = 0; col < LCD_FB_COLS; col++) {
+      if (shadow_[row][col] == front_[row][col]) {
+        continue;
+      }
+      // The LCD auto-increments, so consecutive changed cells need one setCursor
+      if (lcdCol != col) {
+        lcd_.setCursor(col, row);
+        writes++;
+      }
+      lcd_.write((uint8_t)shadow_[row][col]);
+      writes++;
+      front_[row][col] = shadow_[row][col];
+      lcdCol = col + 1;
+    }
+  }
+
+  // Compared with the old clear-and-redraw on every pass, unchanged frames save it all
+  i2cBytesSent_ += writes * LCD_I2C_BYTES_PER_WRITE;
+  if (writes < FULL_REDRAW_WRITES) {
+    i2cBytesSaved_ += (FULL_REDRAW_WRITES - writes) * LCD_I2C_BYTES_PER_WRITE;
+  }
+}
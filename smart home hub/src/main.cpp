@@ -19,6 +19,31 @@
  #include <HTTPClient.h>
  #include <ESPAsyncWebServer.h>
  #include <AsyncWebSocket.h>
+ #include "device_registry.h"
+ #include "device_journal.h"
+ #include "rule_engine.h"
+ #include "button_input.h"
+ #include "climate_sensor.h"
+ #include "battery_monitor.h"
+ #include "scheduler.h"
+ #include "lcd_framebuffer.h"
+ #include "json_pool.h"
+ #include "message_types.h"
+ #include "uplink_batcher.h"
+ #include "uplink_queue.h"
+ #include "uplink_codec.h"
+ #include "command_latency.h"
+ #include "hub_metrics.h"
+ #include "timer_wheel.h"
+ #include "core_link.h"
+ #include "alert_lane.h"
+ #include "ws_fanout.h"
+ #include <compact_frame.h>
+ #include <wifi_connector.h>
+ #include <async_log.h>
+ #include <config_store.h>
+ #include <atomic>
+ #include <mutex>
 
  
  // Pin definitions
@@ -27,17 +52,43 @@
  #define BUTTON2_PIN 27   // Button 2 connected to D27
  #define BUTTON3_PIN 25   // Button 3 connected to D25
  #define ALARM_PIN 23     // Alarm connected to D23
- #define VOLTAGE_SENSOR_PIN 13  // Voltage sensor connected to D13
+ #define VOLTAGE_SENSOR_PIN 34  // Voltage sensor connected to D34 (ADC1; ADC2 pins such as D13 cannot be read with WiFi on)
+ #define BATTERY_DIVIDER_RATIO 2.0  // Battery volts per volt at the pin (1:1 divider)
+ #define BATTERY_SAMPLE_INTERVAL 20   // ms between battery service() runs; 8 runs make one measurement
  
  // Constants
  #define EEPROM_SIZE 512
  #define AP_SSID_PREFIX "SmartHome_Hub_"
  #define AP_PASSWORD "12345678"  // Default password, will be changed during setup
- #define MAX_DEVICES 10
  #define LCD_COLS 16
  #define LCD_ROWS 4
  #define LCD_ADDR 0x27  // I2C address for LCD (may vary)
  #define WS_PORT 81     // Local WebSocket port for sub-devices
+ #define FRAME_BUFFER_SIZE 512        // Largest JSON frame built on the message paths
+ #define COMPACT_FRAME_SIZE 128       // Largest binary frame sent to a sub-device
+ #define UPLINK_FRAME_SIZE 2048       // Largest batched uplink frame
+ #define UPLINK_POLL_INTERVAL 10      // ms between checks for a due uplink batch
+ #define UPLINK_DRAIN_INTERVAL 50     // ms between drain steps after reconnecting
+ #define UPLINK_DRAIN_BURST 4         // Queued frames sent per drain step
+ #define STATUS_PAGE_SIZE 1024        // Largest hub_status frame; bigger updates are paginated
+ #define STATUS_PAGE_TAIL 64          // Room kept for the closing fields of a page
+ #define WIFI_POLL_INTERVAL 100       // ms between WiFi connector polls; bounds time-to-connected resolution
+ #define WIFI_CACHE_ADDR (EEPROM_SIZE - WIFI_CACHE_SIZE)  // Last good connection (see wifi_connector.h)
+ #define CONFIG_STORE_ADDR 0          // Two HubConfig slots (see config_store.h)
+ #define CONFIG_VERSION 1             // Layout version of HubConfig
+ #define BUTTON_DEBOUNCE_MS 50
+ #define BUTTON_LONG_PRESS_MS 1000
+ #define FACTORY_RESET_HOLD_MS 5000
+ #define DEVICE_LIVENESS_TIMEOUT_MS 95000  // Three missed 30 s device heartbeats, plus slack
+ #define LIVENESS_FIRED_MAX 16        // Expired deadlines handled per liveness tick
+ #define OFFLINE_STATUS "offline"     // Status given to a device that missed its deadline
+ #define NET_CORE 0                   // Network I/O, with AsyncTCP (see platformio.ini); loop() runs on core 1
+ #define NET_TASK_STACK 8192
+ #define NET_TASK_PRIORITY 2          // Above the loop task, below AsyncTCP
+ #define LINK_BURST 8                 // Messages taken from each core link per scheduler pass
+ #define LOG_TASK_PRIORITY 1          // Drains the log ring to Serial (see async_log.h); below the net task
+ #define CLIMATE_CORE 1               // DHT11 task, beside the loop; its interrupts-off bit read stays off the network core
+ #define CLIMATE_TASK_PRIORITY 1      // Same as the loop task, so neither starves the other
  
  // Global variables
  String internetSSID = "";
@@ -45,83 +96,304 @@
  String username = "";
  String password = "";
  String uniqueId = "";
- bool isConfigured = false;
+ bool isConfigured = false;         // A configuration was found in (or migrated to) configStore
  bool alarmState = false;
- float temperature = 0;
+ float temperature = 0;               // Latest filtered DHT11 values (see climate_sensor.h)
  float humidity = 0;
+ bool climateStale = true;            // No good DHT11 reading recently; temperature and humidity are old
  float batteryPercentage = 0;
- unsigned long lastTempReadTime = 0;
- unsigned long lastHeartbeatTime = 0;
- String connectedDevices[MAX_DEVICES];
- String deviceTypes[MAX_DEVICES];
- String deviceStatus[MAX_DEVICES];
- IPAddress deviceIPs[MAX_DEVICES];
- int numConnectedDevices = 0;
+ DeviceRegistry registry;             // Registered sub-devices (see device_registry.h)
+ DeviceJournal journal;               // Registry copy on LittleFS, restored at boot (see device_journal.h)
+ RuleEngine rules;                    // Automation rules run on the hub itself (see rule_engine.h)
+ uint32_t deviceFrameUs = 0;          // micros() when the device frame being handled left the inbox
+ uint32_t alertReceivedUs = 0;        // micros() when the alert being handled reached the hub; 0 if it came the slow way
+ AlertBacklog alertBacklog;           // Alerts waiting for the server, sent before the uplink queue (see alert_lane.h)
+ Scheduler scheduler;                 // Runs every periodic job from loop() (see scheduler.h)
+ uint32_t unknownServerMessages = 0;  // Frames whose "type" has no handler, per path
+ uint32_t unknownDeviceMessages = 0;
+ UplinkBatcher uplink;                // Non-urgent events waiting to go to the server (see uplink_batcher.h)
+ volatile bool uplinkFlushNow = false; // Set when a batch fills before its window ends
+ UplinkQueue uplinkQueue;             // Frames held while the server link is down (see uplink_queue.h)
+ bool cloudConnected = false;         // Server WebSocket up, as last reported by the net task
+ bool cloudReady = false;             // Connected and authenticated; queued frames may drain
+ bool statusAfterDrain = false;       // Send a hub_status snapshot once the backlog is gone
+ uint32_t statusEpoch = 0;            // Random per boot; sequence numbers restart with it
+ uint32_t cloudStatusEpoch = 0;       // Epoch and sequence the server last confirmed having
+ uint32_t cloudStatusSeq = 0;
+ UplinkEncoder uplinkEncoder;         // Session dictionary for binary uplink frames (see uplink_codec.h)
+ bool cloudBinary = false;            // Server accepted binary uplink frames at auth
+ CommandLatency commandLatency;       // Control-to-reply times per device type (see command_latency.h)
+ TimerWheel liveness;                 // One deadline per registry index (see timer_wheel.h)
+ 
+ // Settings that survive a reboot, stored as one block; strings are NUL-terminated
+ struct __attribute__((packed)) HubConfig {
+   char ssid[33];
+   char wifiPassword[65];
+   char username[33];
+   char password[65];
+   char uniqueId[13];
+ };
+ static_assert(CONFIG_STORE_ADDR + CONFIG_STORE_SIZE(sizeof(HubConfig)) <= WIFI_CACHE_ADDR, 
+               "config store overlaps the WiFi cache");
+ ConfigStore configStore;             // Double-buffered, CRC-checked HubConfig (see config_store.h)
+ 
+ // What /metrics shows of each task's state. The loop and net tasks publish a
+ // copy once a second; the scrape, on AsyncTCP, reads only these (see hub_metrics.h).
+ struct LinkStats {
+   uint32_t used;
+   uint32_t peak;
+   uint32_t dropped;
+ };
+ 
+ struct LoopSnapshot {
+   HubMetrics counters;
+   uint32_t configLoadUs;
+   uint32_t registryLoadUs;
+   uint32_t restoredDevices;
+   int taskCount;
+   const char *taskNames[MAX_SCHEDULER_TASKS];   // Static strings given to addTask()
+   uint32_t taskMaxRunUs[MAX_SCHEDULER_TASKS];
+   uint32_t unknownServerMessages;
+   uint32_t unknownDeviceMessages;
+   bool cloudReady;
+   uint32_t wifiBootConnectMs;
+   uint32_t wifiConnectMs;
+   bool wifiFastPath;
+   uint32_t devices;
+   uint32_t devicesBound;
+   uint32_t devicesOnline;
+   uint32_t boundClients[REGISTRY_CAPACITY];   // The first devicesBound are valid
+   uint32_t journalBytes;
+   uint32_t journalRecords;
+   uint32_t journalCompactions;
+   uint32_t rulesVersion;
+   uint32_t rules;
+   uint32_t rulesFired;
+   uint32_t alertBacklogDepth;
+   uint32_t alertsHeld;
+   uint32_t uplinkQueueDepth;
+   uint32_t uplinkQueueDropped;
+   uint32_t jsonPoolExhausted;
+   float batteryVolts;
+   float batteryPercent;
+   uint32_t buttonEdges;
+   uint32_t buttonEdgesDropped;
+   LinkStats deviceOutbox;              // Rings the loop task produces into
+   LinkStats cloudOutbox;
+   LinkStats alertOutbox;
+ };
+ 
+ struct NetSnapshot {
+   NetMetrics counters;
+   uint32_t fanouts;
+   uint32_t fanoutSends;
+   uint32_t fanoutSkipped;
+   uint32_t fanoutClosed;
+   uint32_t fanoutLastClients;
+   int32_t fanoutLastHeapBytes;
+   LinkStats cloudInbox;                // The ring the net task produces into
+ };
+ 
+ SeqLockSnapshot<LoopSnapshot> loopSnapshot;
+ SeqLockSnapshot<NetSnapshot> netSnapshot;
+ 
+ // Messages between the cores, one producer and one consumer each (see core_link.h)
+ uint8_t deviceInboxBuffer[8192];
+ uint8_t deviceOutboxBuffer[4096];
+ uint8_t cloudInboxBuffer[4096];
+ uint8_t cloudOutboxBuffer[8192];
+ uint8_t alertInboxBuffer[2048];
+ uint8_t alertOutboxBuffer[1024];
+ CoreLink deviceInbox(deviceInboxBuffer, sizeof(deviceInboxBuffer));
+ CoreLink deviceOutbox(deviceOutboxBuffer, sizeof(deviceOutboxBuffer));
+ CoreLink cloudInbox(cloudInboxBuffer, sizeof(cloudInboxBuffer));
+ CoreLink cloudOutbox(cloudOutboxBuffer, sizeof(cloudOutboxBuffer));
+ CoreLink alertInbox(alertInboxBuffer, sizeof(alertInboxBuffer));
+ CoreLink alertOutbox(alertOutboxBuffer, sizeof(alertOutboxBuffer));
+ 
+ // Owned by the net task
+ Scheduler netScheduler;              // Jobs of the net task on NET_CORE
+ LinkKind pendingCloudEvent = LINK_CLOUD_DISCONNECTED;
+ bool cloudEventPending = false;      // Link event still to be posted to cloudInbox
+ 
+ // Internet WiFi; serviceWiFi starts wifiLink, which then retries on its own
+ enum WifiState {
+   WIFI_IDLE,        // Not configured or no credentials
+   WIFI_PENDING,     // Connect requested, waiting for wifiStateSince + wifiDelay
+   WIFI_STARTED      // wifiLink owns the connection
+ };
+ WifiState wifiState = WIFI_IDLE;
+ unsigned long wifiStateSince = 0;
+ unsigned long wifiDelay = 0;
+ WifiConnector wifiLink;              // Cached fast path, scan fallback with backoff (see wifi_connector.h)
+ 
+ // While set, updateLCD() leaves a temporary screen (alert, device info) alone
+ unsigned long lcdHoldUntil = 0;
+ 
+ // Button edges from the pin interrupts, turned into gestures by checkButtons (see button_input.h)
+ uint8_t buttonPins[BUTTON_COUNT] = {BUTTON1_PIN, BUTTON2_PIN, BUTTON3_PIN};  // Not const: read from the ISR, so kept in RAM
+ ButtonEdgeQueue buttonEdges;
+ GestureRecognizer gestures(BUTTON_DEBOUNCE_MS, BUTTON_LONG_PRESS_MS, FACTORY_RESET_HOLD_MS);
  
  // Initialize objects
  DHT dht(DHT_PIN, DHT11);
+ ClimateSensor climate(dht);          // Samples the DHT11 on its own task
+ BatteryMonitor battery(VOLTAGE_SENSOR_PIN, BATTERY_DIVIDER_RATIO);  // Calibrated, oversampled (see battery_monitor.h)
  LiquidCrystal_I2C lcd(LCD_ADDR, LCD_COLS, LCD_ROWS);
+ LcdFrameBuffer display(lcd);         // All screens draw here; only changed cells reach the LCD
  WebSocketsClient webSocket;          // Client for cloud server
  AsyncWebServer server(80);           // HTTP server for setup
  AsyncWebSocket ws("/ws");            // WebSocket server for sub-devices
+ WsFanout fanout(ws);                 // Frames for many sub-devices, one shared copy each (net task)
+ // Held by AsyncTCP for every sub-device WebSocket event, and by the net task while it
+ // looks up and sends to clients, so neither sees a client the other is adding or freeing
+ std::recursive_mutex wsClientsLock;
+ // Set when a client's disconnect could not be posted to the loop task; the loop then
+ // has the net task check every bound client (see checkBindings), so no unbind is lost
+ std::atomic<bool> bindingsStale(false);
  
  // Function prototypes
  void setupAP();
  void handleSetup();
  void sendAuthMessage();
  void connectToInternet();
+ void scheduleInternetConnect(unsigned long delayMs);
+ void serviceWiFi();
+ void onWifiEvent(ConnectorEvent event);
+ void showWiFiConnecting();
  void connectToWebSocketServer();
  void webSocketEvent(WStype_t type, uint8_t * payload, size_t length);
- void processSubDeviceMessage(String message);
- void processServerMessage(String message);
+ void processSubDeviceMessage(uint32_t clientId, uint32_t ip, const char *data, size_t length);
+ void processSubDeviceFrame(uint32_t clientId, uint32_t ip, const uint8_t *data, size_t length);
+ void processServerMessage(const char *data, size_t length);
  void sendHeartbeat();
  void updateLCD();
+ void serviceLCD();
+ void onButtonEdge(void *arg);
  void checkButtons();
+ void handleButtonEvent(const ButtonEvent &event);
+ void showNextDevice();
  void readSensors();
+ void sampleBattery();
  void triggerAlarm(bool state);
+ void setAlarmOutput(bool state);
  void saveConfiguration();
  void loadConfiguration();
- void handleNewDevice(String deviceId, String deviceType, IPAddress ipAddress);
+ void applySetup(const HubConfig &setup);
+ bool loadLegacyConfiguration(HubConfig &config);
+ void handleNewDevice(const char *deviceId, const char *deviceType, uint32_t clientId, uint32_t ip, bool compact);
+ void removeDevice(const char *deviceId);
  String generateUniqueId();
  void handleWebSocketMessage(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
  void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len);
- void forwardCommandToDevice(String deviceId, String command);
- void confirmDeviceRegistration(String deviceId);
- void notifyServerNewDevice(String deviceId, String deviceType);
- void updateDeviceStatus(String deviceId, String status);
- void handleDeviceAlert(String deviceId, String alertType);
+ void forwardCommandToDevice(const char *deviceId, const char *command, uint32_t corrId);
+ void commandSent(int deviceIndex, uint32_t corrId);
+ void commandAnswered(const char *deviceId, uint32_t corrId);
+ void deviceSeen(int deviceIndex);
+ void deviceSeen(const char *deviceId);
+ void markDeviceOffline(int deviceIndex, uint32_t silentMs);
+ void restoreDeviceLiveness();
+ void confirmDeviceRegistration(const char *deviceId);
+ void notifyServerNewDevice(const char *deviceId, const char *deviceType);
+ void updateDeviceStatus(const char *deviceId, const char *status);
+ void handleDeviceAlert(const char *deviceId, const char *alertType);
+ void sendAlertToServer(const char *deviceId, const char *alertType);
+ void broadcastAlert(const char *deviceId, const char *alertType);
+ bool sendAlertBacklog();
+ void handleRulesPage(JsonDocument &doc);
+ void runRules(uint32_t event, const char *deviceId, const char *value, uint32_t startUs);
+ void runRuleAction(uint8_t kind, const char *deviceId, const char *command, bool state);
+ bool sendJsonToServer(JsonDocument &doc);
+ bool sendJsonToClient(uint32_t clientId, JsonDocument &doc);
+ bool sendToDevice(uint32_t clientId, LinkKind kind, const void *data, size_t length);
+ bool sendToDevices(const uint32_t *clientIds, int count, LinkKind kind, const void *data, size_t length);
+ bool broadcastToSubDevices(JsonDocument &doc);
+ bool sendToCloud(LinkKind kind, const void *data, size_t length, size_t jsonLength);
+ void serviceInboxes();
+ void checkBindings();
+ void reportClientsGone(const uint32_t *clientIds, uint32_t count);
+ void netTask(void *parameter);
+ void openCloudSocket(const char *path);
+ void postCloudEvent(LinkKind kind);
+ void pumpNetOutboxes();
+ void queueUplink(UplinkKind kind, const char *deviceId, const char *value);
+ void flushUplink();
+ void sendUplink(JsonDocument &doc, UplinkPriority priority);
+ bool sendUplinkNow(JsonDocument &doc);
+ bool sendQueuedFrame(const char *frame, size_t length);
+ void drainUplinkQueue();
  void sendStatusUpdate();
+ void sendStatusSince(uint32_t epoch, uint32_t sinceSeq);
+ void sendHubStatus(bool full, uint32_t sinceSeq);
+ void addCommandLatency(JsonDocument &doc);
+ void holdLCD(unsigned long durationMs);
+ void checkFactoryResetButtons();
+ void factoryReset();
+ void checkInactiveDevices();
+ void checkServerConnection();
+ void reportLoopStats();
+ void sampleMetrics();
+ void publishNetMetrics();
+ LinkStats linkStats(const CoreLink &link);
+ void handleMetrics(AsyncWebServerRequest *request);
  
  void setup() {
    // Initialize serial for debugging
+   // Logging goes through a ring drained by its own task on the network core
    Serial.begin(115200);
-   Serial.println("Smart Home Hub starting...");
+   asyncLog.begin(Serial);
+   asyncLog.startTask(LOG_TASK_PRIORITY, NET_CORE);
+   LOG_INFO("Smart Home Hub starting...");
    
-   // Initialize EEPROM
+   // Initialize EEPROM; the config store reads its slots from this image
    EEPROM.begin(EEPROM_SIZE);
+   configStore.begin(CONFIG_STORE_ADDR, sizeof(HubConfig), CONFIG_VERSION);
+   
+   // Store-and-forward queue for the server link (mounts LittleFS)
+   uplinkQueue.begin();
+   statusEpoch = esp_random();
+   
+   // Devices known before the reboot, restored before anything can connect
+   int restored = journal.load(registry);
+   LOG_INFO("Restored %d devices from %u journal records in %u us", 
+                 restored, journal.loadedRecords(), journal.loadUs());
+   // Local rules, so automations run even before the server is reachable
+   rules.begin();
    
    // Initialize pins
    pinMode(BUTTON1_PIN, INPUT_PULLUP);
    pinMode(BUTTON2_PIN, INPUT_PULLUP);
    pinMode(BUTTON3_PIN, INPUT_PULLUP);
+   // Buttons already held at boot (a factory reset chord) count from now
+   for (int i = 0; i < BUTTON_COUNT; i++) {
+     buttonEdges.push(i, digitalRead(buttonPins[i]) == LOW, millis());
+   }
+   for (int i = 0; i < BUTTON_COUNT; i++) {
+     attachInterruptArg(buttonPins[i], onButtonEdge, (void*)(uintptr_t)i, CHANGE);
+   }
    pinMode(ALARM_PIN, OUTPUT);
    digitalWrite(ALARM_PIN, LOW);
    
-   // Initialize DHT sensor
-   dht.begin();
+   // DHT11 sampling runs on its own task from here on; the loop only reads snapshots
+   climate.begin(CLIMATE_TASK_PRIORITY, CLIMATE_CORE);
+   battery.begin();
+   LOG_INFO("Battery ADC calibration: %s", battery.calibration());
    
    // Initialize LCD
    Wire.begin();
    lcd.init();
    lcd.backlight();
    lcd.clear();
-   lcd.setCursor(0, 0);
-   lcd.print("Smart Home Hub");
-   lcd.setCursor(0, 1);
-   lcd.print("Initializing...");
+   display.clear();
+   display.setCursor(0, 0);
+   display.print("Smart Home Hub");
+   display.setCursor(0, 1);
+   display.print("Initializing...");
+   display.refresh();
    
    // Load configuration if available
    loadConfiguration();
+   wifiLink.onEvent(onWifiEvent);
    
    if (!isConfigured) {
      // First time setup - generate unique ID and start AP mode
@@ -151,13 +423,17 @@
      server.on("/setup", HTTP_GET, [](AsyncWebServerRequest *request){
        if (request->hasParam("ssid") && request->hasParam("pass") && 
            request->hasParam("user") && request->hasParam("pwd")) {
-         internetSSID = request->getParam("ssid")->value();
-         internetPassword = request->getParam("pass")->value();
-         username = request->getParam("user")->value();
-         password = request->getParam("pwd")->value();
-         
-         isConfigured = true;
-         saveConfiguration();
+         // The loop task owns the settings; it saves them and starts the connection (see applySetup)
+         HubConfig setup;
+         memset(&setup, 0, sizeof(setup));
+         strlcpy(setup.ssid, request->getParam("ssid")->value().c_str(), sizeof(setup.ssid));
+         strlcpy(setup.wifiPassword, request->getParam("pass")->value().c_str(), sizeof(setup.wifiPassword));
+         strlcpy(setup.username, request->getParam("user")->value().c_str(), sizeof(setup.username));
+         strlcpy(setup.password, request->getParam("pwd")->value().c_str(), sizeof(setup.password));
+         if (!deviceInbox.send(LINK_SETUP, NO_CLIENT, 0, &setup, sizeof(setup))) {
+           request->send(503, "text/plain", "Hub busy, please try again");
+           return;
+         }
          
          String html = "<!DOCTYPE html><html>";
          html += "<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">";
@@ -168,14 +444,6 @@
          html += "<p>The hub will now connect to your WiFi network.</p>";
          html += "<p>You can close this page.</p></body></html>";
          request->send(200, "text/html", html);
-         
-         // Connect to WiFi after a short delay
-         xTaskCreate([](void* parameter) {
-           delay(3000);
-           connectToInternet();
-           connectToWebSocketServer();
-           vTaskDelete(NULL);
-         }, "connectTask", 4096, NULL, 1, NULL);
        } else {
          request->send(400, "text/plain", "Missing parameters");
        }
@@ -183,50 +451,55 @@
      
      server.begin();
    } else {
-     // Normal operation - connect to WiFi and server
+     // Normal operation - connect to WiFi (the server link follows once online)
      connectToInternet();
-     connectToWebSocketServer();
      setupAP();  // Also start AP for sub-devices
    }
    
    // Setup WebSocket server for sub-devices
    ws.onEvent(onEvent);
    server.addHandler(&ws);
-   Serial.println("WebSocket server started for sub-devices");
- }
- 
- void loop() {
-   // Handle WebSocket client communication with cloud server
-   webSocket.loop();
-   
-   // Clean inactive WebSocket clients (for sub-devices)
-   ws.cleanupClients();
-   
-   // Read sensor data periodically
-   unsigned long currentMillis = millis();
-   if (currentMillis - lastTempReadTime > 5000) {  // every 5 seconds
-     readSensors();
-     lastTempReadTime = currentMillis;
-   }
-   
-   // Send heartbeat to server periodically
-   if (currentMillis - lastHeartbeatTime > 30000) {  // every 30 seconds
-     sendHeartbeat();
-     lastHeartbeatTime = currentMillis;
+   // Prometheus scrape target (see hub_metrics.h)
+   server.on("/metrics", HTTP_GET, handleMetrics);
+   if (isConfigured) {
+     server.begin();  // Setup mode already started the server above
    }
+   LOG_INFO("WebSocket server started for sub-devices");
    
-   // Check buttons for local control
-   checkButtons();
+   // Register periodic jobs; none of them may block
+   scheduler.addTask("inbox", serviceInboxes, 0);
+   scheduler.addTask("wifi", serviceWiFi, WIFI_POLL_INTERVAL);
+   scheduler.addTask("buttons", checkButtons, 10);
+   scheduler.addTask("factoryReset", checkFactoryResetButtons, 50);
+   scheduler.addTask("lcd", serviceLCD, LCD_REFRESH_MS);
+   scheduler.addTask("sensors", readSensors, CLIMATE_INTERVAL_MS);
+   scheduler.addTask("battery", sampleBattery, BATTERY_SAMPLE_INTERVAL);
+   scheduler.addTask("heartbeat", sendHeartbeat, 30000);
+   scheduler.addTask("uplink", flushUplink, UPLINK_POLL_INTERVAL);
+   scheduler.addTask("uplinkDrain", drainUplinkQueue, UPLINK_DRAIN_INTERVAL);
+   scheduler.addTask("serverLink", checkServerConnection, 1000);
+   liveness.begin(millis());
+   restoreDeviceLiveness();
+   scheduler.addTask("liveness", checkInactiveDevices, TIMER_WHEEL_TICK_MS);
+   scheduler.addTask("journal", []() { journal.service(); }, JOURNAL_FLUSH_INTERVAL);
+   scheduler.addTask("loopStats", reportLoopStats, 60000);
+   scheduler.addTask("metrics", sampleMetrics, 1000);
+   sampleMetrics();
    
-   // Update LCD display
-   updateLCD();
+   // Network I/O moves to the other core; from here on only core links cross between them
+   netScheduler.addTask("cloudSocket", []() { webSocket.loop(); }, 0);
+   netScheduler.addTask("outbox", pumpNetOutboxes, 0);
+   netScheduler.addTask("metrics", publishNetMetrics, 1000);
+   publishNetMetrics();
+   xTaskCreatePinnedToCore(netTask, "net", NET_TASK_STACK, nullptr, NET_TASK_PRIORITY, nullptr, NET_CORE);
    
-   // Handle WiFi reconnection if needed
-   if (isConfigured && WiFi.status() != WL_CONNECTED) {
-     Serial.println("WiFi connection lost. Reconnecting...");
-     connectToInternet();
-     connectToWebSocketServer();
-   }
+   display.refresh();
+ }
+ 
+ void loop() {
+   // Everything runs as a non-blocking scheduler task
+   scheduler.run();
+   metrics.loopUs.observe(scheduler.lastLoopUs());
  }
  
  String generateUniqueId() {
@@ -245,224 +518,225 @@
  void setupAP() {
    String apSSID = AP_SSID_PREFIX + uniqueId.substring(0, 6);
    
-   Serial.println("Setting up Access Point...");
-   Serial.print("SSID: ");
-   Serial.println(apSSID);
+   LOG_INFO("Setting up Access Point %s", apSSID.c_str());
    
    // Start AP with unique SSID
    WiFi.softAP(apSSID.c_str(), uniqueId.c_str());
    
    IPAddress IP = WiFi.softAPIP();
-   Serial.print("AP IP address: ");
-   Serial.println(IP);
+   LOG_INFO("AP IP address: %s", IP.toString().c_str());
    
-   lcd.clear();
-   lcd.setCursor(0, 0);
-   lcd.print("AP Mode Active");
-   lcd.setCursor(0, 1);
-   lcd.print("SSID: " + apSSID);
-   lcd.setCursor(0, 2);
-   lcd.print("Pass: " + uniqueId);
+   display.clear();
+   display.setCursor(0, 0);
+   display.print("AP Mode Active");
+   display.setCursor(0, 1);
+   display.print("SSID: " + apSSID);
+   display.setCursor(0, 2);
+   display.print("Pass: " + uniqueId);
  }
  
  void saveConfiguration() {
-   // Save configuration to EEPROM
-   int addr = 0;
+   HubConfig config;
+   memset(&config, 0, sizeof(config));
+   // A value too long for its field is cut short instead of running into the next one
+   strlcpy(config.ssid, internetSSID.c_str(), sizeof(config.ssid));
+   strlcpy(config.wifiPassword, internetPassword.c_str(), sizeof(config.wifiPassword));
+   strlcpy(config.username, username.c_str(), sizeof(config.username));
+   strlcpy(config.password, password.c_str(), sizeof(config.password));
+   strlcpy(config.uniqueId, uniqueId.c_str(), sizeof(config.uniqueId));
    
-   // Save isConfigured flag
-   EEPROM.write(addr, isConfigured ? 1 : 0);
-   addr += 1;
-   
-   // Save WiFi SSID (length + data)
-   EEPROM.write(addr, internetSSID.length());
-   addr += 1;
-   for (int i = 0; i < internetSSID.length(); i++) {
-     EEPROM.write(addr + i, internetSSID[i]);
+   if (configStore.save(config)) {
+     LOG_INFO("Configuration saved (seq %u)", configStore.sequence());
+   } else {
+     LOG_ERROR("Configuration save failed");
    }
-   addr += internetSSID.length();
-   
-   // Save WiFi password (length + data)
-   EEPROM.write(addr, internetPassword.length());
+ }
+ 
+ // Settings from the setup page, posted by the AsyncTCP task
+void applySetup(const HubConfig &setup) {
+  internetSSID = setup.ssid;
+  internetPassword = setup.wifiPassword;
+  username = setup.username;
+  password = setup.password;
+  isConfigured = true;
+  saveConfiguration();
+  
+  // Connect to WiFi after a short delay (lets the setup page's response go out first)
+  scheduleInternetConnect(3000);
+}
+
+// Read one length-prefixed string of the pre-store layout; false if it cannot be one
+ bool readLegacyField(int &addr, char *dest, size_t size) {
+   int length = EEPROM.read(addr);
    addr += 1;
-   for (int i = 0; i < internetPassword.length(); i++) {
-     EEPROM.write(addr + i, internetPassword[i]);
+   if (length >= (int)size || addr + length > EEPROM_SIZE) {
+     return false;
    }
-   addr += internetPassword.length();
-   
-   // Save username (length + data)
-   EEPROM.write(addr, username.length());
-   addr += 1;
-   for (int i = 0; i < username.length(); i++) {
-     EEPROM.write(addr + i, username[i]);
+   for (int i = 0; i < length; i++) {
+     dest[i] = (char)EEPROM.read(addr + i);
    }
-   addr += username.length();
-   
-   // Save password (length + data)
-   EEPROM.write(addr, password.length());
-   addr += 1;
-   for (int i = 0; i < password.length(); i++) {
-     EEPROM.write(addr + i, password[i]);
+   dest[length] = '\0';
+   addr += length;
+   return true;
+ }
+ 
+ // The layout before the config store: a configured flag, then five length-prefixed strings
+ bool loadLegacyConfiguration(HubConfig &config) {
+   memset(&config, 0, sizeof(config));
+   int addr = 0;
+   if (EEPROM.read(addr) != 1) {
+     return false;
    }
-   addr += password.length();
-   
-   // Save uniqueId (length + data)
-   EEPROM.write(addr, uniqueId.length());
    addr += 1;
-   for (int i = 0; i < uniqueId.length(); i++) {
-     EEPROM.write(addr + i, uniqueId[i]);
-   }
-   
-   EEPROM.commit();
-   Serial.println("Configuration saved to EEPROM");
+   return readLegacyField(addr, config.ssid, sizeof(config.ssid)) &&
+          readLegacyField(addr, config.wifiPassword, sizeof(config.wifiPassword)) &&
+          readLegacyField(addr, config.username, sizeof(config.username)) &&
+          readLegacyField(addr, config.password, sizeof(config.password)) &&
+          readLegacyField(addr, config.uniqueId, sizeof(config.uniqueId));
  }
  
  void loadConfiguration() {
-   // Load configuration from EEPROM
-   int addr = 0;
+   HubConfig config;
+   isConfigured = configStore.load(config);
    
-   // Load isConfigured flag
-   isConfigured = EEPROM.read(addr) == 1;
-   addr += 1;
+   // First boot after the update: the settings are still in the old layout
+   bool migrated = false;
+   uint32_t legacyUs = 0;
+   if (!isConfigured) {
+     uint32_t legacyStart = micros();
+     migrated = loadLegacyConfiguration(config);
+     legacyUs = micros() - legacyStart;
+     isConfigured = migrated;
+   }
    
    if (isConfigured) {
-     // Load WiFi SSID
-     int ssidLength = EEPROM.read(addr);
-     addr += 1;
-     internetSSID = "";
-     for (int i = 0; i < ssidLength; i++) {
-       internetSSID += (char)EEPROM.read(addr + i);
-     }
-     addr += ssidLength;
-     
-     // Load WiFi password
-     int passLength = EEPROM.read(addr);
-     addr += 1;
-     internetPassword = "";
-     for (int i = 0; i < passLength; i++) {
-       internetPassword += (char)EEPROM.read(addr + i);
-     }
-     addr += passLength;
-     
-     // Load username
-     int userLength = EEPROM.read(addr);
-     addr += 1;
-     username = "";
-     for (int i = 0; i < userLength; i++) {
-       username += (char)EEPROM.read(addr + i);
-     }
-     addr += userLength;
-     
-     // Load password
-     int pwdLength = EEPROM.read(addr);
-     addr += 1;
-     password = "";
-     for (int i = 0; i < pwdLength; i++) {
-       password += (char)EEPROM.read(addr + i);
-     }
-     addr += pwdLength;
-     
-     // Load uniqueId
-     int idLength = EEPROM.read(addr);
-     addr += 1;
-     uniqueId = "";
-     for (int i = 0; i < idLength; i++) {
-       uniqueId += (char)EEPROM.read(addr + i);
+     internetSSID = config.ssid;
+     internetPassword = config.wifiPassword;
+     username = config.username;
+     password = config.password;
+     uniqueId = config.uniqueId;
+     if (migrated) {
+       saveConfiguration();
+       LOG_INFO("Configuration migrated from the old EEPROM layout, which took %u us to read", legacyUs);
      }
-     
-     Serial.println("Configuration loaded from EEPROM");
-     Serial.print("SSID: ");
-     Serial.println(internetSSID);
-     Serial.print("UniqueID: ");
-     Serial.println(uniqueId);
+     LOG_INFO("Configuration loaded in %u us (seq %u), SSID %s, unique ID %s", 
+              configStore.loadUs(), configStore.sequence(), internetSSID.c_str(), uniqueId.c_str());
    } else {
-     Serial.println("No configuration found in EEPROM");
+     LOG_INFO("No configuration found in EEPROM");
      uniqueId = generateUniqueId();
    }
  }
  
+ // Start connecting to the internet WiFi; wifiLink reports back through onWifiEvent()
  void connectToInternet() {
    if (internetSSID.length() > 0) {
-     Serial.println("Connecting to WiFi network...");
-     lcd.clear();
-     lcd.setCursor(0, 0);
-     lcd.print("Connecting to");
-     lcd.setCursor(0, 1);
-     lcd.print(internetSSID);
-     
-     WiFi.begin(internetSSID.c_str(), internetPassword.c_str());
-     
-     int attempts = 0;
-     while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-       delay(500);
-       Serial.print(".");
-       lcd.setCursor(attempts % 16, 2);
-       lcd.print(".");
-       attempts++;
-     }
-     
-     if (WiFi.status() == WL_CONNECTED) {
-       Serial.println("");
-       Serial.println("WiFi connected");
-       Serial.print("IP address: ");
-       Serial.println(WiFi.localIP());
+     LOG_INFO("Connecting to WiFi network...");
+     showWiFiConnecting();
+     wifiLink.begin(internetSSID.c_str(), internetPassword.c_str(), WIFI_CACHE_ADDR);
+     wifiState = WIFI_STARTED;
+   } else {
+     LOG_INFO("No WiFi credentials available");
+     wifiState = WIFI_IDLE;
+   }
+ }
+ 
+ // Request a connection attempt after delayMs
+ void scheduleInternetConnect(unsigned long delayMs) {
+   wifiDelay = delayMs;
+   wifiStateSince = millis();
+   wifiState = WIFI_PENDING;
+ }
+ 
+ // Polled by the scheduler every WIFI_POLL_INTERVAL
+ void serviceWiFi() {
+   if (wifiState == WIFI_PENDING && millis() - wifiStateSince >= wifiDelay) {
+     connectToInternet();
+   }
+   wifiLink.service();
+ }
+ 
+ void showWiFiConnecting() {
+   display.clear();
+   display.setCursor(0, 0);
+   display.print("Connecting to");
+   display.setCursor(0, 1);
+   display.print(internetSSID);
+   holdLCD(WIFI_SCAN_TIMEOUT_MS);
+ }
+ 
+ void onWifiEvent(ConnectorEvent event) {
+   switch (event) {
+     case CONNECTOR_CONNECTED:
+       display.clear();
+       display.setCursor(0, 0);
+       display.print("WiFi Connected");
+       display.setCursor(0, 1);
+       display.print(WiFi.localIP());
+       holdLCD(2000);
        
-       lcd.clear();
-       lcd.setCursor(0, 0);
-       lcd.print("WiFi Connected");
-       lcd.setCursor(0, 1);
-       lcd.print(WiFi.localIP());
-     } else {
-       Serial.println("");
-       Serial.println("WiFi connection failed");
+       metrics.wifiConnects++;
+       connectToWebSocketServer();
+       break;
        
-       lcd.clear();
-       lcd.setCursor(0, 0);
-       lcd.print("WiFi Failed");
-       lcd.setCursor(0, 1);
-       lcd.print("Check settings");
-     }
-   } else {
-     Serial.println("No WiFi credentials available");
+     case CONNECTOR_LOST:
+       showWiFiConnecting();
+       break;
+       
+     case CONNECTOR_FAILED:
+       display.clear();
+       display.setCursor(0, 0);
+       display.print("WiFi Failed");
+       display.setCursor(0, 1);
+       display.print("Check settings");
+       holdLCD(2000);
+       break;
    }
  }
  
  void connectToWebSocketServer() {
    if (WiFi.status() == WL_CONNECTED) {
-     // Connect to WebSocket server
-     Serial.println("Connecting to WebSocket server...");
-     
-     // Set server address and port - replace with your actual FastAPI server details
-     webSocket.begin("https://well-scallop-cybergenii-075601d4.koyeb.app", 8080, "/ws/hub/" + uniqueId);
-     
-     // Set event handler
-     webSocket.onEvent(webSocketEvent);
-     
-     // Retry interval (ms)
-     webSocket.setReconnectInterval(5000);
-     
-     Serial.println("WebSocket connection established");
+     // The net task owns the client and opens the connection (see openCloudSocket)
+     LOG_INFO("Connecting to WebSocket server...");
+     String path = "/ws/hub/" + uniqueId;
+     cloudOutbox.send(LINK_CLOUD_OPEN, NO_CLIENT, 0, path.c_str(), path.length());
    }
  }
  
+ // Net task: start (or restart) the server connection
+ void openCloudSocket(const char *path) {
+   // Set server address and port - replace with your actual FastAPI server details
+   webSocket.begin("https://well-scallop-cybergenii-075601d4.koyeb.app", 8080, path);
+   
+   // Set event handler
+   webSocket.onEvent(webSocketEvent);
+   
+   // Retry interval (ms)
+   webSocket.setReconnectInterval(5000);
+   
+   LOG_INFO("WebSocket connection established");
+ }
+ 
+ // Net task: hand server link events and frames to the loop task
  void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
    switch(type) {
      case WStype_DISCONNECTED:
-       Serial.println("WebSocket disconnected from server");
+       LOG_WARN("WebSocket disconnected from server");
+       postCloudEvent(LINK_CLOUD_DISCONNECTED);
        break;
        
      case WStype_CONNECTED:
-       Serial.println("WebSocket connected to server");
-       // Send authentication message
-       sendAuthMessage();
+       LOG_INFO("WebSocket connected to server");
+       postCloudEvent(LINK_CLOUD_CONNECTED);
        break;
        
      case WStype_TEXT:
-       Serial.printf("WebSocket received text from server: %s\n", payload);
-       processServerMessage(String((char*)payload));
+       if (length > FRAME_BUFFER_SIZE || !cloudInbox.send(LINK_CLOUD_TEXT, NO_CLIENT, 0, payload, length)) {
+         LOG_WARN("Server message too large or cloud inbox full, dropped");
+       }
        break;
        
      case WStype_ERROR:
-       Serial.println("WebSocket error with server connection");
+       LOG_WARN("WebSocket error with server connection");
        break;
        
      default:
@@ -471,13 +745,21 @@
  }
  
  void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+   // A disconnecting client is freed when this returns; not while the net task is sending to it
+   std::lock_guard<std::recursive_mutex> lock(wsClientsLock);
    switch (type) {
      case WS_EVT_CONNECT:
-       Serial.printf("WebSocket client #%u connected from IP %s\n", client->id(), client->remoteIP().toString().c_str());
+       LOG_INFO("WebSocket client #%u connected from IP %s", client->id(), client->remoteIP().toString().c_str());
+       // Close the oldest clients beyond the library's limit, here on the task that owns the list
+       ws.cleanupClients();
        break;
        
      case WS_EVT_DISCONNECT:
-       Serial.printf("WebSocket client #%u disconnected\n", client->id());
+       // The loop task drops the device binding so no command is routed to a dead client
+       if (!deviceInbox.send(LINK_DEVICE_DISCONNECTED, client->id(), 0, nullptr, 0)) {
+         bindingsStale = true;
+         LOG_WARN("Device inbox full, bindings will be checked for client #%u", client->id());
+       }
        break;
        
      case WS_EVT_DATA:
@@ -492,477 +774,1494 @@
  
  void handleWebSocketMessage(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
    AwsFrameInfo *info = (AwsFrameInfo*)arg;
-   if (info->final && info->index == 0 && info->len == len && info->opcode == WS_TEXT) {
-     data[len] = 0;
-     String message = String((char*)data);
-     Serial.printf("Received message from sub-device: %s\n", message.c_str());
-     processSubDeviceMessage(message);
-     
-     // Store client IP for future communication
-     for (int i = 0; i < numConnectedDevices; i++) {
-       if (deviceIPs[i] == client->remoteIP()) {
-         return; // IP already stored
-       }
-     }
+   if (!info->final || info->index != 0 || info->len != len) {
+     return;
    }
- }
- 
- void sendAuthMessage() {
-   // Create JSON authentication message
-   DynamicJsonDocument doc(1024);
-   doc["type"] = "auth";
-   doc["hubId"] = uniqueId;
-   doc["username"] = username;
-   doc["password"] = password;
-   
-   String jsonString;
-   serializeJson(doc, jsonString);
-   
-   // Send to server
-   webSocket.sendTXT(jsonString);
-   Serial.println("Sent authentication message to server");
- }
- 
- void processServerMessage(String message) {
-   // Parse JSON message
-   DynamicJsonDocument doc(1024);
-   DeserializationError error = deserializeJson(doc, message);
-   
-   if (error) {
-     Serial.print("deserializeJson() failed: ");
-     Serial.println(error.c_str());
+   if (info->opcode != WS_TEXT && info->opcode != WS_BINARY) {
      return;
    }
-   
-   String msgType = doc["type"];
-   
-   if (msgType == "control") {
-     // Control command for a specific device
-     String deviceId = doc["deviceId"];
-     String command = doc["command"];
-     
-     // Forward the command to the sub-device
-     forwardCommandToDevice(deviceId, command);
-   } 
-   else if (msgType == "status_request") {
-     // Server requesting status of all devices
-     sendStatusUpdate();
-   }
-   else if (msgType == "alarm") {
-     // Alarm control command
-     bool state = doc["state"];
-     triggerAlarm(state);
+   if (len > FRAME_BUFFER_SIZE) {
+     LOG_WARN("Oversized frame from client #%u dropped", client->id());
+     return;
    }
-   else if (msgType == "auth_response") {
-     // Authentication response
-     bool success = doc["success"];
-     if (success) {
-       Serial.println("Authentication successful");
-       // Send current status after successful authentication
-       sendStatusUpdate();
-     } else {
-       Serial.println("Authentication failed");
-       // Maybe implement retry or notification
+   bool binary = info->opcode == WS_BINARY;
+   if (isAlertFrame(data, len, binary)) {
+     // The siren comes on here, before the frame is even parsed (see alert_lane.h)
+     uint32_t receivedUs = micros();
+     digitalWrite(ALARM_PIN, HIGH);
+     asyncTcpMetrics.alertGpioUs.observe(micros() - receivedUs);
+     if (alertInbox.send(binary ? LINK_ALERT_BINARY : LINK_ALERT_TEXT, client->id(), receivedUs, data, len)) {
+       return;
      }
+     LOG_WARN("Alert inbox full, alert from client #%u takes the slow path", client->id());
+   }
+   // Copied out of the receive buffer here; the loop task parses it (see serviceInboxes)
+   LinkKind kind = binary ? LINK_DEVICE_BINARY : LINK_DEVICE_TEXT;
+   if (!deviceInbox.send(kind, client->id(), (uint32_t)client->remoteIP(), data, len)) {
+     LOG_WARN("Device inbox full, frame from client #%u dropped", client->id());
    }
  }
  
- void forwardCommandToDevice(String deviceId, String command) {
-   // Find device in connected devices list
-   int deviceIndex = -1;
-   for (int i = 0; i < numConnectedDevices; i++) {
-     if (connectedDevices[i] == deviceId) {
-       deviceIndex = i;
-       break;
+ // Loop task: handle what the net task and the AsyncWebSocket callbacks have received
+ void serviceInboxes() {
+   static uint8_t frame[FRAME_BUFFER_SIZE];
+   LinkMessage message;
+   // Alerts first, all of them; the siren is already on (see alert_lane.h)
+   while (alertInbox.receive(message, frame, sizeof(frame))) {
+     deviceFrameUs = micros();
+     alertReceivedUs = message.ip;
+     // The pin is on whatever becomes of the frame; keep alarmState in step with it
+     setAlarmOutput(true);
+     metrics.localRx.messages++;
+     metrics.localRx.bytes += message.length;
+     // No address: an alert never registers a device
+     if (message.kind == LINK_ALERT_BINARY) {
+       processSubDeviceFrame(message.clientId, 0, frame, message.length);
+     } else {
+       processSubDeviceMessage(message.clientId, 0, (const char*)frame, message.length);
      }
+     alertReceivedUs = 0;
    }
    
-   if (deviceIndex >= 0) {
-     // Create JSON command message for the sub-device
-     DynamicJsonDocument doc(512);
-     doc["type"] = "command";
-     doc["command"] = command;
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Find the client with the matching IP and send the command
-     bool messageSent = false;
-     for (int i = 0; i < ws.getClients().length(); i++) {
-       AsyncWebSocketClient *client = *ws.getClients().nth(i);
-       if (client->remoteIP() == deviceIPs[deviceIndex]) {
-         ws.text(client->id(), jsonString);
-         messageSent = true;
-         Serial.printf("Forwarded command to device %s at IP %s: %s\n", 
-                       deviceId.c_str(), 
-                       deviceIPs[deviceIndex].toString().c_str(),
-                       command.c_str());
+   for (int i = 0; i < LINK_BURST && cloudInbox.receive(message, frame, sizeof(frame)); i++) {
+     switch (message.kind) {
+       case LINK_CLOUD_CONNECTED:
+         cloudConnected = true;
+         cloudReady = false;
+         metrics.cloudConnects++;
+         // Send authentication message
+         sendAuthMessage();
+         break;
+         
+       case LINK_CLOUD_DISCONNECTED:
+         cloudConnected = false;
+         // Hold uplink frames until the next successful auth_response
+         cloudReady = false;
+         break;
+         
+       case LINK_CLOUD_TEXT:
+         metrics.cloudRx.messages++;
+         metrics.cloudRx.bytes += message.length;
+         LOG_DEBUG("WebSocket received text from server: %.*s", (int)message.length, (const char*)frame);
+         processServerMessage((const char*)frame, message.length);
+         break;
+         
+       case LINK_DEVICE_GONE:
+         // Bound clients the net task found missing from the server's list
+         for (uint32_t j = 0; j < message.clientId && (j + 1) * sizeof(uint32_t) <= message.length; j++) {
+           uint32_t clientId;
+           memcpy(&clientId, frame + j * sizeof(uint32_t), sizeof(clientId));
+           int deviceIndex = registry.unbindClient(clientId);
+           if (deviceIndex != NO_DEVICE) {
+             LOG_INFO("WebSocket client #%u (device %s) gone", clientId, registry.at(deviceIndex).id);
+           }
+         }
          break;
-       }
-     }
-     
-     if (!messageSent) {
-       Serial.printf("Device %s found in list but no active WebSocket connection\n", deviceId.c_str());
      }
-   } else {
-     Serial.print("Device not found: ");
-     Serial.println(deviceId);
-   }
- }
- 
- void processSubDeviceMessage(String message) {
-   // Parse JSON message from sub-device
-   DynamicJsonDocument doc(1024);
-   DeserializationError error = deserializeJson(doc, message);
-   
-   if (error) {
-     Serial.print("deserializeJson() failed: ");
-     Serial.println(error.c_str());
-     return;
    }
    
-   String msgType = doc["type"];
-   
-   if (msgType == "registration") {
-     // New device registration
-     String deviceId = doc["deviceId"];
-     String deviceType = doc["deviceType"];
-     
-     // Get the IP of the device that sent this message
-     IPAddress ip;
-     for (int i = 0; i < ws.getClients().length(); i++) {
-       AsyncWebSocketClient *client = *ws.getClients().nth(i);
-       if (client->id() == doc["clientId"].as<uint32_t>()) {
-         ip = client->remoteIP();
+   for (int i = 0; i < LINK_BURST && deviceInbox.receive(message, frame, sizeof(frame)); i++) {
+     switch (message.kind) {
+       case LINK_DEVICE_TEXT:
+         deviceFrameUs = micros();
+         metrics.localRx.messages++;
+         metrics.localRx.bytes += message.length;
+         // The frame is not NUL-terminated
+         LOG_DEBUG("Received message from sub-device: %.*s", (int)message.length, (const char*)frame);
+         processSubDeviceMessage(message.clientId, message.ip, (const char*)frame, message.length);
+         break;
+         
+       case LINK_DEVICE_BINARY:
+         deviceFrameUs = micros();
+         metrics.localRx.messages++;
+         metrics.localRx.bytes += message.length;
+         // Compact frame from a device that negotiated it at registration
+         processSubDeviceFrame(message.clientId, message.ip, frame, message.length);
+         break;
+         
+       case LINK_SETUP:
+         if (message.length == sizeof(HubConfig)) {
+           HubConfig setup;
+           memcpy(&setup, frame, sizeof(setup));
+           applySetup(setup);
+         }
+         break;
+         
+       case LINK_DEVICE_DISCONNECTED: {
+         int deviceIndex = registry.unbindClient(message.clientId);
+         if (deviceIndex != NO_DEVICE) {
+           LOG_INFO("WebSocket client #%u (device %s) disconnected", message.clientId, registry.at(deviceIndex).id);
+         } else {
+           LOG_INFO("WebSocket client #%u disconnected", message.clientId);
+         }
          break;
        }
      }
-     
-     handleNewDevice(deviceId, deviceType, ip);
-   }
-   else if (msgType == "status") {
-     // Status update from a device
-     String deviceId = doc["deviceId"];
-     String status = doc["status"];
-     updateDeviceStatus(deviceId, status);
-   }
-   else if (msgType == "alert") {
-     // Alert from a device (e.g., smoke detector)
-     String deviceId = doc["deviceId"];
-     String alertType = doc["alertType"];
-     handleDeviceAlert(deviceId, alertType);
-   }
-   else if (msgType == "heartbeat") {
-     // Heartbeat from a device
-     String deviceId = doc["deviceId"];
-     // Update last seen time if needed
-     Serial.printf("Received heartbeat from device: %s\n", deviceId.c_str());
-   }
- }
- 
- void handleNewDevice(String deviceId, String deviceType, IPAddress ipAddress) {
-   // Check if device already registered
-   for (int i = 0; i < numConnectedDevices; i++) {
-     if (connectedDevices[i] == deviceId) {
-       Serial.println("Device already registered: " + deviceId);
-       // Update IP address in case it changed
-       deviceIPs[i] = ipAddress;
-       return;
-     }
    }
    
-   // Add new device if space available
-   if (numConnectedDevices < MAX_DEVICES) {
-     connectedDevices[numConnectedDevices] = deviceId;
-     deviceTypes[numConnectedDevices] = deviceType;
-     deviceStatus[numConnectedDevices] = "Unknown"; // Initial status
-     deviceIPs[numConnectedDevices] = ipAddress;
-     numConnectedDevices++;
-     
-     Serial.println("New device registered: " + deviceId + " (" + deviceType + ") at IP " + ipAddress.toString());
-     
-     // Send registration confirmation to the device
-     confirmDeviceRegistration(deviceId);
-     
-     // Update server about new device
-     notifyServerNewDevice(deviceId, deviceType);
-   } else {
-     Serial.println("Cannot register new device, maximum reached");
+   // Only once the frames queued before the lost disconnect have all been handled
+   if (deviceInbox.empty() && bindingsStale.exchange(false)) {
+     checkBindings();
    }
  }
  
- void confirmDeviceRegistration(String deviceId) {
-   // Find the device and send confirmation
-   for (int i = 0; i < numConnectedDevices; i++) {
-     if (connectedDevices[i] == deviceId) {
-       DynamicJsonDocument doc(256);
-       doc["type"] = "registration_confirm";
-       doc["deviceId"] = deviceId;
-       doc["success"] = true;
-       
-       String jsonString;
-       serializeJson(doc, jsonString);
-       
-       // Find the client with the matching IP and send confirmation
-       for (int j = 0; j < ws.getClients().length(); j++) {
-         AsyncWebSocketClient *client = *ws.getClients().nth(j);
-         if (client->remoteIP() == deviceIPs[i]) {
-           ws.text(client->id(), jsonString);
-           Serial.printf("Sent registration confirmation to device %s\n", deviceId.c_str());
-           break;
-         }
-       }
-       break;
+ // A disconnect was lost: ask the net task which bound clients the server no longer has
+ void checkBindings() {
+   uint32_t clientIds[REGISTRY_CAPACITY];
+   uint32_t count = 0;
+   for (int i = 0; i < registry.count(); i++) {
+     if (registry.at(i).clientId != NO_CLIENT) {
+       clientIds[count++] = registry.at(i).clientId;
      }
    }
+   if (count > 0 && !deviceOutbox.send(LINK_DEVICE_CHECK, count, 0, clientIds, count * sizeof(uint32_t))) {
+     bindingsStale = true;   // Try again on the next pass
+   }
  }
  
- void notifyServerNewDevice(String deviceId, String deviceType) {
-   if (webSocket.isConnected()) {
-     // Create JSON notification message
-     DynamicJsonDocument doc(512);
-     doc["type"] = "device_added";
-     doc["hubId"] = uniqueId;
-     doc["deviceId"] = deviceId;
-     doc["deviceType"] = deviceType;
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Send to server
-     webSocket.sendTXT(jsonString);
-     Serial.println("Notified server about new device: " + deviceId);
+ // Hand a frame for one sub-device to the net task
+ bool sendToDevice(uint32_t clientId, LinkKind kind, const void *data, size_t length) {
+   if (!deviceOutbox.send(kind, clientId, 0, data, length)) {
+     LOG_WARN("Device outbox full, frame dropped");
+     return false;
    }
+   metrics.localTx.messages++;
+   metrics.localTx.bytes += length;
+   return true;
  }
  
- void updateDeviceStatus(String deviceId, String status) {
-   // Update local status tracking
-   bool deviceFound = false;
-   for (int i = 0; i < numConnectedDevices; i++) {
-     if (connectedDevices[i] == deviceId) {
-       deviceStatus[i] = status;
-       deviceFound = true;
-       Serial.println("Updated status for device " + deviceId + ": " + status);
-       break;
+ // Hand one frame for several sub-devices to the net task, which queues a single
+ // shared copy of it on each of them (see ws_fanout.h); kind is LINK_DEVICE_TEXT or _BINARY
+ bool sendToDevices(const uint32_t *clientIds, int count, LinkKind kind, const void *data, size_t length) {
+   static uint8_t payload[FANOUT_MAX_CLIENTS * sizeof(uint32_t) + FRAME_BUFFER_SIZE];
+   if (length > FRAME_BUFFER_SIZE) {
+     return false;
+   }
+   LinkKind fanoutKind = kind == LINK_DEVICE_BINARY ? LINK_DEVICE_FANOUT_BINARY : LINK_DEVICE_FANOUT_TEXT;
+   bool sent = true;
+   for (int first = 0; first < count; first += FANOUT_MAX_CLIENTS) {
+     int clients = min(count - first, FANOUT_MAX_CLIENTS);
+     size_t idBytes = clients * sizeof(uint32_t);
+     memcpy(payload, clientIds + first, idBytes);
+     memcpy(payload + idBytes, data, length);
+     if (!deviceOutbox.send(fanoutKind, clients, 0, payload, idBytes + length)) {
+       LOG_WARN("Device outbox full, frame for %d devices dropped", clients);
+       sent = false;
+       continue;
      }
+     metrics.localTx.messages += clients;
+     metrics.localTx.bytes += clients * length;
    }
-   
-   if (!deviceFound) {
-     Serial.println("Received status update for unknown device: " + deviceId);
-     return;
+   return sent;
+ }
+ 
+ // Hand a frame for the server to the net task; jsonLength is what it would cost as JSON
+ bool sendToCloud(LinkKind kind, const void *data, size_t length, size_t jsonLength) {
+   if (!cloudOutbox.send(kind, NO_CLIENT, 0, data, length)) {
+     return false;
    }
-   
-   // Forward to server
-   if (webSocket.isConnected()) {
-     // Create JSON status update message
-     DynamicJsonDocument doc(512);
-     doc["type"] = "device_status";
-     doc["hubId"] = uniqueId;
-     doc["deviceId"] = deviceId;
-     doc["status"] = status;
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Send to server
-     webSocket.sendTXT(jsonString);
-     Serial.println("Forwarded status update for device: " + deviceId);
+   metrics.cloudTx.messages++;
+   metrics.cloudTx.bytes += length;
+   metrics.cloudTxJsonBytes += jsonLength;
+   return true;
+ }
+ 
+ // Net task: the cloud WebSocket client and the outboxes. AsyncTCP runs on the same core.
+ void netTask(void *parameter) {
+   for (;;) {
+     netScheduler.run();
+     netMetrics.netLoopUs.observe(netScheduler.lastLoopUs());
+     // Let AsyncTCP, the WiFi stack and the idle task in
+     vTaskDelay(1);
    }
  }
  
- void handleDeviceAlert(String deviceId, String alertType) {
-   // Handle alerts from devices (e.g., smoke detector)
-   Serial.println("ALERT from device " + deviceId + ": " + alertType);
+ // Net task: post the latest server link state, retrying while cloudInbox is full
+ void postCloudEvent(LinkKind kind) {
+   pendingCloudEvent = kind;
+   cloudEventPending = !cloudInbox.send(kind, NO_CLIENT, 0, nullptr, 0);
+ }
+ 
+ // Net task: send what the loop task has queued for the server and the sub-devices
+ void pumpNetOutboxes() {
+   static uint8_t frame[UPLINK_FRAME_SIZE + 1];   // Room to terminate a LINK_CLOUD_OPEN path
+   if (cloudEventPending) {
+     postCloudEvent(pendingCloudEvent);
+   }
    
-   // Trigger local alarm
-   triggerAlarm(true);
+   // Alert notifications go out before anything else queued for the server
+   LinkMessage message;
+   while (alertOutbox.receive(message, frame, sizeof(frame))) {
+     if (!webSocket.sendTXT(frame, message.length)) {
+       LOG_WARN("Alert not sent to server, link down");
+     } else if (message.ip != 0) {
+       netMetrics.alertCloudUs.observe(micros() - message.ip);
+     }
+   }
    
-   // Forward alert to server
-   if (webSocket.isConnected()) {
-     // Create JSON alert message
-     DynamicJsonDocument doc(512);
-     doc["type"] = "alert";
-     doc["hubId"] = uniqueId;
-     doc["deviceId"] = deviceId;
-     doc["alertType"] = alertType;
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Send to server
-     webSocket.sendTXT(jsonString);
-     Serial.println("Forwarded alert to server");
+   for (int i = 0; i < LINK_BURST && cloudOutbox.receive(message, frame, sizeof(frame) - 1); i++) {
+     switch (message.kind) {
+       case LINK_CLOUD_OPEN:
+         frame[message.length] = '\0';
+         openCloudSocket((const char*)frame);
+         break;
+         
+       case LINK_CLOUD_TEXT:
+         if (!webSocket.sendTXT(frame, message.length)) {
+           LOG_WARN("Server frame not sent, link down");
+         }
+         break;
+         
+       case LINK_CLOUD_BINARY:
+         if (!webSocket.sendBIN(frame, message.length)) {
+           LOG_WARN("Server frame not sent, link down");
+         }
+         break;
+     }
    }
    
-   // Display alert on LCD
-   lcd.clear();
-   lcd.setCursor(0, 0);
-   lcd.print("!!! ALERT !!!");
-   lcd.setCursor(0, 1);
-   lcd.print("Device: " + deviceId);
-   lcd.setCursor(0, 2);
-   lcd.print("Type: " + alertType);
+   if (deviceOutbox.empty()) {
+     return;
+   }
+   // Clients are looked up and queued on with AsyncTCP kept out of the client list
+   std::lock_guard<std::recursive_mutex> lock(wsClientsLock);
+   for (int i = 0; i < LINK_BURST && deviceOutbox.receive(message, frame, sizeof(frame)); i++) {
+     if (message.kind == LINK_DEVICE_FANOUT_TEXT || message.kind == LINK_DEVICE_FANOUT_BINARY) {
+       // Client IDs first, then the frame they all get
+       uint32_t clientIds[FANOUT_MAX_CLIENTS];
+       size_t idBytes = message.clientId * sizeof(uint32_t);
+       if (message.clientId <= FANOUT_MAX_CLIENTS && idBytes <= message.length) {
+         memcpy(clientIds, frame, idBytes);
+         fanout.send(clientIds, message.clientId, frame + idBytes, message.length - idBytes, 
+                     message.kind == LINK_DEVICE_FANOUT_BINARY);
+       }
+       continue;
+     }
+     if (message.kind == LINK_DEVICE_CHECK) {
+       // Bound client IDs from the loop task; answer with those the server no longer has
+       uint32_t gone[REGISTRY_CAPACITY];
+       uint32_t goneCount = 0;
+       for (uint32_t j = 0; j < message.clientId && j < REGISTRY_CAPACITY; j++) {
+         uint32_t clientId;
+         memcpy(&clientId, frame + j * sizeof(uint32_t), sizeof(clientId));
+         if (ws.client(clientId) == nullptr) {
+           gone[goneCount++] = clientId;
+         }
+       }
+       reportClientsGone(gone, goneCount);
+       continue;
+     }
+     bool binary = message.kind == LINK_DEVICE_BINARY;
+     // The client may have gone since the loop task queued this; make sure its binding goes too
+     AsyncWebSocketClient *client = ws.client(message.clientId);
+     if (client == nullptr) {
+       reportClientsGone(&message.clientId, 1);
+       continue;
+     }
+     if (binary) {
+       client->binary(frame, message.length);
+     } else {
+       client->text((const char*)frame, message.length);
+     }
+   }
  }
  
- void sendHeartbeat() {
-   if (webSocket.isConnected()) {
-     // Create JSON heartbeat message
-     DynamicJsonDocument doc(256);
-     doc["type"] = "heartbeat";
-     doc["hubId"] = uniqueId;
-     doc["time"] = millis();
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Send to server
-     webSocket.sendTXT(jsonString);
-     Serial.println("Sent heartbeat to server");
+ // Net task: tell the loop task these clients are gone, or have it check again if that cannot be sent
+ void reportClientsGone(const uint32_t *clientIds, uint32_t count) {
+   if (count > 0 && !cloudInbox.send(LINK_DEVICE_GONE, count, 0, clientIds, count * sizeof(uint32_t))) {
+     bindingsStale = true;
    }
  }
  
- void sendStatusUpdate() {
-   if (webSocket.isConnected()) {
-     // Create JSON status update message
-     DynamicJsonDocument doc(1024);
-     doc["type"] = "hub_status";
-     doc["hubId"] = uniqueId;
-     doc["temperature"] = temperature;
-     doc["humidity"] = humidity;
-     doc["alarmState"] = alarmState;
-     doc["connectedDevices"] = numConnectedDevices;
-     
-     // Add array of connected devices
-     JsonArray devices = doc.createNestedArray("devices");
-     for (int i = 0; i < numConnectedDevices; i++) {
-       JsonObject device = devices.createNestedObject();
-       device["id"] = connectedDevices[i];
-       device["type"] = deviceTypes[i];
-       device["status"] = deviceStatus[i];
+ // Serialize a document into a stack buffer and send it to the cloud server
+ bool sendJsonToServer(JsonDocument &doc) {
+   char frame[FRAME_BUFFER_SIZE];
+   size_t length = serializeJson(doc, frame, sizeof(frame));
+   if (length == 0 || length >= sizeof(frame) - 1) {
+     LOG_WARN("Outgoing server frame too large, dropped");
+     return false;
+   }
+   return sendToCloud(LINK_CLOUD_TEXT, frame, length, length);
+ }
+ 
+ // Serialize a document into a stack buffer and send it to one sub-device
+ bool sendJsonToClient(uint32_t clientId, JsonDocument &doc) {
+   char frame[FRAME_BUFFER_SIZE];
+   size_t length = serializeJson(doc, frame, sizeof(frame));
+   if (length == 0 || length >= sizeof(frame) - 1) {
+     LOG_WARN("Outgoing device frame too large, dropped");
+     return false;
+   }
+   return sendToDevice(clientId, LINK_DEVICE_TEXT, frame, length);
+ }
+ 
+ // Serialize a document once and send it to every sub-device with a live connection
+ bool broadcastToSubDevices(JsonDocument &doc) {
+   char frame[FRAME_BUFFER_SIZE];
+   size_t length = serializeJson(doc, frame, sizeof(frame));
+   if (length == 0 || length >= sizeof(frame) - 1) {
+     LOG_WARN("Outgoing device frame too large, dropped");
+     return false;
+   }
+   uint32_t clientIds[REGISTRY_CAPACITY];
+   int count = 0;
+   for (int i = 0; i < registry.count(); i++) {
+     if (registry.at(i).clientId != NO_CLIENT) {
+       clientIds[count++] = registry.at(i).clientId;
      }
-     
-     String jsonString;
-     serializeJson(doc, jsonString);
-     
-     // Send to server
-     webSocket.sendTXT(jsonString);
-     Serial.println("Sent status update to server");
    }
+   return count == 0 || sendToDevices(clientIds, count, LINK_DEVICE_TEXT, frame, length);
  }
  
- void readSensors() {
-  // Read temperature and humidity from DHT11
-  float newTemp = dht.readTemperature();
-  float newHumidity = dht.readHumidity();
-  
-  // Check if reading was successful
-  if (!isnan(newTemp) && !isnan(newHumidity)) {
-    temperature = newTemp;
-    humidity = newHumidity;
-    Serial.printf("Sensor readings: Temperature %.1f°C, Humidity %.1f%%\n", temperature, humidity);
-  } else {
-    Serial.println("Failed to read from DHT sensor!");
-  }
-
-    // Read battery voltage from voltage sensor pin
-    int rawVoltage = analogRead(VOLTAGE_SENSOR_PIN);
-  
-    // Convert raw reading to actual voltage (adjust multiplier based on your voltage divider)
-    // Assuming ESP32 ADC (0-4095) maps to 0-3.3V and you have a voltage divider
-    float voltage = rawVoltage * (3.3 / 4095.0) * 2.0; // Multiply by 2 if using a 1:1 voltage divider
-    
-    // Calculate battery percentage (adjust min/max values based on your battery)
-    // Assuming 3.0V is 0% and 4.2V is 100% for a typical LiPo battery
-    batteryPercentage = constrain((voltage - 3.0) * 100.0 / (4.2 - 3.0), 0.0, 100.0);
-    
-    Serial.printf("Battery: %.2fV (%.1f%%)\n", voltage, batteryPercentage);
-}
-
-void triggerAlarm(bool state) {
-  alarmState = state;
-  digitalWrite(ALARM_PIN, state ? HIGH : LOW);
+ void sendAuthMessage() {
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     return;
+   }
+   
+   // Create JSON authentication message
+   JsonDocument &doc = *lease;
+   doc["type"] = "auth";
+   doc["hubId"] = uniqueId;
+   doc["username"] = username;
+   doc["password"] = password;
+   // Offer binary uplink frames; the server may answer with JSON only
+   JsonArray encodings = doc["encodings"].to<JsonArray>();
+   encodings.add(UPLINK_ENCODING_NAME);
+   // The server pushes its rules again if this is not its latest version
+   doc["rulesVersion"] = rules.version();
+   
+   // Send to server
+   sendJsonToServer(doc);
+   LOG_INFO("Sent authentication message to server");
+ }
+ 
+ void processServerMessage(const char *data, size_t length) {
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     LOG_WARN("No free JSON document, server message dropped");
+     return;
+   }
+   
+   // Parse JSON message
+   JsonDocument &doc = *lease;
+   DeserializationError error = deserializeJson(doc, data, length);
+   
+   if (error) {
+     metrics.jsonParseFailures++;
+     LOG_WARN("deserializeJson() failed: %s", error.c_str());
+     return;
+   }
+   
+   // Fields are views into the pooled document, valid until the lease ends
+   const char *msgType = doc["type"] | "";
+   
+   // One hash of the type, then a single switch (see message_types.h)
+   switch (msgTypeHash(msgType)) {
+     case MSG_CONTROL: {
+       // Control command for a specific device
+       const char *deviceId = doc["deviceId"] | "";
+       const char *command = doc["command"] | "";
+       uint32_t corrId = doc["corrId"] | NO_CORRELATION;
+       
+       // Forward the command to the sub-device; its reply will carry corrId back
+       forwardCommandToDevice(deviceId, command, corrId);
+       break;
+     }
+       
+     case MSG_STATUS_REQUEST:
+       // Server requesting the devices changed since a sequence number, or all of them
+       if (doc["sinceSeq"].is<uint32_t>()) {
+         sendStatusSince(doc["epoch"] | 0u, doc["sinceSeq"]);
+       } else {
+         sendStatusUpdate();
+       }
+       break;
+       
+     case MSG_ALARM: {
+       // Alarm control command
+       bool state = doc["state"];
+       triggerAlarm(state);
+       break;
+     }
+       
+     case MSG_AUTH_RESPONSE: {
+       // Authentication response
+       bool success = doc["success"];
+       if (success) {
+         // Binary frames only if the server took the offer; either way a new dictionary
+         cloudBinary = strcmp(doc["encoding"] | "", UPLINK_ENCODING_NAME) == 0;
+         uplinkEncoder.reset();
+         cloudReady = true;
+         LOG_INFO("Authentication successful, %s uplink", cloudBinary ? "binary" : "JSON");
+         // The server says which status it already has, so only the changes need to go
+         cloudStatusEpoch = doc["epoch"] | 0u;
+         cloudStatusSeq = doc["seq"] | 0u;
+         // Send current status after successful authentication, behind anything
+         // queued during the outage so the snapshot is not overwritten by older frames
+         if (uplinkQueue.empty()) {
+           sendStatusSince(cloudStatusEpoch, cloudStatusSeq);
+         } else {
+           statusAfterDrain = true;
+           LOG_INFO("Draining %u queued frames to server", uplinkQueue.depth());
+         }
+       } else {
+         LOG_WARN("Authentication failed");
+         // Maybe implement retry or notification
+       }
+       break;
+     }
+       
+     case MSG_RULES:
+       // One page of the local rule set (see rule_engine.h)
+       handleRulesPage(doc);
+       break;
+       
+     case MSG_REMOVE_DEVICE:
+       // The user deleted the device; forget it here too
+       removeDevice(doc["deviceId"] | "");
+       break;
+       
+     default:
+       unknownServerMessages++;
+       LOG_WARN("Unknown message type from server: %s", msgType);
+       break;
+   }
+ }
+ 
+ void forwardCommandToDevice(const char *deviceId, const char *command, uint32_t corrId) {
+   // Find device in the registry
+   int deviceIndex = registry.find(deviceId);
+   bool forwarded = false;
+   
+   if (deviceIndex != NO_DEVICE) {
+     // Send over the client bound at registration
+     uint32_t clientId = registry.at(deviceIndex).clientId;
+     JsonDocLease lease(jsonPool);
+     if (clientId != NO_CLIENT && registry.at(deviceIndex).encoding == ENCODING_COMPACT) {
+       uint8_t frame[COMPACT_FRAME_SIZE];
+       CompactWriter writer(frame, sizeof(frame));
+       writer.begin(FRAME_COMMAND);
+       writer.putString(KEY_COMMAND, command);
+       if (corrId != NO_CORRELATION) {
+         writer.putInt(KEY_CORR_ID, corrId);
+       }
+       size_t length = writer.finish();
+       if (length > 0 && sendToDevice(clientId, LINK_DEVICE_BINARY, frame, length)) {
+         commandSent(deviceIndex, corrId);
+         forwarded = true;
+         LOG_INFO("Forwarded compact command to device %s (client #%u): %s", 
+                       deviceId, clientId, command);
+       }
+     } else if (clientId != NO_CLIENT && lease) {
+       // Create JSON command message for the sub-device
+       JsonDocument &doc = *lease;
+       doc["type"] = "command";
+       doc["command"] = command;
+       if (corrId != NO_CORRELATION) {
+         doc["corrId"] = corrId;
+       }
+       
+       if (sendJsonToClient(clientId, doc)) {
+         commandSent(deviceIndex, corrId);
+         forwarded = true;
+       }
+       LOG_INFO("Forwarded command to device %s (client #%u): %s", 
+                     deviceId, 
+                     clientId,
+                     command);
+     } else {
+       LOG_WARN("Device %s found in list but no active WebSocket connection", deviceId);
+     }
+   } else {
+     LOG_WARN("Device not found: %s", deviceId);
+   }
+   
+   // How soon after boot the hub could route a command again
+   if (forwarded && metrics.firstForwardMs == 0) {
+     metrics.firstForwardMs = millis();
+     LOG_INFO("First command forwarded %u ms after boot (%d devices restored from the journal)", 
+                   metrics.firstForwardMs, journal.restoredDevices());
+   }
+ }
+ 
+ // Start timing a command that went out with a correlation ID
+ void commandSent(int deviceIndex, uint32_t corrId) {
+   const DeviceRecord &record = registry.at(deviceIndex);
+   commandLatency.start(corrId, record.idHash, record.typeIndex, millis());
+ }
+ 
+ // Stop the clock once the device answers with the same correlation ID
+ void commandAnswered(const char *deviceId, uint32_t corrId) {
+   if (corrId != NO_CORRELATION) {
+     commandLatency.complete(corrId, DeviceRegistry::hashId(deviceId), millis());
+   }
+ }
+ 
+ // Any frame from a device proves it alive; a device that had gone offline is back
+ void deviceSeen(int deviceIndex) {
+   DeviceRecord &record = registry.at(deviceIndex);
+   record.lastSeen = millis();
+   if (record.online) {
+     // The wheel moves the deadline out from lastSeen when the old one comes up
+     return;
+   }
+   record.online = true;
+   liveness.arm(deviceIndex, DEVICE_LIVENESS_TIMEOUT_MS);
+   if (strcmp(record.status, OFFLINE_STATUS) == 0) {
+     // Until the device reports again, all we know is that it is reachable
+     LOG_INFO("Device %s is back online", record.id);
+     registry.setStatus(deviceIndex, "online");
+     queueUplink(UPLINK_DEVICE_STATUS, record.id, "online");
+   }
+ }
+ 
+ void deviceSeen(const char *deviceId) {
+   int deviceIndex = registry.find(deviceId);
+   if (deviceIndex != NO_DEVICE) {
+     deviceSeen(deviceIndex);
+   }
+ }
+ 
+ void markDeviceOffline(int deviceIndex, uint32_t silentMs) {
+   DeviceRecord &record = registry.at(deviceIndex);
+   record.online = false;
+   metrics.devicesOffline++;
+   registry.setStatus(deviceIndex, OFFLINE_STATUS);
+   queueUplink(UPLINK_DEVICE_OFFLINE, record.id, "");
+   LOG_INFO("Device %s offline, nothing heard for %u s", record.id, silentMs / 1000);
+   runRules(RULE_EVENT_OFFLINE, record.id, "", micros());
+ }
+ 
+ // Devices restored from the journal get one liveness timeout to reconnect before they are
+ // reported offline; those already offline stay so until they are heard from
+ void restoreDeviceLiveness() {
+   for (int i = 0; i < registry.count(); i++) {
+     DeviceRecord &record = registry.at(i);
+     if (strcmp(record.status, OFFLINE_STATUS) != 0) {
+       record.online = true;
+       record.lastSeen = millis();
+       liveness.arm(i, DEVICE_LIVENESS_TIMEOUT_MS);
+     }
+   }
+ }
+ 
+ void processSubDeviceMessage(uint32_t clientId, uint32_t ip, const char *data, size_t length) {
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     LOG_WARN("No free JSON document, sub-device message dropped");
+     return;
+   }
+   
+   // Parse JSON message from sub-device
+   JsonDocument &doc = *lease;
+   DeserializationError error = deserializeJson(doc, data, length);
+   
+   if (error) {
+     metrics.jsonParseFailures++;
+     LOG_WARN("deserializeJson() failed: %s", error.c_str());
+     return;
+   }
+   
+   // Fields are views into the pooled document, valid until the lease ends
+   const char *msgType = doc["type"] | "";
+   const char *deviceId = doc["deviceId"] | "";
+   
+   // One hash of the type, then a single switch (see message_types.h)
+   switch (msgTypeHash(msgType)) {
+     case MSG_REGISTRATION: {
+       // New device registration
+       const char *deviceType = doc["deviceType"] | "unknown";
+       
+       // Newer firmware offers the compact binary encoding
+       bool compact = false;
+       for (JsonVariant encoding : doc["encodings"].as<JsonArray>()) {
+         if (encoding == COMPACT_ENCODING_NAME) {
+           compact = true;
+         }
+       }
+       
+       // First registration after a device boot says how long its WiFi took
+       if (doc["wifiBootMs"].is<uint32_t>()) {
+         uint32_t bootMs = doc["wifiBootMs"];
+         metrics.deviceBootConnectUs.observe(bootMs < UINT32_MAX / 1000 ? bootMs * 1000 : UINT32_MAX);
+         if (doc["wifiFastPath"] | false) {
+           metrics.deviceFastBoots++;
+         }
+       }
+       
+       // Bind the device to the client that sent the registration
+       handleNewDevice(deviceId, deviceType, clientId, ip, compact);
+       break;
+     }
+       
+     case MSG_STATUS: {
+       // Status update from a device, possibly the answer to a command
+       const char *status = doc["status"] | "";
+       deviceSeen(deviceId);
+       updateDeviceStatus(deviceId, status);
+       commandAnswered(deviceId, doc["corrId"] | NO_CORRELATION);
+       break;
+     }
+       
+     case MSG_POSITION_UPDATE: {
+       // Blind position, reported as its status
+       char status[DEVICE_STATUS_LEN];
+       snprintf(status, sizeof(status), "%d%%", doc["position"] | 0);
+       deviceSeen(deviceId);
+       updateDeviceStatus(deviceId, status);
+       commandAnswered(deviceId, doc["corrId"] | NO_CORRELATION);
+       break;
+     }
+       
+     case MSG_ACK:
+       // Command carried out, nothing to report
+       deviceSeen(deviceId);
+       commandAnswered(deviceId, doc["corrId"] | NO_CORRELATION);
+       break;
+       
+     case MSG_ALERT: {
+       // Alert from a device (e.g., smoke detector)
+       const char *alertType = doc["alertType"] | "";
+       deviceSeen(deviceId);
+       handleDeviceAlert(deviceId, alertType);
+       break;
+     }
+       
+     case MSG_HEARTBEAT:
+       // Heartbeat from a device; pushes its liveness deadline out
+       deviceSeen(deviceId);
+       LOG_DEBUG("Received heartbeat from device: %s", deviceId);
+       break;
+       
+     default:
+       unknownDeviceMessages++;
+       LOG_WARN("Unknown message type from client #%u: %s", clientId, msgType);
+       break;
+   }
+ }
+ 
+ // Decode a compact frame and hand it to the same handlers as the JSON path
+ void processSubDeviceFrame(uint32_t clientId, uint32_t ip, const uint8_t *data, size_t length) {
+   CompactReader reader(data, length);
+   if (!reader.valid()) {
+     LOG_WARN("Malformed compact frame from client #%u", clientId);
+     return;
+   }
+   
+   char deviceId[DEVICE_ID_LEN] = "";
+   char text[DEVICE_STATUS_LEN] = "";   // deviceType, status or alertType, depending on the type
+   FrameType frameType = FRAME_UNKNOWN;
+   int32_t position = 0;
+   uint32_t corrId = NO_CORRELATION;
+   uint8_t key;
+   CompactValue value;
+   while (reader.next(key, value)) {
+     switch (key) {
+       case KEY_TYPE:
+         frameType = (FrameType)value.asInt();
+         break;
+       case KEY_DEVICE_ID:
+         value.copyTo(deviceId, sizeof(deviceId));
+         break;
+       case KEY_DEVICE_TYPE:
+       case KEY_STATUS:
+       case KEY_ALERT_TYPE:
+         value.copyTo(text, sizeof(text));
+         break;
+       case KEY_POSITION:
+         position = value.asInt();
+         break;
+       case KEY_CORR_ID:
+         corrId = (uint32_t)value.asInt();
+         break;
+     }
+   }
+   
+   // Frames after registration may leave out the device ID; the connection identifies it
+   if (deviceId[0] == '\0') {
+     int deviceIndex = registry.findByClient(clientId);
+     if (deviceIndex != NO_DEVICE) {
+       strcpy(deviceId, registry.at(deviceIndex).id);
+     }
+   }
+   
+   switch (frameType) {
+     case FRAME_REGISTRATION:
+       handleNewDevice(deviceId, text[0] ? text : "unknown", clientId, ip, true);
+       break;
+       
+     case FRAME_STATUS:
+       deviceSeen(deviceId);
+       updateDeviceStatus(deviceId, text);
+       commandAnswered(deviceId, corrId);
+       break;
+       
+     case FRAME_POSITION_UPDATE:
+       snprintf(text, sizeof(text), "%d%%", (int)position);
+       deviceSeen(deviceId);
+       updateDeviceStatus(deviceId, text);
+       commandAnswered(deviceId, corrId);
+       break;
+       
+     case FRAME_ACK:
+       deviceSeen(deviceId);
+       commandAnswered(deviceId, corrId);
+       break;
+       
+     case FRAME_ALERT:
+       deviceSeen(deviceId);
+       handleDeviceAlert(deviceId, text);
+       break;
+       
+     case FRAME_HEARTBEAT:
+       deviceSeen(deviceId);
+       LOG_DEBUG("Received heartbeat from device: %s", deviceId);
+       break;
+       
+     default:
+       unknownDeviceMessages++;
+       LOG_WARN("Unknown compact frame type %d from client #%u", frameType, clientId);
+       break;
+   }
+ }
+ 
+ void handleNewDevice(const char *deviceId, const char *deviceType, uint32_t clientId, uint32_t ip, bool compact) {
+   bool isNew = false;
+   int deviceIndex = registry.add(deviceId, deviceType, &isNew);
+   
+   if (deviceIndex == NO_DEVICE) {
+     LOG_WARN("Cannot register new device, registry full or invalid ID");
+     return;
+   }
+   
+   // Route future commands over this client; update IP in case it changed
+   registry.bindClient(deviceIndex, clientId);
+   registry.setIP(deviceIndex, ip);
+   registry.setEncoding(deviceIndex, compact ? ENCODING_COMPACT : ENCODING_JSON);
+   deviceSeen(deviceIndex);
+   
+   if (!isNew) {
+     LOG_INFO("Device already registered: %s", deviceId);
+   } else {
+     LOG_INFO("New device registered: %s (%s) from client #%u", deviceId, deviceType, clientId);
+     
+     // Update server about new device
+     notifyServerNewDevice(deviceId, deviceType);
+   }
+   
+   // Send registration confirmation to the device (also on re-registration after reconnect)
+   confirmDeviceRegistration(deviceId);
+ }
+ 
+ // Forget a device: the journal writes a tombstone for it and the server gets a snapshot without it.
+ // One that is still connected is added again when it next registers.
+ void removeDevice(const char *deviceId) {
+   int deviceIndex = registry.find(deviceId);
+   if (deviceIndex == NO_DEVICE) {
+     LOG_WARN("Cannot remove device %s, not registered", deviceId);
+     return;
+   }
+   
+   // remove() moves the last record into the freed index; its liveness deadline moves with it
+   int last = registry.count() - 1;
+   registry.remove(deviceId);
+   journal.removed(deviceId);
+   liveness.disarm(last);
+   liveness.disarm(deviceIndex);
+   if (deviceIndex < registry.count() && registry.at(deviceIndex).online) {
+     uint32_t silentMs = millis() - registry.at(deviceIndex).lastSeen;
+     liveness.arm(deviceIndex, silentMs < DEVICE_LIVENESS_TIMEOUT_MS ? DEVICE_LIVENESS_TIMEOUT_MS - silentMs : 0);
+   }
+   LOG_INFO("Device %s removed", deviceId);
+   
+   // A removal cannot go out as a delta
+   sendStatusUpdate();
+ }
+ 
+ void confirmDeviceRegistration(const char *deviceId) {
+   // Find the device and send confirmation
+   int deviceIndex = registry.find(deviceId);
+   uint32_t clientId = deviceIndex != NO_DEVICE ? registry.at(deviceIndex).clientId : NO_CLIENT;
+   JsonDocLease lease(jsonPool);
+   if (clientId != NO_CLIENT && lease) {
+     JsonDocument &doc = *lease;
+     doc["type"] = "registration_confirm";
+     doc["deviceId"] = deviceId;
+     doc["success"] = true;
+     // Accept the compact encoding; both sides switch after this (JSON) confirmation
+     if (registry.at(deviceIndex).encoding == ENCODING_COMPACT) {
+       doc["encoding"] = COMPACT_ENCODING_NAME;
+     }
+     
+     sendJsonToClient(clientId, doc);
+     LOG_INFO("Sent registration confirmation to device %s", deviceId);
+   }
+ }
+ 
+ void notifyServerNewDevice(const char *deviceId, const char *deviceType) {
+   // Goes out with the next uplink batch (or waits in the uplink queue while offline)
+   queueUplink(UPLINK_DEVICE_ADDED, deviceId, deviceType);
+   LOG_DEBUG("Queued new device notification for server: %s", deviceId);
+ }
+ 
+ void updateDeviceStatus(const char *deviceId, const char *status) {
+   // Update local status tracking
+   int deviceIndex = registry.find(deviceId);
+   if (deviceIndex == NO_DEVICE) {
+     LOG_WARN("Received status update for unknown device: %s", deviceId);
+     return;
+   }
+   
+   uint32_t version = registry.at(deviceIndex).version;
+   registry.setStatus(deviceIndex, status);
+   LOG_DEBUG("Updated status for device %s: %s", deviceId, status);
+   
+   // Forward to server with the next uplink batch (a newer status replaces this one)
+   queueUplink(UPLINK_DEVICE_STATUS, deviceId, status);
+   
+   // Status rules fire on a change, not on every repeat of the same status
+   if (registry.at(deviceIndex).version != version) {
+     runRules(MSG_STATUS, deviceId, status, deviceFrameUs);
+   }
+ }
+ 
+ void handleDeviceAlert(const char *deviceId, const char *alertType) {
+   // Handle alerts from devices (e.g., smoke detector). The siren, the server and the
+   // other devices come first; logging and the display wait until they are on their way.
+   setAlarmOutput(true);
+   sendAlertToServer(deviceId, alertType);
+   broadcastAlert(deviceId, alertType);
+   
+   // Local rules before the slow work: they must not wait for the server
+   runRules(MSG_ALERT, deviceId, alertType, deviceFrameUs);
+   
+   LOG_INFO("ALERT from device %s: %s", deviceId, alertType);
+   
+   // Display alert on LCD
+   display.clear();
+   display.setCursor(0, 0);
+   display.print("!!! ALERT !!!");
+   display.setCursor(0, 1);
+   display.print("Device: ");
+   display.print(deviceId);
+   display.setCursor(0, 2);
+   display.print("Type: ");
+   display.print(alertType);
+   holdLCD(10000);
+ }
+ 
+ // Alert notification for the server, ahead of every frame already waiting for it
+ void sendAlertToServer(const char *deviceId, const char *alertType) {
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     LOG_WARN("No free JSON document, alert not forwarded");
+     return;
+   }
+   JsonDocument &doc = *lease;
+   doc["type"] = "alert";
+   doc["hubId"] = uniqueId;
+   doc["deviceId"] = deviceId;
+   doc["alertType"] = alertType;
+   
+   // Always JSON text, so the binary uplink dictionary never sees it out of order
+   char frame[ALERT_FRAME_SIZE];
+   size_t length = serializeJson(doc, frame, sizeof(frame));
+   if (length == 0 || length >= sizeof(frame) - 1) {
+     LOG_WARN("Alert frame too large, dropped");
+     return;
+   }
+   // Older held alerts go first, so this one waits behind them
+   if (cloudReady && alertBacklog.empty() && alertOutbox.send(LINK_CLOUD_TEXT, NO_CLIENT, alertReceivedUs, frame, length)) {
+     metrics.cloudTx.messages++;
+     metrics.cloudTx.bytes += length;
+     metrics.cloudTxJsonBytes += length;
+     return;
+   }
+   if (!holdAlert(alertBacklog, uplinkQueue, frame, length)) {
+     LOG_WARN("Alert backlog and uplink queue full, alert dropped");
+   }
+ }
+ 
+ // Tell every sub-device; ones with no use for it ignore the unknown type
+ void broadcastAlert(const char *deviceId, const char *alertType) {
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     LOG_WARN("No free JSON document, alert not broadcast");
+     return;
+   }
+   JsonDocument &doc = *lease;
+   doc["type"] = "alert";
+   doc["deviceId"] = deviceId;
+   doc["alertType"] = alertType;
+   broadcastToSubDevices(doc);
+ }
+ 
+ // Send the alerts held while the server link was down; false while any remain
+ bool sendAlertBacklog() {
+   size_t length;
+   const char *frame;
+   while ((frame = alertBacklog.peek(length)) != nullptr) {
+     // Untimed: the wait for the link says nothing about the lane
+     if (!alertOutbox.send(LINK_CLOUD_TEXT, NO_CLIENT, 0, frame, length)) {
+       return false;
+     }
+     metrics.cloudTx.messages++;
+     metrics.cloudTx.bytes += length;
+     metrics.cloudTxJsonBytes += length;
+     alertBacklog.pop();
+   }
+   return true;
+ }
+
+ // One page of a rule set from the server. Pages arrive in order and the set is
+ // compiled as they come; only the last page makes it the active one.
+ void handleRulesPage(JsonDocument &doc) {
+   static uint16_t nextPage = 0;
+   uint32_t version = doc["version"] | 0u;
+   uint16_t page = doc["page"] | 0;
+   uint16_t pages = doc["pages"] | 1;
+   
+   if (page == 0) {
+     rules.beginUpdate(version);
+     nextPage = 0;
+   }
+   const char *error = nullptr;
+   if (!rules.updating() || rules.updateVersion() != version || page != nextPage) {
+     // A page was lost, or belongs to another push; the server starts over
+     rules.abortUpdate();
+     error = "page out of order";
+   } else {
+     nextPage++;
+   }
+   
+   for (JsonObject rule : doc["rules"].as<JsonArray>()) {
+     if (!rules.updating()) {
+       break;
+     }
+     const char *event = rule["on"] | "";
+     const char *device = rule["device"].as<const char*>();
+     RuleSource source = device != nullptr ? RULE_SOURCE_DEVICE : RULE_SOURCE_TYPE;
+     bool ok = rules.addRule(event, source, device != nullptr ? device : rule["deviceType"] | "", 
+                             rule["match"].as<const char*>());
+     for (JsonObject action : rule["do"].as<JsonArray>()) {
+       if (!ok) {
+         break;
+       }
+       if (action["alarm"].is<bool>()) {
+         ok = rules.addAction(RULE_ACTION_ALARM, "", "", action["alarm"].as<bool>());
+       } else {
+         ok = rules.addAction(RULE_ACTION_COMMAND, action["deviceId"] | "", action["command"] | "", false);
+       }
+     }
+   }
+   
+   if (rules.updating() && page + 1 < pages) {
+     // More pages to come
+     return;
+   }
+   bool success = rules.updating() && rules.commitUpdate();
+   if (error == nullptr) {
+     error = rules.error();
+   }
+   
+   // The document is done with; the reply reuses it
+   doc.clear();
+   doc["type"] = "rules_ack";
+   doc["hubId"] = uniqueId;
+   doc["version"] = version;
+   doc["success"] = success;
+   doc["rules"] = rules.ruleCount();
+   if (!success) {
+     doc["error"] = error;
+     LOG_WARN("Rules version %u rejected: %s", version, error);
+   }
+   sendUplink(doc, UPLINK_PRIORITY_NORMAL);
+ }
+ 
+ // Run the local rules for an event; startUs is when the event reached the loop task
+ void runRules(uint32_t event, const char *deviceId, const char *value, uint32_t startUs) {
+   int deviceIndex = registry.find(deviceId);
+   if (deviceIndex == NO_DEVICE) {
+     return;
+   }
+   if (rules.evaluate(event, deviceId, registry.typeName(deviceIndex), value, runRuleAction) > 0) {
+     metrics.ruleActionUs.observe(micros() - startUs);
+   }
+ }
+ 
+ void runRuleAction(uint8_t kind, const char *deviceId, const char *command, bool state) {
+   if (kind == RULE_ACTION_ALARM) {
+     triggerAlarm(state);
+   } else {
+     LOG_INFO("Rule: %s -> %s", deviceId, command);
+     forwardCommandToDevice(deviceId, command, NO_CORRELATION);
+   }
+ }
+ 
+ void sendHeartbeat() {
+   if (cloudConnected) {
+     // The heartbeat body is filled in when the batch is sent
+     queueUplink(UPLINK_HEARTBEAT, "", "");
+     LOG_DEBUG("Queued heartbeat for server");
+   }
+ }
+ 
+ void queueUplink(UplinkKind kind, const char *deviceId, const char *value) {
+   if (uplink.add(kind, deviceId, value, millis())) {
+     // Batch is full; don't wait for the rest of the window
+     uplinkFlushNow = true;
+   }
+ }
+ 
+ // Fill in one uplink event using the same fields as its standalone message
+ void writeUplinkEvent(JsonObject msg, const UplinkEvent &event) {
+   switch (event.kind) {
+     case UPLINK_DEVICE_STATUS:
+       msg["type"] = "device_status";
+       msg["deviceId"] = event.deviceId;
+       msg["status"] = event.value;
+       break;
+       
+     case UPLINK_DEVICE_ADDED:
+       msg["type"] = "device_added";
+       msg["deviceId"] = event.deviceId;
+       msg["deviceType"] = event.value;
+       break;
+       
+     case UPLINK_DEVICE_OFFLINE:
+       msg["type"] = "device_offline";
+       msg["deviceId"] = event.deviceId;
+       break;
+       
+     case UPLINK_HEARTBEAT:
+       msg["type"] = "heartbeat";
+       msg["time"] = millis();
+       msg["loopMaxUs"] = scheduler.maxLoopUs();
+       msg["unknownMsgs"] = unknownServerMessages + unknownDeviceMessages;
+       msg["queueDepth"] = uplinkQueue.depth();
+       msg["queueDropped"] = uplinkQueue.dropped();
+       break;
+   }
+ }
+ 
+ // Send the pending uplink events once the window has passed or the batch is full
+ void flushUplink() {
+   unsigned long now = millis();
+   if (!uplinkFlushNow && !uplink.due(now)) {
+     return;
+   }
+   // Before take(): with no document free the events stay pending and the next run retries
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     LOG_DEBUG("No free JSON document, uplink batch kept for the next run");
+     return;
+   }
+   uplinkFlushNow = false;
+   
+   static UplinkEvent batch[UPLINK_BATCH_CAPACITY];
+   int count = uplink.take(batch, UPLINK_BATCH_CAPACITY, now);
+   if (count == 0) {
+     return;
+   }
+   
+   // A batch is worth keeping through an outage as much as its most important event
+   UplinkPriority priority = UPLINK_PRIORITY_LOW;
+   for (int i = 0; i < count; i++) {
+     if (batch[i].kind == UPLINK_DEVICE_ADDED || batch[i].kind == UPLINK_DEVICE_OFFLINE) {
+       priority = UPLINK_PRIORITY_NORMAL;
+     }
+   }
+   
+   JsonDocument &doc = *lease;
+   
+   if (count == 1) {
+     // A lone event goes out in its usual format
+     writeUplinkEvent(doc.to<JsonObject>(), batch[0]);
+     doc["hubId"] = uniqueId;
+   } else {
+     doc["type"] = "batch";
+     doc["hubId"] = uniqueId;
+     JsonArray events = doc["events"].to<JsonArray>();
+     for (int i = 0; i < count; i++) {
+       writeUplinkEvent(events.add<JsonObject>(), batch[i]);
+     }
+   }
+   
+   sendUplink(doc, priority);
+   uplink.frameSent();
+ }
+ 
+ // Send a message now if the link is up and nothing older is waiting, otherwise queue it
+ void sendUplink(JsonDocument &doc, UplinkPriority priority) {
+   if (cloudReady && uplinkQueue.empty() && sendUplinkNow(doc)) {
+     return;
+   }
+   // Queued as JSON and encoded for whichever session drains it
+   static char frame[UPLINK_FRAME_SIZE];
+   size_t length = serializeJson(doc, frame, sizeof(frame));
+   if (length == 0 || length >= sizeof(frame) - 1) {
+     LOG_WARN("Uplink frame too large, dropped");
+   } else if (!uplinkQueue.push(frame, length, priority)) {
+     LOG_WARN("Uplink queue full, frame dropped");
+   }
+ }
+ 
+ // Send one message in the encoding agreed at auth; false if cloudOutbox is full
+ bool sendUplinkNow(JsonDocument &doc) {
+   static uint8_t frame[UPLINK_FRAME_SIZE];
+   if (!cloudBinary) {
+     size_t length = serializeJson(doc, (char*)frame, sizeof(frame));
+     return length > 0 && length < sizeof(frame) - 1 && sendToCloud(LINK_CLOUD_TEXT, frame, length, length);
+   }
+   
+   // The server knows the hub from the connection path, so hubId is left out
+   size_t length = uplinkEncoder.encode(doc, "hubId", frame, sizeof(frame));
+   if (length == 0 || !sendToCloud(LINK_CLOUD_BINARY, frame, length, measureJson(doc))) {
+     // Entries this frame defined never reached the server
+     uplinkEncoder.rollback();
+     return false;
+   }
+   uplinkEncoder.commit();
+   return true;
+ }
+ 
+ // Send one frame from the uplink queue
+ bool sendQueuedFrame(const char *frame, size_t length) {
+   if (!cloudBinary) {
+     return sendToCloud(LINK_CLOUD_TEXT, frame, length, length);
+   }
+   
+   JsonDocLease lease(jsonPool);
+   if (!lease) {
+     return false;
+   }
+   if (deserializeJson(*lease, frame, length)) {
+     // Cannot be re-encoded; don't let it block everything behind it
+     metrics.jsonParseFailures++;
+     LOG_WARN("Unreadable queued uplink frame, dropped");
+     return true;
+   }
+   return sendUplinkNow(*lease);
+ }
+ 
+ // Send queued frames in order at a paced rate once authenticated again
+ void drainUplinkQueue() {
+   static unsigned long drainStart = 0;
+   static uint32_t drainStartFrames = 0;
+   static uint32_t drainStartBytes = 0;
+   if (!cloudReady) {
+     drainStart = 0;
+     return;
+   }
+   
+   // Held alerts go out before the rest of the backlog
+   if (!sendAlertBacklog()) {
+     return;
+   }
+   
+   static char frame[UPLINK_FRAME_SIZE];
+   for (int i = 0; i < UPLINK_DRAIN_BURST; i++) {
+     size_t length = uplinkQueue.peek(frame, sizeof(frame));
+     if (length == 0) {
+       break;
+     }
+     if (drainStart == 0) {
+       drainStart = millis();
+       drainStartFrames = uplinkQueue.drainedFrames();
+       drainStartBytes = uplinkQueue.drainedBytes();
+     }
+     if (!sendQueuedFrame(frame, length)) {
+       // Leave it queued and try again next step
+       return;
+     }
+     uplinkQueue.pop();
+   }
+   
+   if (uplinkQueue.empty()) {
+     if (drainStart != 0) {
+       unsigned long elapsed = millis() - drainStart;
+       uint32_t frames = uplinkQueue.drainedFrames() - drainStartFrames;
+       LOG_INFO("Uplink queue drained: %u frames, %u bytes in %lu ms (%lu frames/s)", 
+                     frames, uplinkQueue.drainedBytes() - drainStartBytes, elapsed, 
+                     frames * 1000UL / (elapsed ? elapsed : 1));
+       drainStart = 0;
+     }
+     if (statusAfterDrain) {
+       statusAfterDrain = false;
+       sendStatusSince(cloudStatusEpoch, cloudStatusSeq);
+     }
+   }
+ }
+ 
+ // Send every device as a full snapshot
+ void sendStatusUpdate() {
+   sendHubStatus(true, 0);
+ }
+ 
+ // Send the devices changed since sinceSeq, or a snapshot if that is not possible
+ void sendStatusSince(uint32_t epoch, uint32_t sinceSeq) {
+   bool full = epoch != statusEpoch || !registry.canDelta(sinceSeq);
+   sendHubStatus(full, sinceSeq);
+ }
+ 
+ // Add command latency percentiles for every device type that has been sent a timed command
+ void addCommandLatency(JsonDocument &doc) {
+   commandLatency.expire(millis());
+   JsonObject latency;
+   for (int type = 0; type < registry.typeCount(); type++) {
+     if (!commandLatency.hasData(type)) {
+       continue;
+     }
+     if (latency.isNull()) {
+       latency = doc["latency"].to<JsonObject>();
+     }
+     LatencyStats stats = commandLatency.stats(type);
+     JsonObject entry = latency[registry.typeNameAt(type)].to<JsonObject>();
+     entry["n"] = stats.samples;
+     entry["timeouts"] = stats.timeouts;
+     entry["p50"] = stats.p50Ms;
+     entry["p95"] = stats.p95Ms;
+     entry["p99"] = stats.p99Ms;
+   }
+ }
+ 
+ // Send hub_status in pages of at most STATUS_PAGE_SIZE bytes (see PROTOCOL.md)
+ void sendHubStatus(bool full, uint32_t sinceSeq) {
+   if (!cloudReady) {
+     return;
+   }
+   
+   uint32_t seq = registry.seq();
+   int next = 0;
+   int page = 0;
+   int sent = 0;
+   bool last = false;
+   
+   while (!last) {
+     JsonDocLease lease(jsonPool);
+     if (!lease) {
+       return;
+     }
+     
+     // Create JSON status update message
+     JsonDocument &doc = *lease;
+     doc["type"] = "hub_status";
+     doc["hubId"] = uniqueId;
+     doc["epoch"] = statusEpoch;
+     doc["seq"] = seq;
+     doc["full"] = full;
+     if (!full) {
+       doc["sinceSeq"] = sinceSeq;
+     }
+     doc["page"] = page;
+     doc["temperature"] = temperature;
+     doc["humidity"] = humidity;
+     if (climateStale) {
+       doc["climateStale"] = true;
+     }
+     doc["alarmState"] = alarmState;
+     doc["connectedDevices"] = registry.count();
+     if (page == 0) {
+       addCommandLatency(doc);
+     }
+     
+     // Add devices until the page is full
+     JsonArray devices = doc["devices"].to<JsonArray>();
+     last = true;
+     for (; next < registry.count(); next++) {
+       const DeviceRecord &record = registry.at(next);
+       if (!full && record.version <= sinceSeq) {
+         continue;
+       }
+       JsonObject device = devices.add<JsonObject>();
+       device["id"] = record.id;
+       device["type"] = registry.typeName(next);
+       device["status"] = record.status;
+       device["ver"] = record.version;
+       if (devices.size() > 1 && measureJson(doc) > STATUS_PAGE_SIZE - STATUS_PAGE_TAIL) {
+         // Doesn't fit; it starts the next page
+         devices.remove(devices.size() - 1);
+         last = false;
+         break;
+       }
+     }
+     
+     doc["last"] = last;
+     if (last) {
+       // Lets the server check that applying the pages reproduced the hub's view
+       doc["digest"] = registry.digest();
+     }
+     
+     sent += devices.size();
+     sendUplink(doc, UPLINK_PRIORITY_NORMAL);
+     page++;
+   }
+   
+   LOG_INFO("Sent %s status to server: %d devices in %d pages (seq %u)", 
+                 full ? "full" : "delta", sent, page, seq);
+ }
+ 
+ void readSensors() {
+  // Temperature and humidity from the climate task; nothing here touches the DHT11
+  static uint32_t seenReadings = 0;
+  ClimateSnapshot climateNow = climate.snapshot();
+  if (climateNow.readings != seenReadings) {
+    seenReadings = climateNow.readings;
+    metrics.sensorReadUs.observe(climateNow.lastReadUs);
+  }
+  if (climateNow.valid) {
+    temperature = climateNow.temperature;
+    humidity = climateNow.humidity;
+    LOG_DEBUG("Sensor readings: Temperature %.1f°C, Humidity %.1f%%", temperature, humidity);
+  }
+  if (climateNow.stale != climateStale) {
+    climateStale = climateNow.stale;
+    if (climateStale) {
+      LOG_WARN("No good DHT11 reading for %u s (%u of %u reads failed)", 
+                    CLIMATE_STALE_MS / 1000, climateNow.failures, climateNow.readings);
+    } else {
+      LOG_INFO("DHT11 readings resumed");
+    }
+  }
+}
+
+// A few battery readings per run; a measurement completes every BATTERY_OVERSAMPLE readings
+void sampleBattery() {
+  if (battery.service()) {
+    batteryPercentage = battery.percent();
+    LOG_DEBUG("Battery: %.2fV (%.1f%%)", battery.voltage(), batteryPercentage);
+  }
+}
+
+void triggerAlarm(bool state) {
+  setAlarmOutput(state);
   
-  Serial.printf("Alarm state set to: %s\n", state ? "ON" : "OFF");
+  LOG_INFO("Alarm state set to: %s", state ? "ON" : "OFF");
   
   // Update LCD with alarm state
   updateLCD();
 }
 
+// Just the pin and its state; alerts call this before any logging or display work
+void setAlarmOutput(bool state) {
+  alarmState = state;
+  digitalWrite(ALARM_PIN, state ? HIGH : LOW);
+}
+
+// Pin interrupt: record the level and the time, nothing else
+void IRAM_ATTR onButtonEdge(void *arg) {
+  uint8_t button = (uint8_t)(uintptr_t)arg;
+  buttonEdges.push(button, digitalRead(buttonPins[button]) == LOW, millis());
+}
+
+// Turn the edges recorded since the last run into gestures; never reads a pin
 void checkButtons() {
-  // Button 1 - Toggle local alarm
-  if (digitalRead(BUTTON1_PIN) == LOW) {
-    delay(50); // Debounce
-    if (digitalRead(BUTTON1_PIN) == LOW) {
-      triggerAlarm(!alarmState);
-      // Wait for button release
-      while (digitalRead(BUTTON1_PIN) == LOW) {
-        delay(10);
-      }
-    }
+  ButtonEdge edge;
+  while (buttonEdges.pop(edge)) {
+    gestures.edge(edge);
   }
+  gestures.advance(millis());
   
-  // Button 2 - Cycle through connected devices on LCD
-  static int currentDeviceIndex = 0;
-  static unsigned long lastButtonPress = 0;
-  
-  if (digitalRead(BUTTON2_PIN) == LOW && millis() - lastButtonPress > 300) {
-    delay(50); // Debounce
-    if (digitalRead(BUTTON2_PIN) == LOW) {
-      lastButtonPress = millis();
-      
-      if (numConnectedDevices > 0) {
-        currentDeviceIndex = (currentDeviceIndex + 1) % numConnectedDevices;
-        
-        lcd.clear();
-        lcd.setCursor(0, 0);
-        lcd.print("Device Info:");
-        lcd.setCursor(0, 1);
-        lcd.print(connectedDevices[currentDeviceIndex]);
-        lcd.setCursor(0, 2);
-        lcd.print(deviceTypes[currentDeviceIndex]);
-        lcd.setCursor(0, 3);
-        lcd.print(deviceStatus[currentDeviceIndex]);
+  ButtonEvent event;
+  while (gestures.nextEvent(event)) {
+    handleButtonEvent(event);
+  }
+}
+
+void handleButtonEvent(const ButtonEvent &event) {
+  switch (event.kind) {
+    case BUTTON_CLICK:
+      if (event.button == 0) {
+        // Button 1 - Toggle local alarm
+        triggerAlarm(!alarmState);
+      } else if (event.button == 1) {
+        // Button 2 - Cycle through connected devices on LCD
+        showNextDevice();
       } else {
-        lcd.clear();
-        lcd.setCursor(0, 0);
-        lcd.print("No devices");
-        lcd.setCursor(0, 1);
-        lcd.print("connected");
+        // Button 3 - Send status update to server
+        sendStatusUpdate();
+        
+        display.clear();
+        display.setCursor(0, 0);
+        display.print("Status update");
+        display.setCursor(0, 1);
+        display.print("sent to server");
+        
+        // Reset LCD after 2 seconds
+        holdLCD(2000);
       }
+      break;
       
-      // Wait for button release
-      while (digitalRead(BUTTON2_PIN) == LOW) {
-        delay(10);
+    case BUTTON_LONG_PRESS:
+      if (event.button == 0) {
+        // Button 1 held - silence the alarm, whatever its state
+        triggerAlarm(false);
+      } else if (event.button == 1) {
+        // Button 2 held - back to the main screen
+        lcdHoldUntil = millis();
+        updateLCD();
       }
+      break;
+      
+    case BUTTON_CHORD_START:
+      // All three buttons down: count down to a factory reset (see checkFactoryResetButtons)
+      display.clear();
+      display.setCursor(0, 0);
+      display.print("Hold buttons for");
+      display.setCursor(0, 1);
+      display.print("factory reset...");
+      holdLCD(1000);
+      break;
       
-      // Reset LCD after 5 seconds
-      delay(5000);
+    case BUTTON_CHORD_CANCEL:
+      // Released early - return to normal operation
+      lcdHoldUntil = millis();
       updateLCD();
-    }
+      break;
+      
+    case BUTTON_CHORD_HOLD:
+      factoryReset();
+      break;
   }
+}
+
+void showNextDevice() {
+  static int currentDeviceIndex = 0;
   
-  // Button 3 - Send status update to server
-  if (digitalRead(BUTTON3_PIN) == LOW) {
-    delay(50); // Debounce
-    if (digitalRead(BUTTON3_PIN) == LOW) {
-      sendStatusUpdate();
-      
-      lcd.clear();
-      lcd.setCursor(0, 0);
-      lcd.print("Status update");
-      lcd.setCursor(0, 1);
-      lcd.print("sent to server");
-      
-      // Wait for button release
-      while (digitalRead(BUTTON3_PIN) == LOW) {
-        delay(10);
-      }
-      
-      // Reset LCD after 2 seconds
-      delay(2000);
-      updateLCD();
-    }
+  if (registry.count() > 0) {
+    currentDeviceIndex = (currentDeviceIndex + 1) % registry.count();
+    
+    display.clear();
+    display.setCursor(0, 0);
+    display.print("Device Info:");
+    display.setCursor(0, 1);
+    display.print(registry.at(currentDeviceIndex).id);
+    display.setCursor(0, 2);
+    display.print(registry.typeName(currentDeviceIndex));
+    display.setCursor(0, 3);
+    display.print(registry.at(currentDeviceIndex).status);
+  } else {
+    display.clear();
+    display.setCursor(0, 0);
+    display.print("No devices");
+    display.setCursor(0, 1);
+    display.print("connected");
   }
+  
+  // Reset LCD after 5 seconds
+  holdLCD(5000);
+}
+
+// Keep the current (temporary) screen up for durationMs before updateLCD() redraws
+void holdLCD(unsigned long durationMs) {
+  lcdHoldUntil = millis() + durationMs;
+}
+
+// Render the current screen into the frame buffer and push any changed cells
+void serviceLCD() {
+  updateLCD();
+  display.refresh();
 }
 
 void updateLCD() {
@@ -976,160 +2275,111 @@ void updateLCD() {
   static LCDState lcdState = SHOW_STATUS;
   static unsigned long lastLCDUpdate = 0;
   
+  // A temporary screen is still being shown
+  if ((long)(millis() - lcdHoldUntil) < 0) {
+    return;
+  }
+  
   // Update LCD every 5 seconds (cycle through different screens)
   if (millis() - lastLCDUpdate > 5000) {
     lastLCDUpdate = millis();
     lcdState = (LCDState)((lcdState + 1) % 3);
   }
   
-  lcd.clear();
+  display.clear();
   
   switch (lcdState) {
     case SHOW_STATUS:
       // Show hub status, temperature, humidity, alarm
-      lcd.setCursor(0, 0);
-      lcd.print("Smart Home Hub");
-      lcd.setCursor(0, 1);
-      lcd.printf("Temp: %.1fC", temperature);
-      lcd.setCursor(0, 2);
-      lcd.printf("Humidity: %.1f%%", humidity);
-      lcd.setCursor(0, 3);
-      lcd.print("Batt: ");
-      lcd.print((int)batteryPercentage);
-      lcd.print("% ");
-      lcd.print(alarmState ? "Alarm:ON" : "Alarm:OFF");
+      display.setCursor(0, 0);
+      display.print("Smart Home Hub");
+      display.setCursor(0, 1);
+      if (climateStale) {
+        display.print("Temp: --");
+        display.setCursor(0, 2);
+        display.print("Humidity: --");
+      } else {
+        display.printf("Temp: %.1fC", temperature);
+        display.setCursor(0, 2);
+        display.printf("Humidity: %.1f%%", humidity);
+      }
+      display.setCursor(0, 3);
+      display.print("Batt: ");
+      display.print((int)batteryPercentage);
+      display.print("% ");
+      display.print(alarmState ? "Alarm:ON" : "Alarm:OFF");
       break;
       
     case SHOW_NETWORK:
       // Show network information
-      lcd.setCursor(0, 0);
-      lcd.print("Network Status");
-      lcd.setCursor(0, 1);
+      display.setCursor(0, 0);
+      display.print("Network Status");
+      display.setCursor(0, 1);
       if (WiFi.status() == WL_CONNECTED) {
-        lcd.print("WiFi: Connected");
-        lcd.setCursor(0, 2);
-        lcd.print(WiFi.localIP().toString());
+        display.print("WiFi: Connected");
+        display.setCursor(0, 2);
+        display.print(WiFi.localIP().toString());
       } else {
-        lcd.print("WiFi: Disconnected");
+        display.print("WiFi: Disconnected");
       }
-      lcd.setCursor(0, 3);
-      lcd.print("AP: ");
-      lcd.print(AP_SSID_PREFIX + uniqueId.substring(0, 6));
+      display.setCursor(0, 3);
+      display.print("AP: ");
+      display.print(AP_SSID_PREFIX + uniqueId.substring(0, 6));
       break;
       
     case SHOW_DEVICES:
       // Show connected devices count
-      lcd.setCursor(0, 0);
-      lcd.print("Devices: ");
-      lcd.print(numConnectedDevices);
-      if (numConnectedDevices > 0) {
+      display.setCursor(0, 0);
+      display.print("Devices: ");
+      display.print(registry.count());
+      if (registry.count() > 0) {
         // Show last 3 connected devices
-        int startIdx = max(0, numConnectedDevices - 3);
-        for (int i = startIdx; i < numConnectedDevices; i++) {
-          lcd.setCursor(0, i - startIdx + 1);
-          String displayText = connectedDevices[i];
+        int startIdx = max(0, registry.count() - 3);
+        for (int i = startIdx; i < registry.count(); i++) {
+          display.setCursor(0, i - startIdx + 1);
+          String displayText = registry.at(i).id;
           if (displayText.length() > 16) {
             displayText = displayText.substring(0, 13) + "...";
           }
-          lcd.print(displayText);
+          display.print(displayText);
         }
       } else {
-        lcd.setCursor(0, 1);
-        lcd.print("No devices");
+        display.setCursor(0, 1);
+        display.print("No devices");
       }
       break;
   }
 }
 
-// Helper function to find device by ID
-int findDeviceById(String deviceId) {
-  for (int i = 0; i < numConnectedDevices; i++) {
-    if (connectedDevices[i] == deviceId) {
-      return i;
-    }
-  }
-  return -1;
-}
-
-// Helper function to broadcast message to all sub-devices
-void broadcastToSubDevices(String message) {
-  ws.textAll(message);
-  Serial.println("Broadcasted message to all sub-devices: " + message);
-}
-
-// Function to handle specific device types
-void handleDeviceTypeSpecificCommand(String deviceId, String deviceType, String command) {
-  DynamicJsonDocument doc(256);
-  doc["type"] = "command";
-  doc["deviceId"] = deviceId;
-  
-  if (deviceType == "smart_switch" || deviceType == "smart_bulb") {
-    // For relays, just forward the command (on/off)
-    doc["command"] = command;
-  }
-  else if (deviceType == "window_blind") {
-    // For window blinds, may need position info
-    if (command == "up" || command == "down" || command == "stop") {
-      doc["command"] = command;
-    }
-    else if (command.startsWith("position_")) {
-      // Extract position percentage
-      int position = command.substring(9).toInt();
-      doc["command"] = "position";
-      doc["value"] = position;
-    }
-  }
-  else if (deviceType == "smoke_sensor") {
-    // For sensors, usually just status requests
-    if (command == "get_status") {
-      doc["command"] = "read_sensor";
-    }
-    else if (command == "set_sensitivity") {
-      doc["command"] = command;
-      // Additional parameter parsing if needed
+// Run one liveness tick: only the deadlines falling due are looked at, however many devices there are
+void checkInactiveDevices() {
+  static int16_t fired[LIVENESS_FIRED_MAX];
+  uint32_t now = millis();
+  int count = liveness.advance(now, fired, LIVENESS_FIRED_MAX);
+  for (int i = 0; i < count; i++) {
+    int deviceIndex = fired[i];
+    if (deviceIndex >= registry.count() || !registry.at(deviceIndex).online) {
+      continue;
     }
-  }
-  else {
-    // Unknown device type, forward command as is
-    doc["command"] = command;
-  }
-  
-  String jsonString;
-  serializeJson(doc, jsonString);
-  
-  // Find device and send command
-  int deviceIndex = findDeviceById(deviceId);
-  if (deviceIndex >= 0) {
-    for (int i = 0; i < ws.getClients().length(); i++) {
-      AsyncWebSocketClient *client = *ws.getClients().nth(i);
-      if (client->remoteIP() == deviceIPs[deviceIndex]) {
-        ws.text(client->id(), jsonString);
-        Serial.printf("Sent type-specific command to %s device %s: %s\n", 
-                     deviceType.c_str(), deviceId.c_str(), jsonString.c_str());
-        break;
-      }
+    uint32_t silentMs = now - registry.at(deviceIndex).lastSeen;
+    if (silentMs < DEVICE_LIVENESS_TIMEOUT_MS) {
+      // Heard from since the timer was armed; count the timeout from the latest frame
+      liveness.arm(deviceIndex, DEVICE_LIVENESS_TIMEOUT_MS - silentMs);
+    } else {
+      markDeviceOffline(deviceIndex, silentMs);
     }
   }
 }
 
-// Function to check for inactive devices
-void checkInactiveDevices() {
-  // This would typically use timing to detect when devices haven't sent heartbeats
-  // Simplified version that just logs connected devices
-  Serial.println("Currently connected devices:");
-  for (int i = 0; i < numConnectedDevices; i++) {
-    Serial.printf("  %s (%s): %s\n", connectedDevices[i].c_str(), 
-                 deviceTypes[i].c_str(), deviceStatus[i].c_str());
-  }
-}
+// Set by factoryReset(); the restart itself happens on a later scheduler pass
+bool restartPending = false;
+unsigned long restartAt = 0;
 
 // Handle factory reset (could be triggered by a specific button combination)
 void factoryReset() {
-  // Clear EEPROM
-  for (int i = 0; i < EEPROM_SIZE; i++) {
-    EEPROM.write(i, 0);
-  }
-  EEPROM.commit();
+  // Invalidate both configuration slots in one commit, and forget the devices
+  configStore.erase();
+  journal.erase();
   
   // Reset variables
   isConfigured = false;
@@ -1139,78 +2389,302 @@ void factoryReset() {
   password = "";
   uniqueId = generateUniqueId(); // Generate new ID
   
-  Serial.println("Factory reset performed. Restarting...");
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("Factory Reset");
-  lcd.setCursor(0, 1);
-  lcd.print("Restarting...");
+  LOG_INFO("Factory reset performed. Restarting...");
+  display.clear();
+  display.setCursor(0, 0);
+  display.print("Factory Reset");
+  display.setCursor(0, 1);
+  display.print("Restarting...");
+  holdLCD(FACTORY_RESET_HOLD_MS);
   
-  delay(2000);
-  ESP.restart();
+  // Restart from checkFactoryResetButtons() once the message has been shown
+  restartAt = millis() + 2000;
+  restartPending = true;
 }
 
-// Check for button combination to trigger factory reset
+// Factory reset countdown while the button chord is held, and the restart after a reset
 void checkFactoryResetButtons() {
-  // If all three buttons are pressed simultaneously for 5 seconds, perform factory reset
-  if (digitalRead(BUTTON1_PIN) == LOW && 
-      digitalRead(BUTTON2_PIN) == LOW && 
-      digitalRead(BUTTON3_PIN) == LOW) {
-    
-    lcd.clear();
-    lcd.setCursor(0, 0);
-    lcd.print("Hold buttons for");
-    lcd.setCursor(0, 1);
-    lcd.print("factory reset...");
-    
-    // Count down 5 seconds while buttons remain pressed
-    int countdown = 5;
-    while (countdown > 0 && 
-           digitalRead(BUTTON1_PIN) == LOW && 
-           digitalRead(BUTTON2_PIN) == LOW && 
-           digitalRead(BUTTON3_PIN) == LOW) {
-      
-      lcd.setCursor(0, 2);
-      lcd.printf("Resetting in %d...", countdown);
-      
-      delay(1000);
-      countdown--;
-    }
-    
-    // If buttons were held for full duration, reset
-    if (countdown == 0) {
-      factoryReset();
-    } else {
-      // Otherwise, return to normal operation
-      updateLCD();
+  static int shownCountdown = -1;
+  
+  if (restartPending) {
+    if ((long)(millis() - restartAt) >= 0) {
+      asyncLog.flush();
+      ESP.restart();
     }
+    return;
   }
-}
-
-
-
-// Main loop additions to implement all functionality
-void completeLoop() {
-  // The existing loop code will run first, but we add these additional checks
-  
-  // Check for factory reset button combination
-  checkFactoryResetButtons();
   
-  // Periodically check for inactive devices (every 5 minutes)
-  static unsigned long lastDeviceCheck = 0;
-  if (millis() - lastDeviceCheck > 300000) {
-    checkInactiveDevices();
-    lastDeviceCheck = millis();
+  // The gesture recognizer starts, cancels and completes the hold (see handleButtonEvent)
+  if (!gestures.chordActive()) {
+    shownCountdown = -1;
+    return;
   }
+  holdLCD(1000);
   
-  // Handle automatic reconnection to server if connection drops
+  uint32_t held = gestures.chordHeldMs(millis());
+  int countdown = held < FACTORY_RESET_HOLD_MS ? (FACTORY_RESET_HOLD_MS - held + 999) / 1000 : 0;
+  if (countdown != shownCountdown) {
+    shownCountdown = countdown;
+    display.setCursor(0, 2);
+    display.printf("Resetting in %d...", countdown);
+  }
+}
+
+// Handle automatic reconnection to server if connection drops
+void checkServerConnection() {
   static bool wasConnected = false;
-  if (webSocket.isConnected()) {
+  if (cloudConnected) {
     wasConnected = true;
   } else if (wasConnected && WiFi.status() == WL_CONNECTED) {
     // If we lost connection but WiFi is still connected, try to reconnect
-    Serial.println("Lost connection to server. Attempting to reconnect...");
+    LOG_WARN("Lost connection to server. Attempting to reconnect...");
     connectToWebSocketServer();
     wasConnected = false; // Wait for successful reconnection
   }
-}
\ No newline at end of file
+}
+
+// Log the worst loop iteration of the last window and start a new one
+void reportLoopStats() {
+  LOG_INFO("Loop stats: %u iterations, worst %u us", 
+                scheduler.loopCount(), scheduler.maxLoopUs());
+  for (int i = 0; i < scheduler.taskCount(); i++) {
+    const SchedulerTask &task = scheduler.task(i);
+    LOG_INFO("  %-12s worst %u us", task.name, task.maxRunUs);
+  }
+  LOG_INFO("LCD: %u I2C bytes sent, %u saved by diffing", 
+                display.i2cBytesSent(), display.i2cBytesSaved());
+  LOG_INFO("JSON pool: peak %u bytes per document, %u allocation failures, %u times exhausted", 
+                (unsigned)jsonPool.peakBytes(), (unsigned)jsonPool.allocFailures(), (unsigned)jsonPool.exhausted());
+  LOG_INFO("Unknown message types: %u from server, %u from devices", 
+                unknownServerMessages, unknownDeviceMessages);
+  LOG_INFO("Uplink: %u events, %u coalesced, %u frames sent, %u saved, latency avg %u ms max %u ms, %u dropped", 
+                uplink.eventsQueued(), uplink.eventsCoalesced(), uplink.framesSent(), uplink.framesSaved(), 
+                uplink.avgLatencyMs(), uplink.maxLatencyMs(), uplink.eventsDropped());
+  LOG_INFO("Uplink queue: depth %u (%u spilled), %u dropped, %u frames / %u bytes drained", 
+                uplinkQueue.depth(), uplinkQueue.spilledDepth(), uplinkQueue.dropped(), 
+                uplinkQueue.drainedFrames(), uplinkQueue.drainedBytes());
+  LOG_INFO("Uplink link: %u bytes sent, %u as JSON, %d dictionary entries", 
+                metrics.cloudTx.bytes, metrics.cloudTxJsonBytes, uplinkEncoder.entries());
+  LOG_INFO("Rules: version %u, %d rules, %u fired in %u evaluations", 
+                rules.version(), rules.ruleCount(), rules.fired(), rules.evaluations());
+  LOG_INFO("Log: %u lines written, %u dropped, %u truncated, peak %u of %d slots", 
+                asyncLog.written(), asyncLog.dropped(), asyncLog.truncated(), asyncLog.peakDepth(), LOG_SLOTS);
+  scheduler.resetLoopStats();
+}
+
+// Track the heap watermarks between scrapes, and publish what /metrics shows of the loop task
+void sampleMetrics() {
+  static LoopSnapshot snapshot;
+  metrics.sampleHeap();
+  snapshot.counters = metrics;
+  snapshot.configLoadUs = configStore.loadUs();
+  snapshot.registryLoadUs = journal.loadUs();
+  snapshot.restoredDevices = journal.restoredDevices();
+  snapshot.taskCount = scheduler.taskCount();
+  for (int i = 0; i < scheduler.taskCount(); i++) {
+    snapshot.taskNames[i] = scheduler.task(i).name;
+    snapshot.taskMaxRunUs[i] = scheduler.task(i).maxRunUs;
+  }
+  snapshot.unknownServerMessages = unknownServerMessages;
+  snapshot.unknownDeviceMessages = unknownDeviceMessages;
+  snapshot.cloudReady = cloudReady;
+  snapshot.wifiBootConnectMs = wifiLink.bootConnectMs();
+  snapshot.wifiConnectMs = wifiLink.connectMs();
+  snapshot.wifiFastPath = wifiLink.fastPath();
+  snapshot.devices = registry.count();
+  snapshot.devicesBound = 0;
+  snapshot.devicesOnline = 0;
+  for (int i = 0; i < registry.count(); i++) {
+    if (registry.at(i).clientId != NO_CLIENT) {
+      snapshot.boundClients[snapshot.devicesBound++] = registry.at(i).clientId;
+    }
+    if (registry.at(i).online) {
+      snapshot.devicesOnline++;
+    }
+  }
+  snapshot.journalBytes = journal.fileBytes();
+  snapshot.journalRecords = journal.recordsWritten();
+  snapshot.journalCompactions = journal.compactions();
+  snapshot.rulesVersion = rules.version();
+  snapshot.rules = rules.ruleCount();
+  snapshot.rulesFired = rules.fired();
+  snapshot.alertBacklogDepth = alertBacklog.depth();
+  snapshot.alertsHeld = alertBacklog.held();
+  snapshot.uplinkQueueDepth = uplinkQueue.depth();
+  snapshot.uplinkQueueDropped = uplinkQueue.dropped();
+  snapshot.jsonPoolExhausted = jsonPool.exhausted();
+  snapshot.batteryVolts = battery.voltage();
+  snapshot.batteryPercent = battery.percent();
+  snapshot.buttonEdges = buttonEdges.pushed();
+  snapshot.buttonEdgesDropped = buttonEdges.dropped();
+  snapshot.deviceOutbox = linkStats(deviceOutbox);
+  snapshot.cloudOutbox = linkStats(cloudOutbox);
+  snapshot.alertOutbox = linkStats(alertOutbox);
+  loopSnapshot.publish(snapshot);
+}
+
+// Net task: publish what /metrics shows of the net task
+void publishNetMetrics() {
+  static NetSnapshot snapshot;
+  snapshot.counters = netMetrics;
+  snapshot.fanouts = fanout.fanouts();
+  snapshot.fanoutSends = fanout.queued();
+  snapshot.fanoutSkipped = fanout.skipped();
+  snapshot.fanoutClosed = fanout.closed();
+  snapshot.fanoutLastClients = fanout.lastClients();
+  snapshot.fanoutLastHeapBytes = fanout.lastHeapBytes();
+  snapshot.cloudInbox = linkStats(cloudInbox);
+  netSnapshot.publish(snapshot);
+}
+
+// Read by the ring's producer, the only task that writes its peak and drop counts
+LinkStats linkStats(const CoreLink &link) {
+  LinkStats stats;
+  stats.used = link.used();
+  stats.peak = link.peakUsed();
+  stats.dropped = link.dropped();
+  return stats;
+}
+
+// AsyncTCP task: stream the last published snapshots to the scraper; nothing is buffered in a String
+void handleMetrics(AsyncWebServerRequest *request) {
+  // Only ever used here, on AsyncTCP; too big for its stack
+  static LoopSnapshot loopNow;
+  static NetSnapshot netNow;
+  loopSnapshot.read(loopNow);
+  netSnapshot.read(netNow);
+  const HubMetrics &counters = loopNow.counters;
+  
+  AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+  MetricsWriter out(*response);
+  
+  out.counter("hub_uptime_seconds", "Seconds since boot.", millis() / 1000);
+  out.header("hub_config_load_seconds", "gauge", "Time taken to load the configuration at boot.");
+  out.sample("hub_config_load_seconds", nullptr, loopNow.configLoadUs / 1e6f);
+  out.header("hub_registry_load_seconds", "gauge", "Time taken to restore the device registry from its journal at boot.");
+  out.sample("hub_registry_load_seconds", nullptr, loopNow.registryLoadUs / 1e6f);
+  out.gauge("hub_registry_restored_devices", "Devices restored from the journal at boot.", loopNow.restoredDevices);
+  out.header("hub_first_forward_seconds", "gauge", "Time from boot to the first command forwarded to a device; 0 until then.");
+  out.sample("hub_first_forward_seconds", nullptr, counters.firstForwardMs / 1e3f);
+  
+  out.histogram("hub_loop_duration_seconds", "Time per scheduler loop iteration.", counters.loopUs);
+  out.histogram("hub_net_loop_duration_seconds", "Time per net task loop iteration.", netNow.counters.netLoopUs);
+  out.header("hub_task_max_run_seconds", "gauge", "Longest single run of each scheduler task in the current stats window.");
+  for (int i = 0; i < loopNow.taskCount; i++) {
+    char labels[40];
+    snprintf(labels, sizeof(labels), "task=\"%s\"", loopNow.taskNames[i]);
+    out.sample("hub_task_max_run_seconds", labels, loopNow.taskMaxRunUs[i] / 1e6f);
+  }
+  
+  out.gauge("hub_heap_free_bytes", "Free heap.", ESP.getFreeHeap());
+  out.gauge("hub_heap_min_free_bytes", "Lowest free heap since boot.", ESP.getMinFreeHeap());
+  out.gauge("hub_heap_largest_block_bytes", "Largest allocatable heap block.", ESP.getMaxAllocHeap());
+  out.gauge("hub_heap_min_largest_block_bytes", "Smallest largest-block seen since boot, sampled every second.", counters.heapMinLargestBlock);
+  
+  out.header("hub_messages_total", "counter", "WebSocket messages by link and direction.");
+  out.sample("hub_messages_total", "link=\"cloud\",direction=\"rx\"", counters.cloudRx.messages);
+  out.sample("hub_messages_total", "link=\"cloud\",direction=\"tx\"", counters.cloudTx.messages);
+  out.sample("hub_messages_total", "link=\"local\",direction=\"rx\"", counters.localRx.messages);
+  out.sample("hub_messages_total", "link=\"local\",direction=\"tx\"", counters.localTx.messages);
+  out.header("hub_message_bytes_total", "counter", "WebSocket payload bytes by link and direction.");
+  out.sample("hub_message_bytes_total", "link=\"cloud\",direction=\"rx\"", counters.cloudRx.bytes);
+  out.sample("hub_message_bytes_total", "link=\"cloud\",direction=\"tx\"", counters.cloudTx.bytes);
+  out.sample("hub_message_bytes_total", "link=\"local\",direction=\"rx\"", counters.localRx.bytes);
+  out.sample("hub_message_bytes_total", "link=\"local\",direction=\"tx\"", counters.localTx.bytes);
+  out.counter("hub_cloud_tx_json_bytes_total", "What the cloud frames sent would have cost as JSON text.", counters.cloudTxJsonBytes);
+  
+  out.counter("hub_json_parse_failures_total", "Incoming or queued frames that failed to parse as JSON.", counters.jsonParseFailures);
+  out.header("hub_unknown_messages_total", "counter", "Frames whose type has no handler.");
+  out.sample("hub_unknown_messages_total", "link=\"cloud\"", loopNow.unknownServerMessages);
+  out.sample("hub_unknown_messages_total", "link=\"local\"", loopNow.unknownDeviceMessages);
+  out.header("hub_reconnects_total", "counter", "Connections re-established after the first.");
+  out.sample("hub_reconnects_total", "link=\"wifi\"", counters.wifiConnects > 0 ? counters.wifiConnects - 1 : 0);
+  out.sample("hub_reconnects_total", "link=\"cloud\"", counters.cloudConnects > 0 ? counters.cloudConnects - 1 : 0);
+  out.gauge("hub_cloud_connected", "1 while the server link is up and authenticated.", loopNow.cloudReady ? 1 : 0);
+  out.header("hub_wifi_boot_connect_seconds", "gauge", "Time from boot to the first WiFi connection; 0 until connected.");
+  out.sample("hub_wifi_boot_connect_seconds", nullptr, loopNow.wifiBootConnectMs / 1e3f);
+  out.header("hub_wifi_connect_seconds", "gauge", "Time the last WiFi connection took from its first attempt.");
+  out.sample("hub_wifi_connect_seconds", nullptr, loopNow.wifiConnectMs / 1e3f);
+  out.gauge("hub_wifi_fast_path", "1 if the last WiFi connection used the cached BSSID, channel and lease.", loopNow.wifiFastPath ? 1 : 0);
+  
+  // Messages waiting in the send queues of registered devices
+  std::unique_lock<std::recursive_mutex> clientsLock(wsClientsLock);
+  uint32_t queued = 0;
+  for (uint32_t i = 0; i < loopNow.devicesBound; i++) {
+    AsyncWebSocketClient *client = ws.client(loopNow.boundClients[i]);
+    if (client != nullptr) {
+      queued += client->queueLen();
+    }
+  }
+  uint32_t clients = ws.count();
+  clientsLock.unlock();
+  out.gauge("hub_ws_send_queue_messages", "Messages queued for sending to sub-devices.", queued);
+  out.gauge("hub_ws_clients", "Sub-device WebSocket connections.", clients);
+  out.counter("hub_ws_fanouts_total", "Frames sent to several sub-devices from one shared copy.", netNow.fanouts);
+  out.counter("hub_ws_fanout_sends_total", "Client sends queued from shared frames.", netNow.fanoutSends);
+  out.counter("hub_ws_fanout_skipped_total", "Client sends skipped because the client's queue was too long.", netNow.fanoutSkipped);
+  out.counter("hub_ws_fanout_closed_total", "Sub-device clients closed because their send queue was full.", netNow.fanoutClosed);
+  out.gauge("hub_ws_fanout_last_clients", "Clients the last shared frame was queued on.", netNow.fanoutLastClients);
+  out.header("hub_ws_fanout_last_heap_bytes", "gauge", "Drop in free heap across the last shared-frame send.");
+  out.sample("hub_ws_fanout_last_heap_bytes", nullptr, (float)netNow.fanoutLastHeapBytes);
+  out.gauge("hub_devices", "Registered sub-devices.", loopNow.devices);
+  out.gauge("hub_devices_connected", "Registered sub-devices with a live connection.", loopNow.devicesBound);
+  out.gauge("hub_devices_online", "Registered sub-devices heard from within the liveness timeout.", loopNow.devicesOnline);
+  out.counter("hub_device_offline_total", "Times a sub-device missed its liveness deadline.", counters.devicesOffline);
+  out.histogram("hub_device_wifi_boot_connect_seconds", "Time from boot to the first WiFi connection, as reported by sub-devices.", counters.deviceBootConnectUs);
+  out.counter("hub_device_wifi_fast_boots_total", "Sub-device boots whose first WiFi connection used the cached fast path.", counters.deviceFastBoots);
+  out.gauge("hub_registry_journal_bytes", "Size of the device registry journal.", loopNow.journalBytes);
+  out.counter("hub_registry_journal_records_total", "Device records written to the journal.", loopNow.journalRecords);
+  out.counter("hub_registry_compactions_total", "Times the journal was rewritten with only the current devices.", loopNow.journalCompactions);
+  
+  out.gauge("hub_rules_version", "Version of the active local rule set; 0 if none was received.", loopNow.rulesVersion);
+  out.gauge("hub_rules", "Rules in the active local rule set.", loopNow.rules);
+  out.counter("hub_rules_fired_total", "Local rules whose actions ran.", loopNow.rulesFired);
+  out.histogram("hub_rule_action_seconds", "Time from a device event leaving the inbox to its rule actions queued.", counters.ruleActionUs);
+  
+  out.histogram("hub_alert_gpio_seconds", "Time from an alert frame reaching the hub to the alarm pin driven.", asyncTcpMetrics.alertGpioUs);
+  out.histogram("hub_alert_cloud_seconds", "Time from an alert frame reaching the hub to its notification sent to the server.", netNow.counters.alertCloudUs);
+  out.gauge("hub_alert_backlog_frames", "Alerts held for the server while its link is down.", loopNow.alertBacklogDepth);
+  out.counter("hub_alerts_held_total", "Alerts that had to wait for the server link.", loopNow.alertsHeld);
+  
+  out.gauge("hub_uplink_queue_frames", "Uplink frames held for the server.", loopNow.uplinkQueueDepth);
+  out.counter("hub_uplink_queue_dropped_total", "Uplink frames dropped because the queue was full.", loopNow.uplinkQueueDropped);
+  out.counter("hub_json_pool_exhausted_total", "Times no pooled JSON document was free.", loopNow.jsonPoolExhausted);
+  out.counter("hub_log_lines_total", "Log lines written to Serial.", asyncLog.written());
+  out.counter("hub_log_dropped_total", "Log lines dropped because the log ring was full.", asyncLog.dropped());
+  
+  // AsyncTCP produces into the device and alert inboxes, so their counts are its own
+  const char *linkNames[] = {"link=\"deviceInbox\"", "link=\"deviceOutbox\"", "link=\"cloudInbox\"", "link=\"cloudOutbox\"", 
+                             "link=\"alertInbox\"", "link=\"alertOutbox\""};
+  const LinkStats links[] = {linkStats(deviceInbox), loopNow.deviceOutbox, netNow.cloudInbox, loopNow.cloudOutbox, 
+                             linkStats(alertInbox), loopNow.alertOutbox};
+  const int linkCount = sizeof(links) / sizeof(links[0]);
+  out.header("hub_core_link_used_bytes", "gauge", "Bytes waiting in each message ring between the cores.");
+  for (int i = 0; i < linkCount; i++) {
+    out.sample("hub_core_link_used_bytes", linkNames[i], links[i].used);
+  }
+  out.header("hub_core_link_peak_bytes", "gauge", "Most bytes ever waiting in each ring.");
+  for (int i = 0; i < linkCount; i++) {
+    out.sample("hub_core_link_peak_bytes", linkNames[i], links[i].peak);
+  }
+  out.header("hub_core_link_dropped_total", "counter", "Messages dropped because a ring was full.");
+  for (int i = 0; i < linkCount; i++) {
+    out.sample("hub_core_link_dropped_total", linkNames[i], links[i].dropped);
+  }
+  
+  out.histogram("hub_sensor_read_duration_seconds", "Wall time of one DHT11 transaction on the climate task, wake-up sleep included.", counters.sensorReadUs);
+  // The climate task publishes under its own lock; snapshot() is safe from any task
+  ClimateSnapshot climateNow = climate.snapshot();
+  out.counter("hub_sensor_reads_total", "DHT11 transactions attempted.", climateNow.readings);
+  out.counter("hub_sensor_read_failures_total", "DHT11 transactions that gave no usable reading.", climateNow.failures);
+  out.gauge("hub_sensor_stale", "1 while no good DHT11 reading has arrived for 30 s.", climateNow.stale ? 1 : 0);
+  out.header("hub_battery_volts", "gauge", "Battery voltage, averaged over recent measurements.");
+  out.sample("hub_battery_volts", nullptr, loopNow.batteryVolts);
+  out.header("hub_battery_percent", "gauge", "Battery charge estimated from the LiPo discharge curve.");
+  out.sample("hub_battery_percent", nullptr, loopNow.batteryPercent);
+  
+  out.counter("hub_button_edges_total", "Button pin edges recorded by the interrupt.", loopNow.buttonEdges);
+  out.counter("hub_button_edges_dropped_total", "Button edges lost because the edge queue was full.", loopNow.buttonEdgesDropped);
+  
+  request->send(response);
+}
@@ -0,0 +1,244 @@
+#include "rule_engine.h"
+
+#include <LittleFS.h>
+#include <rom/crc.h>
+#include <async_log.h>
+#include <string.h>
+#include "device_registry.h"
+#include "message_types.h"
+
+#define RULES_MAGIC 0x31524C48u   // "HLR1"
+#define INDEX_MASK (RULE_INDEX_SLOTS - 1)
+#define POOL_FULL 0xFFFE
+
+static_assert(RULE_INDEX_SLOTS >= 2 * RULE_CAPACITY, "rule index too small");
+static_assert(RULE_CAPACITY <= 127 && RULE_ACTION_CAPACITY <= 255, "rule links are 8-bit");
+
+struct RulesFileHeader {
+  uint32_t magic;
+  uint32_t size;      // sizeof(RuleTable) when written; a different build rejects the file
+  uint32_t crc;       // CRC-32 of the table
+};
+
+static uint32_t indexKey(uint32_t sourceHash, uint32_t eventHash, uint8_t source) {
+  return sourceHash ^ (eventHash * 2654435761u) ^ source;
+}
+
+static void clearTable(RuleTable& table, uint32_t version) {
+  memset(&table, 0, sizeof(table));
+  table.version = version;
+  memset(table.index, NO_RULE, sizeof(table.index));
+}
+
+RuleEngine::RuleEngine() {
+  clearTable(tables_[0], 0);
+  clearTable(tables_[1], 0);
+  active_ = 0;
+  updating_ = false;
+  error_ = "";
+  evaluations_ = 0;
+  fired_ = 0;
+}
+
+void RuleEngine::begin() {
+  File file = LittleFS.open(RULES_PATH, FILE_READ);
+  if (!file) {
+    return;
+  }
+  RulesFileHeader header;
+  RuleTable& table = tables_[active_];
+  bool ok = file.read((uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+            header.magic == RULES_MAGIC && header.size == sizeof(RuleTable) &&
+            file.read((uint8_t*)&table, sizeof(table)) == sizeof(table) &&
+            crc32_le(0, (const uint8_t*)&table, sizeof(table)) == header.crc;
+  file.close();
+  if (!ok) {
+    clearTable(table, 0);
+    LOG_WARN("Stored rules unreadable, running without rules");
+    return;
+  }
+  LOG_INFO("Loaded %u rules (version %u)", table.ruleCount, table.version);
+}
+
+int RuleEngine::chainOf(const RuleTable& table, uint32_t sourceHash, uint32_t eventHash, uint8_t source) const {
+  uint32_t slot = indexKey(sourceHash, eventHash, source) & INDEX_MASK;
+  for (int probes = 0; probes < RULE_INDEX_SLOTS; probes++) {
+    int8_t head = table.index[slot];
+    if (head == NO_RULE) {
+      return NO_RULE;
+    }
+    const Rule& rule = table.rules[head];
+    if (rule.sourceHash == sourceHash && rule.eventHash == eventHash && rule.source == source) {
+      return head;
+    }
+    slot = (slot + 1) & INDEX_MASK;
+  }
+  return NO_RULE;
+}
+
+int RuleEngine::evaluate(uint32_t eventHash, const char* deviceId, const char* deviceType, const char* value,
+                         RuleActionCallback callback) {
+  const RuleTable& table = tables_[active_];
+  if (table.ruleCount == 0) {
+    return 0;
+  }
+  evaluations_++;
+
+  // Rules naming the device come before rules for its type
+  const uint32_t sourceHashes[2] = {DeviceRegistry::hashId(deviceId), DeviceRegistry::hashId(deviceType)};
+  int count = 0;
+  for (uint8_t source = RULE_SOURCE_DEVICE; source <= RULE_SOURCE_TYPE; source++) {
+    int next = chainOf(table, sourceHashes[source], eventHash, source);
+    while (next != NO_RULE) {
+      const Rule& rule = table.rules[next];
+      next = rule.next;
+      if (rule.match != RULE_ANY_VALUE && strcmp(table.pool + rule.match, value) != 0) {
+        continue;
+      }
+      for (int i = 0; i < rule.actionCount; i++) {
+        const RuleAction& action = table.actions[rule.firstAction + i];
+        callback(action.kind, table.pool + action.deviceId, table.pool + action.command, action.state != 0);
+      }
+      count++;
+    }
+  }
+  fired_ += count;
+  return count;
+}
+
+void RuleEngine::beginUpdate(uint32_t version) {
+  clearTable(tables_[1 - active_], version);
+  updating_ = true;
+  error_ = "";
+}
+
+bool RuleEngine::fail(const char* error) {
+  error_ = error;
+  updating_ = false;
+  return false;
+}
+
+uint16_t RuleEngine::intern(RuleTable& table, const char* text) {
+  // Commands and device IDs repeat across rules; keep one copy of each
+  uint16_t offset = 0;
+  while (offset < table.poolUsed) {
+    if (strcmp(table.pool + offset, text) == 0) {
+      return offset;
+    }
+    offset += strlen(table.pool + offset) + 1;
+  }
+  size_t length = strlen(text) + 1;
+  if (table.poolUsed + length > RULE_POOL_SIZE) {
+    return POOL_FULL;
+  }
+  memcpy(table.pool + table.poolUsed, text, length);
+  table.poolUsed += length;
+  return offset;
+}
+
+bool RuleEngine::addRule(const char* event, RuleSource source, const char* sourceName, const char* match) {
+  if (!updating_) {
+    return false;
+  }
+  RuleTable& table = tables_[1 - active_];
+  if (table.ruleCount >= RULE_CAPACITY) {
+    return fail("too many rules");
+  }
+  if (event == nullptr || event[0] == '\0' || sourceName == nullptr || sourceName[0] == '\0') {
+    return fail("rule without event or source");
+  }
+
+  Rule& rule = table.rules[table.ruleCount];
+  rule.sourceHash = DeviceRegistry::hashId(sourceName);
+  rule.eventHash = msgTypeHash(event);
+  rule.source = source;
+  rule.match = RULE_ANY_VALUE;
+  if (match != nullptr) {
+    rule.match = intern(table, match);
+    if (rule.match == POOL_FULL) {
+      return fail("rule strings too long");
+    }
+  }
+  rule.firstAction = table.actionCount;
+  rule.actionCount = 0;
+  rule.next = NO_RULE;
+  table.ruleCount++;
+  return true;
+}
+
+bool RuleEngine::addAction(RuleActionKind kind, const char* deviceId, const char* command, bool state) {
+  if (!updating_) {
+    return false;
+  }
+  RuleTable& table = tables_[1 - active_];
+  if (table.ruleCount == 0) {
+    return fail("action before any rule");
+  }
+  if (table.actionCount >= RULE_ACTION_CAPACITY) {
+    return fail("too many actions");
+  }
+
+  RuleAction& action = table.actions[table.actionCount];
+  action.kind = kind;
+  action.state = state ? 1 : 0;
+  action.deviceId = intern(table, deviceId != nullptr ? deviceId : "");
+  action.command = intern(table, command != nullptr ? command : "");
+  if (action.deviceId == POOL_FULL || action.command == POOL_FULL) {
+    return fail("rule strings too long");
+  }
+  // Actions of one rule are contiguous: rules are built one at a time
+  table.actionCount++;
+  table.rules[table.ruleCount - 1].actionCount++;
+  return true;
+}
+
+void RuleEngine::buildIndex(RuleTable& table) {
+  memset(table.index, NO_RULE, sizeof(table.index));
+  // Walk backwards and push each rule to the front of its chain, so chains keep the server's order
+  for (int r = table.ruleCount - 1; r >= 0; r--) {
+    Rule& rule = table.rules[r];
+    uint32_t slot = indexKey(rule.sourceHash, rule.eventHash, rule.source) & INDEX_MASK;
+    while (table.index[slot] != NO_RULE) {
+      const Rule& head = table.rules[table.index[slot]];
+      if (head.sourceHash == rule.sourceHash && head.eventHash == rule.eventHash && head.source == rule.source) {
+        break;
+      }
+      slot = (slot + 1) & INDEX_MASK;
+    }
+    rule.next = table.index[slot];
+    table.index[slot] = r;
+  }
+}
+
+bool RuleEngine::store(const RuleTable& table) {
+  RulesFileHeader header = {RULES_MAGIC, sizeof(RuleTable), crc32_le(0, (const uint8_t*)&table, sizeof(table))};
+  File file = LittleFS.open(RULES_UPDATE_PATH, FILE_WRITE);
+  if (!file) {
+    return false;
+  }
+  bool ok = file.write((const uint8_t*)&header, sizeof(header)) == sizeof(header) &&
+            file.write((const uint8_t*)&table, sizeof(table)) == sizeof(table);
+  file.close();
+  // The rename replaces the old file in one step; a reset before it keeps the old rules
+  if (!ok || !LittleFS.rename(RULES_UPDATE_PATH, RULES_PATH)) {
+    LittleFS.remove(RULES_UPDATE_PATH);
+    return false;
+  }
+  return true;
+}
+
+bool RuleEngine::commitUpdate() {
+  if (!updating_) {
+    return false;
+  }
+  RuleTable& table = tables_[1 - active_];
+  buildIndex(table);
+  if (!store(table)) {
+    return fail("could not store rules");
+  }
+  active_ = 1 - active_;
+  updating_ = false;
+  LOG_INFO("Rules updated to version %u: %u rules, %u actions, %u string bytes",
+           table.version, table.ruleCount, table.actionCount, table.poolUsed);
+  return true;
+}
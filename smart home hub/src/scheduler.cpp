@@ -0,0 +1,57 @@
+#include "scheduler.h"
+
+#include <Arduino.h>
+
+Scheduler::Scheduler() {
+  numTasks_ = 0;
+  resetLoopStats();
+}
+
+int Scheduler::addTask(const char* name, TaskCallback callback, uint32_t intervalMs) {
+  if (numTasks_ >= MAX_SCHEDULER_TASKS) {
+    return NO_TASK;
+  }
+  SchedulerTask& task = tasks_[numTasks_];
+  task.name = name;
+  task.callback = callback;
+  task.intervalMs = intervalMs;
+  task.lastRunMs = millis();
+  task.maxRunUs = 0;
+  return numTasks_++;
+}
+
+void Scheduler::run() {
+  uint32_t loopStart = micros();
+
+  for (int i = 0; i < numTasks_; i++) {
+    SchedulerTask& task = tasks_[i];
+    // Unsigned subtraction keeps this correct across millis() rollover
+    uint32_t now = millis();
+    if (task.intervalMs > 0 && now - task.lastRunMs < task.intervalMs) {
+      continue;
+    }
+    task.lastRunMs = now;
+
+    uint32_t taskStart = micros();
+    task.callback();
+    uint32_t taskUs = micros() - taskStart;
+    if (taskUs > task.maxRunUs) {
+      task.maxRunUs = taskUs;
+    }
+  }
+
+  lastLoopUs_ = micros() - loopStart;
+  if (lastLoopUs_ > maxLoopUs_) {
+    maxLoopUs_ = lastLoopUs_;
+  }
+  loopCount_++;
+}
+
+void Scheduler::resetLoopStats() {
+  lastLoopUs_ = 0;
+  maxLoopUs_ = 0;
+  loopCount_ = 0;
+  for (int i = 0; i < numTasks_; i++) {
+    tasks_[i].maxRunUs = 0;
+  }
+}
@@ -0,0 +1,98 @@
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel() {
+  for (int i = 0; i < TIMER_WHEEL_TIMERS; i++) {
+    timers_[i].next = NO_TIMER;
+    timers_[i].prev = NO_TIMER;
+    timers_[i].deadlineTick = 0;
+    timers_[i].armed = false;
+  }
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    slots_[i] = NO_TIMER;
+  }
+  currentTick_ = 0;
+  tickStartMs_ = 0;
+  armedCount_ = 0;
+}
+
+void TimerWheel::begin(uint32_t now) {
+  tickStartMs_ = now;
+}
+
+void TimerWheel::link(int id) {
+  int slot = timers_[id].deadlineTick & (TIMER_WHEEL_SLOTS - 1);
+  timers_[id].prev = NO_TIMER;
+  timers_[id].next = slots_[slot];
+  if (slots_[slot] != NO_TIMER) {
+    timers_[slots_[slot]].prev = id;
+  }
+  slots_[slot] = id;
+  timers_[id].armed = true;
+  armedCount_++;
+}
+
+void TimerWheel::unlink(int id) {
+  Timer &timer = timers_[id];
+  if (timer.prev != NO_TIMER) {
+    timers_[timer.prev].next = timer.next;
+  } else {
+    slots_[timer.deadlineTick & (TIMER_WHEEL_SLOTS - 1)] = timer.next;
+  }
+  if (timer.next != NO_TIMER) {
+    timers_[timer.next].prev = timer.prev;
+  }
+  timer.next = NO_TIMER;
+  timer.prev = NO_TIMER;
+  timer.armed = false;
+  armedCount_--;
+}
+
+void TimerWheel::arm(int id, uint32_t delayMs) {
+  if (id < 0 || id >= TIMER_WHEEL_TIMERS) {
+    return;
+  }
+  // Never due before the next tick, so the slot being run is not refilled
+  uint32_t ticks = (delayMs + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  if (ticks == 0) {
+    ticks = 1;
+  }
+
+  if (timers_[id].armed) {
+    unlink(id);
+  }
+  timers_[id].deadlineTick = currentTick_ + ticks;
+  link(id);
+}
+
+void TimerWheel::disarm(int id) {
+  if (id < 0 || id >= TIMER_WHEEL_TIMERS) {
+    return;
+  }
+  if (timers_[id].armed) {
+    unlink(id);
+  }
+}
+
+int TimerWheel::advance(uint32_t now, int16_t* fired, int max) {
+  int count = 0;
+  while (now - tickStartMs_ >= TIMER_WHEEL_TICK_MS) {
+    uint32_t tick = currentTick_ + 1;
+    int16_t id = slots_[tick & (TIMER_WHEEL_SLOTS - 1)];
+    while (id != NO_TIMER && count < max) {
+      int16_t next = timers_[id].next;
+      // Deadlines more than one turn away share the slot but are not due yet
+      if ((int32_t)(timers_[id].deadlineTick - tick) <= 0) {
+        unlink(id);
+        fired[count++] = id;
+      }
+      id = next;
+    }
+    if (id != NO_TIMER) {
+      // fired is full; finish this tick on the next call
+      break;
+    }
+    currentTick_ = tick;
+    tickStartMs_ += TIMER_WHEEL_TICK_MS;
+  }
+  return count;
+}
@@ -0,0 +1,89 @@
+#include "uplink_batcher.h"
+
+#include <string.h>
+
+// Copy a string into a fixed-size field, always NUL-terminated
+static void copyField(char* dest, const char* src, size_t size) {
+  size_t len = strnlen(src, size - 1);
+  memcpy(dest, src, len);
+  dest[len] = '\0';
+}
+
+UplinkBatcher::UplinkBatcher(uint32_t windowMs, int maxEvents) {
+  count_ = 0;
+  windowMs_ = windowMs;
+  maxEvents_ = maxEvents < UPLINK_BATCH_CAPACITY ? maxEvents : UPLINK_BATCH_CAPACITY;
+  eventsQueued_ = 0;
+  eventsCoalesced_ = 0;
+  eventsDropped_ = 0;
+  eventsSent_ = 0;
+  framesSent_ = 0;
+  latencyTotalMs_ = 0;
+  maxLatencyMs_ = 0;
+}
+
+bool UplinkBatcher::add(UplinkKind kind, const char* deviceId, const char* value, uint32_t now) {
+  if (deviceId == nullptr) {
+    deviceId = "";
+  }
+  if (value == nullptr) {
+    value = "";
+  }
+
+  eventsQueued_++;
+
+  // A newer event of the same kind for the same device replaces the pending one.
+  // It goes to the back, behind anything the device sent in between (status X,
+  // offline, status Y must not reach the cloud as Y, offline), and keeps the
+  // old queue time so coalescing never delays the flush.
+  uint32_t queuedAt = now;
+  for (int i = 0; i < count_; i++) {
+    if (events_[i].kind == kind && strcmp(events_[i].deviceId, deviceId) == 0) {
+      queuedAt = events_[i].queuedAt;
+      count_--;
+      memmove(events_ + i, events_ + i + 1, (count_ - i) * sizeof(UplinkEvent));
+      eventsCoalesced_++;
+      break;
+    }
+  }
+  if (count_ >= UPLINK_BATCH_CAPACITY) {
+    eventsDropped_++;
+    return true;
+  }
+  UplinkEvent& event = events_[count_++];
+  event.kind = kind;
+  copyField(event.deviceId, deviceId, DEVICE_ID_LEN);
+  copyField(event.value, value, DEVICE_STATUS_LEN);
+  event.queuedAt = queuedAt;
+
+  bool full = count_ >= maxEvents_;
+  return full;
+}
+
+bool UplinkBatcher::due(uint32_t now) const {
+  // A coalesced event moves to the back with its old queue time, so the oldest can be anywhere
+  for (int i = 0; i < count_; i++) {
+    if (now - events_[i].queuedAt >= windowMs_) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int UplinkBatcher::take(UplinkEvent* out, int max, uint32_t now) {
+  int taken = count_ < max ? count_ : max;
+  for (int i = 0; i < taken; i++) {
+    out[i] = events_[i];
+    uint32_t latency = now - events_[i].queuedAt;
+    latencyTotalMs_ += latency;
+    if (latency > maxLatencyMs_) {
+      maxLatencyMs_ = latency;
+    }
+  }
+  eventsSent_ += taken;
+
+  // Keep anything that did not fit, still in order
+  count_ -= taken;
+  memmove(events_, events_ + taken, count_ * sizeof(UplinkEvent));
+  return taken;
+}
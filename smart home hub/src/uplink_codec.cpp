@@ -0,0 +1,506 @@
+#include "uplink_codec.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Fields whose string values repeat across frames and go in the dictionary
+static const char* const IDENTIFIER_FIELDS[] = {"type", "deviceId", "deviceType", "id", "alertType"};
+
+static bool isIdentifier(const char* key) {
+  for (const char* field : IDENTIFIER_FIELDS) {
+    if (strcmp(key, field) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t hashString(const char* text, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+  }
+  return hash;
+}
+
+UplinkEncoder::UplinkEncoder() {
+  out_ = nullptr;
+  size_ = 0;
+  length_ = 0;
+  overflow_ = false;
+  reset();
+}
+
+void UplinkEncoder::reset() {
+  committed_ = 0;
+  count_ = 0;
+}
+
+void UplinkEncoder::commit() {
+  committed_ = count_;
+}
+
+void UplinkEncoder::rollback() {
+  count_ = committed_;
+}
+
+size_t UplinkEncoder::encode(JsonVariantConst message, const char* omitKey, uint8_t* out, size_t size) {
+  // Entries of an earlier frame that was neither committed nor rolled back never reached the server
+  rollback();
+  out_ = out;
+  size_ = size;
+  length_ = 0;
+  overflow_ = false;
+
+  if (message.is<JsonObjectConst>()) {
+    writeMap(message.as<JsonObjectConst>(), omitKey, 1);
+  } else {
+    writeValue(message, false, 1);
+  }
+
+  if (overflow_ || length_ == 0) {
+    rollback();
+    return 0;
+  }
+  return length_;
+}
+
+void UplinkEncoder::writeValue(JsonVariantConst value, bool identifier, int depth) {
+  if (depth > UPLINK_CODEC_MAX_DEPTH) {
+    overflow_ = true;
+    return;
+  }
+
+  if (value.isNull()) {
+    writeByte(0xc0);
+  } else if (value.is<bool>()) {
+    writeByte(value.as<bool>() ? 0xc3 : 0xc2);
+  } else if (value.is<const char*>()) {
+    writeString(value.as<const char*>(), identifier, false);
+  } else if (value.is<JsonObjectConst>()) {
+    writeMap(value.as<JsonObjectConst>(), nullptr, depth + 1);
+  } else if (value.is<JsonArrayConst>()) {
+    JsonArrayConst array = value.as<JsonArrayConst>();
+    writeHeader(0x90, 0xdc, 0xdd, array.size());
+    for (JsonVariantConst item : array) {
+      writeValue(item, false, depth + 1);
+    }
+  } else if (value.is<uint32_t>()) {
+    writeInt(value.as<uint32_t>());
+  } else if (value.is<int32_t>()) {
+    writeInt(value.as<int32_t>());
+  } else {
+    // Readings, and integers too wide for 32 bits, go as float32
+    float number = value.as<float>();
+    uint32_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    writeByte(0xca);
+    writeBigEndian(bits, 4);
+  }
+}
+
+void UplinkEncoder::writeMap(JsonObjectConst object, const char* omitKey, int depth) {
+  size_t count = 0;
+  for (JsonPairConst pair : object) {
+    if (omitKey == nullptr || strcmp(pair.key().c_str(), omitKey) != 0) {
+      count++;
+    }
+  }
+
+  writeHeader(0x80, 0xde, 0xdf, count);
+  for (JsonPairConst pair : object) {
+    const char* key = pair.key().c_str();
+    if (omitKey != nullptr && strcmp(key, omitKey) == 0) {
+      continue;
+    }
+    writeString(key, true, true);
+    writeValue(pair.value(), isIdentifier(key), depth);
+  }
+}
+
+void UplinkEncoder::writeString(const char* text, bool dictionary, bool key) {
+  if (text == nullptr) {
+    text = "";
+  }
+  size_t length = strlen(text);
+  if (!dictionary || length > UPLINK_DICT_STRING_MAX) {
+    writeRawString(text, length);
+    return;
+  }
+
+  uint32_t hash = hashString(text, length);
+  int index = lookup(text, length, hash);
+  if (index >= 0) {
+    if (key && index < 128) {
+      writeByte((uint8_t)index);  // positive fixint key
+    } else if (index < 256) {
+      writeByte(0xd4);            // fixext 1
+      writeByte(UPLINK_EXT_REF);
+      writeByte((uint8_t)index);
+    } else {
+      writeByte(0xd5);            // fixext 2
+      writeByte(UPLINK_EXT_REF);
+      writeBigEndian(index, 2);
+    }
+    return;
+  }
+
+  if (count_ >= UPLINK_DICT_ENTRIES) {
+    // Dictionary full for this session
+    writeRawString(text, length);
+    return;
+  }
+  memcpy(strings_[count_], text, length + 1);
+  hashes_[count_] = hash;
+  count_++;
+  writeByte(0xc7);                // ext 8
+  writeByte((uint8_t)length);
+  writeByte(UPLINK_EXT_DEF);
+  writeBytes(text, length);
+}
+
+void UplinkEncoder::writeRawString(const char* text, size_t length) {
+  if (length < 32) {
+    writeByte(0xa0 | (uint8_t)length);  // fixstr
+  } else if (length <= 0xFF) {
+    writeByte(0xd9);
+    writeByte((uint8_t)length);
+  } else if (length <= 0xFFFF) {
+    writeByte(0xda);
+    writeBigEndian(length, 2);
+  } else {
+    writeByte(0xdb);
+    writeBigEndian(length, 4);
+  }
+  writeBytes(text, length);
+}
+
+void UplinkEncoder::writeInt(int64_t value) {
+  if (value >= 0 && value < 128) {
+    writeByte((uint8_t)value);  // positive fixint
+  } else if (value < 0 && value >= -32) {
+    writeByte((uint8_t)(int8_t)value);  // negative fixint
+  } else if (value >= 0 && value <= 0xFF) {
+    writeByte(0xcc);
+    writeByte((uint8_t)value);
+  } else if (value >= 0 && value <= 0xFFFF) {
+    writeByte(0xcd);
+    writeBigEndian((uint32_t)value, 2);
+  } else if (value >= 0) {
+    writeByte(0xce);
+    writeBigEndian((uint32_t)value, 4);
+  } else if (value >= -128) {
+    writeByte(0xd0);
+    writeByte((uint8_t)(int8_t)value);
+  } else if (value >= -32768) {
+    writeByte(0xd1);
+    writeBigEndian((uint16_t)(int16_t)value, 2);
+  } else {
+    writeByte(0xd2);
+    writeBigEndian((uint32_t)(int32_t)value, 4);
+  }
+}
+
+void UplinkEncoder::writeHeader(uint8_t fixBase, uint8_t tag16, uint8_t tag32, size_t count) {
+  if (count < 16) {
+    writeByte(fixBase | (uint8_t)count);
+  } else if (count <= 0xFFFF) {
+    writeByte(tag16);
+    writeBigEndian(count, 2);
+  } else {
+    writeByte(tag32);
+    writeBigEndian(count, 4);
+  }
+}
+
+int UplinkEncoder::lookup(const char* text, size_t length, uint32_t hash) const {
+  // Pending entries count too: a string defined earlier in this frame is already known
+  for (int i = 0; i < count_; i++) {
+    if (hashes_[i] == hash && memcmp(strings_[i], text, length + 1) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void UplinkEncoder::writeByte(uint8_t value) {
+  if (length_ < size_) {
+    out_[length_++] = value;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void UplinkEncoder::writeBytes(const void* data, size_t length) {
+  if (length_ + length <= size_) {
+    memcpy(out_ + length_, data, length);
+    length_ += length;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void UplinkEncoder::writeBigEndian(uint32_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    writeByte((uint8_t)(value >> (i * 8)));
+  }
+}
+
+UplinkDecoder::UplinkDecoder() {
+  in_ = nullptr;
+  inLength_ = 0;
+  pos_ = 0;
+  out_ = nullptr;
+  size_ = 0;
+  length_ = 0;
+  overflow_ = false;
+  reset();
+}
+
+void UplinkDecoder::reset() {
+  count_ = 0;
+}
+
+size_t UplinkDecoder::decode(const uint8_t* frame, size_t length, char* json, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  in_ = frame;
+  inLength_ = length;
+  pos_ = 0;
+  out_ = json;
+  size_ = size;
+  length_ = 0;
+  overflow_ = false;
+
+  // A frame that fails part way must not leave its definitions behind
+  int start = count_;
+  if (!readValue(false, 0) || pos_ != inLength_ || overflow_) {
+    count_ = start;
+    json[0] = '\0';
+    return 0;
+  }
+  json[length_] = '\0';
+  return length_;
+}
+
+bool UplinkDecoder::readValue(bool key, int depth) {
+  if (depth > UPLINK_CODEC_MAX_DEPTH || pos_ >= inLength_) {
+    return false;
+  }
+  uint8_t tag = in_[pos_++];
+  uint64_t raw;
+  char number[32];
+
+  // Unsigned integers: a dictionary reference in key position
+  if (tag < 0x80 || (tag >= 0xcc && tag <= 0xcf)) {
+    raw = tag;
+    if (tag >= 0xcc && !readBigEndian(1 << (tag - 0xcc), raw)) {
+      return false;
+    }
+    if (key) {
+      return emitEntry(raw);
+    }
+    snprintf(number, sizeof(number), "%llu", (unsigned long long)raw);
+    emit(number);
+    return true;
+  }
+
+  if ((tag & 0xe0) == 0xa0 || (tag >= 0xd9 && tag <= 0xdb)) {
+    size_t length = tag & 0x1f;
+    if (tag >= 0xd9) {
+      if (!readBigEndian(1 << (tag - 0xd9), raw)) return false;
+      length = raw;
+    }
+    return readString(length);
+  }
+
+  if (tag >= 0xd4 && tag <= 0xd8) {
+    // fixext 1/2/4/8/16
+    if (pos_ >= inLength_) return false;
+    uint8_t type = in_[pos_++];
+    return readExt(type, 1 << (tag - 0xd4));
+  }
+  if (tag >= 0xc7 && tag <= 0xc9) {
+    // ext 8/16/32
+    if (!readBigEndian(1 << (tag - 0xc7), raw) || pos_ >= inLength_) return false;
+    uint8_t type = in_[pos_++];
+    return readExt(type, raw);
+  }
+
+  if (key) {
+    // JSON keys are strings; anything else is not a frame this protocol produces
+    return false;
+  }
+
+  if (tag >= 0xe0 || (tag >= 0xd0 && tag <= 0xd3)) {
+    int64_t value = (int8_t)tag;
+    if (tag < 0xe0) {
+      int bytes = 1 << (tag - 0xd0);
+      if (!readBigEndian(bytes, raw)) return false;
+      // Sign-extend from the encoded width
+      int shift = 64 - bytes * 8;
+      value = (int64_t)(raw << shift) >> shift;
+    }
+    snprintf(number, sizeof(number), "%lld", (long long)value);
+    emit(number);
+    return true;
+  }
+
+  size_t count = 0;
+  bool isMap = false;
+  if ((tag & 0xf0) == 0x80 || (tag & 0xf0) == 0x90) {
+    isMap = (tag & 0xf0) == 0x80;
+    count = tag & 0x0f;
+  } else if (tag == 0xdc || tag == 0xdd || tag == 0xde || tag == 0xdf) {
+    isMap = tag >= 0xde;
+    if (!readBigEndian((tag & 1) ? 4 : 2, raw)) return false;
+    count = raw;
+  } else {
+    switch (tag) {
+      case 0xc0:
+        emit("null");
+        return true;
+      case 0xc2:
+        emit("false");
+        return true;
+      case 0xc3:
+        emit("true");
+        return true;
+      case 0xca: {
+        if (!readBigEndian(4, raw)) return false;
+        uint32_t bits = (uint32_t)raw;
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        if (isfinite(value)) {
+          snprintf(number, sizeof(number), "%.9g", value);
+          emit(number);
+        } else {
+          emit("null");
+        }
+        return true;
+      }
+      case 0xcb: {
+        if (!readBigEndian(8, raw)) return false;
+        double value;
+        memcpy(&value, &raw, sizeof(value));
+        if (isfinite(value)) {
+          snprintf(number, sizeof(number), "%.17g", value);
+          emit(number);
+        } else {
+          emit("null");
+        }
+        return true;
+      }
+      default:
+        // bin and the never-used 0xc1 have no JSON equivalent
+        return false;
+    }
+  }
+
+  emitChar(isMap ? '{' : '[');
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0) {
+      emitChar(',');
+    }
+    if (isMap) {
+      if (!readValue(true, depth + 1)) return false;
+      emitChar(':');
+    }
+    if (!readValue(false, depth + 1)) return false;
+  }
+  emitChar(isMap ? '}' : ']');
+  return true;
+}
+
+bool UplinkDecoder::readString(size_t length) {
+  if (pos_ + length > inLength_) {
+    return false;
+  }
+  emitText((const char*)in_ + pos_, length);
+  pos_ += length;
+  return true;
+}
+
+bool UplinkDecoder::readExt(uint8_t type, size_t length) {
+  if (pos_ + length > inLength_) {
+    return false;
+  }
+  const uint8_t* data = in_ + pos_;
+  pos_ += length;
+
+  if (type == UPLINK_EXT_REF) {
+    if (length == 1) {
+      return emitEntry(data[0]);
+    }
+    if (length == 2) {
+      return emitEntry((data[0] << 8) | data[1]);
+    }
+    return false;
+  }
+  if (type == UPLINK_EXT_DEF) {
+    // The hub never defines more entries, or longer ones, than these limits
+    if (count_ >= UPLINK_DICT_ENTRIES || length > UPLINK_DICT_STRING_MAX) {
+      return false;
+    }
+    memcpy(strings_[count_], data, length);
+    strings_[count_][length] = '\0';
+    count_++;
+    emitText((const char*)data, length);
+    return true;
+  }
+  return false;
+}
+
+bool UplinkDecoder::readBigEndian(int bytes, uint64_t& value) {
+  if (pos_ + bytes > inLength_) {
+    return false;
+  }
+  value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | in_[pos_++];
+  }
+  return true;
+}
+
+bool UplinkDecoder::emitEntry(uint32_t index) {
+  if (index >= (uint32_t)count_) {
+    return false;
+  }
+  emitText(strings_[index], strlen(strings_[index]));
+  return true;
+}
+
+void UplinkDecoder::emitText(const char* text, size_t length) {
+  emitChar('"');
+  for (size_t i = 0; i < length; i++) {
+    char c = text[i];
+    if (c == '"' || c == '\\') {
+      emitChar('\\');
+      emitChar(c);
+    } else if ((uint8_t)c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", (uint8_t)c);
+      emit(escape);
+    } else {
+      emitChar(c);
+    }
+  }
+  emitChar('"');
+}
+
+void UplinkDecoder::emit(const char* text) {
+  while (*text) {
+    emitChar(*text++);
+  }
+}
+
+void UplinkDecoder::emitChar(char c) {
+  // Keep one byte for the terminating NUL
+  if (length_ + 1 < size_) {
+    out_[length_++] = c;
+  } else {
+    overflow_ = true;
+  }
+}
@@ -0,0 +1,239 @@
+#include "uplink_queue.h"
+
+#include <LittleFS.h>
+#include <async_log.h>
+#include <string.h>
+
+#define HEADER_SIZE sizeof(RecordHeader)
+
+UplinkQueue::UplinkQueue() {
+  ramHead_ = 0;
+  ramUsed_ = 0;
+  ramCount_ = 0;
+  fsReady_ = false;
+  spillBlocked_ = false;
+  fileSize_ = 0;
+  fileReadOffset_ = 0;
+  fileCount_ = 0;
+  peekedLength_ = 0;
+  peekedFromFile_ = false;
+  dropped_ = 0;
+  spilled_ = 0;
+  drainedFrames_ = 0;
+  drainedBytes_ = 0;
+}
+
+void UplinkQueue::begin() {
+  fsReady_ = LittleFS.begin(true);
+  if (!fsReady_) {
+    LOG_WARN("LittleFS mount failed, uplink queue is RAM only");
+    return;
+  }
+  // The read position of an old segment is lost across a reboot
+  if (LittleFS.exists(UPLINK_SPILL_PATH)) {
+    LittleFS.remove(UPLINK_SPILL_PATH);
+  }
+}
+
+void UplinkQueue::ringWrite(size_t offset, const void* data, size_t length) {
+  const uint8_t* src = (const uint8_t*)data;
+  offset %= UPLINK_QUEUE_RAM_BYTES;
+  size_t first = UPLINK_QUEUE_RAM_BYTES - offset;
+  if (first > length) {
+    first = length;
+  }
+  memcpy(ring_ + offset, src, first);
+  memcpy(ring_, src + first, length - first);
+}
+
+void UplinkQueue::ringRead(size_t offset, void* data, size_t length) const {
+  uint8_t* dest = (uint8_t*)data;
+  offset %= UPLINK_QUEUE_RAM_BYTES;
+  size_t first = UPLINK_QUEUE_RAM_BYTES - offset;
+  if (first > length) {
+    first = length;
+  }
+  memcpy(dest, ring_ + offset, first);
+  memcpy(dest + first, ring_, length - first);
+}
+
+void UplinkQueue::dropRamHead() {
+  RecordHeader header;
+  ringRead(ramHead_, &header, HEADER_SIZE);
+  size_t total = HEADER_SIZE + header.length;
+  ramHead_ = (ramHead_ + total) % UPLINK_QUEUE_RAM_BYTES;
+  ramUsed_ -= total;
+  ramCount_--;
+}
+
+void UplinkQueue::resetSegment() {
+  // Fully drained (or nothing readable left): start the next outage with an empty segment
+  LittleFS.remove(UPLINK_SPILL_PATH);
+  fileSize_ = 0;
+  fileReadOffset_ = 0;
+  if (spillBlocked_) {
+    spillBlocked_ = false;
+    LOG_INFO("Uplink spill segment drained, spilling again");
+  }
+}
+
+bool UplinkQueue::appendToSpill(const RecordHeader& header, size_t ringOffset) {
+  if (!fsReady_ || spillBlocked_) {
+    return false;
+  }
+  uint32_t limit = UPLINK_SPILL_MAX_BYTES;
+  if (header.priority == UPLINK_PRIORITY_HIGH) {
+    limit += UPLINK_SPILL_HIGH_RESERVE;
+  }
+  if (fileSize_ + HEADER_SIZE + header.length > limit) {
+    return false;
+  }
+
+  File segment = LittleFS.open(UPLINK_SPILL_PATH, FILE_APPEND);
+  if (!segment) {
+    return false;
+  }
+  // Copy the payload out of the ring in at most two pieces
+  size_t written = segment.write((const uint8_t*)&header, HEADER_SIZE);
+  size_t offset = (ringOffset + HEADER_SIZE) % UPLINK_QUEUE_RAM_BYTES;
+  size_t first = UPLINK_QUEUE_RAM_BYTES - offset;
+  if (first > header.length) {
+    first = header.length;
+  }
+  written += segment.write(ring_ + offset, first);
+  written += segment.write(ring_, header.length - first);
+  segment.close();
+
+  if (written != HEADER_SIZE + header.length) {
+    // A partial record now ends the segment. LittleFS cannot truncate it, so
+    // nothing more is appended until the records before it are drained and
+    // the file is removed; with none before it, that is right away.
+    if (fileCount_ == 0) {
+      resetSegment();
+    } else {
+      spillBlocked_ = true;
+    }
+    LOG_WARN("Uplink spill write failed, queue is RAM only until the segment drains");
+    return false;
+  }
+  fileSize_ += written;
+  fileCount_++;
+  spilled_++;
+  return true;
+}
+
+bool UplinkQueue::evictRamHead(UplinkPriority incoming) {
+  RecordHeader header;
+  ringRead(ramHead_, &header, HEADER_SIZE);
+
+  if (appendToSpill(header, ramHead_)) {
+    dropRamHead();
+    return true;
+  }
+  if (header.priority > incoming) {
+    return false;
+  }
+  dropRamHead();
+  dropped_++;
+  return true;
+}
+
+bool UplinkQueue::push(const char* data, size_t length, UplinkPriority priority) {
+  size_t total = HEADER_SIZE + length;
+  if (length == 0 || length > 0xFFFF || total > UPLINK_QUEUE_RAM_BYTES) {
+    dropped_++;
+    return false;
+  }
+
+  // A peeked RAM record may be about to be popped; never evict it from under the drain
+  while (ramFree() < total) {
+    bool headPeeked = peekedLength_ > 0 && !peekedFromFile_;
+    if (ramCount_ == 0 || headPeeked || !evictRamHead(priority)) {
+      dropped_++;
+      return false;
+    }
+  }
+
+  RecordHeader header = {(uint16_t)length, priority, 0};
+  size_t tail = ramHead_ + ramUsed_;
+  ringWrite(tail, &header, HEADER_SIZE);
+  ringWrite(tail + HEADER_SIZE, data, length);
+  ramUsed_ += total;
+  ramCount_++;
+  return true;
+}
+
+size_t UplinkQueue::peek(char* out, size_t size) {
+  peekedLength_ = 0;
+
+  // The segment holds the oldest records
+  while (fileCount_ > 0) {
+    File segment = LittleFS.open(UPLINK_SPILL_PATH, FILE_READ);
+    RecordHeader header;
+    bool ok = segment && segment.seek(fileReadOffset_) &&
+              segment.read((uint8_t*)&header, HEADER_SIZE) == HEADER_SIZE;
+    if (ok && header.length <= size) {
+      ok = segment.read((uint8_t*)out, header.length) == header.length;
+      segment.close();
+      if (ok) {
+        peekedLength_ = HEADER_SIZE + header.length;
+        peekedFromFile_ = true;
+        return header.length;
+      }
+    } else if (segment) {
+      segment.close();
+    }
+
+    if (!ok) {
+      // Unreadable segment: give up on everything in it
+      dropped_ += fileCount_;
+      fileCount_ = 0;
+    } else {
+      // Record larger than the caller's buffer: skip it
+      fileReadOffset_ += HEADER_SIZE + header.length;
+      fileCount_--;
+      dropped_++;
+    }
+    if (fileCount_ == 0) {
+      resetSegment();
+    }
+  }
+
+  while (ramCount_ > 0) {
+    RecordHeader header;
+    ringRead(ramHead_, &header, HEADER_SIZE);
+    if (header.length <= size) {
+      ringRead(ramHead_ + HEADER_SIZE, out, header.length);
+      peekedLength_ = HEADER_SIZE + header.length;
+      peekedFromFile_ = false;
+      return header.length;
+    }
+    dropRamHead();
+    dropped_++;
+  }
+
+  return 0;
+}
+
+void UplinkQueue::pop() {
+  if (peekedLength_ == 0) {
+    return;
+  }
+
+  if (peekedFromFile_) {
+    fileReadOffset_ += peekedLength_;
+    fileCount_--;
+    if (fileCount_ == 0) {
+      resetSegment();
+    }
+  } else {
+    dropRamHead();
+  }
+  drainedFrames_++;
+  drainedBytes_ += peekedLength_ - HEADER_SIZE;
+  peekedLength_ = 0;
+}
+
+bool UplinkQueue::empty() {
+  return ramCount_ == 0 && fileCount_ == 0;
+}
@@ -0,0 +1,50 @@
+#include "ws_fanout.h"
+
+#include <memory>
+#include <vector>
+
+WsFanout::WsFanout(AsyncWebSocket& ws) : ws_(ws) {
+  fanouts_ = 0;
+  queued_ = 0;
+  skipped_ = 0;
+  closed_ = 0;
+  lastClients_ = 0;
+  lastHeapBytes_ = 0;
+}
+
+uint32_t WsFanout::send(const uint32_t* clientIds, int count, const uint8_t* data, size_t length, bool binary) {
+  uint32_t heapBefore = ESP.getFreeHeap();
+  // The only copy of the payload; every client's message holds a reference to it
+  auto buffer = std::make_shared<std::vector<uint8_t>>(data, data + length);
+
+  uint32_t sent = 0;
+  for (int i = 0; i < count; i++) {
+    // The client may have gone since the loop task named it; the caller's lock keeps it from going now
+    AsyncWebSocketClient* client = ws_.client(clientIds[i]);
+    if (client == nullptr || client->status() != WS_CONNECTED) {
+      continue;
+    }
+    if (client->queueIsFull()) {
+      // Not reading at all; queueing more would only hold more heap
+      client->close();
+      closed_++;
+      continue;
+    }
+    if (client->queueLen() >= FANOUT_SKIP_QUEUE) {
+      skipped_++;
+      continue;
+    }
+    if (binary) {
+      client->binary(buffer);
+    } else {
+      client->text(buffer);
+    }
+    sent++;
+  }
+
+  fanouts_++;
+  queued_ += sent;
+  lastClients_ = sent;
+  lastHeapBytes_ = (int32_t)(heapBefore - ESP.getFreeHeap());
+  return sent;
+}
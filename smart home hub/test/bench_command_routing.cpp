@@ -0,0 +1,115 @@
+// Cost of finding the connection to forward a command on, at 10/50/200 clients
+//
+// Before: the device ID was found by scanning the String ID array, then
+// ws.getClients() was walked with nth(i), itself a walk of the client
+// list, comparing each client's remoteIP() with the device's IP; ws.text()
+// then looked the client up by ID once more. After: the registry maps the
+// ID to the client bound at registration, and the net task makes the one
+// ws.client(id) lookup. The client list is modelled as the library's
+// linked list. The registry holds at most 128 devices, so at 200 clients
+// the last 72 are connections that never registered.
+#include "test_support.h"
+
+#include <device_registry.h>
+#include <list>
+#include <string>
+#include <vector>
+
+static const int COMMANDS = 200000;
+
+struct FakeClient {
+  uint32_t id;
+  uint32_t ip;
+};
+
+typedef std::list<FakeClient> ClientList;
+
+static const FakeClient* nth(const ClientList& clients, size_t index) {
+  auto it = clients.begin();
+  while (index-- > 0 && it != clients.end()) {
+    ++it;
+  }
+  return it == clients.end() ? nullptr : &*it;
+}
+
+// AsyncWebSocket::client(id)
+static const FakeClient* clientById(const ClientList& clients, uint32_t id) {
+  for (const FakeClient& client : clients) {
+    if (client.id == id) {
+      return &client;
+    }
+  }
+  return nullptr;
+}
+
+static void benchSize(int connected) {
+  ClientList clients;
+  DeviceRegistry registry;
+  std::vector<std::string> deviceIds;
+  std::vector<uint32_t> deviceIPs;
+  int devices = connected < REGISTRY_CAPACITY ? connected : REGISTRY_CAPACITY;
+  for (int i = 0; i < connected; i++) {
+    uint32_t ip = 0x0104a8c0 + (i << 24);
+    clients.push_back({(uint32_t)(i + 1), ip});
+    if (i < devices) {
+      char id[DEVICE_ID_LEN];
+      snprintf(id, sizeof(id), "esp-%06x", 0x1a2b00 + i * 37);
+      deviceIds.push_back(id);
+      deviceIPs.push_back(ip);
+      int index = registry.add(id, "light");
+      registry.setIP(index, ip);
+      registry.bindClient(index, i + 1);
+    }
+  }
+
+  std::vector<int> order(4096);
+  uint32_t state = 777;
+  for (int& pick : order) {
+    state = state * 1103515245u + 12345u;
+    pick = (state >> 8) % devices;
+  }
+
+  uint64_t sum = 0;
+  double before;
+  {
+    BenchTimer timer;
+    for (int n = 0; n < COMMANDS; n++) {
+      const char* deviceId = deviceIds[order[n & 4095]].c_str();
+      int deviceIndex = -1;
+      for (size_t i = 0; i < deviceIds.size(); i++) {
+        if (deviceIds[i] == deviceId) {
+          deviceIndex = (int)i;
+          break;
+        }
+      }
+      for (size_t i = 0; i < clients.size(); i++) {
+        const FakeClient* client = nth(clients, i);
+        if (client->ip == deviceIPs[deviceIndex]) {
+          sum += clientById(clients, client->id)->id;
+          break;
+        }
+      }
+    }
+    before = timer.elapsedNs() / COMMANDS;
+  }
+  double after;
+  {
+    BenchTimer timer;
+    for (int n = 0; n < COMMANDS; n++) {
+      int deviceIndex = registry.find(deviceIds[order[n & 4095]].c_str());
+      const FakeClient* client = clientById(clients, registry.at(deviceIndex).clientId);
+      sum += client->id;
+    }
+    after = timer.elapsedNs() / COMMANDS;
+  }
+  benchKeep(sum);
+  printf("%4d clients (%3d devices)  before %9.1f ns/command  after %6.1f ns/command\n", connected, devices,
+         before, after);
+}
+
+int main() {
+  benchSize(10);
+  benchSize(50);
+  benchSize(200);
+  return 0;
+}
@@ -0,0 +1,127 @@
+// Compact frames against JSON: bytes on the wire and encode/decode time per message type
+//
+// The JSON column is the text the same message is sent as on a JSON
+// connection, built with snprintf in the compact form serializeJson()
+// writes. Encode is CompactWriter from begin() to finish(); decode walks
+// every field with CompactReader as the hub's handler does, copying the
+// strings out. With ArduinoJson available (see CMakeLists.txt) the JSON
+// serialize/parse times are printed alongside.
+#include "test_support.h"
+
+#include <compact_frame.h>
+#ifdef HUB_HAVE_ARDUINOJSON
+#include <json_pool.h>
+#endif
+
+static const int ROUNDS = 1000000;
+
+struct Sample {
+  const char* name;
+  FrameType type;
+  const char* deviceId;
+  const char* deviceType;  // or alert type, status, command: the one text field
+  FrameKey textKey;
+  const char* textName;
+  int32_t number;
+  FrameKey numberKey;      // KEY_TYPE: none
+  const char* numberName;
+};
+
+static const Sample SAMPLES[] = {
+  {"registration", FRAME_REGISTRATION, "esp-1a2b3c", "smart_switch", KEY_DEVICE_TYPE, "deviceType", 0, KEY_TYPE, nullptr},
+  {"status", FRAME_STATUS, "esp-1a2b3c", "on", KEY_STATUS, "status", 48213, KEY_CORR_ID, "corrId"},
+  {"alert", FRAME_ALERT, "esp-4d5e6f", "smoke", KEY_ALERT_TYPE, "alertType", 812, KEY_VALUE, "value"},
+  {"heartbeat", FRAME_HEARTBEAT, "esp-1a2b3c", nullptr, KEY_TYPE, nullptr, 0, KEY_TYPE, nullptr},
+  {"command", FRAME_COMMAND, nullptr, "toggle", KEY_COMMAND, "command", 48213, KEY_CORR_ID, "corrId"},
+  {"position_update", FRAME_POSITION_UPDATE, "esp-7a8b9c", nullptr, KEY_TYPE, nullptr, 65, KEY_POSITION, "position"},
+  {"ack", FRAME_ACK, "esp-1a2b3c", nullptr, KEY_TYPE, nullptr, 48213, KEY_CORR_ID, "corrId"},
+};
+
+static size_t encodeCompact(const Sample& sample, uint8_t* frame, size_t size) {
+  CompactWriter writer(frame, size);
+  writer.begin(sample.type);
+  if (sample.deviceId) writer.putString(KEY_DEVICE_ID, sample.deviceId);
+  if (sample.textName) writer.putString(sample.textKey, sample.deviceType);
+  if (sample.numberName) writer.putInt(sample.numberKey, sample.number);
+  return writer.finish();
+}
+
+static size_t encodeJson(const Sample& sample, char* text, size_t size) {
+  int length = snprintf(text, size, "{\"type\":\"%s\"", sample.name);
+  if (sample.deviceId) length += snprintf(text + length, size - length, ",\"deviceId\":\"%s\"", sample.deviceId);
+  if (sample.textName) length += snprintf(text + length, size - length, ",\"%s\":\"%s\"", sample.textName, sample.deviceType);
+  if (sample.numberName) length += snprintf(text + length, size - length, ",\"%s\":%d", sample.numberName, (int)sample.number);
+  length += snprintf(text + length, size - length, "}");
+  return length;
+}
+
+static size_t decodeCompact(const uint8_t* frame, size_t length) {
+  CompactReader reader(frame, length);
+  uint8_t key;
+  CompactValue value;
+  char text[32];
+  size_t sum = 0;
+  while (reader.next(key, value)) {
+    sum += value.kind == COMPACT_STRING ? value.copyTo(text, sizeof(text)) : (size_t)value.asInt();
+  }
+  return sum;
+}
+
+int main() {
+  printf("%-16s %5s %8s %10s %10s", "type", "json", "compact", "encode", "decode");
+#ifdef HUB_HAVE_ARDUINOJSON
+  printf(" %12s %12s", "json encode", "json decode");
+#endif
+  printf("\n");
+
+  for (const Sample& sample : SAMPLES) {
+    uint8_t frame[128];
+    char text[256];
+    size_t compactLength = encodeCompact(sample, frame, sizeof(frame));
+    size_t jsonLength = encodeJson(sample, text, sizeof(text));
+    CHECK(compactLength > 0);
+    CHECK(CompactReader(frame, compactLength).type() == sample.type);
+
+    size_t sum = 0;
+    BenchTimer encodeTimer;
+    for (int i = 0; i < ROUNDS; i++) {
+      benchKeep(frame);
+      sum += encodeCompact(sample, frame, sizeof(frame));
+    }
+    double encodeNs = encodeTimer.elapsedNs() / ROUNDS;
+    BenchTimer decodeTimer;
+    for (int i = 0; i < ROUNDS; i++) {
+      benchKeep(frame);
+      sum += decodeCompact(frame, compactLength);
+    }
+    double decodeNs = decodeTimer.elapsedNs() / ROUNDS;
+    benchKeep(sum);
+    printf("%-16s %5zu %8zu %7.1f ns %7.1f ns", sample.name, jsonLength, compactLength, encodeNs, decodeNs);
+
+#ifdef HUB_HAVE_ARDUINOJSON
+    BenchTimer jsonEncodeTimer;
+    for (int i = 0; i < ROUNDS / 10; i++) {
+      JsonDocLease lease(jsonPool);
+      JsonDocument& doc = *lease;
+      doc["type"] = sample.name;
+      if (sample.deviceId) doc["deviceId"] = sample.deviceId;
+      if (sample.textName) doc[sample.textName] = sample.deviceType;
+      if (sample.numberName) doc[sample.numberName] = sample.number;
+      sum += serializeJson(doc, text, sizeof(text));
+    }
+    double jsonEncodeNs = jsonEncodeTimer.elapsedNs() / (ROUNDS / 10);
+    BenchTimer jsonDecodeTimer;
+    for (int i = 0; i < ROUNDS / 10; i++) {
+      JsonDocLease lease(jsonPool);
+      deserializeJson(*lease, (const char*)text, jsonLength);
+      const char* type = (*lease)["type"] | "";
+      sum += strlen(type);
+    }
+    double jsonDecodeNs = jsonDecodeTimer.elapsedNs() / (ROUNDS / 10);
+    benchKeep(sum);
+    printf(" %9.1f ns %9.1f ns", jsonEncodeNs, jsonDecodeNs);
+#endif
+    printf("\n");
+  }
+  return testResult();
+}
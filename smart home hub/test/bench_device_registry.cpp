@@ -0,0 +1,98 @@
+// Registry lookups at 10/50/128 devices, against the String arrays it replaced
+//
+// The baseline is the old hub's layout: parallel arrays of device IDs and
+// client IDs scanned front to back with a string compare per entry. The
+// registry holds at most REGISTRY_CAPACITY (128) devices, so that is the
+// largest size measured.
+#include "test_support.h"
+
+#include <device_registry.h>
+#include <string>
+#include <vector>
+
+static const int LOOKUPS = 2000000;
+
+struct LinearTable {
+  std::vector<std::string> ids;
+  std::vector<uint32_t> clients;
+
+  int find(const char* deviceId) const {
+    for (size_t i = 0; i < ids.size(); i++) {
+      if (ids[i] == deviceId) {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+  int findByClient(uint32_t clientId) const {
+    for (size_t i = 0; i < clients.size(); i++) {
+      if (clients[i] == clientId) {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+};
+
+static void benchSize(int devices) {
+  DeviceRegistry registry;
+  LinearTable linear;
+  std::vector<std::string> ids;
+  for (int i = 0; i < devices; i++) {
+    char id[DEVICE_ID_LEN];
+    snprintf(id, sizeof(id), "esp-%06x", 0x1a2b00 + i * 37);
+    ids.push_back(id);
+    registry.bindClient(registry.add(id, i % 2 ? "light" : "door"), 1000 + i);
+    linear.ids.push_back(id);
+    linear.clients.push_back(1000 + i);
+  }
+
+  // Same pseudo-random order of hits for every table
+  std::vector<int> order(4096);
+  uint32_t state = 12345;
+  for (int& pick : order) {
+    state = state * 1103515245u + 12345u;
+    pick = (state >> 8) % devices;
+  }
+
+  double ns[4];
+  long sum = 0;
+  {
+    BenchTimer timer;
+    for (int i = 0; i < LOOKUPS; i++) {
+      sum += linear.find(ids[order[i & 4095]].c_str());
+    }
+    ns[0] = timer.elapsedNs() / LOOKUPS;
+  }
+  {
+    BenchTimer timer;
+    for (int i = 0; i < LOOKUPS; i++) {
+      sum += registry.find(ids[order[i & 4095]].c_str());
+    }
+    ns[1] = timer.elapsedNs() / LOOKUPS;
+  }
+  {
+    BenchTimer timer;
+    for (int i = 0; i < LOOKUPS; i++) {
+      sum += linear.findByClient(1000 + order[i & 4095]);
+    }
+    ns[2] = timer.elapsedNs() / LOOKUPS;
+  }
+  {
+    BenchTimer timer;
+    for (int i = 0; i < LOOKUPS; i++) {
+      sum += registry.findByClient(1000 + order[i & 4095]);
+    }
+    ns[3] = timer.elapsedNs() / LOOKUPS;
+  }
+  benchKeep(sum);
+  printf("%4d devices  by id: linear %7.1f ns  registry %5.1f ns   by client: linear %6.1f ns  registry %5.1f ns\n",
+         devices, ns[0], ns[1], ns[2], ns[3]);
+}
+
+int main() {
+  benchSize(10);
+  benchSize(50);
+  benchSize(REGISTRY_CAPACITY);
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Sub-device frame parsing: messages per second and heap bytes per message
+//
+// Before: the frame was copied into a String, parsed into a fresh heap
+// document (DynamicJsonDocument(1024)) and each field copied out into a
+// String. After: the frame is parsed in place, with its length, into a
+// pooled arena document and the fields are read as const char* views.
+// Heap use is counted through operator new (std::string stands in for
+// String; its small-string buffer hides the shortest copies, so the
+// "before" figures are if anything low) and through the document's
+// allocator. Needs ArduinoJson; see CMakeLists.txt.
+#include "test_support.h"
+
+#include <host_heap.h>
+#include <json_pool.h>
+#include <stdlib.h>
+#include <string>
+
+static const int MESSAGES = 200000;
+
+static const char* FRAMES[] = {
+  "{\"type\":\"registration\",\"deviceId\":\"esp-1a2b3c\",\"deviceType\":\"smart_switch\",\"encodings\":[\"compact\"]}",
+  "{\"type\":\"status\",\"deviceId\":\"esp-1a2b3c\",\"status\":\"on\",\"corrId\":1234}",
+  "{\"type\":\"heartbeat\",\"deviceId\":\"esp-1a2b3c\"}",
+  "{\"type\":\"alert\",\"deviceId\":\"esp-4d5e6f\",\"deviceType\":\"smoke_sensor\",\"alertType\":\"smoke\",\"value\":812}",
+};
+static const int FRAME_COUNT = sizeof(FRAMES) / sizeof(FRAMES[0]);
+
+// The heap allocator the old documents used, with a byte count
+class CountingAllocator : public ArduinoJson::Allocator {
+ public:
+  void* allocate(size_t size) override {
+    bytes += size;
+    allocations++;
+    return malloc(size);
+  }
+  void deallocate(void* ptr) override { free(ptr); }
+  void* reallocate(void* ptr, size_t newSize) override {
+    bytes += newSize;
+    allocations++;
+    return realloc(ptr, newSize);
+  }
+
+  uint64_t bytes = 0;
+  uint64_t allocations = 0;
+};
+
+static CountingAllocator heapAllocator;
+
+static size_t handleBefore(const uint8_t* data, size_t length) {
+  std::string message((const char*)data, length);
+  JsonDocument doc(&heapAllocator);
+  if (deserializeJson(doc, message)) {
+    return 0;
+  }
+  std::string msgType = doc["type"] | "";
+  std::string deviceId = doc["deviceId"] | "";
+  std::string deviceType = doc["deviceType"] | "";
+  std::string status = doc["status"] | "";
+  return msgType.length() + deviceId.length() + deviceType.length() + status.length();
+}
+
+static size_t handleAfter(const uint8_t* data, size_t length) {
+  JsonDocLease lease(jsonPool);
+  if (!lease || deserializeJson(*lease, (const char*)data, length)) {
+    return 0;
+  }
+  JsonDocument& doc = *lease;
+  const char* msgType = doc["type"] | "";
+  const char* deviceId = doc["deviceId"] | "";
+  const char* deviceType = doc["deviceType"] | "";
+  const char* status = doc["status"] | "";
+  return strlen(msgType) + strlen(deviceId) + strlen(deviceType) + strlen(status);
+}
+
+static void bench(const char* name, size_t (*handle)(const uint8_t*, size_t)) {
+  size_t lengths[FRAME_COUNT];
+  for (int i = 0; i < FRAME_COUNT; i++) {
+    lengths[i] = strlen(FRAMES[i]);
+  }
+  uint64_t newBytes = hostHeapAllocationBytes();
+  uint64_t newCount = hostHeapAllocations();
+  uint64_t docBytes = heapAllocator.bytes;
+  uint64_t docCount = heapAllocator.allocations;
+  size_t sum = 0;
+  BenchTimer timer;
+  for (int i = 0; i < MESSAGES; i++) {
+    sum += handle((const uint8_t*)FRAMES[i % FRAME_COUNT], lengths[i % FRAME_COUNT]);
+  }
+  double seconds = timer.elapsedNs() / 1e9;
+  benchKeep(sum);
+  double bytes = (double)(hostHeapAllocationBytes() - newBytes + heapAllocator.bytes - docBytes) / MESSAGES;
+  double allocations = (double)(hostHeapAllocations() - newCount + heapAllocator.allocations - docCount) / MESSAGES;
+  printf("%-7s %9.0f msgs/s  %6.1f heap bytes/msg  %4.1f allocations/msg\n", name, MESSAGES / seconds, bytes,
+         allocations);
+}
+
+int main() {
+  bench("before", handleBefore);
+  bench("after", handleAfter);
+  CHECK_EQ(jsonPool.allocFailures(), 0);
+  return testResult();
+}
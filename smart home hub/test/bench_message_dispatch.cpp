@@ -0,0 +1,89 @@
+// Dispatch cost per message type: the strcmp chain against the hashed switch
+//
+// The chains are the old handlers' if/else order (sub-device types, then
+// the cloud types each in their own chain); the switch is what the hub
+// runs now, msgTypeHash() of the "type" field and one switch. The type
+// strings are copied into a buffer first, as they arrive in a frame, so
+// neither side can compare pointers.
+#include "test_support.h"
+
+#include <message_types.h>
+#include <string.h>
+
+static const int DISPATCHES = 5000000;
+
+enum Handler { H_UNKNOWN, H_REGISTRATION, H_STATUS, H_ALERT, H_HEARTBEAT, H_POSITION, H_ACK,
+               H_CONTROL, H_STATUS_REQUEST, H_ALARM, H_AUTH_RESPONSE, H_RULES };
+
+static int __attribute__((noinline)) deviceChain(const char* type) {
+  if (strcmp(type, "registration") == 0) return H_REGISTRATION;
+  else if (strcmp(type, "status") == 0) return H_STATUS;
+  else if (strcmp(type, "alert") == 0) return H_ALERT;
+  else if (strcmp(type, "heartbeat") == 0) return H_HEARTBEAT;
+  else if (strcmp(type, "position_update") == 0) return H_POSITION;
+  else if (strcmp(type, "ack") == 0) return H_ACK;
+  return H_UNKNOWN;
+}
+
+static int __attribute__((noinline)) deviceSwitch(const char* type) {
+  switch (msgTypeHash(type)) {
+    case MSG_REGISTRATION: return H_REGISTRATION;
+    case MSG_STATUS: return H_STATUS;
+    case MSG_ALERT: return H_ALERT;
+    case MSG_HEARTBEAT: return H_HEARTBEAT;
+    case MSG_POSITION_UPDATE: return H_POSITION;
+    case MSG_ACK: return H_ACK;
+    default: return H_UNKNOWN;
+  }
+}
+
+static int __attribute__((noinline)) serverChain(const char* type) {
+  if (strcmp(type, "control") == 0) return H_CONTROL;
+  else if (strcmp(type, "status_request") == 0) return H_STATUS_REQUEST;
+  else if (strcmp(type, "alarm") == 0) return H_ALARM;
+  else if (strcmp(type, "auth_response") == 0) return H_AUTH_RESPONSE;
+  else if (strcmp(type, "rules") == 0) return H_RULES;
+  return H_UNKNOWN;
+}
+
+static int __attribute__((noinline)) serverSwitch(const char* type) {
+  switch (msgTypeHash(type)) {
+    case MSG_CONTROL: return H_CONTROL;
+    case MSG_STATUS_REQUEST: return H_STATUS_REQUEST;
+    case MSG_ALARM: return H_ALARM;
+    case MSG_AUTH_RESPONSE: return H_AUTH_RESPONSE;
+    case MSG_RULES: return H_RULES;
+    default: return H_UNKNOWN;
+  }
+}
+
+static double timeDispatch(int (*dispatch)(const char*), const char* type) {
+  char frameType[32];
+  snprintf(frameType, sizeof(frameType), "%s", type);
+  long sum = 0;
+  BenchTimer timer;
+  for (int i = 0; i < DISPATCHES; i++) {
+    benchKeep(frameType);
+    sum += dispatch(frameType);
+  }
+  benchKeep(sum);
+  return timer.elapsedNs() / DISPATCHES;
+}
+
+static void benchType(const char* path, int (*chain)(const char*), int (*hashed)(const char*), const char* type) {
+  CHECK_EQ(chain(type), hashed(type));
+  printf("%-6s %-16s chain %5.1f ns  switch %5.1f ns\n", path, type, timeDispatch(chain, type),
+         timeDispatch(hashed, type));
+}
+
+int main() {
+  const char* deviceTypes[] = {"registration", "status", "alert", "heartbeat", "position_update", "ack", "bogus"};
+  for (const char* type : deviceTypes) {
+    benchType("device", deviceChain, deviceSwitch, type);
+  }
+  const char* serverTypes[] = {"control", "status_request", "alarm", "auth_response", "rules", "bogus"};
+  for (const char* type : serverTypes) {
+    benchType("cloud", serverChain, serverSwitch, type);
+  }
+  return testResult();
+}
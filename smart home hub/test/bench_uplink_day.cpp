@@ -0,0 +1,142 @@
+// Uplink bytes over a simulated day: JSON text against dictionary-coded binary
+//
+// Twenty devices on one hub. Each device reports a status change on
+// average every ten minutes, a heartbeat goes up every 30 s, two devices
+// drop offline and come back every few hours, and the cloud link
+// reconnects every six hours (a new session, so an empty dictionary).
+// Events go through the same UplinkBatcher the hub uses, polled every
+// UPLINK_POLL_INTERVAL ms, and each batch is built as the hub builds it.
+#include "test_support.h"
+
+#include <uplink_batcher.h>
+#include <uplink_codec.h>
+#include <vector>
+#include <algorithm>
+
+static const uint32_t DAY_MS = 24u * 3600u * 1000u;
+static const uint32_t POLL_MS = 10;
+static const int DEVICES = 20;
+
+struct Planned {
+  uint32_t at;
+  UplinkKind kind;
+  int device;
+  const char* value;
+};
+
+static void writeEvent(JsonObject msg, const UplinkEvent& event, uint32_t now) {
+  switch (event.kind) {
+    case UPLINK_DEVICE_STATUS:
+      msg["type"] = "device_status";
+      msg["deviceId"] = event.deviceId;
+      msg["status"] = event.value;
+      break;
+    case UPLINK_DEVICE_ADDED:
+      msg["type"] = "device_added";
+      msg["deviceId"] = event.deviceId;
+      msg["deviceType"] = event.value;
+      break;
+    case UPLINK_DEVICE_OFFLINE:
+      msg["type"] = "device_offline";
+      msg["deviceId"] = event.deviceId;
+      break;
+    case UPLINK_HEARTBEAT:
+      msg["type"] = "heartbeat";
+      msg["time"] = now;
+      msg["loopMaxUs"] = 850 + now % 400;
+      msg["unknownMsgs"] = 0;
+      msg["queueDepth"] = 0;
+      msg["queueDropped"] = 0;
+      break;
+  }
+}
+
+int main() {
+  static const char* STATUSES[] = {"on", "off", "open", "closed", "idle", "50%"};
+  char deviceIds[DEVICES][DEVICE_ID_LEN];
+  for (int i = 0; i < DEVICES; i++) {
+    snprintf(deviceIds[i], DEVICE_ID_LEN, "esp-%06x", 0x3c71b0 + i * 97);
+  }
+
+  std::vector<Planned> plan;
+  uint32_t state = 4242;
+  auto random = [&state](uint32_t range) {
+    state = state * 1103515245u + 12345u;
+    return (state >> 8) % range;
+  };
+  for (int i = 0; i < DEVICES; i++) {
+    plan.push_back({1000u + i * 50u, UPLINK_DEVICE_ADDED, i, i % 2 ? "smart_switch" : "window_blind"});
+    for (uint32_t at = random(1200000); at < DAY_MS; at += 1 + random(1200000)) {
+      plan.push_back({at, UPLINK_DEVICE_STATUS, i, STATUSES[random(6)]});
+    }
+  }
+  for (uint32_t at = 30000; at < DAY_MS; at += 30000) {
+    plan.push_back({at, UPLINK_HEARTBEAT, -1, ""});
+  }
+  for (uint32_t at = 3 * 3600000u; at < DAY_MS; at += 3 * 3600000u) {
+    plan.push_back({at, UPLINK_DEVICE_OFFLINE, (int)random(DEVICES), ""});
+    plan.push_back({at + 90000, UPLINK_DEVICE_ADDED, (int)random(DEVICES), "smart_switch"});
+  }
+  std::sort(plan.begin(), plan.end(), [](const Planned& a, const Planned& b) { return a.at < b.at; });
+
+  UplinkBatcher batcher;
+  UplinkEncoder encoder;
+  UplinkDecoder decoder;
+  UplinkEvent batch[UPLINK_BATCH_CAPACITY];
+  static char text[2048];
+  static uint8_t frame[2048];
+  static char check[4096];
+  uint64_t jsonBytes = 0;
+  uint64_t binaryBytes = 0;
+  uint32_t frames = 0;
+  uint32_t sessions = 1;
+  size_t next = 0;
+
+  for (uint32_t now = 0; now < DAY_MS; now += POLL_MS) {
+    if (now > 0 && now % (6 * 3600000u) == 0) {
+      encoder.reset();
+      decoder.reset();
+      sessions++;
+    }
+    bool flushNow = false;
+    while (next < plan.size() && plan[next].at <= now) {
+      const Planned& event = plan[next++];
+      flushNow |= batcher.add(event.kind, event.device >= 0 ? deviceIds[event.device] : "", event.value, now);
+    }
+    if (!flushNow && !batcher.due(now)) {
+      continue;
+    }
+    int count = batcher.take(batch, UPLINK_BATCH_CAPACITY, now);
+    if (count == 0) {
+      continue;
+    }
+    JsonDocument doc;
+    if (count == 1) {
+      writeEvent(doc.to<JsonObject>(), batch[0], now);
+      doc["hubId"] = "3c71bf4a";
+    } else {
+      doc["type"] = "batch";
+      doc["hubId"] = "3c71bf4a";
+      JsonArray events = doc["events"].to<JsonArray>();
+      for (int i = 0; i < count; i++) {
+        writeEvent(events.add<JsonObject>(), batch[i], now);
+      }
+    }
+    batcher.frameSent();
+    jsonBytes += serializeJson(doc, text, sizeof(text));
+    size_t length = encoder.encode(doc, "hubId", frame, sizeof(frame));
+    CHECK(length > 0);
+    encoder.commit();
+    binaryBytes += length;
+    frames++;
+    // The server end stays in step all day
+    CHECK(decoder.decode(frame, length, check, sizeof(check)) > 0);
+  }
+
+  printf("%u events in %u frames over %u sessions\n", batcher.eventsQueued(), frames, sessions);
+  printf("JSON text    %8llu bytes/day  %6.1f bytes/frame\n", (unsigned long long)jsonBytes,
+         (double)jsonBytes / frames);
+  printf("binary       %8llu bytes/day  %6.1f bytes/frame  (%.0f%% of JSON)\n", (unsigned long long)binaryBytes,
+         (double)binaryBytes / frames, 100.0 * binaryBytes / jsonBytes);
+  return testResult();
+}
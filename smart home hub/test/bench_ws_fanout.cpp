@@ -0,0 +1,96 @@
+// Heap and time to send one frame to 10 and 50 sub-devices
+//
+// Before: each client was sent the frame with client->text(data, length),
+// so each queued message held its own copy of the payload. After:
+// WsFanout copies the frame once into a shared buffer and each client
+// queues a reference to it. The heap figure is what is held once the frame
+// is queued on every client, which is what stays allocated until the
+// slowest device has taken it; allocations are per frame. Every client
+// takes its message before the next frame, so queues never fill here.
+#include "test_support.h"
+
+#include <host_heap.h>
+#include <ws_fanout.h>
+#include <vector>
+
+static const int FRAMES = 20000;
+
+static void drain(AsyncWebSocket& ws, const std::vector<uint32_t>& ids) {
+  for (uint32_t id : ids) {
+    ws.client(id)->hostSent(1);
+  }
+}
+
+static void benchSize(int clients, size_t length) {
+  AsyncWebSocket ws;
+  std::vector<uint32_t> ids;
+  for (int i = 0; i < clients; i++) {
+    ids.push_back(ws.hostAddClient()->id());
+  }
+  std::vector<uint8_t> frame(length);
+  for (size_t i = 0; i < length; i++) {
+    frame[i] = (uint8_t)('a' + i % 26);
+  }
+
+  // Heap held by one frame queued on every client
+  uint64_t live = hostHeapLive();
+  uint64_t count = hostHeapAllocations();
+  for (uint32_t id : ids) {
+    ws.client(id)->text((const char*)frame.data(), length);
+  }
+  uint64_t beforeHeap = hostHeapLive() - live;
+  uint64_t beforeAllocs = hostHeapAllocations() - count;
+  drain(ws, ids);
+
+  WsFanout fanout(ws);
+  live = hostHeapLive();
+  count = hostHeapAllocations();
+  CHECK_EQ(fanout.send(ids.data(), clients, frame.data(), length, false), clients);
+  uint64_t afterHeap = hostHeapLive() - live;
+  uint64_t afterAllocs = hostHeapAllocations() - count;
+  CHECK_EQ(fanout.lastHeapBytes(), (int64_t)afterHeap);
+
+  // One payload, referenced by every client's message
+  const AsyncWebSocketSharedBuffer& shared = ws.client(ids[0])->hostQueue().front().buffer();
+  CHECK_EQ(shared.use_count(), clients);
+  CHECK(*shared == frame);
+  for (uint32_t id : ids) {
+    CHECK(ws.client(id)->hostQueue().front().buffer() == shared);
+  }
+  drain(ws, ids);
+
+  double before;
+  {
+    BenchTimer timer;
+    for (int n = 0; n < FRAMES; n++) {
+      for (uint32_t id : ids) {
+        ws.client(id)->text((const char*)frame.data(), length);
+      }
+      drain(ws, ids);
+    }
+    before = timer.elapsedNs() / FRAMES;
+  }
+  double after;
+  {
+    BenchTimer timer;
+    for (int n = 0; n < FRAMES; n++) {
+      fanout.send(ids.data(), clients, frame.data(), length, false);
+      drain(ws, ids);
+    }
+    after = timer.elapsedNs() / FRAMES;
+  }
+  CHECK_EQ(fanout.queued(), (uint64_t)clients * (FRAMES + 1));
+  CHECK_EQ(fanout.skipped() + fanout.closed(), 0);
+
+  printf("%3d clients %5zu B  before %6llu B held %4llu allocs %8.1f ns/frame  "
+         "after %6llu B held %4llu allocs %8.1f ns/frame\n",
+         clients, length, (unsigned long long)beforeHeap, (unsigned long long)beforeAllocs, before,
+         (unsigned long long)afterHeap, (unsigned long long)afterAllocs, after);
+}
+
+int main() {
+  benchSize(10, 256);
+  benchSize(50, 256);
+  benchSize(50, 1024);
+  return testResult();
+}
@@ -0,0 +1,96 @@
+/*
+ * Host stand-in for the Arduino core - just enough to build the hub's
+ * modules off-target for the tests and benchmarks in test/.
+ *
+ * millis() and micros() follow the host's steady clock until a test calls
+ * hostSetMillis(), which freezes them at that value so timing-dependent
+ * code (deadlines, debounce, backoff) can be stepped exactly. FreeRTOS
+ * critical sections map to one process-wide mutex and tasks to threads.
+ */
+
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+
+#define IRAM_ATTR
+#define HIGH 1
+#define LOW 0
+
+using std::max;
+using std::min;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+// Freeze the clock at ms (micros() follows as ms * 1000); advance it with hostAdvanceMillis()
+void hostSetMillis(uint32_t ms);
+void hostAdvanceMillis(uint32_t ms);
+// Back to the host's steady clock
+void hostRealClock();
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t byte) = 0;
+  virtual size_t write(const uint8_t* data, size_t length);
+  size_t print(const char* text) { return write((const uint8_t*)text, strlen(text)); }
+  size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+// Collects everything written; availableForWrite() is a settable FIFO size
+class HardwareSerial : public Print {
+ public:
+  size_t write(uint8_t byte) override;
+  size_t write(const uint8_t* data, size_t length) override;
+  int availableForWrite() { return room; }
+  void flush() {}
+
+  int room = 128;
+  size_t bytes = 0;
+  bool keep = false;      // Append output to text (off for benchmarks)
+  char text[1 << 16];
+  size_t textLength = 0;
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  uint32_t getFreeHeap();
+};
+
+extern EspClass ESP;
+
+// Hardware RNG; deterministic on the host, restarted with hostSeedRandom()
+uint32_t esp_random();
+void hostSeedRandom(uint32_t seed);
+
+// FreeRTOS critical sections: one host mutex for all of them
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+void hostEnterCritical();
+void hostExitCritical();
+#define portENTER_CRITICAL(mux) ((void)(mux), hostEnterCritical())
+#define portEXIT_CRITICAL(mux) ((void)(mux), hostExitCritical())
+typedef unsigned int UBaseType_t;
+typedef int BaseType_t;
+
+// FreeRTOS tasks run as detached host threads; ticks are milliseconds
+typedef void* TaskHandle_t;
+typedef uint32_t TickType_t;
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define pdPASS 1
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stackDepth, void* parameter,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core);
+void vTaskDelay(TickType_t ticks);
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Host stand-in for ESPAsyncWebServer's AsyncWebSocket - the client list
+ * and per-client message queue, with the subset of the API the hub's
+ * fan-out uses (client(id), status, queueLen/queueIsFull, close, text and
+ * binary from a copy or from a shared buffer).
+ *
+ * As in the library, a send queues a message holding a reference-counted
+ * payload: text(data, length) copies the payload into a buffer of its
+ * own, text(buffer) takes another reference to one the caller already
+ * has. Nothing is written to a socket; hostSent(n) takes up to n messages
+ * off the front of the queue the way a send completing does, and
+ * hostAddClient() connects a client.
+ */
+
+#ifndef HOST_ASYNC_WEB_SOCKET_H
+#define HOST_ASYNC_WEB_SOCKET_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <list>
+#include <memory>
+#include <vector>
+
+#define WS_MAX_QUEUED_MESSAGES 32
+
+typedef enum { WS_DISCONNECTED, WS_CONNECTED, WS_DISCONNECTING } AwsClientStatus;
+
+typedef std::shared_ptr<std::vector<uint8_t>> AsyncWebSocketSharedBuffer;
+
+class AsyncWebSocketMessage {
+ public:
+  AsyncWebSocketMessage(AsyncWebSocketSharedBuffer buffer, bool binary) : buffer_(buffer), binary_(binary) {}
+
+  const AsyncWebSocketSharedBuffer& buffer() const { return buffer_; }
+  bool binary() const { return binary_; }
+
+ private:
+  AsyncWebSocketSharedBuffer buffer_;
+  bool binary_;
+};
+
+class AsyncWebSocketClient {
+ public:
+  explicit AsyncWebSocketClient(uint32_t id) : id_(id), status_(WS_CONNECTED) {}
+
+  uint32_t id() const { return id_; }
+  AwsClientStatus status() const { return status_; }
+  size_t queueLen() const { return queue_.size(); }
+  bool queueIsFull() const { return queue_.size() >= WS_MAX_QUEUED_MESSAGES || status_ != WS_CONNECTED; }
+
+  void close() {
+    status_ = WS_DISCONNECTING;
+    queue_.clear();
+  }
+
+  void text(const char* message, size_t length) {
+    queue(std::make_shared<std::vector<uint8_t>>((const uint8_t*)message, (const uint8_t*)message + length), false);
+  }
+  void binary(const uint8_t* message, size_t length) {
+    queue(std::make_shared<std::vector<uint8_t>>(message, message + length), true);
+  }
+  void text(AsyncWebSocketSharedBuffer buffer) { queue(buffer, false); }
+  void binary(AsyncWebSocketSharedBuffer buffer) { queue(buffer, true); }
+
+  // The messages waiting to be sent, oldest first
+  const std::deque<AsyncWebSocketMessage>& hostQueue() const { return queue_; }
+
+  // n sends completed: drop up to n messages from the front of the queue
+  void hostSent(size_t n) {
+    while (n-- > 0 && !queue_.empty()) {
+      queue_.pop_front();
+    }
+  }
+
+ private:
+  void queue(AsyncWebSocketSharedBuffer buffer, bool binary) {
+    if (status_ != WS_CONNECTED || queue_.size() >= WS_MAX_QUEUED_MESSAGES) {
+      return;
+    }
+    queue_.emplace_back(buffer, binary);
+  }
+
+  uint32_t id_;
+  AwsClientStatus status_;
+  std::deque<AsyncWebSocketMessage> queue_;
+};
+
+class AsyncWebSocket {
+ public:
+  AsyncWebSocket() : nextId_(1) {}
+
+  AsyncWebSocketClient* client(uint32_t id) {
+    for (AsyncWebSocketClient& client : clients_) {
+      if (client.id() == id) {
+        return &client;
+      }
+    }
+    return nullptr;
+  }
+
+  AsyncWebSocketClient* hostAddClient() {
+    clients_.emplace_back(nextId_++);
+    return &clients_.back();
+  }
+
+ private:
+  uint32_t nextId_;
+  std::list<AsyncWebSocketClient> clients_;
+};
+
+#endif
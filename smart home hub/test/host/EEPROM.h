@@ -0,0 +1,55 @@
+/*
+ * Host stand-in for the ESP32 EEPROM library - a RAM image with the
+ * get/put/getDataPtr/commit API, and a copy standing for flash that only
+ * commit() updates, so a test can "reboot" by calling begin() again and
+ * see exactly what was committed. commits() counts flash writes, and
+ * failCommits() makes commit() fail without touching flash.
+ * tearNextCommit(n) makes the next commit write only the first n bytes
+ * and leave the rest erased, as power lost partway through the ESP8266's
+ * sector rewrite does.
+ */
+
+#ifndef HOST_EEPROM_H
+#define HOST_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HOST_EEPROM_MAX 4096
+
+class EEPROMClass {
+ public:
+  bool begin(size_t size);
+  bool commit();
+  uint8_t* getDataPtr() { return image_; }
+  const uint8_t* getConstDataPtr() const { return image_; }
+  size_t length() const { return size_; }
+
+  template <typename T> T& get(int address, T& value) {
+    memcpy(&value, image_ + address, sizeof(T));
+    return value;
+  }
+  template <typename T> const T& put(int address, const T& value) {
+    memcpy(image_ + address, &value, sizeof(T));
+    return value;
+  }
+
+  // Test hooks
+  void reset();                                   // Blank flash (zeros, as a fresh ESP32 reads), counters zero
+  uint32_t commits() const { return commits_; }
+  void failCommits(bool fail) { failCommits_ = fail; }
+  void tearNextCommit(size_t bytes) { tearAt_ = (long)bytes; }
+
+ private:
+  uint8_t image_[HOST_EEPROM_MAX];
+  uint8_t flash_[HOST_EEPROM_MAX] = {};
+  size_t size_ = 0;
+  uint32_t commits_ = 0;
+  bool failCommits_ = false;
+  long tearAt_ = -1;
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
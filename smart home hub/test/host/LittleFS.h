@@ -0,0 +1,69 @@
+/*
+ * Host stand-in for LittleFS - files kept in memory, with the subset of the
+ * File API the hub uses (open/read/write/seek/size, exists/remove/rename).
+ *
+ * hostFsFailWritesAfter(n) makes the filesystem accept n more bytes and
+ * then fail every write, partway through a record if that is where the
+ * budget runs out, the way a full flash partition does. hostFsFailMount()
+ * makes the next begin() fail.
+ */
+
+#ifndef HOST_LITTLEFS_H
+#define HOST_LITTLEFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <string>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+class File {
+ public:
+  File() : pos_(0) {}
+  explicit File(std::shared_ptr<std::string> data, size_t pos) : data_(data), pos_(pos) {}
+
+  explicit operator bool() const { return data_ != nullptr; }
+  size_t size() const { return data_ ? data_->size() : 0; }
+  size_t position() const { return pos_; }
+  bool seek(uint32_t pos);
+  size_t read(uint8_t* buffer, size_t length);
+  size_t write(const uint8_t* buffer, size_t length);
+  void close() { data_.reset(); }
+
+ private:
+  std::shared_ptr<std::string> data_;
+  size_t pos_;
+};
+
+class HostFS {
+ public:
+  bool begin(bool formatOnFail = false);
+  bool exists(const char* path) const { return files_.count(path) != 0; }
+  bool remove(const char* path) { return files_.erase(path) != 0; }
+  bool rename(const char* from, const char* to);
+  File open(const char* path, const char* mode);
+
+  // Test hooks
+  void reset();                                   // Drop every file and fault
+  std::string& contents(const char* path) { return *files_[path]; }
+  void failWritesAfter(long bytes) { writeBudget_ = bytes; }
+  void failMount() { mountFails_ = true; }
+  // Returns how many bytes of a write of length may land; -1 budget = no limit
+  size_t takeWriteBudget(size_t length);
+
+ private:
+  std::map<std::string, std::shared_ptr<std::string>> files_;
+  long writeBudget_ = -1;
+  bool mountFails_ = false;
+};
+
+extern HostFS LittleFS;
+
+inline void hostFsFailWritesAfter(long bytes) { LittleFS.failWritesAfter(bytes); }
+inline void hostFsFailMount() { LittleFS.failMount(); }
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Host stand-in for the ESP32 WiFi station - a simulated radio with the
+ * access points a test sets up, for driving the WiFi connector.
+ *
+ * begin() pinned to a BSSID and channel associates in assocMs; a plain
+ * begin() scans every channel first (scanMs), and without a static
+ * address from config() the lease then takes dhcpMs more. Once that time
+ * has passed on millis() (see Arduino.h), status() looks for an access
+ * point that is up and matches: WL_CONNECTED if there is one; otherwise
+ * WL_NO_SSID_AVAIL for a pinned join, while a scan keeps reporting
+ * WL_DISCONNECTED. Taking an access point down drops a station connected
+ * to it. The counters tell a test which path
+ * a connection took.
+ */
+
+#ifndef HOST_WIFI_H
+#define HOST_WIFI_H
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+
+typedef enum {
+  WL_IDLE_STATUS = 0,
+  WL_NO_SSID_AVAIL = 1,
+  WL_CONNECTED = 3,
+  WL_CONNECT_FAILED = 4,
+  WL_CONNECTION_LOST = 5,
+  WL_DISCONNECTED = 6
+} wl_status_t;
+
+class IPAddress {
+ public:
+  IPAddress() : address_(0) {}
+  IPAddress(uint32_t address) : address_(address) {}
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+      : address_((uint32_t)a | (uint32_t)b << 8 | (uint32_t)c << 16 | (uint32_t)d << 24) {}
+  operator uint32_t() const { return address_; }
+  std::string toString() const;
+
+ private:
+  uint32_t address_;   // First octet in the low byte, as in the core
+};
+
+struct HostAccessPoint {
+  std::string ssid;
+  std::string password;
+  uint8_t bssid[6];
+  uint8_t channel;
+  IPAddress ip;        // Lease the DHCP server hands out
+  IPAddress gateway;
+  IPAddress subnet;
+  IPAddress dns;
+  bool up;
+};
+
+class WiFiClass {
+ public:
+  void persistent(bool persistent) { (void)persistent; }
+  void setAutoReconnect(bool autoReconnect) { (void)autoReconnect; }
+  bool config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns = IPAddress());
+  wl_status_t begin(const char* ssid, const char* password, int32_t channel = 0, const uint8_t* bssid = nullptr);
+  bool disconnect();
+  wl_status_t status();
+
+  const uint8_t* BSSID();
+  int32_t channel();
+  IPAddress localIP();
+  IPAddress gatewayIP();
+  IPAddress subnetMask();
+  IPAddress dnsIP(uint8_t index = 0);
+
+  // Test hooks
+  void reset();                                    // No access points, station idle, counters zero
+  HostAccessPoint& addAccessPoint(const char* ssid, const char* password, uint8_t lastBssidByte,
+                                  uint8_t channel, IPAddress ip);
+  uint32_t assocMs = 300;
+  uint32_t scanMs = 2500;
+  uint32_t dhcpMs = 1200;
+  uint32_t begins = 0;        // begin() calls
+  uint32_t pinnedBegins = 0;  // ... of them pinned to a BSSID and channel
+  uint32_t dhcpLeases = 0;    // Leases taken from a DHCP server
+
+ private:
+  HostAccessPoint* find();
+
+  std::deque<HostAccessPoint> accessPoints_;   // deque: addAccessPoint() references stay valid
+  IPAddress staticIp_, staticGateway_, staticSubnet_, staticDns_;
+  std::string ssid_;          // Last begin()
+  std::string password_;
+  bool pinned_ = false;       // ... named a BSSID and channel
+  uint8_t bssid_[6] = {};
+  int32_t channel_ = 0;
+  bool connecting_ = false;
+  uint32_t readyAt_ = 0;      // millis() when the join in progress completes
+  bool connected_ = false;
+  HostAccessPoint* joined_ = nullptr;
+  bool leased_ = false;       // The connection took its address from DHCP
+};
+
+extern WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,182 @@
+#include "Arduino.h"
+#include "host_heap.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <thread>
+
+HardwareSerial Serial;
+EspClass ESP;
+
+static bool manualClock = false;
+static uint32_t manualMs = 0;
+
+static uint64_t steadyMicros() {
+  static const auto start = std::chrono::steady_clock::now();
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+unsigned long millis() {
+  return manualClock ? manualMs : (uint32_t)(steadyMicros() / 1000);
+}
+
+unsigned long micros() {
+  return manualClock ? manualMs * 1000u : (uint32_t)steadyMicros();
+}
+
+void delay(unsigned long ms) {
+  if (manualClock) {
+    manualMs += ms;
+  } else {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+  }
+}
+
+void yield() {
+  std::this_thread::yield();
+}
+
+void hostSetMillis(uint32_t ms) {
+  manualClock = true;
+  manualMs = ms;
+}
+
+void hostAdvanceMillis(uint32_t ms) {
+  manualMs += ms;
+}
+
+void hostRealClock() {
+  manualClock = false;
+}
+
+size_t Print::write(const uint8_t* data, size_t length) {
+  size_t written = 0;
+  while (written < length && write(data[written])) {
+    written++;
+  }
+  return written;
+}
+
+size_t Print::printf(const char* format, ...) {
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0) {
+    return 0;
+  }
+  return write((const uint8_t*)line, min((size_t)length, sizeof(line) - 1));
+}
+
+size_t HardwareSerial::write(uint8_t byte) {
+  return write(&byte, 1);
+}
+
+size_t HardwareSerial::write(const uint8_t* data, size_t length) {
+  bytes += length;
+  if (keep) {
+    size_t room = sizeof(text) - textLength;
+    size_t copy = length < room ? length : room;
+    memcpy(text + textLength, data, copy);
+    textLength += copy;
+  }
+  return length;
+}
+
+static uint32_t randomState = 0x9E3779B9u;
+
+uint32_t esp_random() {
+  // xorshift32
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+void hostSeedRandom(uint32_t seed) {
+  randomState = seed != 0 ? seed : 0x9E3779B9u;
+}
+
+BaseType_t xTaskCreatePinnedToCore(void (*task)(void*), const char* name, uint32_t stackDepth, void* parameter,
+                                   UBaseType_t priority, TaskHandle_t* handle, BaseType_t core) {
+  (void)name;
+  (void)stackDepth;
+  (void)priority;
+  (void)core;
+  std::thread(task, parameter).detach();
+  if (handle != nullptr) {
+    *handle = nullptr;
+  }
+  return pdPASS;
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+static std::recursive_mutex criticalLock;
+
+void hostEnterCritical() {
+  criticalLock.lock();
+}
+
+void hostExitCritical() {
+  criticalLock.unlock();
+}
+
+// Heap accounting: every operator new is counted, so tests can read what a
+// code path allocates and ESP.getFreeHeap() moves the way it does on target
+static std::atomic<uint64_t> liveBytes(0);
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocatedBytes(0);
+static const uint32_t HOST_HEAP_SIZE = 320 * 1024;   // Roughly an ESP32's free heap after boot
+
+uint64_t hostHeapLive() {
+  return liveBytes.load();
+}
+
+uint64_t hostHeapAllocations() {
+  return allocations.load();
+}
+
+uint64_t hostHeapAllocationBytes() {
+  return allocatedBytes.load();
+}
+
+uint32_t EspClass::getFreeHeap() {
+  uint64_t live = liveBytes.load();
+  return live < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - (uint32_t)live : 0;
+}
+
+static void* countedAlloc(size_t size) {
+  // The size is kept in front of the block so delete can take it off again
+  size_t* block = (size_t*)malloc(size + sizeof(max_align_t));
+  if (block == nullptr) {
+    throw std::bad_alloc();
+  }
+  *block = size;
+  liveBytes += size;
+  allocations++;
+  allocatedBytes += size;
+  return (uint8_t*)block + sizeof(max_align_t);
+}
+
+static void countedFree(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  size_t* block = (size_t*)((uint8_t*)ptr - sizeof(max_align_t));
+  liveBytes -= *block;
+  free(block);
+}
+
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void* ptr) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr) noexcept { countedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { countedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { countedFree(ptr); }
@@ -0,0 +1,37 @@
+#include "EEPROM.h"
+
+EEPROMClass EEPROM;
+
+bool EEPROMClass::begin(size_t size) {
+  if (size > HOST_EEPROM_MAX) {
+    return false;
+  }
+  size_ = size;
+  memcpy(image_, flash_, size_);
+  return true;
+}
+
+bool EEPROMClass::commit() {
+  if (failCommits_) {
+    return false;
+  }
+  if (tearAt_ >= 0) {
+    size_t written = (size_t)tearAt_ < size_ ? (size_t)tearAt_ : size_;
+    memcpy(flash_, image_, written);
+    memset(flash_ + written, 0xFF, size_ - written);
+    tearAt_ = -1;
+    return false;
+  }
+  memcpy(flash_, image_, size_);
+  commits_++;
+  return true;
+}
+
+void EEPROMClass::reset() {
+  memset(flash_, 0, sizeof(flash_));
+  memset(image_, 0, sizeof(image_));
+  size_ = 0;
+  commits_ = 0;
+  failCommits_ = false;
+  tearAt_ = -1;
+}
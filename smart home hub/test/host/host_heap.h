@@ -0,0 +1,16 @@
+/*
+ * Host heap accounting - bytes currently held through operator new, and
+ * how many allocations (and bytes, in total) have been made, for tests
+ * that check what a code path costs on the heap.
+ */
+
+#ifndef HOST_HEAP_H
+#define HOST_HEAP_H
+
+#include <stdint.h>
+
+uint64_t hostHeapLive();
+uint64_t hostHeapAllocations();
+uint64_t hostHeapAllocationBytes();
+
+#endif
@@ -0,0 +1,84 @@
+#include "LittleFS.h"
+
+#include <string.h>
+
+HostFS LittleFS;
+
+bool File::seek(uint32_t pos) {
+  if (!data_ || pos > data_->size()) {
+    return false;
+  }
+  pos_ = pos;
+  return true;
+}
+
+size_t File::read(uint8_t* buffer, size_t length) {
+  if (!data_ || pos_ >= data_->size()) {
+    return 0;
+  }
+  size_t count = data_->size() - pos_ < length ? data_->size() - pos_ : length;
+  memcpy(buffer, data_->data() + pos_, count);
+  pos_ += count;
+  return count;
+}
+
+size_t File::write(const uint8_t* buffer, size_t length) {
+  if (!data_) {
+    return 0;
+  }
+  size_t count = LittleFS.takeWriteBudget(length);
+  if (pos_ > data_->size()) {
+    pos_ = data_->size();
+  }
+  data_->replace(pos_, count < data_->size() - pos_ ? count : data_->size() - pos_, (const char*)buffer, count);
+  pos_ += count;
+  return count;
+}
+
+bool HostFS::begin(bool formatOnFail) {
+  (void)formatOnFail;
+  if (mountFails_) {
+    mountFails_ = false;
+    return false;
+  }
+  return true;
+}
+
+bool HostFS::rename(const char* from, const char* to) {
+  auto it = files_.find(from);
+  if (it == files_.end()) {
+    return false;
+  }
+  std::shared_ptr<std::string> data = it->second;
+  files_.erase(it);
+  files_[to] = data;
+  return true;
+}
+
+File HostFS::open(const char* path, const char* mode) {
+  auto it = files_.find(path);
+  if (mode[0] == 'r') {
+    return it == files_.end() ? File() : File(it->second, 0);
+  }
+  if (it == files_.end() || mode[0] == 'w') {
+    // Writers of a replaced file keep the old contents, as on LittleFS
+    files_[path] = std::make_shared<std::string>();
+  }
+  std::shared_ptr<std::string> data = files_[path];
+  return File(data, mode[0] == 'a' ? data->size() : 0);
+}
+
+void HostFS::reset() {
+  files_.clear();
+  writeBudget_ = -1;
+  mountFails_ = false;
+}
+
+size_t HostFS::takeWriteBudget(size_t length) {
+  if (writeBudget_ < 0) {
+    return length;
+  }
+  size_t count = (size_t)writeBudget_ < length ? (size_t)writeBudget_ : length;
+  writeBudget_ -= count;
+  return count;
+}
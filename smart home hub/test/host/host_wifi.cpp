@@ -0,0 +1,123 @@
+#include "WiFi.h"
+#include "Arduino.h"
+
+WiFiClass WiFi;
+
+std::string IPAddress::toString() const {
+  char text[16];
+  snprintf(text, sizeof(text), "%u.%u.%u.%u", address_ & 0xFF, (address_ >> 8) & 0xFF,
+           (address_ >> 16) & 0xFF, address_ >> 24);
+  return text;
+}
+
+bool WiFiClass::config(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns) {
+  staticIp_ = ip;
+  staticGateway_ = gateway;
+  staticSubnet_ = subnet;
+  staticDns_ = dns;
+  return true;
+}
+
+HostAccessPoint* WiFiClass::find() {
+  // The radio looks for the network when the join completes, not when it starts
+  for (HostAccessPoint& ap : accessPoints_) {
+    if (ap.up && ap.ssid == ssid_ && ap.password == password_ &&
+        (!pinned_ || (memcmp(ap.bssid, bssid_, sizeof(bssid_)) == 0 && ap.channel == channel_))) {
+      return &ap;
+    }
+  }
+  return nullptr;
+}
+
+wl_status_t WiFiClass::begin(const char* ssid, const char* password, int32_t channel, const uint8_t* bssid) {
+  begins++;
+  connected_ = false;
+  connecting_ = true;
+  ssid_ = ssid;
+  password_ = password;
+  pinned_ = bssid != nullptr;
+  if (pinned_) {
+    pinnedBegins++;
+    memcpy(bssid_, bssid, sizeof(bssid_));
+    channel_ = channel;
+  }
+  leased_ = (uint32_t)staticIp_ == 0;
+  readyAt_ = (uint32_t)millis() + (pinned_ ? assocMs : scanMs) + (leased_ ? dhcpMs : 0);
+  return WL_DISCONNECTED;
+}
+
+bool WiFiClass::disconnect() {
+  connected_ = false;
+  connecting_ = false;
+  return true;
+}
+
+wl_status_t WiFiClass::status() {
+  if (connected_) {
+    if (!joined_->up) {
+      disconnect();
+      return WL_CONNECTION_LOST;
+    }
+    return WL_CONNECTED;
+  }
+  if (!connecting_ || (int32_t)((uint32_t)millis() - readyAt_) < 0) {
+    return WL_DISCONNECTED;
+  }
+  joined_ = find();
+  if (joined_ == nullptr) {
+    // A scan keeps looking until the caller gives up; a pinned join reports the miss
+    return pinned_ ? WL_NO_SSID_AVAIL : WL_DISCONNECTED;
+  }
+  connecting_ = false;
+  connected_ = true;
+  if (leased_) {
+    dhcpLeases++;
+  }
+  return WL_CONNECTED;
+}
+
+const uint8_t* WiFiClass::BSSID() {
+  return connected_ ? joined_->bssid : nullptr;
+}
+
+int32_t WiFiClass::channel() {
+  return connected_ ? joined_->channel : 0;
+}
+
+IPAddress WiFiClass::localIP() {
+  return !connected_ ? IPAddress() : leased_ ? joined_->ip : staticIp_;
+}
+
+IPAddress WiFiClass::gatewayIP() {
+  return !connected_ ? IPAddress() : leased_ ? joined_->gateway : staticGateway_;
+}
+
+IPAddress WiFiClass::subnetMask() {
+  return !connected_ ? IPAddress() : leased_ ? joined_->subnet : staticSubnet_;
+}
+
+IPAddress WiFiClass::dnsIP(uint8_t index) {
+  (void)index;
+  return !connected_ ? IPAddress() : leased_ ? joined_->dns : staticDns_;
+}
+
+void WiFiClass::reset() {
+  *this = WiFiClass();
+}
+
+HostAccessPoint& WiFiClass::addAccessPoint(const char* ssid, const char* password, uint8_t lastBssidByte,
+                                           uint8_t channel, IPAddress ip) {
+  accessPoints_.emplace_back();
+  HostAccessPoint& ap = accessPoints_.back();
+  ap.ssid = ssid;
+  ap.password = password;
+  const uint8_t bssid[6] = {0x24, 0x0A, 0xC4, 0x00, 0x00, lastBssidByte};
+  memcpy(ap.bssid, bssid, sizeof(bssid));
+  ap.channel = channel;
+  ap.ip = ip;
+  ap.gateway = IPAddress(192, 168, 1, 1);
+  ap.subnet = IPAddress(255, 255, 255, 0);
+  ap.dns = IPAddress(192, 168, 1, 1);
+  ap.up = true;
+  return ap;
+}
@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for the ESP32 ROM CRC routines (same polynomial and
+ * conventions as crc32_le in the ROM).
+ */
+
+#ifndef HOST_ROM_CRC_H
+#define HOST_ROM_CRC_H
+
+#include <stdint.h>
+
+static inline uint32_t crc32_le(uint32_t crc, const uint8_t* data, uint32_t length) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+#endif
@@ -0,0 +1,160 @@
+// isAlertFrame on text and binary frames, and AlertBacklog: lengths,
+// wraparound, and the fall-back to the uplink queue once it is full
+#include "test_support.h"
+
+#include <LittleFS.h>
+#include <alert_lane.h>
+#include <compact_frame.h>
+#include <string>
+
+static bool isAlertText(const char* text) {
+  return isAlertFrame((const uint8_t*)text, strlen(text), false);
+}
+
+static void testTextFrames() {
+  CHECK(isAlertText("{\"type\":\"alert\",\"deviceId\":\"esp-1a2b3c\",\"alertType\":\"motion\"}"));
+  CHECK(isAlertText("{\"type\":\"alert\"}"));
+
+  // A longer type that starts with the same word
+  CHECK(!isAlertText("{\"type\":\"alerts\",\"count\":2}"));
+  CHECK(!isAlertText("{\"type\":\"alert_ack\"}"));
+  // The type anywhere but first
+  CHECK(!isAlertText("{\"deviceId\":\"esp-1a2b3c\",\"type\":\"alert\"}"));
+  CHECK(!isAlertText("{\"type\":\"status\",\"note\":\"{\\\"type\\\":\\\"alert\\\"}\"}"));
+  CHECK(!isAlertText(" {\"type\":\"alert\"}"));
+  // Cut short: the prefix alone, or less, says nothing about what follows
+  CHECK(!isAlertText("{\"type\":\"alert\""));
+  CHECK(!isAlertText("{\"type\":\"ale"));
+  CHECK(!isAlertText(""));
+}
+
+static void testBinaryFrames() {
+  uint8_t frame[64];
+  CompactWriter writer(frame, sizeof(frame));
+  writer.begin(FRAME_ALERT);
+  writer.putString(KEY_DEVICE_ID, "esp-1a2b3c");
+  size_t length = writer.finish();
+  CHECK(length > 0);
+  CHECK(isAlertFrame(frame, length, true));
+  // The same bytes arriving as text are not JSON, so not an alert
+  CHECK(!isAlertFrame(frame, length, false));
+
+  writer.begin(FRAME_STATUS);
+  writer.putString(KEY_DEVICE_ID, "esp-1a2b3c");
+  length = writer.finish();
+  CHECK(!isAlertFrame(frame, length, true));
+
+  // JSON text sent as a binary frame, and frames too short to have a type
+  const char* text = "{\"type\":\"alert\"}";
+  CHECK(!isAlertFrame((const uint8_t*)text, strlen(text), true));
+  CHECK(!isAlertFrame(frame, 0, true));
+  CHECK(!isAlertFrame(frame, 1, true));
+}
+
+static std::string makeAlert(int seq, size_t length) {
+  char head[32];
+  snprintf(head, sizeof(head), "{\"type\":\"alert\",\"seq\":%d,\"x\":\"", seq);
+  std::string frame = head;
+  frame.resize(length - 2, 'x');
+  return frame + "\"}";
+}
+
+static void checkHead(AlertBacklog& backlog, const std::string& expected) {
+  size_t length = 0;
+  const char* frame = backlog.peek(length);
+  CHECK(frame != nullptr);
+  if (frame != nullptr) {
+    CHECK_EQ(length, expected.size());
+    CHECK(std::string(frame, length) == expected);
+  }
+}
+
+static void testBacklogLengths() {
+  AlertBacklog backlog;
+  size_t length;
+  CHECK(backlog.empty());
+  CHECK(backlog.peek(length) == nullptr);
+  backlog.pop();   // Harmless when empty
+
+  std::string longest = makeAlert(1, ALERT_FRAME_SIZE);
+  std::string tooLong = makeAlert(2, ALERT_FRAME_SIZE + 1);
+  CHECK(!backlog.push(tooLong.data(), tooLong.size()));
+  CHECK(backlog.empty());
+  CHECK_EQ(backlog.held(), 0);
+  CHECK(backlog.push(longest.data(), longest.size()));
+  checkHead(backlog, longest);
+  CHECK_EQ(backlog.held(), 1);
+}
+
+static void testBacklogWraparound() {
+  // Frames of different lengths go round the slots several times and come out in order
+  AlertBacklog backlog;
+  int pushed = 0;
+  int popped = 0;
+  for (int round = 0; round < 5; round++) {
+    while (backlog.depth() < ALERT_BACKLOG_SLOTS) {
+      std::string frame = makeAlert(pushed, 40 + pushed * 7 % 150);
+      CHECK(backlog.push(frame.data(), frame.size()));
+      pushed++;
+    }
+    std::string spare = makeAlert(999, 40);
+    CHECK(!backlog.push(spare.data(), spare.size()));
+    for (int i = 0; i < 3 + round; i++) {
+      checkHead(backlog, makeAlert(popped, 40 + popped * 7 % 150));
+      backlog.pop();
+      popped++;
+    }
+  }
+  while (!backlog.empty()) {
+    checkHead(backlog, makeAlert(popped, 40 + popped * 7 % 150));
+    backlog.pop();
+    popped++;
+  }
+  CHECK_EQ(popped, pushed);
+  CHECK_EQ(backlog.held(), pushed);
+}
+
+static void testFallbackToQueue() {
+  LittleFS.reset();
+  hostFsFailMount();
+  static UplinkQueue queue;
+  queue = UplinkQueue();
+  queue.begin();
+  AlertBacklog backlog;
+
+  for (int i = 0; i < ALERT_BACKLOG_SLOTS; i++) {
+    std::string frame = makeAlert(i, 80);
+    CHECK(holdAlert(backlog, queue, frame.data(), frame.size()));
+  }
+  CHECK_EQ(backlog.depth(), ALERT_BACKLOG_SLOTS);
+  CHECK(queue.empty());
+
+  // The backlog is full: the next alert goes to the uplink queue instead
+  std::string overflow = makeAlert(ALERT_BACKLOG_SLOTS, 80);
+  CHECK(holdAlert(backlog, queue, overflow.data(), overflow.size()));
+  CHECK_EQ(backlog.depth(), ALERT_BACKLOG_SLOTS);
+  CHECK_EQ(backlog.held(), ALERT_BACKLOG_SLOTS);
+  CHECK_EQ(queue.depth(), 1);
+
+  char out[ALERT_FRAME_SIZE];
+  size_t length = queue.peek(out, sizeof(out));
+  CHECK(std::string(out, length) == overflow);
+  queue.pop();
+
+  // Once the backlog has room again, alerts go back to it
+  backlog.pop();
+  std::string next = makeAlert(ALERT_BACKLOG_SLOTS + 1, 80);
+  CHECK(holdAlert(backlog, queue, next.data(), next.size()));
+  CHECK_EQ(backlog.depth(), ALERT_BACKLOG_SLOTS);
+  CHECK(queue.empty());
+  checkHead(backlog, makeAlert(1, 80));
+}
+
+int main() {
+  testTextFrames();
+  testBinaryFrames();
+  testBacklogLengths();
+  testBacklogWraparound();
+  testFallbackToQueue();
+  return testResult();
+}
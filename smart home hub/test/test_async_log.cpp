@@ -0,0 +1,199 @@
+// AsyncLog: formatting, the UART FIFO limit, a full ring, and four producer
+// threads against one consumer with every line checked for order and tearing
+#include "test_support.h"
+
+#include <async_log.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A UART whose FIFO empties only when the test says so
+class FifoSerial : public HardwareSerial {
+ public:
+  size_t write(const uint8_t* data, size_t length) override {
+    if (length > (size_t)room) {
+      overruns++;
+    }
+    room -= (int)length;
+    output.append((const char*)data, length);
+    linesOut += std::count(data, data + length, '\n');
+    return length;
+  }
+  std::string output;
+  int overruns = 0;
+  std::atomic<uint32_t> linesOut{0};   // Read by the producers of the paced run
+};
+
+static std::vector<std::string> lines(const std::string& output) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  size_t end;
+  while ((end = output.find('\n', start)) != std::string::npos) {
+    result.push_back(output.substr(start, end - start));
+    start = end + 1;
+  }
+  return result;
+}
+
+static void testFormatAndFifo() {
+  hostSetMillis(12345);
+  AsyncLog log;
+  FifoSerial out;
+  out.room = 0;
+  log.begin(out);
+  log.write(LOG_LEVEL_WARN, "battery %d%%", 17);
+  log.write(LOG_LEVEL_INFO, "%s", std::string(300, 'x').c_str());
+
+  // A full FIFO: nothing is written, and service() says lines are waiting
+  CHECK(log.service());
+  CHECK(out.output.empty());
+
+  // 8 bytes of room at a time, never more
+  for (int i = 0; i < 100 && log.service(); i++) {
+    out.room = 8;
+  }
+  CHECK_EQ(out.overruns, 0);
+  std::vector<std::string> got = lines(out.output);
+  CHECK_EQ(got.size(), 2);
+  CHECK(got[0] == "12.345 W battery 17%");
+  CHECK(got[1] == "12.345 I " + std::string(LOG_LINE_SIZE - 1, 'x') + "...");
+  CHECK_EQ(log.truncated(), 1);
+  CHECK_EQ(log.written(), 2);
+  hostRealClock();
+}
+
+static void testFullRing() {
+  hostSetMillis(0);
+  AsyncLog log;
+  FifoSerial out;
+  out.room = 1 << 20;
+  for (int i = 0; i < LOG_SLOTS + 8; i++) {
+    log.write(LOG_LEVEL_INFO, "line %d", i);
+  }
+  CHECK_EQ(log.dropped(), 8);
+
+  // Lines logged before begin() wait in the ring
+  log.begin(out);
+  while (log.service()) {
+  }
+  std::vector<std::string> got = lines(out.output);
+  CHECK_EQ(got.size(), LOG_SLOTS + 1);
+  CHECK(got.size() > 0 && got[0] == "0.000 W (8 log lines dropped)");
+  for (int i = 1; i < (int)got.size(); i++) {
+    CHECK(got[i] == "0.000 I line " + std::to_string(i - 1));
+  }
+  CHECK_EQ(log.peakDepth(), LOG_SLOTS);
+
+  // Room again once drained
+  log.write(LOG_LEVEL_INFO, "after");
+  log.service();
+  CHECK(lines(out.output).back() == "0.000 I after");
+  CHECK_EQ(log.dropped(), 8);
+  hostRealClock();
+}
+
+static uint32_t lineCheck(int producer, uint32_t seq) {
+  uint32_t x = (uint32_t)producer * 0x9E3779B9u ^ seq * 0x85EBCA6Bu;
+  return x ^ (x >> 15);
+}
+
+// The hub's producers: loop task, net task, AsyncTCP, and the climate task.
+// Flooding, most lines are dropped and every drop must be counted; paced,
+// each producer waits for a free slot (by the lines written out so far),
+// so the ring runs full with all four claiming at once and nothing drops.
+static void testFourProducers(bool paced) {
+  const int PRODUCERS = 4;
+  const uint32_t LINES_EACH = paced ? 10000 : 100000;
+  AsyncLog log;
+  FifoSerial out;
+  out.room = 1 << 30;
+  log.begin(out);
+
+  std::atomic<int> running(PRODUCERS);
+  std::atomic<uint32_t> issued(0);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; p++) {
+    producers.emplace_back([&log, &out, &running, &issued, paced, p, LINES_EACH]() {
+      for (uint32_t seq = 0; seq < LINES_EACH; seq++) {
+        if (paced) {
+          uint32_t taken = issued.load();
+          while (taken - out.linesOut.load() >= LOG_SLOTS || !issued.compare_exchange_weak(taken, taken + 1)) {
+            std::this_thread::yield();
+            taken = issued.load();
+          }
+        }
+        log.write(LOG_LEVEL_INFO, "p%d seq=%u check=%08x", p, seq, lineCheck(p, seq));
+        if ((seq & 63) == 0) {
+          std::this_thread::yield();
+        }
+      }
+      running--;
+    });
+  }
+  std::thread consumer([&log, &running]() {
+    // One consumer, as the drain task is; stop once the producers are done and the ring is empty
+    while (running.load() > 0 || log.service()) {
+      log.service();
+    }
+  });
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  consumer.join();
+
+  // Every line whole, and each producer's lines in the order it wrote them
+  uint32_t received[PRODUCERS] = {};
+  int64_t lastSeq[PRODUCERS];
+  for (int p = 0; p < PRODUCERS; p++) {
+    lastSeq[p] = -1;
+  }
+  uint64_t dropsReported = 0;
+  int malformed = 0;
+  int outOfOrder = 0;
+  for (const std::string& line : lines(out.output)) {
+    unsigned long secs, ms;
+    char tag;
+    int p;
+    unsigned seq, check, dropped;
+    char rest[LOG_LINE_SIZE];
+    if (sscanf(line.c_str(), "%lu.%lu %c (%u log lines dropped%s", &secs, &ms, &tag, &dropped, rest) == 5 &&
+        tag == 'W') {
+      dropsReported += dropped;
+    } else if (sscanf(line.c_str(), "%lu.%lu %c p%d seq=%u check=%x", &secs, &ms, &tag, &p, &seq, &check) == 6 &&
+               tag == 'I' && p >= 0 && p < PRODUCERS && check == lineCheck(p, seq)) {
+      received[p]++;
+      if ((int64_t)seq <= lastSeq[p]) {
+        outOfOrder++;
+      }
+      lastSeq[p] = seq;
+    } else {
+      malformed++;
+    }
+  }
+
+  uint64_t total = 0;
+  for (int p = 0; p < PRODUCERS; p++) {
+    CHECK(received[p] > 0);
+    total += received[p];
+  }
+  CHECK_EQ(malformed, 0);
+  CHECK_EQ(outOfOrder, 0);
+  CHECK_EQ(total, log.written());
+  CHECK_EQ(total + log.dropped(), (uint64_t)PRODUCERS * LINES_EACH);
+  CHECK_EQ(dropsReported, log.dropped());
+  if (paced) {
+    CHECK_EQ(log.dropped(), 0);
+  }
+  printf("4 producers, %s: %llu lines written, %u dropped, peak depth %u of %d\n", paced ? "paced" : "flooding",
+         (unsigned long long)total, log.dropped(), log.peakDepth(), LOG_SLOTS);
+}
+
+int main() {
+  testFormatAndFifo();
+  testFullRing();
+  testFourProducers(false);
+  testFourProducers(true);
+  return testResult();
+}
@@ -0,0 +1,224 @@
+// GestureRecognizer driven by synthetic edge traces: contact bounce, long
+// press, double press, chords, a backlog of edges, the millis() wrap, and
+// the ButtonEdgeQueue that carries the edges from the interrupt
+#include "test_support.h"
+
+#include <button_input.h>
+#include <vector>
+
+static const uint32_t DEBOUNCE = 50;
+static const uint32_t LONG_PRESS = 1000;
+static const uint32_t CHORD_HOLD = 5000;
+
+// Feeds each edge, runs the timers to end, and returns the events in order
+static std::vector<ButtonEvent> run(GestureRecognizer& gestures, const std::vector<ButtonEdge>& trace, uint32_t end) {
+  for (const ButtonEdge& edge : trace) {
+    gestures.edge(edge);
+  }
+  gestures.advance(end);
+  std::vector<ButtonEvent> events;
+  ButtonEvent event;
+  while (gestures.nextEvent(event)) {
+    events.push_back(event);
+  }
+  return events;
+}
+
+static void checkEvent(const ButtonEvent& event, uint8_t kind, uint8_t button, uint32_t ms) {
+  CHECK_EQ(event.kind, kind);
+  CHECK_EQ(event.button, button);
+  CHECK_EQ(event.ms, ms);
+}
+
+static void testBounce() {
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  // A press that bounces for 12 ms, then a release that bounces for 9 ms
+  std::vector<ButtonEdge> trace = {
+    {100, 0, 1}, {103, 0, 0}, {105, 0, 1}, {109, 0, 0}, {112, 0, 1},
+    {400, 0, 0}, {402, 0, 1}, {406, 0, 0}, {409, 0, 1}, {409, 0, 0},
+  };
+  std::vector<ButtonEvent> events = run(gestures, trace, 1000);
+  CHECK_EQ(events.size(), 1);
+  if (events.size() == 1) {
+    checkEvent(events[0], BUTTON_CLICK, 0, 409 + DEBOUNCE);
+  }
+  CHECK(!gestures.pressed(0));
+
+  // A glitch shorter than the debounce time is not a press at all
+  trace = {{2000, 1, 1}, {2030, 1, 0}};
+  events = run(gestures, trace, 3000);
+  CHECK_EQ(events.size(), 0);
+  CHECK(!gestures.pressed(1));
+}
+
+static void testLongPress() {
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  gestures.edge(2, true, 0);
+  gestures.advance(DEBOUNCE + LONG_PRESS - 1);
+  ButtonEvent event;
+  CHECK(gestures.pressed(2));
+  CHECK(!gestures.nextEvent(event));
+
+  gestures.advance(DEBOUNCE + LONG_PRESS);
+  CHECK(gestures.nextEvent(event));
+  checkEvent(event, BUTTON_LONG_PRESS, 2, DEBOUNCE + LONG_PRESS);
+
+  // Only once while held, and no click on release
+  gestures.advance(10000);
+  CHECK(!gestures.nextEvent(event));
+  gestures.edge(2, false, 12000);
+  gestures.advance(13000);
+  CHECK(!gestures.nextEvent(event));
+  CHECK(!gestures.pressed(2));
+
+  // Released just short of the long-press time: a click
+  std::vector<ButtonEdge> trace = {{20000, 2, 1}, {20000 + LONG_PRESS - 1, 2, 0}};
+  std::vector<ButtonEvent> events = run(gestures, trace, 30000);
+  CHECK_EQ(events.size(), 1);
+  if (events.size() == 1) {
+    checkEvent(events[0], BUTTON_CLICK, 2, 20000 + LONG_PRESS - 1 + DEBOUNCE);
+  }
+}
+
+static void testDoublePress() {
+  // Two quick presses are two clicks, each reported on its release
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  std::vector<ButtonEdge> trace = {
+    {1000, 1, 1}, {1002, 1, 0}, {1004, 1, 1}, {1120, 1, 0},
+    {1200, 1, 1}, {1310, 1, 0}, {1313, 1, 1}, {1316, 1, 0},
+  };
+  std::vector<ButtonEvent> events = run(gestures, trace, 5000);
+  CHECK_EQ(events.size(), 2);
+  if (events.size() == 2) {
+    checkEvent(events[0], BUTTON_CLICK, 1, 1120 + DEBOUNCE);
+    checkEvent(events[1], BUTTON_CLICK, 1, 1316 + DEBOUNCE);
+  }
+
+  // Presses closer together than the debounce time merge into one
+  trace = {{6000, 1, 1}, {6100, 1, 0}, {6130, 1, 1}, {6200, 1, 0}};
+  events = run(gestures, trace, 7000);
+  CHECK_EQ(events.size(), 1);
+  if (events.size() == 1) {
+    checkEvent(events[0], BUTTON_CLICK, 1, 6200 + DEBOUNCE);
+  }
+}
+
+static void testChord() {
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  std::vector<ButtonEdge> trace = {
+    {0, 0, 1}, {20, 1, 1}, {40, 2, 1},
+    {8000, 0, 0}, {8010, 1, 0}, {8020, 2, 0},
+  };
+  std::vector<ButtonEvent> events = run(gestures, trace, 9000);
+  // No clicks or long presses from buttons that were part of the chord
+  CHECK_EQ(events.size(), 2);
+  if (events.size() == 2) {
+    checkEvent(events[0], BUTTON_CHORD_START, BUTTON_CHORD, 40 + DEBOUNCE);
+    checkEvent(events[1], BUTTON_CHORD_HOLD, BUTTON_CHORD, 40 + DEBOUNCE + CHORD_HOLD);
+  }
+  CHECK(!gestures.chordActive());
+
+  // Let go early: cancelled, and still no clicks
+  trace = {{10000, 0, 1}, {10000, 1, 1}, {10000, 2, 1}, {11000, 1, 0}, {11100, 0, 0}, {11100, 2, 0}};
+  events = run(gestures, trace, 12000);
+  CHECK_EQ(events.size(), 2);
+  if (events.size() == 2) {
+    checkEvent(events[0], BUTTON_CHORD_START, BUTTON_CHORD, 10000 + DEBOUNCE);
+    checkEvent(events[1], BUTTON_CHORD_CANCEL, BUTTON_CHORD, 11000 + DEBOUNCE);
+  }
+}
+
+static void testBacklog() {
+  // Edges fed with the timers run between them, and the same edges fed in
+  // one go, as after a busy loop iteration, give the same events
+  std::vector<ButtonEdge> trace = {
+    {100, 0, 1}, {104, 0, 0}, {107, 0, 1}, {300, 1, 1}, {420, 0, 0},
+    {1500, 1, 0}, {1600, 2, 1}, {1602, 2, 0}, {1605, 2, 1}, {1700, 2, 0},
+  };
+  GestureRecognizer live(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  std::vector<ButtonEvent> expected;
+  ButtonEvent event;
+  uint32_t now = 0;
+  for (const ButtonEdge& edge : trace) {
+    while (now < edge.ms) {
+      live.advance(now++);
+    }
+    live.edge(edge);
+    while (live.nextEvent(event)) {
+      expected.push_back(event);
+    }
+  }
+  live.advance(3000);
+  while (live.nextEvent(event)) {
+    expected.push_back(event);
+  }
+
+  GestureRecognizer batched(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  std::vector<ButtonEvent> events = run(batched, trace, 3000);
+  CHECK_EQ(expected.size(), 3);   // Click 0, long press 1, click 2; no click from 1
+  CHECK_EQ(events.size(), expected.size());
+  for (size_t i = 0; i < events.size() && i < expected.size(); i++) {
+    checkEvent(events[i], expected[i].kind, expected[i].button, expected[i].ms);
+  }
+}
+
+static void testMillisWrap() {
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  uint32_t start = 0xFFFFFF00u;
+  std::vector<ButtonEdge> trace = {{start, 0, 1}, {start + 3, 0, 0}, {start + 5, 0, 1}};
+  std::vector<ButtonEvent> events = run(gestures, trace, start + 5 + DEBOUNCE + LONG_PRESS);
+  CHECK_EQ(events.size(), 1);
+  if (events.size() == 1) {
+    checkEvent(events[0], BUTTON_LONG_PRESS, 0, start + 5 + DEBOUNCE + LONG_PRESS);
+  }
+}
+
+static void testEventOverflow() {
+  // Events nobody takes are counted, not written over
+  GestureRecognizer gestures(DEBOUNCE, LONG_PRESS, CHORD_HOLD);
+  uint32_t ms = 0;
+  for (int i = 0; i < BUTTON_EVENT_SLOTS + 3; i++) {
+    gestures.edge(0, true, ms);
+    gestures.edge(0, false, ms + 100);
+    ms += 200;
+  }
+  gestures.advance(ms + 100);
+  CHECK_EQ(gestures.droppedEvents(), 3);
+  ButtonEvent event;
+  CHECK(gestures.nextEvent(event));
+  checkEvent(event, BUTTON_CLICK, 0, 100 + DEBOUNCE);
+}
+
+static void testEdgeQueue() {
+  ButtonEdgeQueue queue;
+  for (int i = 0; i < BUTTON_EDGE_SLOTS; i++) {
+    CHECK(queue.push(i % BUTTON_COUNT, i & 1, 1000 + i));
+  }
+  CHECK(!queue.push(0, true, 2000));
+  CHECK_EQ(queue.dropped(), 1);
+  CHECK_EQ(queue.pushed(), BUTTON_EDGE_SLOTS);
+
+  ButtonEdge edge;
+  for (int i = 0; i < BUTTON_EDGE_SLOTS; i++) {
+    CHECK(queue.pop(edge));
+    CHECK_EQ(edge.ms, 1000 + i);
+    CHECK_EQ(edge.button, i % BUTTON_COUNT);
+    CHECK_EQ(edge.pressed, i & 1);
+  }
+  CHECK(!queue.pop(edge));
+  CHECK(queue.push(1, true, 3000));
+  CHECK(queue.pop(edge));
+  CHECK_EQ(edge.ms, 3000);
+}
+
+int main() {
+  testBounce();
+  testLongPress();
+  testDoublePress();
+  testChord();
+  testBacklog();
+  testMillisWrap();
+  testEventOverflow();
+  testEdgeQueue();
+  return testResult();
+}
@@ -0,0 +1,162 @@
+// CompactWriter/CompactReader: round trips, and hostile frames off the network
+//
+// The hostile frames are the ones that broke the reader: lengths that wrap
+// pos_ + n on a 32-bit size_t (an array32 of 0xFFFFFFFF bin32 entries of
+// 0xFFFFFFFB bytes spun for about 4 billion iterations) and deep nesting
+// that recursed until the stack ran out. Each must be rejected at once;
+// ctest's timeout catches a reader that spins instead. On a 64-bit host the
+// wrap cannot happen, so configure with -DHUB_M32=ON where a 32-bit
+// toolchain is installed to exercise it as the ESP32 sees it.
+#include "test_support.h"
+
+#include <compact_frame.h>
+#include <vector>
+
+static bool readAll(const uint8_t* data, size_t length, int* fields = nullptr) {
+  CompactReader reader(data, length);
+  if (!reader.valid()) {
+    return false;
+  }
+  reader.type();
+  uint8_t key;
+  CompactValue value;
+  int count = 0;
+  while (reader.next(key, value)) {
+    count++;
+  }
+  if (fields != nullptr) {
+    *fields = count;
+  }
+  return true;
+}
+
+static void testRoundTrip() {
+  uint8_t frame[128];
+  CompactWriter writer(frame, sizeof(frame));
+  writer.begin(FRAME_STATUS);
+  writer.putString(KEY_DEVICE_ID, "esp-1a2b3c");
+  writer.putString(KEY_STATUS, "on");
+  writer.putInt(KEY_VALUE, -40000);
+  writer.putInt(KEY_CORR_ID, 70000);
+  writer.putBool(KEY_SUCCESS, true);
+  writer.putFloat(KEY_POSITION, 42.5f);
+  size_t length = writer.finish();
+  CHECK(length > 0);
+
+  CompactReader reader(frame, length);
+  CHECK(reader.valid());
+  CHECK_EQ(reader.type(), FRAME_STATUS);
+  uint8_t key;
+  CompactValue value;
+  char text[32];
+  int seen = 0;
+  while (reader.next(key, value)) {
+    seen++;
+    switch (key) {
+      case KEY_TYPE: CHECK_EQ(value.asInt(), FRAME_STATUS); break;
+      case KEY_DEVICE_ID: value.copyTo(text, sizeof(text)); CHECK(strcmp(text, "esp-1a2b3c") == 0); break;
+      case KEY_STATUS: value.copyTo(text, sizeof(text)); CHECK(strcmp(text, "on") == 0); break;
+      case KEY_VALUE: CHECK_EQ(value.asInt(), -40000); break;
+      case KEY_CORR_ID: CHECK_EQ(value.asInt(), 70000); break;
+      case KEY_SUCCESS: CHECK(value.boolean); break;
+      case KEY_POSITION: CHECK(value.asFloat() == 42.5f); break;
+      default: CHECK(false);
+    }
+  }
+  CHECK_EQ(seen, 7);
+
+  // Every truncation of a good frame ends cleanly (ASan would see an overread)
+  for (size_t cut = 0; cut < length; cut++) {
+    std::vector<uint8_t> prefix(frame, frame + cut);
+    readAll(prefix.data(), prefix.size());
+  }
+}
+
+static void testSkipsUnknownValues() {
+  // {0: 3, 5: [1, {2: "x"}, bin8 "ab"], 3: "on"}: the nested value is skipped, the next field read
+  const uint8_t frame[] = {0x83, 0x00, 0x03, 0x05, 0x93, 0x01, 0x81, 0x02, 0xa1, 'x',
+                           0xc4, 0x02, 'a', 'b', 0x03, 0xa2, 'o', 'n'};
+  CompactReader reader(frame, sizeof(frame));
+  CHECK_EQ(reader.type(), FRAME_STATUS);
+  uint8_t key;
+  CompactValue value;
+  CHECK(reader.next(key, value));
+  CHECK(reader.next(key, value));
+  CHECK_EQ(key, KEY_VALUE);
+  CHECK_EQ(value.kind, COMPACT_OTHER);
+  CHECK(reader.next(key, value));
+  CHECK_EQ(key, KEY_STATUS);
+  CHECK_EQ(value.length, 2);
+  CHECK(!reader.next(key, value));
+}
+
+static void testWrappingLengths() {
+  // {5: array32(0xFFFFFFFF) [bin32(0xFFFFFFFB) ...]}
+  const uint8_t array32[] = {0x81, 0x05, 0xdd, 0xff, 0xff, 0xff, 0xff, 0xc6, 0xff, 0xff, 0xff, 0xfb, 0x00};
+  int fields = -1;
+  CHECK(readAll(array32, sizeof(array32), &fields));
+  CHECK_EQ(fields, 0);
+
+  // Lengths that reach back to just before the buffer start once added to pos_
+  const std::vector<std::vector<uint8_t>> frames = {
+    {0x81, 0x05, 0xc6, 0xff, 0xff, 0xff, 0xfb, 0x00},         // bin32
+    {0x81, 0x05, 0xdb, 0xff, 0xff, 0xff, 0xff, 0x00},         // str32
+    {0x81, 0x05, 0xc9, 0xff, 0xff, 0xff, 0xff, 0x01, 0x00},   // ext32
+    {0x81, 0x05, 0xdf, 0x80, 0x00, 0x00, 0x01, 0x00, 0x00},   // map32: count * 2 wraps
+    {0x81, 0x05, 0xda, 0xff, 0xff, 'a'},                      // str16 past the end
+  };
+  for (const std::vector<uint8_t>& frame : frames) {
+    CHECK(readAll(frame.data(), frame.size(), &fields));
+    CHECK_EQ(fields, 0);
+  }
+
+  // Element counts larger than the bytes left are rejected before any is read
+  const uint8_t array16[] = {0x81, 0x05, 0xdc, 0xff, 0xff, 0xc0, 0xc0};
+  CHECK(readAll(array16, sizeof(array16), &fields));
+  CHECK_EQ(fields, 0);
+}
+
+static void testDeepNesting() {
+  // {5: [[[[...]]]]} nested 100000 deep used to recurse once per level
+  std::vector<uint8_t> frame = {0x82, 0x05};
+  frame.insert(frame.end(), 100000, 0x91);
+  frame.push_back(0xc0);
+  frame.insert(frame.end(), {0x03, 0xa2, 'o', 'n'});
+  int fields = -1;
+  CHECK(readAll(frame.data(), frame.size(), &fields));
+  CHECK_EQ(fields, 0);
+
+  // Within the limit it is still skipped and the frame read to the end
+  for (int depth = 1; depth <= COMPACT_MAX_DEPTH + 1; depth++) {
+    std::vector<uint8_t> nested = {0x82, 0x05};
+    nested.insert(nested.end(), depth, 0x91);
+    nested.push_back(0xc0);
+    nested.insert(nested.end(), {0x03, 0xa2, 'o', 'n'});
+    CHECK(readAll(nested.data(), nested.size(), &fields));
+    CHECK_EQ(fields, depth <= COMPACT_MAX_DEPTH ? 2 : 0);
+  }
+}
+
+static void testRandomFrames() {
+  // Random bytes behind a map header: the reader must simply stop
+  uint32_t state = 2024;
+  uint8_t frame[64];
+  for (int round = 0; round < 200000; round++) {
+    size_t length = 1 + round % sizeof(frame);
+    for (size_t i = 0; i < length; i++) {
+      state = state * 1103515245u + 12345u;
+      frame[i] = (uint8_t)(state >> 16);
+    }
+    frame[0] = 0x80 | (frame[0] & 0x0f);
+    readAll(frame, length);
+  }
+}
+
+int main() {
+  testRoundTrip();
+  testSkipsUnknownValues();
+  testWrappingLengths();
+  testDeepNesting();
+  testRandomFrames();
+  return testResult();
+}
@@ -0,0 +1,255 @@
+// ConfigStore: saves and reboots, migration from every older layout, and
+// power lost partway through a save. Built twice: test_config_store keeps
+// the store in the EEPROM slots, as on the ESP32, and
+// test_config_store_file in a LittleFS file, as on the ESP8266.
+#include "test_support.h"
+
+#include <EEPROM.h>
+#include <LittleFS.h>
+#include <config_store.h>
+#include <string>
+
+static const size_t EEPROM_BYTES = 512;
+
+// Three generations of one firmware's struct, each appending fields
+struct __attribute__((packed)) ConfigV1 {
+  char ssid[33];
+  char password[65];
+};
+
+struct __attribute__((packed)) ConfigV2 {
+  char ssid[33];
+  char password[65];
+  char deviceName[33];
+};
+
+struct __attribute__((packed)) ConfigV3 {
+  char ssid[33];
+  char password[65];
+  char deviceName[33];
+  uint8_t flags;
+  uint32_t travelMs;
+};
+
+template <typename T>
+static T makeConfig(int seq) {
+  T config;
+  memset(&config, 0, sizeof(config));
+  snprintf(config.ssid, sizeof(config.ssid), "home-%d", seq);
+  snprintf(config.password, sizeof(config.password), "secret-%d", seq);
+  return config;
+}
+
+static void wipe() {
+  EEPROM.reset();
+  LittleFS.reset();
+  EEPROM.begin(EEPROM_BYTES);
+}
+
+// Power cycle: EEPROM.begin() reads flash again and the store starts over
+template <typename T>
+static bool reboot(ConfigStore& store, T& config, uint16_t version) {
+  EEPROM.begin(EEPROM_BYTES);
+  store = ConfigStore();
+  store.begin(0, sizeof(T), version);
+  return store.load(config);
+}
+
+template <typename T>
+static bool same(const T& a, const T& b) {
+  return memcmp(&a, &b, sizeof(T)) == 0;
+}
+
+static void testSaveAndLoad() {
+  wipe();
+  ConfigStore store;
+  ConfigV3 config;
+  memset(&config, 0x5A, sizeof(config));
+  CHECK(!reboot(store, config, 3));
+  CHECK_EQ(config.flags, 0x5A);   // Untouched when there is nothing to load
+
+  for (int seq = 1; seq <= 5; seq++) {
+    ConfigV3 saved = makeConfig<ConfigV3>(seq);
+    saved.travelMs = seq * 1000;
+    CHECK(store.save(saved));
+    CHECK(reboot(store, config, 3));
+    CHECK(same(config, saved));
+    CHECK_EQ(store.sequence(), seq);
+    CHECK_EQ(store.loadedVersion(), 3);
+  }
+
+  // A save that changes nothing writes nothing
+  uint32_t commits = EEPROM.commits();
+  std::string file = LittleFS.exists("/config.bin") ? LittleFS.contents("/config.bin") : "";
+  CHECK(store.save(config));
+  CHECK_EQ(store.saves(), 0);
+  CHECK_EQ(EEPROM.commits(), commits);
+  if (!file.empty()) {
+    CHECK(LittleFS.contents("/config.bin") == file);
+  }
+
+  store.erase();
+  CHECK(!reboot(store, config, 3));
+}
+
+// A store written by an older firmware, with a shorter struct
+template <typename Old>
+static void testMigrateFrom(uint16_t oldVersion) {
+  wipe();
+  ConfigStore store;
+  Old old = makeConfig<Old>(oldVersion);
+  Old loadedOld;
+  reboot(store, loadedOld, oldVersion);
+  CHECK(store.save(old));
+
+  // The new layout reads the old fields, and zeros for the ones it added
+  ConfigV3 config;
+  memset(&config, 0x5A, sizeof(config));
+  CHECK(reboot(store, config, 3));
+  CHECK_EQ(store.loadedVersion(), oldVersion);
+  CHECK(memcmp(&config, &old, sizeof(Old)) == 0);
+  for (size_t i = sizeof(Old); i < sizeof(config); i++) {
+    CHECK_EQ(((const uint8_t*)&config)[i], 0);
+  }
+
+  // Saved again, even unchanged, it is rewritten in the new layout
+  CHECK(store.save(config));
+  CHECK_EQ(store.saves(), 1);
+  ConfigV3 reloaded;
+  CHECK(reboot(store, reloaded, 3));
+  CHECK_EQ(store.loadedVersion(), 3);
+  CHECK(same(reloaded, config));
+}
+
+static void testPreStoreLayout() {
+  // The layout before the store: a configured flag and length-prefixed strings
+  wipe();
+  uint8_t* image = EEPROM.getDataPtr();
+  const char legacy[] = "\x01\x07home-42\x09secret-42";
+  memcpy(image, legacy, sizeof(legacy));
+  EEPROM.commit();
+
+  ConfigStore store;
+  ConfigV3 config;
+  memset(&config, 0x5A, sizeof(config));
+  CHECK(!reboot(store, config, 3));
+  CHECK_EQ(config.flags, 0x5A);
+
+  // The firmware reads it itself and saves it into the store
+  ConfigV3 migrated = makeConfig<ConfigV3>(42);
+  CHECK(store.save(migrated));
+  CHECK(reboot(store, config, 3));
+  CHECK(same(config, migrated));
+}
+
+static void testFailedCommit() {
+  wipe();
+  ConfigStore store;
+  ConfigV3 config;
+  ConfigV3 first = makeConfig<ConfigV3>(1);
+  reboot(store, config, 3);
+  CHECK(store.save(first));
+
+  EEPROM.failCommits(true);
+  hostFsFailWritesAfter(0);
+  ConfigV3 second = makeConfig<ConfigV3>(2);
+  CHECK(!store.save(second));
+  EEPROM.failCommits(false);
+  hostFsFailWritesAfter(-1);
+
+  CHECK(reboot(store, config, 3));
+  CHECK(same(config, first));
+  CHECK(store.save(second));
+  CHECK(reboot(store, config, 3));
+  CHECK(same(config, second));
+}
+
+#ifndef CONFIG_STORE_FILE
+static void testTornSlot() {
+  // Power lost partway through writing the second slot: the CRC rejects it
+  // and the first slot still loads. (Torn inside the first slot, the erased
+  // second slot would be lost with it; see config_store.h.)
+  const size_t slotBytes = sizeof(ConfigHeader) + sizeof(ConfigV3);
+  for (size_t tear = slotBytes; tear < 2 * slotBytes; tear += 7) {
+    wipe();
+    ConfigStore store;
+    ConfigV3 config;
+    ConfigV3 first = makeConfig<ConfigV3>(1);
+    reboot(store, config, 3);
+    CHECK(store.save(first));
+
+    EEPROM.tearNextCommit(tear);
+    CHECK(!store.save(makeConfig<ConfigV3>(2)));
+    CHECK(reboot(store, config, 3));
+    CHECK(same(config, first));
+  }
+}
+#else
+static void testTornFile() {
+  // Power lost after any number of bytes of the new file: the old one loads
+  const size_t fileBytes = sizeof(ConfigHeader) + sizeof(ConfigV3);
+  for (size_t budget = 0; budget < fileBytes; budget++) {
+    wipe();
+    ConfigStore store;
+    ConfigV3 config;
+    ConfigV3 first = makeConfig<ConfigV3>(1);
+    reboot(store, config, 3);
+    CHECK(store.save(first));
+
+    hostFsFailWritesAfter(budget);
+    CHECK(!store.save(makeConfig<ConfigV3>(2)));
+    hostFsFailWritesAfter(-1);
+    CHECK(!LittleFS.exists("/config.bin.new"));
+    CHECK(reboot(store, config, 3));
+    CHECK(same(config, first));
+  }
+  // Saves leave EEPROM alone
+  CHECK_EQ(EEPROM.commits(), 0);
+}
+
+static void testMigrateFromSlots() {
+  // A store the firmware wrote into the EEPROM slots before the file existed
+  wipe();
+  ConfigStore store;
+  ConfigV3 config;
+  hostFsFailMount();
+  reboot(store, config, 3);
+  ConfigV3 inSlots = makeConfig<ConfigV3>(7);
+  CHECK(store.save(inSlots));
+  CHECK(store.save(makeConfig<ConfigV3>(8)));
+  CHECK(store.save(inSlots));
+  CHECK(!LittleFS.exists("/config.bin"));
+
+  // Loaded from the slots, saved into the file, which is read from then on
+  CHECK(reboot(store, config, 3));
+  CHECK(same(config, inSlots));
+  CHECK_EQ(store.sequence(), 3);
+  uint32_t commits = EEPROM.commits();
+  ConfigV3 updated = makeConfig<ConfigV3>(9);
+  CHECK(store.save(updated));
+  CHECK(LittleFS.exists("/config.bin"));
+  CHECK_EQ(EEPROM.commits(), commits);
+  CHECK(reboot(store, config, 3));
+  CHECK(same(config, updated));
+  CHECK_EQ(store.sequence(), 4);
+
+  // A factory reset clears both, so the slots do not come back
+  store.erase();
+  CHECK(!reboot(store, config, 3));
+}
+#endif
+
+int main() {
+  testSaveAndLoad();
+  testMigrateFrom<ConfigV1>(1);
+  testMigrateFrom<ConfigV2>(2);
+  testPreStoreLayout();
+  testFailedCommit();
+#ifndef CONFIG_STORE_FILE
+  testTornSlot();
+#else
+  testTornFile();
+  testMigrateFromSlots();
+#endif
+  return testResult();
+}
@@ -0,0 +1,240 @@
+// DeviceJournal: replay after a reboot, coalesced status changes,
+// tombstones for removals, compaction on size and on an unreported
+// removal, a torn last record, and a failed write
+#include "test_support.h"
+
+#include <LittleFS.h>
+#include <device_journal.h>
+
+static void addDevices(DeviceRegistry& registry, int from, int to) {
+  char id[DEVICE_ID_LEN];
+  for (int i = from; i < to; i++) {
+    snprintf(id, sizeof(id), "dev-%03d", i);
+    registry.add(id, i % 2 ? "light" : "door");
+  }
+}
+
+// Reboot: a fresh registry restored from the file; returns the devices restored
+static int reload(DeviceRegistry& registry, DeviceJournal& journal) {
+  registry = DeviceRegistry();
+  journal = DeviceJournal();
+  return journal.load(registry);
+}
+
+static void testReplay() {
+  LittleFS.reset();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  CHECK_EQ(reload(registry, journal), 0);
+  CHECK(journal.available());
+
+  addDevices(registry, 0, 10);
+  registry.setStatus(registry.find("dev-003"), "on");
+  journal.service();
+  CHECK_EQ(journal.recordsWritten(), 10);
+
+  // Many changes between two service() calls are one record per device
+  for (int i = 0; i < 50; i++) {
+    registry.setStatus(registry.find("dev-004"), i % 2 ? "open" : "closed");
+  }
+  journal.service();
+  CHECK_EQ(journal.recordsWritten(), 11);
+  journal.service();
+  CHECK_EQ(journal.recordsWritten(), 11);
+
+  uint32_t digest = registry.digest();
+  CHECK_EQ(reload(registry, journal), 10);
+  CHECK_EQ(journal.loadedRecords(), 11);
+  CHECK_EQ(registry.digest(), digest);
+  CHECK(strcmp(registry.at(registry.find("dev-004")).status, "open") == 0);
+  CHECK(strcmp(registry.at(registry.find("dev-003")).status, "on") == 0);
+
+  // A device registered again as another type keeps the new type across a reboot
+  registry.add("dev-003", "dimmer");
+  journal.service();
+  CHECK_EQ(reload(registry, journal), 10);
+  CHECK(strcmp(registry.typeName(registry.find("dev-003")), "dimmer") == 0);
+  CHECK(strcmp(registry.at(registry.find("dev-003")).status, "on") == 0);
+}
+
+// Remove a device the way removeDevice() does
+static void removeDevice(DeviceRegistry& registry, DeviceJournal& journal, const char* deviceId) {
+  CHECK(registry.remove(deviceId));
+  journal.removed(deviceId);
+}
+
+static void testRemovalTombstone() {
+  LittleFS.reset();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  reload(registry, journal);
+  addDevices(registry, 0, 40);
+  journal.service();
+  uint32_t written = journal.recordsWritten();
+
+  // More devices than one compaction pass copies: the tombstone alone records the removal
+  removeDevice(registry, journal, "dev-005");
+  journal.service();
+  CHECK(!journal.compacting());
+  CHECK_EQ(journal.recordsWritten(), written + 1);
+  CHECK_EQ(reload(registry, journal), 39);
+  CHECK_EQ(registry.find("dev-005"), NO_DEVICE);
+  CHECK(registry.find("dev-039") != NO_DEVICE);
+
+  // Removed and added again between two calls: back, as a new device
+  removeDevice(registry, journal, "dev-007");
+  registry.add("dev-007", "light");
+  // Added and removed between two calls: gone
+  addDevices(registry, 40, 41);
+  removeDevice(registry, journal, "dev-040");
+  journal.service();
+  uint32_t digest = registry.digest();
+  CHECK_EQ(reload(registry, journal), 39);
+  CHECK_EQ(registry.digest(), digest);
+  CHECK(strcmp(registry.at(registry.find("dev-007")).status, "Unknown") == 0);
+  CHECK_EQ(registry.find("dev-040"), NO_DEVICE);
+
+  // More removals than are held for service() are written as they come
+  for (int i = 10; i < 10 + JOURNAL_REMOVED_SLOTS + 3; i++) {
+    char id[DEVICE_ID_LEN];
+    snprintf(id, sizeof(id), "dev-%03d", i);
+    removeDevice(registry, journal, id);
+  }
+  CHECK_EQ(reload(registry, journal), 39 - JOURNAL_REMOVED_SLOTS);
+  CHECK_EQ(registry.find("dev-010"), NO_DEVICE);
+  CHECK(registry.find("dev-020") != NO_DEVICE);
+}
+
+static void testRemovalWhileCompacting() {
+  LittleFS.reset();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  reload(registry, journal);
+  addDevices(registry, 0, 40);
+  journal.service();
+
+  // A removal the journal was not told about can only be dropped by rewriting the file
+  CHECK(registry.remove("dev-039"));
+  journal.service();
+  CHECK(journal.compacting());
+
+  // Changes and reported removals while the new file is being written
+  registry.setStatus(registry.find("dev-010"), "on");
+  addDevices(registry, 40, 42);
+  removeDevice(registry, journal, "dev-005");
+  journal.service();
+  removeDevice(registry, journal, "dev-020");
+  for (int i = 0; i < 10 && journal.compacting(); i++) {
+    journal.service();
+  }
+  CHECK(!journal.compacting());
+  CHECK_EQ(journal.compactions(), 1);
+  CHECK(!LittleFS.exists(JOURNAL_COMPACT_PATH));
+
+  uint32_t digest = registry.digest();
+  uint32_t bytes = journal.fileBytes();
+  CHECK_EQ(reload(registry, journal), 39);
+  CHECK_EQ(registry.digest(), digest);
+  CHECK_EQ(registry.find("dev-005"), NO_DEVICE);
+  CHECK_EQ(registry.find("dev-020"), NO_DEVICE);
+  CHECK_EQ(registry.find("dev-039"), NO_DEVICE);
+  CHECK(registry.find("dev-041") != NO_DEVICE);
+  CHECK_EQ(journal.fileBytes(), bytes);
+}
+
+static void testSizeCompacts() {
+  LittleFS.reset();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  reload(registry, journal);
+  addDevices(registry, 0, 8);
+  char status[DEVICE_STATUS_LEN];
+  for (int round = 0; journal.compactions() == 0 && round < 1000; round++) {
+    for (int i = 0; i < registry.count(); i++) {
+      snprintf(status, sizeof(status), "%d%%", round % 101);
+      registry.setStatus(i, status);
+    }
+    journal.service();
+  }
+  CHECK_EQ(journal.compactions(), 1);
+  CHECK(journal.fileBytes() < JOURNAL_COMPACT_BYTES);
+
+  uint32_t digest = registry.digest();
+  CHECK_EQ(reload(registry, journal), 8);
+  CHECK_EQ(registry.digest(), digest);
+}
+
+static void testTornRecord() {
+  LittleFS.reset();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  reload(registry, journal);
+  addDevices(registry, 0, 5);
+  journal.service();
+  uint32_t digest = registry.digest();
+  registry.setStatus(registry.find("dev-002"), "on");
+  journal.service();
+
+  // Power lost partway through the last record
+  std::string& file = LittleFS.contents(JOURNAL_PATH);
+  file.resize(file.size() - 3);
+  CHECK_EQ(reload(registry, journal), 5);
+  CHECK_EQ(journal.loadedRecords(), 5);
+  CHECK_EQ(registry.digest(), digest);
+
+  // The next service() rewrites the file, so nothing is left behind the torn record
+  registry.setStatus(registry.find("dev-001"), "off");
+  journal.service();
+  CHECK(!journal.compacting());
+  CHECK_EQ(journal.compactions(), 1);
+  digest = registry.digest();
+  CHECK_EQ(reload(registry, journal), 5);
+  // Five devices, and the change made as the compaction began, which went to both files
+  CHECK_EQ(journal.loadedRecords(), 6);
+  CHECK_EQ(registry.digest(), digest);
+
+  // A compaction cut short by a reset leaves its file behind; load() drops it
+  LittleFS.open(JOURNAL_COMPACT_PATH, FILE_WRITE).close();
+  CHECK_EQ(reload(registry, journal), 5);
+  CHECK(!LittleFS.exists(JOURNAL_COMPACT_PATH));
+}
+
+static void testUnavailable() {
+  // No filesystem: the registry works, RAM only
+  LittleFS.reset();
+  hostFsFailMount();
+  static DeviceRegistry registry;
+  static DeviceJournal journal;
+  CHECK_EQ(reload(registry, journal), 0);
+  CHECK(!journal.available());
+  addDevices(registry, 0, 3);
+  journal.service();
+  CHECK_EQ(journal.recordsWritten(), 0);
+
+  // A write that fails stops the journal rather than leaving it half right
+  reload(registry, journal);
+  addDevices(registry, 0, 3);
+  hostFsFailWritesAfter(10);
+  journal.service();
+  CHECK(!journal.available());
+  hostFsFailWritesAfter(-1);
+
+  // Factory reset
+  LittleFS.reset();
+  reload(registry, journal);
+  addDevices(registry, 0, 3);
+  journal.service();
+  journal.erase();
+  CHECK(!LittleFS.exists(JOURNAL_PATH));
+  CHECK_EQ(reload(registry, journal), 0);
+}
+
+int main() {
+  testReplay();
+  testRemovalTombstone();
+  testRemovalWhileCompacting();
+  testSizeCompacts();
+  testTornRecord();
+  testUnavailable();
+  return testResult();
+}
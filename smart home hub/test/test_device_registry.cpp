@@ -0,0 +1,129 @@
+// DeviceRegistry: lookups by ID and by client, removal, deltas, capacity
+#include "test_support.h"
+
+#include <device_registry.h>
+
+static void testAddFind() {
+  DeviceRegistry registry;
+  bool isNew = false;
+  int a = registry.add("lamp-1", "light", &isNew);
+  CHECK(isNew);
+  int b = registry.add("door-1", "door", &isNew);
+  CHECK(isNew);
+  CHECK_EQ(registry.add("lamp-1", "light", &isNew), a);
+  CHECK(!isNew);
+  CHECK_EQ(registry.find("lamp-1"), a);
+  CHECK_EQ(registry.find("door-1"), b);
+  CHECK_EQ(registry.find("lamp-2"), NO_DEVICE);
+  CHECK_EQ(registry.count(), 2);
+  CHECK(strcmp(registry.typeName(b), "door") == 0);
+  CHECK_EQ(registry.add("", "light"), NO_DEVICE);
+
+  // Registered again: the same type changes nothing, another type is a change
+  uint32_t version = registry.at(a).version;
+  registry.add("lamp-1", "light");
+  CHECK_EQ(registry.at(a).version, version);
+  uint32_t seq = registry.seq();
+  CHECK_EQ(registry.add("lamp-1", "dimmer", &isNew), a);
+  CHECK(!isNew);
+  CHECK(strcmp(registry.typeName(a), "dimmer") == 0);
+  CHECK(registry.at(a).version > seq);
+  CHECK(registry.canDelta(seq));
+}
+
+static void testClientBinding() {
+  DeviceRegistry registry;
+  int a = registry.add("lamp-1", "light");
+  int b = registry.add("door-1", "door");
+  registry.bindClient(a, 7);
+  registry.bindClient(b, 9);
+  CHECK_EQ(registry.findByClient(7), a);
+  CHECK_EQ(registry.findByClient(9), b);
+  CHECK_EQ(registry.findByClient(NO_CLIENT), NO_DEVICE);
+
+  // Rebinding a device moves it; the old client no longer resolves
+  registry.bindClient(a, 11);
+  CHECK_EQ(registry.findByClient(7), NO_DEVICE);
+  CHECK_EQ(registry.findByClient(11), a);
+
+  CHECK_EQ(registry.unbindClient(11), a);
+  CHECK_EQ(registry.findByClient(11), NO_DEVICE);
+  CHECK_EQ(registry.at(a).clientId, NO_CLIENT);
+}
+
+static void testRemoveKeepsIndexes() {
+  DeviceRegistry registry;
+  char id[DEVICE_ID_LEN];
+  for (int i = 0; i < 20; i++) {
+    snprintf(id, sizeof(id), "dev-%d", i);
+    registry.bindClient(registry.add(id, "sensor"), 100 + i);
+  }
+  // Removal moves the last record into the hole; both indexes must follow it
+  CHECK(registry.remove("dev-3"));
+  CHECK(!registry.remove("dev-3"));
+  CHECK_EQ(registry.count(), 19);
+  CHECK_EQ(registry.find("dev-3"), NO_DEVICE);
+  CHECK_EQ(registry.findByClient(103), NO_DEVICE);
+  for (int i = 0; i < 20; i++) {
+    if (i == 3) {
+      continue;
+    }
+    snprintf(id, sizeof(id), "dev-%d", i);
+    int index = registry.find(id);
+    CHECK(index != NO_DEVICE);
+    CHECK_EQ(registry.findByClient(100 + i), index);
+  }
+}
+
+static void testChurnAndCapacity() {
+  DeviceRegistry registry;
+  char id[DEVICE_ID_LEN];
+  // Enough add/remove cycles to force tombstone rebuilds
+  for (int round = 0; round < 2000; round++) {
+    snprintf(id, sizeof(id), "churn-%d", round);
+    CHECK(registry.add(id, "sensor") != NO_DEVICE);
+    if (round >= 50) {
+      snprintf(id, sizeof(id), "churn-%d", round - 50);
+      CHECK(registry.remove(id));
+    }
+  }
+  CHECK_EQ(registry.count(), 50);
+  CHECK(registry.find("churn-1999") != NO_DEVICE);
+  CHECK_EQ(registry.find("churn-1949"), NO_DEVICE);
+
+  registry.clear();
+  for (int i = 0; i < REGISTRY_CAPACITY; i++) {
+    snprintf(id, sizeof(id), "full-%d", i);
+    CHECK(registry.add(id, "sensor") != NO_DEVICE);
+  }
+  CHECK(registry.isFull());
+  CHECK_EQ(registry.add("one-too-many", "sensor"), NO_DEVICE);
+  CHECK(registry.find("full-0") != NO_DEVICE);
+}
+
+static void testDeltas() {
+  DeviceRegistry registry;
+  int a = registry.add("lamp-1", "light");
+  registry.add("door-1", "door");
+  uint32_t since = registry.seq();
+  CHECK(registry.canDelta(since));
+  registry.setStatus(a, "on");
+  CHECK(registry.at(a).version > since);
+  uint32_t before = registry.digest();
+  registry.setStatus(a, "off");
+  CHECK(registry.digest() != before);
+
+  // A removal cannot be described as a delta
+  registry.remove("door-1");
+  CHECK(!registry.canDelta(since));
+  CHECK(registry.canDelta(registry.seq()));
+}
+
+int main() {
+  testAddFind();
+  testClientBinding();
+  testRemoveKeepsIndexes();
+  testChurnAndCapacity();
+  testDeltas();
+  return testResult();
+}
@@ -0,0 +1,221 @@
+// RuleEngine: matching by device and by type, rule order, value matches,
+// table limits, and storing the table across a reboot
+#include "test_support.h"
+
+#include <LittleFS.h>
+#include <device_registry.h>
+#include <message_types.h>
+#include <rule_engine.h>
+#include <string>
+#include <vector>
+
+// What the actions of the last evaluate() asked for, one line per action
+static std::vector<std::string> ran;
+
+static void record(uint8_t kind, const char* deviceId, const char* command, bool state) {
+  if (kind == RULE_ACTION_ALARM) {
+    ran.push_back(state ? "alarm on" : "alarm off");
+  } else {
+    ran.push_back(std::string(deviceId) + " " + command);
+  }
+}
+
+static int evaluate(RuleEngine& engine, uint32_t event, const char* deviceId, const char* deviceType,
+                    const char* value) {
+  ran.clear();
+  return engine.evaluate(event, deviceId, deviceType, value, record);
+}
+
+static bool ranExactly(const std::vector<std::string>& expected) {
+  if (ran != expected) {
+    for (const std::string& line : ran) {
+      fprintf(stderr, "  ran: %s\n", line.c_str());
+    }
+    return false;
+  }
+  return true;
+}
+
+// The rule set the tests start from
+static bool loadRules(RuleEngine& engine, uint32_t version) {
+  engine.beginUpdate(version);
+  // Smoke anywhere: alarm on and open the windows
+  engine.addRule("alert", RULE_SOURCE_TYPE, "smoke_detector", "smoke");
+  engine.addAction(RULE_ACTION_ALARM, nullptr, nullptr, true);
+  engine.addAction(RULE_ACTION_COMMAND, "window-1", "open", false);
+  // The hall detector also turns the hall light on, before the type rule runs
+  engine.addRule("alert", RULE_SOURCE_DEVICE, "SD_HALL", nullptr);
+  engine.addAction(RULE_ACTION_COMMAND, "light-hall", "on", false);
+  // A second rule on the same key, after the first
+  engine.addRule("alert", RULE_SOURCE_TYPE, "smoke_detector", nullptr);
+  engine.addAction(RULE_ACTION_COMMAND, "fan-1", "off", false);
+  // Door opened: light on
+  engine.addRule("status", RULE_SOURCE_DEVICE, "door-1", "open");
+  engine.addAction(RULE_ACTION_COMMAND, "light-hall", "on", false);
+  // Any window going offline sounds the alarm
+  engine.addRule("offline", RULE_SOURCE_TYPE, "window", nullptr);
+  engine.addAction(RULE_ACTION_ALARM, nullptr, nullptr, true);
+  return engine.commitUpdate();
+}
+
+static void testMatching() {
+  LittleFS.reset();
+  RuleEngine engine;
+  engine.begin();
+  CHECK_EQ(engine.version(), 0);
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_HALL", "smoke_detector", "smoke"), 0);
+
+  CHECK(loadRules(engine, 7));
+  CHECK_EQ(engine.version(), 7);
+  CHECK_EQ(engine.ruleCount(), 5);
+
+  // Device rules first, then the type's rules in the order they were sent
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_HALL", "smoke_detector", "smoke"), 3);
+  CHECK(ranExactly({"light-hall on", "alarm on", "window-1 open", "fan-1 off"}));
+  // Another detector: only the type rules
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_KITCHEN", "smoke_detector", "smoke"), 2);
+  CHECK(ranExactly({"alarm on", "window-1 open", "fan-1 off"}));
+  // A value the first rule does not match
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_KITCHEN", "smoke_detector", "battery_low"), 1);
+  CHECK(ranExactly({"fan-1 off"}));
+
+  CHECK_EQ(evaluate(engine, MSG_STATUS, "door-1", "door", "open"), 1);
+  CHECK(ranExactly({"light-hall on"}));
+  CHECK_EQ(evaluate(engine, MSG_STATUS, "door-1", "door", "closed"), 0);
+  // The right source with the wrong event, and the other way round
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "door-1", "door", "open"), 0);
+  CHECK_EQ(evaluate(engine, MSG_STATUS, "door-2", "door", "open"), 0);
+  CHECK_EQ(evaluate(engine, RULE_EVENT_OFFLINE, "window-3", "window", ""), 1);
+  CHECK(ranExactly({"alarm on"}));
+  // A device ID that happens to equal a type name is still a device
+  CHECK_EQ(evaluate(engine, RULE_EVENT_OFFLINE, "window", "light", ""), 0);
+  CHECK_EQ(engine.fired(), 8);
+}
+
+static void testManyRules() {
+  // A full table: every rule is found through the index, whatever slot it hashed to
+  LittleFS.reset();
+  RuleEngine engine;
+  char device[DEVICE_ID_LEN];
+  char command[16];
+  engine.beginUpdate(1);
+  for (int i = 0; i < RULE_CAPACITY; i++) {
+    snprintf(device, sizeof(device), "dev-%02d", i);
+    snprintf(command, sizeof(command), "cmd-%02d", i);
+    CHECK(engine.addRule("status", RULE_SOURCE_DEVICE, device, nullptr));
+    CHECK(engine.addAction(RULE_ACTION_COMMAND, device, command, false));
+  }
+  CHECK(engine.commitUpdate());
+  for (int i = 0; i < RULE_CAPACITY; i++) {
+    snprintf(device, sizeof(device), "dev-%02d", i);
+    snprintf(command, sizeof(command), "cmd-%02d", i);
+    CHECK_EQ(evaluate(engine, MSG_STATUS, device, "light", "on"), 1);
+    CHECK(ranExactly({std::string(device) + " " + command}));
+  }
+}
+
+static void testLimits() {
+  LittleFS.reset();
+  RuleEngine engine;
+  CHECK(loadRules(engine, 1));
+
+  // Nothing is added outside an update
+  CHECK(!engine.addRule("alert", RULE_SOURCE_DEVICE, "x", nullptr));
+  CHECK(!engine.commitUpdate());
+
+  engine.beginUpdate(2);
+  CHECK(!engine.addAction(RULE_ACTION_ALARM, nullptr, nullptr, true));
+  CHECK(strcmp(engine.error(), "action before any rule") == 0);
+  CHECK(!engine.updating());
+
+  engine.beginUpdate(2);
+  CHECK(!engine.addRule("", RULE_SOURCE_DEVICE, "x", nullptr));
+  CHECK(strcmp(engine.error(), "rule without event or source") == 0);
+
+  engine.beginUpdate(2);
+  for (int i = 0; i < RULE_CAPACITY; i++) {
+    engine.addRule("alert", RULE_SOURCE_DEVICE, "x", nullptr);
+  }
+  CHECK(!engine.addRule("alert", RULE_SOURCE_DEVICE, "x", nullptr));
+  CHECK(strcmp(engine.error(), "too many rules") == 0);
+
+  engine.beginUpdate(2);
+  engine.addRule("alert", RULE_SOURCE_DEVICE, "x", nullptr);
+  for (int i = 0; i < RULE_ACTION_CAPACITY; i++) {
+    engine.addAction(RULE_ACTION_ALARM, nullptr, nullptr, true);
+  }
+  CHECK(!engine.addAction(RULE_ACTION_ALARM, nullptr, nullptr, true));
+  CHECK(strcmp(engine.error(), "too many actions") == 0);
+
+  // Repeated strings are stored once; distinct ones run out of pool
+  engine.beginUpdate(2);
+  engine.addRule("alert", RULE_SOURCE_DEVICE, "x", nullptr);
+  for (int i = 0; i < 40; i++) {
+    CHECK(engine.addAction(RULE_ACTION_COMMAND, "a-device-with-a-long-id", "a-long-command", false));
+  }
+  std::string device;
+  std::string command;
+  bool full = false;
+  for (int i = 0; i < RULE_ACTION_CAPACITY - 40 && !full; i++) {
+    device = "another-device-id-" + std::to_string(i);
+    command = "set-a-fairly-long-command-name-number-" + std::to_string(i);
+    full = !engine.addAction(RULE_ACTION_COMMAND, device.c_str(), command.c_str(), false);
+  }
+  CHECK(full);
+  CHECK(strcmp(engine.error(), "rule strings too long") == 0);
+
+  // None of the failed updates touched the running rules
+  CHECK_EQ(engine.version(), 1);
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_HALL", "smoke_detector", "smoke"), 3);
+
+  // Nor does one that is dropped
+  engine.beginUpdate(3);
+  engine.addRule("alert", RULE_SOURCE_DEVICE, "SD_HALL", nullptr);
+  CHECK_EQ(engine.updateVersion(), 3);
+  engine.abortUpdate();
+  CHECK_EQ(engine.updateVersion(), 0);
+  CHECK_EQ(engine.version(), 1);
+}
+
+static void testStored() {
+  LittleFS.reset();
+  {
+    RuleEngine engine;
+    engine.begin();
+    CHECK(loadRules(engine, 9));
+  }
+  // After a reboot the stored table runs as it was
+  RuleEngine engine;
+  engine.begin();
+  CHECK_EQ(engine.version(), 9);
+  CHECK_EQ(engine.ruleCount(), 5);
+  CHECK_EQ(evaluate(engine, MSG_ALERT, "SD_HALL", "smoke_detector", "smoke"), 3);
+  CHECK(!LittleFS.exists(RULES_UPDATE_PATH));
+
+  // A store that fails keeps the old rules, in RAM and in flash
+  hostFsFailWritesAfter(100);
+  CHECK(!loadRules(engine, 10));
+  hostFsFailWritesAfter(-1);
+  CHECK(strcmp(engine.error(), "could not store rules") == 0);
+  CHECK_EQ(engine.version(), 9);
+  CHECK(!LittleFS.exists(RULES_UPDATE_PATH));
+  RuleEngine rebooted;
+  rebooted.begin();
+  CHECK_EQ(rebooted.version(), 9);
+
+  // A damaged file is ignored rather than run
+  std::string& file = LittleFS.contents(RULES_PATH);
+  file[file.size() / 2] ^= 0x40;
+  RuleEngine damaged;
+  damaged.begin();
+  CHECK_EQ(damaged.version(), 0);
+  CHECK_EQ(evaluate(damaged, MSG_ALERT, "SD_HALL", "smoke_detector", "smoke"), 0);
+}
+
+int main() {
+  testMatching();
+  testManyRules();
+  testLimits();
+  testStored();
+  return testResult();
+}
@@ -0,0 +1,64 @@
+/*
+ * Test Support - the small amount of machinery the host tests share
+ *
+ * CHECK() records a failure and carries on, so one run reports every
+ * broken expectation; a test's main() ends with `return testResult();`.
+ * Benchmarks time a loop with BenchTimer and print one line per case in
+ * a fixed layout, so numbers from two runs can be diffed.
+ */
+
+#ifndef TEST_SUPPORT_H
+#define TEST_SUPPORT_H
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+
+static int testFailures = 0;
+
+#define CHECK(condition)                                                         \
+  do {                                                                           \
+    if (!(condition)) {                                                          \
+      fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+      testFailures++;                                                            \
+    }                                                                            \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                               \
+  do {                                                                           \
+    long long actualValue = (long long)(actual);                                 \
+    long long expectedValue = (long long)(expected);                             \
+    if (actualValue != expectedValue) {                                          \
+      fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %lld, expected %lld\n", __FILE__, __LINE__, \
+              #actual, actualValue, expectedValue);                              \
+      testFailures++;                                                            \
+    }                                                                            \
+  } while (0)
+
+static inline int testResult() {
+  if (testFailures != 0) {
+    fprintf(stderr, "%d check(s) failed\n", testFailures);
+    return 1;
+  }
+  printf("ok\n");
+  return 0;
+}
+
+class BenchTimer {
+ public:
+  BenchTimer() : start_(std::chrono::steady_clock::now()) {}
+  double elapsedNs() const {
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+ private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Keeps the optimizer from dropping a result the benchmark never uses
+template <typename T>
+static inline void benchKeep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif
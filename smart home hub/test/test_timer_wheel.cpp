@@ -0,0 +1,146 @@
+// TimerWheel: deadlines, re-arming, long delays, the millis() wrap and a full fired buffer
+#include "test_support.h"
+
+#include <timer_wheel.h>
+#include <vector>
+
+static int advanceAll(TimerWheel& wheel, uint32_t now, std::vector<int>& out) {
+  int16_t fired[TIMER_WHEEL_TIMERS];
+  int count = wheel.advance(now, fired, TIMER_WHEEL_TIMERS);
+  for (int i = 0; i < count; i++) {
+    out.push_back(fired[i]);
+  }
+  return count;
+}
+
+static void testDeadlines() {
+  TimerWheel wheel;
+  wheel.begin(0);
+  wheel.arm(1, 2500);   // Rounded up to 3 ticks
+  wheel.arm(2, 0);      // Never before the next tick
+  CHECK_EQ(wheel.armedCount(), 2);
+
+  std::vector<int> fired;
+  CHECK_EQ(advanceAll(wheel, 999, fired), 0);
+  CHECK_EQ(advanceAll(wheel, 1000, fired), 1);
+  CHECK_EQ(fired[0], 2);
+  CHECK_EQ(advanceAll(wheel, 2999, fired), 0);
+  CHECK_EQ(advanceAll(wheel, 3000, fired), 1);
+  CHECK_EQ(fired[1], 1);
+  CHECK(!wheel.armed(1));
+  CHECK_EQ(wheel.armedCount(), 0);
+}
+
+static void testRearmAndDisarm() {
+  TimerWheel wheel;
+  wheel.begin(0);
+  wheel.arm(5, 2000);
+  wheel.arm(5, 10000);   // Replaces the first deadline
+  wheel.arm(6, 2000);
+  wheel.disarm(6);
+  wheel.disarm(6);       // Twice is harmless
+  CHECK_EQ(wheel.armedCount(), 1);
+
+  std::vector<int> fired;
+  CHECK_EQ(advanceAll(wheel, 9000, fired), 0);
+  CHECK_EQ(advanceAll(wheel, 10000, fired), 1);
+  CHECK_EQ(fired[0], 5);
+
+  // Out-of-range IDs are ignored
+  wheel.arm(-1, 1000);
+  wheel.arm(TIMER_WHEEL_TIMERS, 1000);
+  wheel.disarm(TIMER_WHEEL_TIMERS);
+  CHECK_EQ(wheel.armedCount(), 0);
+}
+
+static void testBeyondOneTurn() {
+  // 200 ticks is more than the 128-slot wheel: the timer passes its slot once
+  TimerWheel wheel;
+  wheel.begin(0);
+  wheel.arm(3, 200 * TIMER_WHEEL_TICK_MS);
+  std::vector<int> fired;
+  CHECK_EQ(advanceAll(wheel, 72 * TIMER_WHEEL_TICK_MS, fired), 0);
+  CHECK_EQ(advanceAll(wheel, 199 * TIMER_WHEEL_TICK_MS, fired), 0);
+  CHECK_EQ(advanceAll(wheel, 200 * TIMER_WHEEL_TICK_MS, fired), 1);
+}
+
+static void testMillisWrap() {
+  TimerWheel wheel;
+  uint32_t start = 0xFFFFFFFFu - 4500;
+  wheel.begin(start);
+  wheel.arm(7, 10000);
+  std::vector<int> fired;
+  CHECK_EQ(advanceAll(wheel, start + 9999, fired), 0);
+  CHECK_EQ(advanceAll(wheel, start + 10000, fired), 1);
+}
+
+static void testFiredBufferFull() {
+  TimerWheel wheel;
+  wheel.begin(0);
+  for (int id = 0; id < 5; id++) {
+    wheel.arm(id, 1000);
+  }
+  wheel.arm(9, 2000);
+  int16_t fired[2];
+  CHECK_EQ(wheel.advance(5000, fired, 2), 2);
+  CHECK_EQ(wheel.advance(5000, fired, 2), 2);
+  // The rest of tick 1 first, then tick 2
+  CHECK_EQ(wheel.advance(5000, fired, 2), 2);
+  CHECK_EQ(wheel.advance(5000, fired, 2), 0);
+  CHECK_EQ(wheel.armedCount(), 0);
+}
+
+static void testAgainstModel() {
+  // Random arms and disarms; each timer must fire in the tick its deadline rounds up to
+  TimerWheel wheel;
+  wheel.begin(0);
+  std::vector<int64_t> due(TIMER_WHEEL_TIMERS, -1);   // Tick the model expects, -1 if disarmed
+  uint32_t state = 99;
+  auto random = [&state](uint32_t range) {
+    state = state * 1103515245u + 12345u;
+    return (state >> 8) % range;
+  };
+  uint32_t now = 0;
+  int firedTotal = 0;
+  for (int step = 0; step < 20000; step++) {
+    int id = random(TIMER_WHEEL_TIMERS);
+    uint32_t tick = now / TIMER_WHEEL_TICK_MS;
+    if (random(4) == 0) {
+      wheel.disarm(id);
+      due[id] = -1;
+    } else {
+      uint32_t delay = random(300 * TIMER_WHEEL_TICK_MS);
+      wheel.arm(id, delay);
+      uint32_t ticks = (delay + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+      due[id] = tick + (ticks ? ticks : 1);
+    }
+    now += random(3 * TIMER_WHEEL_TICK_MS);
+    std::vector<int> fired;
+    advanceAll(wheel, now, fired);
+    uint32_t nowTick = now / TIMER_WHEEL_TICK_MS;
+    for (int firedId : fired) {
+      CHECK(due[firedId] >= 0 && due[firedId] <= nowTick);
+      due[firedId] = -1;
+      firedTotal++;
+    }
+    for (int i = 0; i < TIMER_WHEEL_TIMERS; i++) {
+      CHECK(due[i] < 0 || due[i] > nowTick);
+    }
+  }
+  int armed = 0;
+  for (int64_t tick : due) {
+    armed += tick >= 0;
+  }
+  CHECK_EQ(wheel.armedCount(), armed);
+  CHECK(firedTotal > 1000);
+}
+
+int main() {
+  testDeadlines();
+  testRearmAndDisarm();
+  testBeyondOneTurn();
+  testMillisWrap();
+  testFiredBufferFull();
+  testAgainstModel();
+  return testResult();
+}
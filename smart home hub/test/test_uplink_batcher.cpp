@@ -0,0 +1,74 @@
+// UplinkBatcher: coalescing keeps event order, flush window and capacity
+#include "test_support.h"
+
+#include <uplink_batcher.h>
+
+static void testCoalescedStatusKeepsOrder() {
+  UplinkBatcher batcher(100, 8);
+  batcher.add(UPLINK_DEVICE_STATUS, "lamp", "X", 1000);
+  batcher.add(UPLINK_DEVICE_OFFLINE, "lamp", nullptr, 1010);
+  batcher.add(UPLINK_DEVICE_STATUS, "lamp", "Y", 1020);
+
+  UplinkEvent events[UPLINK_BATCH_CAPACITY];
+  int count = batcher.take(events, UPLINK_BATCH_CAPACITY, 1030);
+  CHECK_EQ(count, 2);
+  CHECK_EQ(events[0].kind, UPLINK_DEVICE_OFFLINE);
+  CHECK_EQ(events[1].kind, UPLINK_DEVICE_STATUS);
+  CHECK(strcmp(events[1].value, "Y") == 0);
+  CHECK_EQ(batcher.eventsCoalesced(), 1);
+}
+
+static void testCoalescingNeverDelaysFlush() {
+  UplinkBatcher batcher(100, 8);
+  batcher.add(UPLINK_DEVICE_STATUS, "lamp", "on", 1000);
+  batcher.add(UPLINK_DEVICE_ADDED, "door", "door", 1050);
+  // Coalesced at 1090: moves behind "door" but still counts from 1000
+  batcher.add(UPLINK_DEVICE_STATUS, "lamp", "off", 1090);
+  CHECK(!batcher.due(1099));
+  CHECK(batcher.due(1100));
+
+  UplinkEvent events[UPLINK_BATCH_CAPACITY];
+  CHECK_EQ(batcher.take(events, UPLINK_BATCH_CAPACITY, 1100), 2);
+  CHECK(strcmp(events[0].deviceId, "door") == 0);
+  CHECK(strcmp(events[1].value, "off") == 0);
+  CHECK_EQ(batcher.maxLatencyMs(), 100);
+}
+
+static void testFlushAndCapacity() {
+  UplinkBatcher batcher(100, 4);
+  char id[DEVICE_ID_LEN];
+  bool full = false;
+  for (int i = 0; i < 4; i++) {
+    snprintf(id, sizeof(id), "dev-%d", i);
+    full = batcher.add(UPLINK_DEVICE_STATUS, id, "on", 0);
+  }
+  CHECK(full);
+  // Past maxEvents the batcher keeps queuing up to its capacity, then drops
+  for (int i = 4; i < UPLINK_BATCH_CAPACITY + 2; i++) {
+    snprintf(id, sizeof(id), "dev-%d", i);
+    batcher.add(UPLINK_DEVICE_STATUS, id, "on", 0);
+  }
+  CHECK_EQ(batcher.pending(), UPLINK_BATCH_CAPACITY);
+  CHECK_EQ(batcher.eventsDropped(), 2);
+
+  // A coalesced event still fits in a full batch: it takes its old entry's place
+  CHECK(batcher.add(UPLINK_DEVICE_STATUS, "dev-0", "off", 5));
+  CHECK_EQ(batcher.pending(), UPLINK_BATCH_CAPACITY);
+  CHECK_EQ(batcher.eventsDropped(), 2);
+
+  UplinkEvent events[UPLINK_BATCH_CAPACITY];
+  CHECK_EQ(batcher.take(events, 10, 10), 10);
+  CHECK(strcmp(events[0].deviceId, "dev-1") == 0);
+  CHECK_EQ(batcher.pending(), UPLINK_BATCH_CAPACITY - 10);
+  CHECK_EQ(batcher.take(events, 10, 10), UPLINK_BATCH_CAPACITY - 10);
+  CHECK(strcmp(events[UPLINK_BATCH_CAPACITY - 11].deviceId, "dev-0") == 0);
+  CHECK_EQ(batcher.pending(), 0);
+  CHECK(!batcher.due(1000));
+}
+
+int main() {
+  testCoalescedStatusKeepsOrder();
+  testCoalescingNeverDelaysFlush();
+  testFlushAndCapacity();
+  return testResult();
+}
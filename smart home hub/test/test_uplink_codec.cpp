@@ -0,0 +1,115 @@
+// UplinkEncoder/UplinkDecoder: round trips, dictionary rollback, malformed frames
+#include "test_support.h"
+
+#include <uplink_codec.h>
+
+static char expected[1024];
+static char decoded[1024];
+static uint8_t frame[1024];
+
+// Encode doc, decode it on the server side and compare with the JSON minus hubId
+static bool roundTrip(UplinkEncoder& encoder, UplinkDecoder& decoder, JsonDocument& doc) {
+  size_t length = encoder.encode(doc, "hubId", frame, sizeof(frame));
+  if (length == 0) {
+    return false;
+  }
+  encoder.commit();
+  JsonDocument copy;
+  copy.set(doc);
+  copy.remove("hubId");
+  serializeJson(copy, expected, sizeof(expected));
+  size_t textLength = decoder.decode(frame, length, decoded, sizeof(decoded));
+  CHECK(textLength > 0);
+  CHECK(strcmp(decoded, expected) == 0);
+  if (strcmp(decoded, expected) != 0) {
+    fprintf(stderr, "  sent    %s\n  decoded %s\n", expected, decoded);
+  }
+  return true;
+}
+
+static void statusFrame(JsonDocument& doc, const char* deviceId, const char* status) {
+  doc.clear();
+  doc["type"] = "device_status";
+  doc["hubId"] = "a1b2c3d4";
+  doc["deviceId"] = deviceId;
+  doc["status"] = status;
+}
+
+static void testRoundTripsShrink() {
+  UplinkEncoder encoder;
+  UplinkDecoder decoder;
+  JsonDocument doc;
+  statusFrame(doc, "esp-1a2b3c", "on");
+  CHECK(roundTrip(encoder, decoder, doc));
+  size_t first = encoder.encode(doc, "hubId", frame, sizeof(frame));
+  encoder.commit();
+  decoder.decode(frame, first, decoded, sizeof(decoded));
+  statusFrame(doc, "esp-1a2b3c", "off");
+  size_t again = encoder.encode(doc, "hubId", frame, sizeof(frame));
+  encoder.commit();
+  // Keys and the device ID are references by now
+  CHECK(again < first);
+  CHECK(again < measureJson(doc) / 2);
+  CHECK(decoder.decode(frame, again, decoded, sizeof(decoded)) > 0);
+
+  doc.clear();
+  doc["type"] = "batch";
+  doc["hubId"] = "a1b2c3d4";
+  JsonArray events = doc["events"].to<JsonArray>();
+  for (int i = 0; i < 5; i++) {
+    JsonObject event = events.add<JsonObject>();
+    event["type"] = "heartbeat";
+    event["time"] = 123456789u + i;
+    event["loopMaxUs"] = -5 * i;
+    event["ratio"] = 0.5;
+    event["ok"] = i % 2 == 0;
+  }
+  CHECK(roundTrip(encoder, decoder, doc));
+  CHECK_EQ(encoder.entries(), decoder.entries());
+}
+
+static void testRollbackKeepsEndsInStep() {
+  UplinkEncoder encoder;
+  UplinkDecoder decoder;
+  JsonDocument doc;
+  statusFrame(doc, "esp-1a2b3c", "on");
+  CHECK(roundTrip(encoder, decoder, doc));
+
+  // A frame defining a new device ID never reaches the server
+  statusFrame(doc, "esp-999999", "on");
+  CHECK(encoder.encode(doc, "hubId", frame, sizeof(frame)) > 0);
+  encoder.rollback();
+  CHECK_EQ(encoder.entries(), decoder.entries());
+
+  // The next frame must define it again, not refer to an entry the server never saw
+  statusFrame(doc, "esp-999999", "off");
+  CHECK(roundTrip(encoder, decoder, doc));
+  CHECK_EQ(encoder.entries(), decoder.entries());
+}
+
+static void testMalformedFrames() {
+  UplinkEncoder encoder;
+  UplinkDecoder decoder;
+  JsonDocument doc;
+  statusFrame(doc, "esp-1a2b3c", "on");
+  size_t length = encoder.encode(doc, "hubId", frame, sizeof(frame));
+  for (size_t cut = 0; cut < length; cut++) {
+    UplinkDecoder fresh;
+    CHECK_EQ(fresh.decode(frame, cut, decoded, sizeof(decoded)), 0);
+  }
+  // A reference to an entry that was never defined
+  const uint8_t badRef[] = {0x81, 0xd4, UPLINK_EXT_REF, 0x05, 0x01};
+  CHECK_EQ(decoder.decode(badRef, sizeof(badRef), decoded, sizeof(decoded)), 0);
+  // Nesting past the limit
+  uint8_t deep[UPLINK_CODEC_MAX_DEPTH + 4];
+  memset(deep, 0x91, sizeof(deep));
+  deep[sizeof(deep) - 1] = 0xc0;
+  CHECK_EQ(decoder.decode(deep, sizeof(deep), decoded, sizeof(decoded)), 0);
+}
+
+int main() {
+  testRoundTripsShrink();
+  testRollbackKeepsEndsInStep();
+  testMalformedFrames();
+  return testResult();
+}
@@ -0,0 +1,133 @@
+// UplinkQueue: RAM ring, spill to LittleFS, and recovery from a torn spill write
+#include "test_support.h"
+
+#include <LittleFS.h>
+#include <uplink_queue.h>
+
+static const size_t FRAME_BYTES = 500;   // 504 with the header: 16 frames fill the RAM ring
+
+static void makeFrame(char* frame, int seq) {
+  memset(frame, 'a' + seq % 26, FRAME_BYTES);
+  snprintf(frame, FRAME_BYTES, "frame-%05d", seq);
+  frame[11] = ' ';
+}
+
+static void pushFrames(UplinkQueue& queue, int from, int to) {
+  char frame[FRAME_BYTES];
+  for (int seq = from; seq < to; seq++) {
+    makeFrame(frame, seq);
+    queue.push(frame, FRAME_BYTES, UPLINK_PRIORITY_NORMAL);
+  }
+}
+
+// Drain everything; returns how many frames came out, checking they are in order from first
+static int drainFrames(UplinkQueue& queue, int first) {
+  char frame[FRAME_BYTES + 16];
+  char expected[FRAME_BYTES];
+  int count = 0;
+  int seq = first;
+  size_t length;
+  while ((length = queue.peek(frame, sizeof(frame))) > 0) {
+    CHECK_EQ(length, FRAME_BYTES);
+    // Frames may have been dropped in between, never reordered
+    int got = atoi(frame + 6);
+    CHECK(got >= seq);
+    seq = got;
+    makeFrame(expected, seq);
+    CHECK(memcmp(frame, expected, FRAME_BYTES) == 0);
+    queue.pop();
+    seq++;
+    count++;
+  }
+  return count;
+}
+
+static void testRamOnly() {
+  LittleFS.reset();
+  hostFsFailMount();
+  static UplinkQueue queue;
+  queue = UplinkQueue();
+  queue.begin();
+  CHECK(!queue.spillAvailable());
+  pushFrames(queue, 0, 20);
+  // 16 fit; the 4 oldest were dropped for the newer ones
+  CHECK_EQ(queue.depth(), 16);
+  CHECK_EQ(queue.dropped(), 4);
+  CHECK_EQ(drainFrames(queue, 4), 16);
+  CHECK(queue.empty());
+}
+
+static void testSpillAndDrain() {
+  LittleFS.reset();
+  static UplinkQueue queue;
+  queue = UplinkQueue();
+  queue.begin();
+  pushFrames(queue, 0, 40);
+  CHECK_EQ(queue.depth(), 40);
+  CHECK_EQ(queue.spilledDepth(), 24);
+  CHECK_EQ(queue.dropped(), 0);
+  CHECK(LittleFS.exists(UPLINK_SPILL_PATH));
+  CHECK_EQ(drainFrames(queue, 0), 40);
+  CHECK(!LittleFS.exists(UPLINK_SPILL_PATH));
+}
+
+static void testTornSpillPausesUntilDrained() {
+  LittleFS.reset();
+  static UplinkQueue queue;
+  queue = UplinkQueue();
+  queue.begin();
+  // 16 in RAM, 8 spilled
+  pushFrames(queue, 0, 24);
+  CHECK_EQ(queue.spilledDepth(), 8);
+
+  // Flash fills up partway through the next spilled record
+  hostFsFailWritesAfter(200);
+  pushFrames(queue, 24, 25);
+  CHECK(!queue.spillAvailable());
+  CHECK_EQ(queue.spilledDepth(), 8);
+  CHECK_EQ(LittleFS.contents(UPLINK_SPILL_PATH).size(), 8 * 504 + 200);
+
+  // Space comes back, but the segment still ends in the torn record: nothing is appended after it
+  hostFsFailWritesAfter(-1);
+  pushFrames(queue, 25, 30);
+  CHECK_EQ(queue.spilledDepth(), 8);
+  CHECK_EQ(LittleFS.contents(UPLINK_SPILL_PATH).size(), 8 * 504 + 200);
+  uint32_t dropped = queue.dropped();
+  CHECK(dropped > 0);
+
+  // Every good spilled record is still readable, then the ring; the torn bytes never show up
+  CHECK_EQ(drainFrames(queue, 0), 30 - (int)dropped);
+  CHECK(!LittleFS.exists(UPLINK_SPILL_PATH));
+  CHECK(queue.spillAvailable());
+
+  // Spilling works again for the next outage
+  pushFrames(queue, 100, 140);
+  CHECK_EQ(queue.spilledDepth(), 24);
+  CHECK_EQ(queue.dropped(), dropped);
+  CHECK_EQ(drainFrames(queue, 100), 40);
+}
+
+static void testTornFirstSpillResetsAtOnce() {
+  LittleFS.reset();
+  static UplinkQueue queue;
+  queue = UplinkQueue();
+  queue.begin();
+  pushFrames(queue, 0, 16);
+  hostFsFailWritesAfter(10);
+  pushFrames(queue, 16, 17);
+  // Nothing good was in the segment, so it is removed and spilling stays on
+  CHECK(!LittleFS.exists(UPLINK_SPILL_PATH));
+  CHECK(queue.spillAvailable());
+  hostFsFailWritesAfter(-1);
+  pushFrames(queue, 17, 20);
+  CHECK(queue.spilledDepth() > 0);
+  CHECK_EQ(drainFrames(queue, 0), 20 - (int)queue.dropped());
+}
+
+int main() {
+  testRamOnly();
+  testSpillAndDrain();
+  testTornSpillPausesUntilDrained();
+  testTornFirstSpillResetsAtOnce();
+  return testResult();
+}
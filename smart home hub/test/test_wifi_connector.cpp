@@ -0,0 +1,254 @@
+// WifiConnector against a simulated station: cold boot, the cached fast path,
+// falling back to a scan, backoff, the fallback network and a lost connection
+#include "test_support.h"
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <WiFi.h>
+#include <wifi_connector.h>
+#include <vector>
+
+#define EEPROM_SIZE 512
+#define CACHE_ADDR (EEPROM_SIZE - WIFI_CACHE_SIZE)
+#define POLL_MS 100   // The hub's WIFI_POLL_INTERVAL
+
+struct Event {
+  ConnectorEvent event;
+  uint32_t ms;
+};
+
+static std::vector<Event> events;
+
+static void onEvent(ConnectorEvent event) {
+  events.push_back({event, (uint32_t)millis()});
+}
+
+// Power on with whatever the last run committed to flash
+static void boot(WifiConnector& connector) {
+  hostSetMillis(1000);
+  EEPROM.begin(EEPROM_SIZE);
+  events.clear();
+  connector = WifiConnector();
+  connector.onEvent(onEvent);
+}
+
+// Poll like the hub does until an event arrives or limitMs passes; returns whether one did
+static bool pollForEvent(WifiConnector& connector, uint32_t limitMs) {
+  size_t seen = events.size();
+  for (uint32_t waited = 0; waited < limitMs; waited += POLL_MS) {
+    hostAdvanceMillis(POLL_MS);
+    connector.service();
+    if (events.size() != seen) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void testColdBootThenFastPath() {
+  EEPROM.reset();
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  WifiConnector connector;
+
+  // Nothing cached: scan and DHCP
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_SCAN);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK(connector.connected());
+  CHECK(!connector.fastPath());
+  CHECK_EQ(connector.connectMs(), WiFi.scanMs + WiFi.dhcpMs);
+  CHECK_EQ(connector.bootConnectMs(), 1000 + WiFi.scanMs + WiFi.dhcpMs);
+  CHECK_EQ(WiFi.dhcpLeases, 1);
+  CHECK_EQ(EEPROM.commits(), 1);
+  CHECK_EQ((uint32_t)WiFi.localIP(), (uint32_t)IPAddress(192, 168, 1, 40));
+
+  // Reboot: pinned to the cached BSSID and channel, with the cached lease
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_FAST);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK(connector.fastPath());
+  CHECK(connector.bootFastPath());
+  CHECK_EQ(connector.connectMs(), WiFi.assocMs);
+  CHECK_EQ(WiFi.pinnedBegins, 1);
+  CHECK_EQ(WiFi.dhcpLeases, 0);
+  CHECK_EQ((uint32_t)WiFi.localIP(), (uint32_t)IPAddress(192, 168, 1, 40));
+  // Same access point, same lease: the cache is not written again
+  CHECK_EQ(EEPROM.commits(), 1);
+}
+
+static void testFastPathFallsBackToScan() {
+  EEPROM.reset();
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  WifiConnector connector;
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK(pollForEvent(connector, 20000));
+
+  // The access point moved to channel 11: the pinned attempt fails at once
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 11, IPAddress(192, 168, 1, 41));
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_FAST);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK(!connector.fastPath());
+  CHECK_EQ(connector.connectMs(), WiFi.assocMs + WiFi.scanMs + WiFi.dhcpMs);
+  CHECK_EQ(WiFi.begins, 2);
+  CHECK_EQ(EEPROM.commits(), 2);   // Refreshed with the new channel and lease
+
+  // ... and the next boot takes the fast path again, on channel 11
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 11, IPAddress(192, 168, 1, 41));
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK(connector.fastPath());
+
+  // An access point that never answers the pinned attempt: scan after WIFI_FAST_TIMEOUT_MS
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 11, IPAddress(192, 168, 1, 41));
+  WiFi.assocMs = WIFI_FAST_TIMEOUT_MS + 1000;
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK(pollForEvent(connector, 30000));
+  CHECK(!connector.fastPath());
+  CHECK_EQ(connector.connectMs(), WIFI_FAST_TIMEOUT_MS + WiFi.scanMs + WiFi.dhcpMs);
+}
+
+static void testCacheKeyedAndChecked() {
+  EEPROM.reset();
+  WiFi.reset();
+  WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  WiFi.addAccessPoint("home", "changed", 1, 6, IPAddress(192, 168, 1, 40));
+  WifiConnector connector;
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK(pollForEvent(connector, 20000));
+
+  // New password: the old lease is not trusted
+  boot(connector);
+  connector.begin("home", "changed", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_SCAN);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK(connector.connected());
+
+  // A flipped bit in the record: scan, never a bogus fast path
+  EEPROM.getDataPtr()[CACHE_ADDR + offsetof(WifiCache, ip)] ^= 0x01;
+  EEPROM.commit();
+  boot(connector);
+  connector.begin("home", "changed", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_SCAN);
+}
+
+static void testBackoff() {
+  EEPROM.reset();
+  WiFi.reset();
+  hostSeedRandom(12345);
+  WifiConnector connector;
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+
+  // No such network: every scan times out, and the waits between them
+  // double from WIFI_BACKOFF_MIN_MS up to WIFI_BACKOFF_MAX_MS, half of each random
+  uint32_t expectedBase[] = {1000, 2000, 4000, 8000, 16000, 32000, 60000, 60000};
+  for (int attempt = 0; attempt < 8; attempt++) {
+    uint32_t started = millis();
+    CHECK(pollForEvent(connector, 20000));
+    CHECK_EQ(events.back().event, CONNECTOR_FAILED);
+    CHECK_EQ(millis() - started, WIFI_SCAN_TIMEOUT_MS);
+    CHECK_EQ(connector.failures(), attempt + 1);
+    CHECK_EQ(connector.state(), CONNECTOR_BACKOFF);
+
+    uint32_t failedAt = millis();
+    uint32_t begins = WiFi.begins;
+    while (WiFi.begins == begins && millis() - failedAt <= WIFI_BACKOFF_MAX_MS + POLL_MS) {
+      hostAdvanceMillis(POLL_MS);
+      connector.service();
+    }
+    uint32_t waited = millis() - failedAt;
+    CHECK(waited >= expectedBase[attempt] / 2);
+    CHECK(waited <= expectedBase[attempt] + POLL_MS);
+  }
+
+  // The network appears: the next scan connects and the count starts over
+  WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK_EQ(connector.failures(), 0);
+  CHECK(connector.connectMs() > 8 * WIFI_SCAN_TIMEOUT_MS);
+}
+
+static void testFallbackNetwork() {
+  EEPROM.reset();
+  WiFi.reset();
+  WiFi.addAccessPoint("SmartHome_Hub_1", "12345678", 7, 1, IPAddress(192, 168, 4, 2));
+  WifiConnector connector;
+  boot(connector);
+  connector.setFallback("SmartHome_Hub_1", "12345678");
+  connector.begin("home", "secret", CACHE_ADDR);
+
+  // Home network is gone: one failed scan, then the fallback connects
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_FAILED);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK_EQ((uint32_t)WiFi.localIP(), (uint32_t)IPAddress(192, 168, 4, 2));
+
+  // The cache belongs to the fallback, so the next boot starts there, fast
+  boot(connector);
+  connector.setFallback("SmartHome_Hub_1", "12345678");
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK_EQ(connector.state(), CONNECTOR_FAST);
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK(connector.fastPath());
+}
+
+static void testConnectionLost() {
+  EEPROM.reset();
+  WiFi.reset();
+  HostAccessPoint& ap = WiFi.addAccessPoint("home", "secret", 1, 6, IPAddress(192, 168, 1, 40));
+  WifiConnector connector;
+  boot(connector);
+  connector.begin("home", "secret", CACHE_ADDR);
+  CHECK(pollForEvent(connector, 20000));
+
+  ap.up = false;
+  CHECK(pollForEvent(connector, 1000));
+  CHECK_EQ(events.back().event, CONNECTOR_LOST);
+  CHECK_EQ(connector.state(), CONNECTOR_FAST);   // Straight back to the cached access point
+  CHECK(!connector.connected());
+
+  // Back up before the fast path gives up
+  ap.up = true;
+  CHECK(pollForEvent(connector, 20000));
+  CHECK_EQ(events.back().event, CONNECTOR_CONNECTED);
+  CHECK(connector.fastPath());
+  CHECK_EQ(connector.connectMs(), WiFi.assocMs);   // Measured from the loss being seen
+
+  // stop() drops the station and the connector stays quiet
+  connector.stop();
+  CHECK_EQ(connector.state(), CONNECTOR_IDLE);
+  size_t seen = events.size();
+  CHECK(!pollForEvent(connector, 60000));
+  CHECK_EQ(events.size(), seen);
+}
+
+int main() {
+  testColdBootThenFastPath();
+  testFastPathFallsBackToScan();
+  testCacheKeyedAndChecked();
+  testBackoff();
+  testFallbackNetwork();
+  testConnectionLost();
+  return testResult();
+}
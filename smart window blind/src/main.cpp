@@ -3,6 +3,10 @@
 #include <WebSocketsClient.h>
 #include <ArduinoJson.h>
 #include <EEPROM.h>
+#include <compact_frame.h>
+#include <wifi_connector.h>
+#include <async_log.h>
+#include <config_store.h>
 
 // Pin definitions
 #define SHIFT_DATA 0   // GPIO0 (Data pin)
@@ -12,12 +16,16 @@
 void shiftOut(byte data);
 void setMotorPins(int step);
 void moveMotor(int steps);
-void setPosition(int percentage);
+void setPosition(int percentage, uint32_t corrId = 0);
+void sendPositionUpdate(uint32_t corrId);
+void handleCommand(const char *command, uint32_t corrId);
+void sendAck(uint32_t corrId, bool success);
 void calibrateBlind();
 void webSocketEvent(WStype_t type, uint8_t * payload, size_t length);
 void connectToHub();
 void handleRoot();
 void connectToHub();
+void onWifiEvent(ConnectorEvent event);
 void handleRoot();
 void handleSetup();
 void handleCalibration();
@@ -25,6 +33,8 @@ void saveConfiguration();
 void loadConfiguration();
 String generateUniqueId();
 void setupAP();
+void sendRegistration();
+void sendHeartbeat();
 
 
 
@@ -33,6 +43,21 @@ void setupAP();
 #define AP_PREFIX "SmartBlind_"
 #define STEPS_PER_REVOLUTION 4096  // For 28BYJ-48 stepper motor
 #define MAX_STEPS 20000  // Maximum steps (adjust based on your blind)
+#define COMPACT_FRAME_SIZE 32  // Largest binary frame the blind sends
+#define WIFI_CACHE_ADDR (EEPROM_SIZE - WIFI_CACHE_SIZE)  // Last good connection (see wifi_connector.h)
+#define CONFIG_STORE_ADDR 0    // Two BlindConfig slots (see config_store.h)
+#define CONFIG_VERSION 1       // Layout version of BlindConfig
+
+// Settings that survive a reboot, stored as one block; strings are NUL-terminated
+struct __attribute__((packed)) BlindConfig {
+  uint8_t configured;
+  uint8_t calibrated;
+  uint16_t totalSteps;
+  char hubSsid[33];
+  char hubPassword[65];
+};
+static_assert(CONFIG_STORE_ADDR + CONFIG_STORE_SIZE(sizeof(BlindConfig)) <= WIFI_CACHE_ADDR,
+              "config store overlaps the WiFi cache");
 IPAddress apIP(192, 168, 4, 1); 
 // Stepper motor sequence (half-step)
 const byte stepSequence[8] = {
@@ -57,10 +82,14 @@ int totalSteps = 0;      // Calibrated total steps
 int currentStep = 0;     // Current step position
 unsigned long lastHeartbeatTime = 0;
 bool isMoving = false;
+bool useCompact = false;  // Hub accepted binary compact frames at registration
+bool bootTimingSent = false;  // The boot WiFi timing went out with a registration
 
 // Objects
 ESP8266WebServer server(80);
 WebSocketsClient webSocket;
+WifiConnector wifi;
+ConfigStore configStore;
 
 // Function to send data to shift register
 void shiftOut(byte data) {
@@ -96,8 +125,12 @@ void moveMotor(int steps) {
   shiftOut(0);
 }
 
-void setPosition(int percentage) {
+void setPosition(int percentage, uint32_t corrId) {
   if (!isCalibrated || isMoving || percentage < 0 || percentage > 100) {
+    // A timed command still gets its answer: the position it stayed at
+    if (corrId != 0) {
+      sendPositionUpdate(corrId);
+    }
     return;
   }
   
@@ -110,11 +143,71 @@ void setPosition(int percentage) {
   currentStep = targetStep;
   isMoving = false;
   
-  // Send position update through WebSocket
+  sendPositionUpdate(corrId);
+}
+
+// Report the current position; corrId echoes the command that asked for it (0 if none)
+void sendPositionUpdate(uint32_t corrId) {
+  if (useCompact) {
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_POSITION_UPDATE);
+    writer.putInt(KEY_POSITION, currentPosition);
+    if (corrId != 0) {
+      writer.putInt(KEY_CORR_ID, corrId);
+    }
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
   DynamicJsonDocument doc(128);
   doc["type"] = "position_update";
   doc["deviceId"] = deviceId;
   doc["position"] = currentPosition;
+  if (corrId != 0) {
+    doc["corrId"] = corrId;
+  }
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
+// Commands forwarded by the hub from the cloud ("up", "down", "position_<0-100>", "calibrate")
+void handleCommand(const char *command, uint32_t corrId) {
+  if (strcmp(command, "up") == 0) {
+    setPosition(100, corrId);
+  } else if (strcmp(command, "down") == 0) {
+    setPosition(0, corrId);
+  } else if (strncmp(command, "position_", 9) == 0) {
+    setPosition(atoi(command + 9), corrId);
+  } else if (strcmp(command, "calibrate") == 0) {
+    calibrateBlind();
+    sendPositionUpdate(corrId);
+  } else if (corrId != 0) {
+    sendAck(corrId, false);
+  }
+}
+
+// Answer a command that has no position to report
+void sendAck(uint32_t corrId, bool success) {
+  if (useCompact) {
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_ACK);
+    writer.putInt(KEY_CORR_ID, corrId);
+    writer.putBool(KEY_SUCCESS, success);
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
+  DynamicJsonDocument doc(128);
+  doc["type"] = "ack";
+  doc["deviceId"] = deviceId;
+  doc["corrId"] = corrId;
+  doc["success"] = success;
   
   String jsonString;
   serializeJson(doc, jsonString);
@@ -146,57 +239,133 @@ void calibrateBlind() {
   isCalibrated = true;
   isMoving = false;
   
-  // Save calibration to EEPROM
-  EEPROM.write(100, isCalibrated);
-  EEPROM.write(101, totalSteps & 0xFF);
-  EEPROM.write(102, (totalSteps >> 8) & 0xFF);
-  EEPROM.commit();
+  // Save calibration with the rest of the configuration
+  saveConfiguration();
 }
 
 void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
   switch(type) {
     case WStype_DISCONNECTED:
-      Serial.println("WebSocket disconnected");
+      LOG_INFO("WebSocket disconnected");
+      // Every new connection negotiates the encoding again
+      useCompact = false;
       break;
     
     case WStype_CONNECTED:
-      Serial.println("WebSocket connected");
+      LOG_INFO("WebSocket connected");
+      sendRegistration();
       break;
     
     case WStype_TEXT: {
       DynamicJsonDocument doc(256);
-      deserializeJson(doc, payload);
+      deserializeJson(doc, payload, length);
       
-      if (doc["type"] == "set_position") {
+      if (doc["type"] == "registration_confirm") {
+        useCompact = doc["encoding"] == COMPACT_ENCODING_NAME;
+      } else if (doc["type"] == "command") {
+        handleCommand(doc["command"] | "", doc["corrId"] | 0u);
+      } else if (doc["type"] == "set_position") {
         int position = doc["position"];
-        setPosition(position);
+        setPosition(position, doc["corrId"] | 0u);
       } else if (doc["type"] == "calibrate") {
         calibrateBlind();
+        sendPositionUpdate(doc["corrId"] | 0u);
       }
       break;
     }
+    
+    case WStype_BIN: {
+      // Compact frame from the hub
+      CompactReader reader(payload, length);
+      FrameType frameType = FRAME_UNKNOWN;
+      char command[24] = "";
+      int position = -1;
+      uint32_t corrId = 0;
+      uint8_t key;
+      CompactValue value;
+      while (reader.next(key, value)) {
+        if (key == KEY_TYPE) {
+          frameType = (FrameType)value.asInt();
+        } else if (key == KEY_COMMAND) {
+          value.copyTo(command, sizeof(command));
+        } else if (key == KEY_POSITION) {
+          position = value.asInt();
+        } else if (key == KEY_CORR_ID) {
+          corrId = (uint32_t)value.asInt();
+        }
+      }
+      
+      if (frameType == FRAME_COMMAND) {
+        handleCommand(command, corrId);
+      } else if (frameType == FRAME_SET_POSITION) {
+        setPosition(position, corrId);
+      } else if (frameType == FRAME_CALIBRATE) {
+        calibrateBlind();
+        sendPositionUpdate(corrId);
+      }
+      break;
+    }
+    
+    default:
+      break;
   }
 }
 
+// Start joining the hub's network; the connector retries on its own from loop()
 void connectToHub() {
-  WiFi.begin(hubSsid.c_str(), hubPassword.c_str());
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
-  }
-  
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\nConnected to hub");
+  wifi.onEvent(onWifiEvent);
+  wifi.begin(hubSsid.c_str(), hubPassword.c_str(), WIFI_CACHE_ADDR);
+}
+
+void onWifiEvent(ConnectorEvent event) {
+  if (event == CONNECTOR_CONNECTED) {
+    LOG_INFO("Connected to hub");
     
-    // Connect to WebSocket server
+    // Connect to WebSocket server; registration follows once connected
     webSocket.begin("192.168.1.1", 81, "/ws");
     webSocket.onEvent(webSocketEvent);
     webSocket.setReconnectInterval(5000);
   }
 }
+
+void sendRegistration() {
+  // Registration is always JSON so any hub understands it; it offers the compact encoding
+  DynamicJsonDocument doc(192);
+  doc["type"] = "registration";
+  doc["deviceId"] = deviceId;
+  doc["deviceType"] = "window_blind";
+  doc["encodings"].add(COMPACT_ENCODING_NAME);
+  // Time from boot to WiFi, once per boot
+  if (!bootTimingSent) {
+    doc["wifiBootMs"] = wifi.bootConnectMs();
+    doc["wifiFastPath"] = wifi.bootFastPath();
+    bootTimingSent = true;
+  }
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
+void sendHeartbeat() {
+  if (useCompact) {
+    // The hub knows which device this connection belongs to
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_HEARTBEAT);
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
+  DynamicJsonDocument doc(128);
+  doc["type"] = "heartbeat";
+  doc["deviceId"] = deviceId;
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
 void handleRoot() {
   String html = "<!DOCTYPE html><html>";
   html += "<head><meta name=\"viewport\" content=\"width=device-width, initial-scale=1\">";
@@ -311,49 +480,64 @@ void handleCalibration() {
 }
 
 void saveConfiguration() {
-  // Save SSID
-  for (int i = 0; i < hubSsid.length(); i++) {
-    EEPROM.write(i, hubSsid[i]);
+  BlindConfig config;
+  memset(&config, 0, sizeof(config));
+  config.configured = isConfigured;
+  config.calibrated = isCalibrated;
+  config.totalSteps = totalSteps;
+  strlcpy(config.hubSsid, hubSsid.c_str(), sizeof(config.hubSsid));
+  strlcpy(config.hubPassword, hubPassword.c_str(), sizeof(config.hubPassword));
+  
+  if (!configStore.save(config)) {
+    LOG_ERROR("Configuration save failed");
   }
-  EEPROM.write(32, 0);
-  
-  // Save password
-  for (int i = 0; i < hubPassword.length(); i++) {
-    EEPROM.write(i + 33, hubPassword[i]);
+}
+
+// Read a NUL-terminated string of the pre-store layout, at most maxLength characters
+void readLegacyString(int addr, int maxLength, char *dest) {
+  int i = 0;
+  for (; i < maxLength; i++) {
+    char c = EEPROM.read(addr + i);
+    if (c == 0) break;
+    dest[i] = c;
   }
-  EEPROM.write(65, 0);
-  
-  EEPROM.write(99, isConfigured);
-  EEPROM.commit();
+  dest[i] = '\0';
+}
+
+// The layout before the config store: SSID at 0, password at 33, flags at 99 and 100, steps at 101
+bool loadLegacyConfiguration(BlindConfig &config) {
+  memset(&config, 0, sizeof(config));
+  if (EEPROM.read(99) != 1) {
+    return false;
+  }
+  config.configured = 1;
+  readLegacyString(0, 32, config.hubSsid);
+  readLegacyString(33, 32, config.hubPassword);
+  config.calibrated = EEPROM.read(100) == 1;
+  if (config.calibrated) {
+    config.totalSteps = EEPROM.read(101) | (EEPROM.read(102) << 8);
+  }
+  return true;
 }
 
 void loadConfiguration() {
-  isConfigured = EEPROM.read(99);
+  BlindConfig config;
+  bool loaded = configStore.load(config);
+  
+  // First boot after the update: the settings are still in the old layout
+  if (!loaded && loadLegacyConfiguration(config)) {
+    loaded = true;
+    configStore.save(config);
+    LOG_INFO("Configuration migrated from the old EEPROM layout");
+  }
   
-  if (isConfigured) {
-    // Load SSID
-    String ssid = "";
-    for (int i = 0; i < 32; i++) {
-      char c = EEPROM.read(i);
-      if (c == 0) break;
-      ssid += c;
-    }
-    hubSsid = ssid;
-    
-    // Load password
-    String pass = "";
-    for (int i = 33; i < 65; i++) {
-      char c = EEPROM.read(i);
-      if (c == 0) break;
-      pass += c;
-    }
-    hubPassword = pass;
-    
-    // Load calibration data
-    isCalibrated = EEPROM.read(100);
-    if (isCalibrated) {
-      totalSteps = EEPROM.read(101) | (EEPROM.read(102) << 8);
-    }
+  if (loaded) {
+    isConfigured = config.configured;
+    hubSsid = config.hubSsid;
+    hubPassword = config.hubPassword;
+    isCalibrated = config.calibrated;
+    totalSteps = config.totalSteps;
+    LOG_INFO("Configuration loaded in %u us (seq %u)", configStore.loadUs(), configStore.sequence());
   }
 }
 
@@ -371,9 +555,11 @@ String generateUniqueId() {
 
 void setup() {
   Serial.begin(115200);
+  asyncLog.begin(Serial);
   
-  // Initialize EEPROM
+  // Initialize EEPROM; the config store reads its slots from this image
   EEPROM.begin(EEPROM_SIZE);
+  configStore.begin(CONFIG_STORE_ADDR, sizeof(BlindConfig), CONFIG_VERSION);
   
   // Set pin modes for shift register
   pinMode(SHIFT_DATA, OUTPUT);
@@ -391,7 +577,7 @@ void setup() {
     server.on("/setup", HTTP_GET, handleSetup);
     server.on("/calibrate", HTTP_GET, handleCalibration);
     server.begin();
-    Serial.println("HTTP server started in AP mode");
+    LOG_INFO("HTTP server started in AP mode");
   } else {
     connectToHub();
   }
@@ -400,33 +586,24 @@ void setupAP() {
   String apName = AP_PREFIX + deviceId.substring(0, 6);
   WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
   WiFi.softAP(apName.c_str(), deviceId.c_str());
-  Serial.println("Access Point Started");
-  Serial.print("SSID: ");
-  Serial.println(apName);
-  Serial.print("Password: ");
-  Serial.println(deviceId);
+  LOG_INFO("Access Point started, SSID %s, password %s", apName.c_str(), deviceId.c_str());
 }
 void loop() {
+  // Write out what has been logged, as far as the UART has room
+  asyncLog.service();
+  
   if (!isConfigured) {
     server.handleClient();
   } else {
-    webSocket.loop();
+    wifi.service();
+    if (wifi.connected()) {
+      webSocket.loop();
+    }
     
     // Send heartbeat periodically
     if (millis() - lastHeartbeatTime > 30000) {  // every 30 seconds
-      DynamicJsonDocument doc(128);
-      doc["type"] = "heartbeat";
-      doc["deviceId"] = deviceId;
-      
-      String jsonString;
-      serializeJson(doc, jsonString);
-      webSocket.sendTXT(jsonString);
+      sendHeartbeat();
       lastHeartbeatTime = millis();
     }
-    
-    // Reconnect to hub if connection lost
-    if (!webSocket.isConnected()) {
-      connectToHub();
-    }
   }
 }
\ No newline at end of file
@@ -5,14 +5,16 @@
 #include <EEPROM.h>
 #include <ESP8266mDNS.h>
 #include <WebSocketsServer.h>
-#include <ESP8266WiFiMulti.h>
+#include <wifi_connector.h>
+#include <async_log.h>
+#include <config_store.h>
 
 // Constants
 #define RELAY_PIN 2
 #define EEPROM_SIZE 512
 #define CONFIG_MAGIC_BYTE 0x42  // Magic byte to validate configuration
 
-// EEPROM address offsets
+// EEPROM address offsets of the layout before the config store, read once to migrate
 #define ADDR_MAGIC_BYTE 0
 #define ADDR_IS_CONFIGURED 1
 #define ADDR_DEVICE_NAME 2
@@ -21,11 +23,28 @@
 #define ADDR_HUB_HOTSPOT_SSID 130
 #define ADDR_HUB_HOTSPOT_PASSWORD 162
 #define ADDR_DEVICE_STATE 194
+#define WIFI_CACHE_ADDR (EEPROM_SIZE - WIFI_CACHE_SIZE)  // Last good connection (see wifi_connector.h)
+#define CONFIG_STORE_ADDR 0    // Two SwitchConfig slots (see config_store.h)
+#define CONFIG_VERSION 1       // Layout version of SwitchConfig
+
+// Settings that survive a reboot, stored as one block; strings are NUL-terminated
+struct __attribute__((packed)) SwitchConfig {
+  uint8_t configured;
+  uint8_t deviceState;
+  char deviceName[32];
+  char homeWifiSSID[32];
+  char homeWifiPassword[64];
+  char hubHotspotSSID[32];
+  char hubHotspotPassword[32];
+};
+static_assert(CONFIG_STORE_ADDR + CONFIG_STORE_SIZE(sizeof(SwitchConfig)) <= WIFI_CACHE_ADDR,
+              "config store overlaps the WiFi cache");
 
 // Global objects
 ESP8266WebServer server(80);
 WebSocketsServer webSocket(81);  // For real-time communication with app
-ESP8266WiFiMulti wifiMulti;
+WifiConnector wifi;  // Home WiFi, falling back to the hub's hotspot
+ConfigStore configStore;
 WiFiClient client;
 
 // Configuration variables
@@ -48,11 +67,13 @@ void sendStatusToHub();
 void checkHubCommands();
 void loadConfiguration();
 void saveConfiguration();
+bool loadLegacyConfiguration(SwitchConfig &config);
 void saveDeviceState();
 void restoreDeviceState();
 void updateRelayState();
 void setupHotspot();
 void connectToWiFi();
+void onWifiEvent(ConnectorEvent event);
 void setupWebServer();
 void setupWebSocket();
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t * payload, size_t length);
@@ -76,6 +97,7 @@ const long hubCheckInterval = 5000;
 
 void setup() {
   Serial.begin(115200);
+  asyncLog.begin(Serial);
   delay(100);
   
   // Initialize pins
@@ -85,8 +107,9 @@ void setup() {
   // Generate device ID from chip ID
   sprintf(deviceId, "%08X", ESP.getChipId());
   
-  // Initialize EEPROM
+  // Initialize EEPROM; the config store reads its slots from this image
   EEPROM.begin(EEPROM_SIZE);
+  configStore.begin(CONFIG_STORE_ADDR, sizeof(SwitchConfig), CONFIG_VERSION);
   loadConfiguration();
   
   if (isConfigured) {
@@ -106,24 +129,25 @@ void setup() {
   if (MDNS.begin(deviceId)) {
     MDNS.addService("http", "tcp", 80);
     MDNS.addService("ws", "tcp", 81);
-    Serial.println("mDNS responder started");
+    LOG_INFO("mDNS responder started");
   }
   
   // Restore device state from EEPROM
   restoreDeviceState();
   
-  Serial.println("Device setup complete");
-  Serial.print("Device ID: ");
-  Serial.println(deviceId);
+  LOG_INFO("Device setup complete, device ID %s", deviceId);
 }
 
 void loop() {
+  // Write out what has been logged, as far as the UART has room
+  asyncLog.service();
+  wifi.service();
   server.handleClient();
   webSocket.loop();
   MDNS.update();
   
   // If configured and connected to WiFi, check for commands from hub
-  if (isConfigured && WiFi.status() == WL_CONNECTED && WiFi.getMode() == WIFI_STA) {
+  if (isConfigured && wifi.connected()) {
     if (millis() - lastHubCheckTime > hubCheckInterval) {
       sendStatusToHub();
       checkHubCommands();
@@ -132,97 +156,96 @@ void loop() {
   }
 }
 
-void loadConfiguration() {
-  if (EEPROM.read(ADDR_MAGIC_BYTE) == CONFIG_MAGIC_BYTE) {
-    isConfigured = EEPROM.read(ADDR_IS_CONFIGURED);
-    
-    if (isConfigured) {
-      // Read device name
-      for (int i = 0; i < 32; i++) {
-        deviceName[i] = EEPROM.read(ADDR_DEVICE_NAME + i);
-      }
-      
-      // Read home WiFi SSID
-      for (int i = 0; i < 32; i++) {
-        homeWifiSSID[i] = EEPROM.read(ADDR_HOME_WIFI_SSID + i);
-      }
-      
-      // Read home WiFi password
-      for (int i = 0; i < 64; i++) {
-        homeWifiPassword[i] = EEPROM.read(ADDR_HOME_WIFI_PASSWORD + i);
-      }
-      
-      // Read hub hotspot SSID
-      for (int i = 0; i < 32; i++) {
-        hubHotspotSSID[i] = EEPROM.read(ADDR_HUB_HOTSPOT_SSID + i);
-      }
-      
-      // Read hub hotspot password
-      for (int i = 0; i < 32; i++) {
-        hubHotspotPassword[i] = EEPROM.read(ADDR_HUB_HOTSPOT_PASSWORD + i);
-      }
-      
-      Serial.println("Configuration loaded from EEPROM");
-      Serial.print("Device name: ");
-      Serial.println(deviceName);
-      Serial.print("Home WiFi SSID: ");
-      Serial.println(homeWifiSSID);
-      Serial.print("Hub Hotspot SSID: ");
-      Serial.println(hubHotspotSSID);
-    }
+// Copy the settings into one SwitchConfig and store it
+void saveConfiguration() {
+  SwitchConfig config;
+  memset(&config, 0, sizeof(config));
+  config.configured = isConfigured ? 1 : 0;
+  config.deviceState = deviceState ? 1 : 0;
+  strlcpy(config.deviceName, deviceName, sizeof(config.deviceName));
+  strlcpy(config.homeWifiSSID, homeWifiSSID, sizeof(config.homeWifiSSID));
+  strlcpy(config.homeWifiPassword, homeWifiPassword, sizeof(config.homeWifiPassword));
+  strlcpy(config.hubHotspotSSID, hubHotspotSSID, sizeof(config.hubHotspotSSID));
+  strlcpy(config.hubHotspotPassword, hubHotspotPassword, sizeof(config.hubHotspotPassword));
+  
+  if (configStore.save(config)) {
+    LOG_INFO("Configuration saved (seq %u)", configStore.sequence());
   } else {
-    isConfigured = false;
-    Serial.println("No valid configuration found in EEPROM");
+    LOG_ERROR("Configuration save failed");
   }
 }
 
-void saveConfiguration() {
-  // Write magic byte to validate configuration
-  EEPROM.write(ADDR_MAGIC_BYTE, CONFIG_MAGIC_BYTE);
-  EEPROM.write(ADDR_IS_CONFIGURED, isConfigured ? 1 : 0);
-  
-  // Write device name
-  for (int i = 0; i < 32; i++) {
-    EEPROM.write(ADDR_DEVICE_NAME + i, deviceName[i]);
+// Read one fixed-size field of the pre-store layout, making sure it ends in a NUL
+void readLegacyField(int addr, char *dest, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dest[i] = (char)EEPROM.read(addr + i);
   }
-  
-  // Write home WiFi SSID
-  for (int i = 0; i < 32; i++) {
-    EEPROM.write(ADDR_HOME_WIFI_SSID + i, homeWifiSSID[i]);
+  dest[size - 1] = '\0';
+}
+
+// The layout before the config store: a magic byte, then fields at fixed offsets
+bool loadLegacyConfiguration(SwitchConfig &config) {
+  memset(&config, 0, sizeof(config));
+  if (EEPROM.read(ADDR_MAGIC_BYTE) != CONFIG_MAGIC_BYTE) {
+    return false;
   }
-  
-  // Write home WiFi password
-  for (int i = 0; i < 64; i++) {
-    EEPROM.write(ADDR_HOME_WIFI_PASSWORD + i, homeWifiPassword[i]);
+  config.configured = EEPROM.read(ADDR_IS_CONFIGURED) ? 1 : 0;
+  config.deviceState = EEPROM.read(ADDR_DEVICE_STATE) == 1 ? 1 : 0;
+  readLegacyField(ADDR_DEVICE_NAME, config.deviceName, sizeof(config.deviceName));
+  readLegacyField(ADDR_HOME_WIFI_SSID, config.homeWifiSSID, sizeof(config.homeWifiSSID));
+  readLegacyField(ADDR_HOME_WIFI_PASSWORD, config.homeWifiPassword, sizeof(config.homeWifiPassword));
+  readLegacyField(ADDR_HUB_HOTSPOT_SSID, config.hubHotspotSSID, sizeof(config.hubHotspotSSID));
+  readLegacyField(ADDR_HUB_HOTSPOT_PASSWORD, config.hubHotspotPassword, sizeof(config.hubHotspotPassword));
+  return true;
+}
+
+void loadConfiguration() {
+  SwitchConfig config;
+  bool loaded = configStore.load(config);
+  
+  // First boot after the update: the settings are still in the old layout
+  bool migrated = false;
+  if (!loaded) {
+    migrated = loadLegacyConfiguration(config);
+    loaded = migrated;
   }
   
-  // Write hub hotspot SSID
-  for (int i = 0; i < 32; i++) {
-    EEPROM.write(ADDR_HUB_HOTSPOT_SSID + i, hubHotspotSSID[i]);
+  if (!loaded) {
+    isConfigured = false;
+    LOG_INFO("No valid configuration found in EEPROM");
+    return;
   }
   
-  // Write hub hotspot password
-  for (int i = 0; i < 32; i++) {
-    EEPROM.write(ADDR_HUB_HOTSPOT_PASSWORD + i, hubHotspotPassword[i]);
+  isConfigured = config.configured != 0;
+  deviceState = config.deviceState != 0;
+  if (isConfigured) {
+    strlcpy(deviceName, config.deviceName, sizeof(deviceName));
+    strlcpy(homeWifiSSID, config.homeWifiSSID, sizeof(homeWifiSSID));
+    strlcpy(homeWifiPassword, config.homeWifiPassword, sizeof(homeWifiPassword));
+    strlcpy(hubHotspotSSID, config.hubHotspotSSID, sizeof(hubHotspotSSID));
+    strlcpy(hubHotspotPassword, config.hubHotspotPassword, sizeof(hubHotspotPassword));
+  }
+  if (migrated) {
+    saveConfiguration();
+    LOG_INFO("Configuration migrated from the old EEPROM layout");
   }
   
-  EEPROM.commit();
-  Serial.println("Configuration saved to EEPROM");
+  LOG_INFO("Configuration loaded in %u us (seq %u)", configStore.loadUs(), configStore.sequence());
+  if (isConfigured) {
+    LOG_INFO("Device name: %s", deviceName);
+    LOG_INFO("Home WiFi SSID: %s, hub hotspot SSID: %s", homeWifiSSID, hubHotspotSSID);
+  }
 }
 
+// The relay state is part of SwitchConfig; a save with nothing else changed rewrites one slot
 void saveDeviceState() {
-  EEPROM.write(ADDR_DEVICE_STATE, deviceState ? 1 : 0);
-  EEPROM.commit();
-  Serial.println("Device state saved to EEPROM");
+  saveConfiguration();
 }
 
 void restoreDeviceState() {
-  if (EEPROM.read(ADDR_MAGIC_BYTE) == CONFIG_MAGIC_BYTE) {
-    deviceState = EEPROM.read(ADDR_DEVICE_STATE) == 1;
-    updateRelayState();
-    Serial.print("Device state restored from EEPROM: ");
-    Serial.println(deviceState ? "ON" : "OFF");
-  }
+  // loadConfiguration() already read it
+  updateRelayState();
+  LOG_INFO("Device state restored from EEPROM: %s", deviceState ? "ON" : "OFF");
 }
 
 void updateRelayState() {
@@ -230,49 +253,35 @@ void updateRelayState() {
 }
 
 void setupHotspot() {
-  WiFi.mode(WIFI_AP);
+  // A configured switch keeps its station up so the connector can retry
+  WiFi.mode(isConfigured ? WIFI_AP_STA : WIFI_AP);
   WiFi.softAP(deviceId, deviceId);  // Use device ID as both SSID and password
-  Serial.print("Hotspot created: ");
-  Serial.println(deviceId);
-  Serial.print("IP address: ");
-  Serial.println(WiFi.softAPIP());
+  LOG_INFO("Hotspot created: %s, IP address %s", deviceId, WiFi.softAPIP().toString().c_str());
 }
 
+// Start joining the configured networks; the connector retries on its own from loop()
 void connectToWiFi() {
-  Serial.println("Attempting to connect to configured networks");
-  
-  // First try to connect to home WiFi
-  wifiMulti.addAP(homeWifiSSID, homeWifiPassword);
+  LOG_INFO("Attempting to connect to configured networks");
   
-  // Then try to connect to hub's hotspot if configured
+  // First try home WiFi, then the hub's hotspot if configured
   if (strlen(hubHotspotSSID) > 0) {
-    wifiMulti.addAP(hubHotspotSSID, hubHotspotPassword);
-  }
-  
-  Serial.print("Connecting to WiFi");
-  
-  // Wait for connection to either network
-  int attempts = 0;
-  while (wifiMulti.run() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
+    wifi.setFallback(hubHotspotSSID, hubHotspotPassword);
   }
-  
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("");
-    Serial.print("Connected to: ");
-    Serial.println(WiFi.SSID());
-    Serial.print("IP address: ");
-    Serial.println(WiFi.localIP());
+  wifi.onEvent(onWifiEvent);
+  wifi.begin(homeWifiSSID, homeWifiPassword, WIFI_CACHE_ADDR);
+}
+
+void onWifiEvent(ConnectorEvent event) {
+  if (event == CONNECTOR_CONNECTED) {
+    LOG_INFO("Connected to %s, IP address %s", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
     
     // If connected to home WiFi, register with hub when needed
     if (WiFi.SSID() == String(homeWifiSSID)) {
-      Serial.println("Connected to home WiFi, looking for hub...");
+      LOG_INFO("Connected to home WiFi, looking for hub...");
     }
-  } else {
-    Serial.println("");
-    Serial.println("Failed to connect to WiFi, reverting to hotspot mode");
+  } else if (event == CONNECTOR_FAILED && !wifi.everConnected() && WiFi.getMode() == WIFI_STA) {
+    // Open the setup hotspot alongside the station, which keeps retrying
+    LOG_WARN("Failed to connect to WiFi, starting hotspot");
     setupHotspot();
   }
 }
@@ -300,7 +309,7 @@ void setupWebServer() {
   server.on("/api/scan", HTTP_GET, handleApiScan);
   
   server.begin();
-  Serial.println("Web server started");
+  LOG_INFO("Web server started");
 }
 
 String getSetupHtml() {
@@ -510,12 +519,12 @@ void handleApiScan() {
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length) {
   switch (type) {
     case WStype_DISCONNECTED:
-      Serial.printf("[%u] Disconnected!\n", num);
+      LOG_INFO("[%u] Disconnected!", num);
       break;
     case WStype_CONNECTED:
       {
         IPAddress ip = webSocket.remoteIP(num);
-        Serial.printf("[%u] Connected from %d.%d.%d.%d\n", num, ip[0], ip[1], ip[2], ip[3]);
+        LOG_INFO("[%u] Connected from %d.%d.%d.%d", num, ip[0], ip[1], ip[2], ip[3]);
         
         // Send current state to newly connected client
         sendStateToClient(num);
@@ -523,7 +532,7 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
       break;
     case WStype_TEXT:
       {
-        Serial.printf("[%u] Received text: %s\n", num, payload);
+        LOG_DEBUG("[%u] Received text: %.*s", num, (int)length, (const char*)payload);
         
         DynamicJsonDocument doc(256);
         DeserializationError error = deserializeJson(doc, payload, length);
@@ -603,9 +612,9 @@ void sendStatusToHub() {
     
     int httpCode = http.POST(jsonStr);
     if (httpCode == HTTP_CODE_OK) {
-      Serial.println("Status sent to hub successfully");
+      LOG_DEBUG("Status sent to hub successfully");
     } else {
-      Serial.printf("Error sending status to hub: %d\n", httpCode);
+      LOG_WARN("Error sending status to hub: %d", httpCode);
     }
     
     http.end();
@@ -637,13 +646,13 @@ void checkHubCommands() {
           deviceState = true;
           updateRelayState();
           saveDeviceState();
-          Serial.println("Turned ON via hub command");
+          LOG_INFO("Turned ON via hub command");
           notifyClients();
         } else if (action == "off" && deviceState) {
           deviceState = false;
           updateRelayState();
           saveDeviceState();
-          Serial.println("Turned OFF via hub command");
+          LOG_INFO("Turned OFF via hub command");
           notifyClients();
         }
       }
@@ -3,6 +3,10 @@
 #include <WebSocketsClient.h>
 #include <ArduinoJson.h>
 #include <EEPROM.h>
+#include <compact_frame.h>
+#include <wifi_connector.h>
+#include <async_log.h>
+#include <config_store.h>
 
 // Pin definitions
 #define SMOKE_SENSOR_PIN 0  // GPIO0 for smoke sensor
@@ -10,6 +14,18 @@
 // Constants
 #define EEPROM_SIZE 512
 #define AP_PREFIX "SmartSmoke_"
+#define COMPACT_FRAME_SIZE 64  // Largest binary frame this sensor sends
+#define WIFI_CACHE_ADDR (EEPROM_SIZE - WIFI_CACHE_SIZE)  // Last good connection (see wifi_connector.h)
+#define CONFIG_STORE_ADDR 0    // Two SmokeConfig slots (see config_store.h)
+#define CONFIG_VERSION 1       // Layout version of SmokeConfig
+
+// Settings that survive a reboot, stored as one block; strings are NUL-terminated
+struct __attribute__((packed)) SmokeConfig {
+  char hubSsid[33];
+  char hubPassword[65];
+};
+static_assert(CONFIG_STORE_ADDR + CONFIG_STORE_SIZE(sizeof(SmokeConfig)) <= WIFI_CACHE_ADDR,
+              "config store overlaps the WiFi cache");
 
 // Global variables
 String deviceId;
@@ -22,28 +38,41 @@ float smokeLevel = 0;
 bool alarmTriggered = false;
 unsigned long lastReadingTime = 0;
 unsigned long lastHeartbeatTime = 0;
+bool useCompact = false;  // Hub accepted binary compact frames at registration
+bool bootTimingSent = false;  // The boot WiFi timing went out with a registration
 
 // Objects
 ESP8266WebServer server(80);
 WebSocketsClient webSocket;
+WifiConnector wifi;
+ConfigStore configStore;
 
 // Function prototypes
 void setupAP();
 void handleRoot();
 void handleSetup();
 void connectToHub();
+void onWifiEvent(ConnectorEvent event);
 void webSocketEvent(WStype_t type, uint8_t * payload, size_t length);
-void sendSensorData();
+void sendSensorData(uint32_t corrId = 0);
+void handleCommand(const char *command, uint32_t corrId);
+void sendAck(uint32_t corrId, bool success);
+void sendRegistration();
+void sendHeartbeat();
+void sendAlert();
 void readSensor();
 void saveConfiguration();
 void loadConfiguration();
+bool loadLegacyConfiguration(SmokeConfig &config);
 String generateUniqueId();
 
 void setup() {
   Serial.begin(115200);
+  asyncLog.begin(Serial);
   
-  // Initialize EEPROM
+  // Initialize EEPROM; the config store reads its slots from this image
   EEPROM.begin(EEPROM_SIZE);
+  configStore.begin(CONFIG_STORE_ADDR, sizeof(SmokeConfig), CONFIG_VERSION);
   
   // Set pin modes
   pinMode(SMOKE_SENSOR_PIN, INPUT);
@@ -59,17 +88,23 @@ void setup() {
     server.on("/", HTTP_GET, handleRoot);
     server.on("/setup", HTTP_GET, handleSetup);
     server.begin();
-    Serial.println("HTTP server started in AP mode");
+    LOG_INFO("HTTP server started in AP mode");
   } else {
     connectToHub();
   }
 }
 
 void loop() {
+  // Write out what has been logged, as far as the UART has room
+  asyncLog.service();
+  
   if (!isConfigured) {
     server.handleClient();
   } else {
-    webSocket.loop();
+    wifi.service();
+    if (wifi.connected()) {
+      webSocket.loop();
+    }
     
     // Read sensor periodically
     if (millis() - lastReadingTime > 2000) {  // every 2 seconds
@@ -79,31 +114,16 @@ void loop() {
     
     // Send heartbeat periodically
     if (millis() - lastHeartbeatTime > 30000) {  // every 30 seconds
-      DynamicJsonDocument doc(128);
-      doc["type"] = "heartbeat";
-      doc["deviceId"] = deviceId;
-      
-      String jsonString;
-      serializeJson(doc, jsonString);
-      webSocket.sendTXT(jsonString);
+      sendHeartbeat();
       lastHeartbeatTime = millis();
     }
-    
-    // Reconnect to hub if connection lost
-    if (!webSocket.isConnected()) {
-      connectToHub();
-    }
   }
 }
 
 void setupAP() {
   String apName = AP_PREFIX + deviceId.substring(0, 6);
   WiFi.softAP(apName.c_str(), deviceId.c_str());
-  Serial.println("Access Point Started");
-  Serial.print("SSID: ");
-  Serial.println(apName);
-  Serial.print("Password: ");
-  Serial.println(deviceId);
+  LOG_INFO("Access Point started, SSID %s, password %s", apName.c_str(), deviceId.c_str());
 }
 
 void handleRoot() {
@@ -138,62 +158,114 @@ void handleSetup() {
   }
 }
 
+// Start joining the hub's network; the connector retries on its own from loop()
 void connectToHub() {
-  WiFi.begin(hubSsid.c_str(), hubPassword.c_str());
-  
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < 20) {
-    delay(500);
-    Serial.print(".");
-    attempts++;
-  }
-  
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println("\nConnected to hub's network");
+  wifi.onEvent(onWifiEvent);
+  wifi.begin(hubSsid.c_str(), hubPassword.c_str(), WIFI_CACHE_ADDR);
+}
+
+void onWifiEvent(ConnectorEvent event) {
+  if (event == CONNECTOR_CONNECTED) {
+    LOG_INFO("Connected to hub's network");
     
     // Connect to hub's WebSocket server
     webSocket.begin(WiFi.gatewayIP().toString(), 81, "/ws");
     webSocket.onEvent(webSocketEvent);
     webSocket.setReconnectInterval(5000);
-    
-    // Send registration message
-    DynamicJsonDocument doc(256);
-    doc["type"] = "registration";
-    doc["deviceId"] = deviceId;
-    doc["deviceType"] = "smoke_sensor";
-    
-    String jsonString;
-    serializeJson(doc, jsonString);
-    webSocket.sendTXT(jsonString);
+    // Registration is sent once the socket is connected (see webSocketEvent)
   }
 }
 
+void sendRegistration() {
+  // Registration is always JSON so any hub understands it; it offers the compact encoding
+  DynamicJsonDocument doc(256);
+  doc["type"] = "registration";
+  doc["deviceId"] = deviceId;
+  doc["deviceType"] = "smoke_sensor";
+  doc["encodings"].add(COMPACT_ENCODING_NAME);
+  // Time from boot to WiFi, once per boot
+  if (!bootTimingSent) {
+    doc["wifiBootMs"] = wifi.bootConnectMs();
+    doc["wifiFastPath"] = wifi.bootFastPath();
+    bootTimingSent = true;
+  }
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
+void sendHeartbeat() {
+  if (useCompact) {
+    // The hub knows which device this connection belongs to
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_HEARTBEAT);
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
+  DynamicJsonDocument doc(128);
+  doc["type"] = "heartbeat";
+  doc["deviceId"] = deviceId;
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
 void webSocketEvent(WStype_t type, uint8_t * payload, size_t length) {
   switch(type) {
     case WStype_DISCONNECTED:
-      Serial.println("Disconnected from hub");
+      LOG_INFO("Disconnected from hub");
+      // Every new connection negotiates the encoding again
+      useCompact = false;
       break;
       
     case WStype_CONNECTED:
-      Serial.println("Connected to hub");
+      LOG_INFO("Connected to hub");
+      sendRegistration();
       break;
       
     case WStype_TEXT: {
-      String message = String((char*)payload);
       DynamicJsonDocument doc(512);
-      DeserializationError error = deserializeJson(doc, message);
+      DeserializationError error = deserializeJson(doc, (const char*)payload, length);
       
       if (!error) {
         String msgType = doc["type"];
-        if (msgType == "command") {
-          String command = doc["command"];
-          if (command == "read_sensor") {
-            sendSensorData();
+        if (msgType == "registration_confirm") {
+          useCompact = doc["encoding"] == COMPACT_ENCODING_NAME;
+          LOG_INFO("%s", useCompact ? "Hub accepted compact frames" : "Hub uses JSON frames");
+        } else if (msgType == "command") {
+          handleCommand(doc["command"] | "", doc["corrId"] | 0u);
+        }
+      }
+      break;
+    }
+    
+    case WStype_BIN: {
+      // Compact frame from the hub
+      CompactReader reader(payload, length);
+      if (reader.type() == FRAME_COMMAND) {
+        char command[24] = "";
+        uint32_t corrId = 0;
+        uint8_t key;
+        CompactValue value;
+        while (reader.next(key, value)) {
+          if (key == KEY_COMMAND) {
+            value.copyTo(command, sizeof(command));
+          } else if (key == KEY_CORR_ID) {
+            corrId = (uint32_t)value.asInt();
           }
         }
+        handleCommand(command, corrId);
       }
       break;
     }
+    
+    default:
+      break;
   }
 }
 
@@ -206,80 +278,152 @@ void readSensor() {
     alarmTriggered = true;
     
     // Send alert to hub
-    DynamicJsonDocument doc(256);
-    doc["type"] = "alert";
-    doc["deviceId"] = deviceId;
-    doc["alertType"] = "smoke_detected";
-    doc["value"] = smokeLevel;
-    
-    String jsonString;
-    serializeJson(doc, jsonString);
-    webSocket.sendTXT(jsonString);
+    sendAlert();
   } else if (smokeLevel <= 500 && alarmTriggered) {
     alarmTriggered = false;
   }
 }
 
-void sendSensorData() {
+void sendAlert() {
+  if (useCompact) {
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_ALERT);
+    writer.putString(KEY_ALERT_TYPE, "smoke_detected");
+    writer.putFloat(KEY_VALUE, smokeLevel);
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
+  DynamicJsonDocument doc(256);
+  doc["type"] = "alert";
+  doc["deviceId"] = deviceId;
+  doc["alertType"] = "smoke_detected";
+  doc["value"] = smokeLevel;
+  
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
+// Commands forwarded by the hub; corrId (0 if none) is echoed in the reply
+void handleCommand(const char *command, uint32_t corrId) {
+  if (strcmp(command, "read_sensor") == 0) {
+    sendSensorData(corrId);
+  } else if (corrId != 0) {
+    sendAck(corrId, false);
+  }
+}
+
+void sendSensorData(uint32_t corrId) {
+  if (useCompact) {
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_STATUS);
+    writer.putString(KEY_STATUS, String(smokeLevel).c_str());
+    if (corrId != 0) {
+      writer.putInt(KEY_CORR_ID, corrId);
+    }
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
+  
   DynamicJsonDocument doc(256);
   doc["type"] = "status";
   doc["deviceId"] = deviceId;
   doc["status"] = String(smokeLevel);
+  if (corrId != 0) {
+    doc["corrId"] = corrId;
+  }
   
   String jsonString;
   serializeJson(doc, jsonString);
   webSocket.sendTXT(jsonString);
 }
 
-void saveConfiguration() {
-  int addr = 0;
+// Answer a command that has no reading to report
+void sendAck(uint32_t corrId, bool success) {
+  if (useCompact) {
+    uint8_t frame[COMPACT_FRAME_SIZE];
+    CompactWriter writer(frame, sizeof(frame));
+    writer.begin(FRAME_ACK);
+    writer.putInt(KEY_CORR_ID, corrId);
+    writer.putBool(KEY_SUCCESS, success);
+    size_t length = writer.finish();
+    webSocket.sendBIN(frame, length);
+    return;
+  }
   
-  // Save isConfigured flag
-  EEPROM.write(addr, isConfigured ? 1 : 0);
-  addr += 1;
+  DynamicJsonDocument doc(128);
+  doc["type"] = "ack";
+  doc["deviceId"] = deviceId;
+  doc["corrId"] = corrId;
+  doc["success"] = success;
   
-  // Save hub SSID
-  EEPROM.write(addr, hubSsid.length());
-  addr += 1;
-  for (int i = 0; i < hubSsid.length(); i++) {
-    EEPROM.write(addr + i, hubSsid[i]);
-  }
-  addr += hubSsid.length();
+  String jsonString;
+  serializeJson(doc, jsonString);
+  webSocket.sendTXT(jsonString);
+}
+
+void saveConfiguration() {
+  SmokeConfig config;
+  memset(&config, 0, sizeof(config));
+  strlcpy(config.hubSsid, hubSsid.c_str(), sizeof(config.hubSsid));
+  strlcpy(config.hubPassword, hubPassword.c_str(), sizeof(config.hubPassword));
   
-  // Save hub password
-  EEPROM.write(addr, hubPassword.length());
+  if (!configStore.save(config)) {
+    LOG_ERROR("Configuration save failed");
+  }
+}
+
+// Read one length-prefixed string of the pre-store layout; false if it cannot be one
+bool readLegacyField(int &addr, char *dest, size_t size) {
+  int length = EEPROM.read(addr);
   addr += 1;
-  for (int i = 0; i < hubPassword.length(); i++) {
-    EEPROM.write(addr + i, hubPassword[i]);
+  if (length >= (int)size || addr + length > EEPROM_SIZE) {
+    return false;
   }
-  
-  EEPROM.commit();
+  for (int i = 0; i < length; i++) {
+    dest[i] = (char)EEPROM.read(addr + i);
+  }
+  dest[length] = '\0';
+  addr += length;
+  return true;
 }
 
-void loadConfiguration() {
+// The layout before the config store: a configured flag, then two length-prefixed strings
+bool loadLegacyConfiguration(SmokeConfig &config) {
+  memset(&config, 0, sizeof(config));
   int addr = 0;
-  
-  // Load isConfigured flag
-  isConfigured = EEPROM.read(addr) == 1;
+  if (EEPROM.read(addr) != 1) {
+    return false;
+  }
   addr += 1;
+  return readLegacyField(addr, config.hubSsid, sizeof(config.hubSsid)) &&
+         readLegacyField(addr, config.hubPassword, sizeof(config.hubPassword));
+}
+
+void loadConfiguration() {
+  SmokeConfig config;
+  isConfigured = configStore.load(config);
+  
+  // First boot after the update: the settings are still in the old layout
+  bool migrated = false;
+  if (!isConfigured) {
+    migrated = loadLegacyConfiguration(config);
+    isConfigured = migrated;
+  }
   
   if (isConfigured) {
-    // Load hub SSID
-    int ssidLen = EEPROM.read(addr);
-    addr += 1;
-    hubSsid = "";
-    for (int i = 0; i < ssidLen; i++) {
-      hubSsid += (char)EEPROM.read(addr + i);
-    }
-    addr += ssidLen;
-    
-    // Load hub password
-    int passLen = EEPROM.read(addr);
-    addr += 1;
-    hubPassword = "";
-    for (int i = 0; i < passLen; i++) {
-      hubPassword += (char)EEPROM.read(addr + i);
+    hubSsid = config.hubSsid;
+    hubPassword = config.hubPassword;
+    if (migrated) {
+      saveConfiguration();
+      LOG_INFO("Configuration migrated from the old EEPROM layout");
     }
+    LOG_INFO("Configuration loaded in %u us (seq %u)", configStore.loadUs(), configStore.sequence());
   }
 }
 